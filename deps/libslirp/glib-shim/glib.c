@@ -33,6 +33,25 @@ int g_str_has_prefix(const char *from, const char *prefix)
     return strncmp(from, prefix, strlen(prefix)) == 0;
 }
 
+gchar *g_strdup(const gchar *str)
+{
+    /* Unlike strdup, NULL is allowed */
+    return str ? strdup(str) : NULL;
+}
+
+gsize g_strlcpy(gchar *dest, const gchar *src, gsize dest_size)
+{
+    gsize src_len = strlen(src);
+
+    if (dest_size > 0) {
+        gsize copy_len = src_len < dest_size ? src_len : dest_size - 1;
+        memcpy(dest, src, copy_len);
+        dest[copy_len] = '\0';
+    }
+
+    return src_len;
+}
+
 
 GString *g_string_new(void *arg)
 {
@@ -2,11 +2,18 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdarg.h>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <strings.h>
+#endif
 
 #define G_GNUC_PRINTF(...)
 #define G_STATIC_ASSERT(...)
@@ -22,10 +29,13 @@
 #define g_error(...) do { printf(__VA_ARGS__); puts(""); } while(0)
 #define g_critical(...) do { printf(__VA_ARGS__); puts(""); } while(0)
 #define g_getenv(...) getenv(__VA_ARGS__)
-#define g_strdup(...) strdup(__VA_ARGS__)
 #define g_snprintf(...) snprintf(__VA_ARGS__)
 #define g_vsnprintf(...) vsnprintf(__VA_ARGS__)
+#ifdef _WIN32
 #define g_ascii_strcasecmp(...) stricmp(__VA_ARGS__)
+#else
+#define g_ascii_strcasecmp(...) strcasecmp(__VA_ARGS__)
+#endif
 #define g_strerror(...) strerror(__VA_ARGS__)
 #define MIN(a, b) (((a) <= (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
@@ -50,10 +60,17 @@
 #define GINT16_FROM_BE(a) (int16_t)(htons(a))
 #define GINT16_TO_BE(a) (int16_t)(htons(a))
 #define GUINT32_FROM_BE(a) (uint32_t)(htonl(a))
-#define GUINT32_TO_BE(a) (uint32_t)(htons(a))
+#define GUINT32_TO_BE(a) (uint32_t)(htonl(a))
 #define GINT32_FROM_BE(a) (int32_t)(htonl(a))
 #define GINT32_TO_BE(a) (int32_t)(htonl(a))
 
+#ifndef FALSE
+#define FALSE 0
+#endif
+#ifndef TRUE
+#define TRUE 1
+#endif
+
 #define G_LITTLE_ENDIAN 1234
 #define G_BIG_ENDIAN 4321
 
@@ -81,6 +98,8 @@ GRand *g_rand_new();
 int g_rand_int_range(GRand *grand, int begin, int end);
 
 int g_str_has_prefix(const char *from, const char *prefix);
+gsize g_strlcpy(gchar *dest, const gchar *src, gsize dest_size);
+gchar *g_strdup(const gchar *str);
 guint g_parse_debug_string(const gchar *string, const GDebugKey *keys,
                            guint nkeys);
 
@@ -0,0 +1,614 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Caching DNS forwarder, see dnscache.h.
+ */
+
+#include "slirp.h"
+
+#define DNS_HDR_LEN 12
+
+/* Third and fourth header bytes */
+#define DNS_FLAG_QR 0x80
+#define DNS_OPCODE_MASK 0x78
+#define DNS_FLAG_TC 0x02
+#define DNS_FLAG_CD 0x10
+#define DNS_RCODE_MASK 0x0f
+
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
+
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_OPT 41
+
+#define DNS_EDNS_DO 0x8000 /* in the TTL field of OPT */
+#define DNS_UDP_SIZE_MIN 512
+
+/* An SOA record ends with 5 32-bit fields, MINIMUM being the last */
+#define DNS_SOA_RDATA_MIN (2 + 5 * 4)
+
+struct dns_question {
+    uint8_t key[DNSCACHE_KEY_MAX];
+    int keylen;
+    int end; /* offset of what follows the question */
+};
+
+struct dns_rr {
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    int ttl_off;
+    int rdata;
+    int rdlen;
+};
+
+static inline uint16_t dns_get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t dns_get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void dns_put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/*
+ * Parse the single question of msg into a cache key. Compression pointers
+ * have nothing to point to that early in a message, they are not accepted.
+ */
+static bool dns_parse_question(const uint8_t *msg, int len,
+                               struct dns_question *q)
+{
+    int off = DNS_HDR_LEN, n = 0, i;
+
+    if (len < DNS_HDR_LEN || dns_get16(msg + 4) != 1) {
+        return false;
+    }
+
+    for (;;) {
+        uint8_t l;
+
+        if (off >= len) {
+            return false;
+        }
+        l = msg[off++];
+        if ((l & 0xc0) || off + l > len || n + 1 + l > DNS_NAME_MAX) {
+            return false;
+        }
+        q->key[n++] = l;
+        for (i = 0; i < l; i++) {
+            uint8_t c = msg[off++];
+            q->key[n++] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+        }
+        if (!l) {
+            break;
+        }
+    }
+
+    /* Type and class */
+    if (off + 4 > len) {
+        return false;
+    }
+    memcpy(q->key + n, msg + off, 4);
+    q->keylen = n + 4;
+    q->end = off + 4;
+    return true;
+}
+
+static int dns_skip_name(const uint8_t *msg, int len, int off)
+{
+    while (off < len) {
+        uint8_t l = msg[off];
+
+        if ((l & 0xc0) == 0xc0) {
+            return off + 2 <= len ? off + 2 : -1;
+        }
+        if (l & 0xc0) {
+            return -1;
+        }
+        off += 1 + l;
+        if (!l) {
+            return off;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Parse the resource record at off, return the offset of the next one or
+ * -1 if it does not fit in the message.
+ */
+static int dns_next_rr(const uint8_t *msg, int len, int off, struct dns_rr *rr)
+{
+    off = dns_skip_name(msg, len, off);
+    if (off < 0 || off + 10 > len) {
+        return -1;
+    }
+
+    rr->type = dns_get16(msg + off);
+    rr->class = dns_get16(msg + off + 2);
+    rr->ttl_off = off + 4;
+    rr->ttl = dns_get32(msg + off + 4);
+    rr->rdlen = dns_get16(msg + off + 8);
+    rr->rdata = off + 10;
+    if (rr->rdata + rr->rdlen > len) {
+        return -1;
+    }
+    return rr->rdata + rr->rdlen;
+}
+
+static inline unsigned int dns_rr_count(const uint8_t *msg)
+{
+    return dns_get16(msg + 6) + dns_get16(msg + 8) + dns_get16(msg + 10);
+}
+
+/*
+ * How long the answer msg may be cached, in seconds, 0 if it may not be.
+ * That is the lowest TTL of its records, and for a negative answer the
+ * MINIMUM of the SOA record of its zone too.
+ */
+static uint32_t dns_answer_ttl(const uint8_t *msg, int len, int off,
+                               bool *negative)
+{
+    unsigned int ancount = dns_get16(msg + 6);
+    unsigned int nscount = dns_get16(msg + 8);
+    unsigned int count = dns_rr_count(msg), i;
+    uint8_t rcode = msg[3] & DNS_RCODE_MASK;
+    uint32_t ttl = DNSCACHE_TTL_MAX;
+    bool soa = false;
+    struct dns_rr rr;
+
+    if (rcode != DNS_RCODE_NOERROR && rcode != DNS_RCODE_NXDOMAIN) {
+        return 0;
+    }
+    *negative = rcode == DNS_RCODE_NXDOMAIN || !ancount;
+
+    for (i = 0; i < count; i++) {
+        off = dns_next_rr(msg, len, off, &rr);
+        if (off < 0) {
+            return 0;
+        }
+        if (rr.type == DNS_TYPE_OPT) {
+            continue;
+        }
+
+        /* RFC 2181 5.2: TTLs with the top bit set mean zero */
+        ttl = MIN(ttl, rr.ttl > INT32_MAX ? 0 : rr.ttl);
+        if (rr.type == DNS_TYPE_SOA && i >= ancount &&
+            i < ancount + nscount && rr.rdlen >= DNS_SOA_RDATA_MIN) {
+            ttl = MIN(ttl, dns_get32(msg + rr.rdata + rr.rdlen - 4));
+            soa = true;
+        }
+    }
+
+    if (*negative && !soa) {
+        return 0;
+    }
+    return ttl;
+}
+
+/*
+ * Drop the OPT record of an answer going to a query without one, as long as
+ * it comes last like upstream servers put it. Returns the new length.
+ */
+static int dns_strip_opt(uint8_t *msg, int len, int off)
+{
+    unsigned int count = dns_rr_count(msg), arcount = dns_get16(msg + 10), i;
+    struct dns_rr rr;
+    int start = off;
+
+    for (i = 0; i < count; i++) {
+        start = off;
+        off = dns_next_rr(msg, len, off, &rr);
+        if (off < 0) {
+            return len;
+        }
+    }
+    if (!arcount || rr.type != DNS_TYPE_OPT) {
+        return len;
+    }
+
+    arcount--;
+    msg[10] = arcount >> 8;
+    msg[11] = arcount;
+    return start;
+}
+
+/* Take age seconds off the TTLs of the records of msg */
+static void dns_age(uint8_t *msg, int len, int off, uint32_t age)
+{
+    unsigned int count = dns_rr_count(msg), i;
+    struct dns_rr rr;
+
+    for (i = 0; i < count; i++) {
+        off = dns_next_rr(msg, len, off, &rr);
+        if (off < 0) {
+            return;
+        }
+        if (rr.type != DNS_TYPE_OPT) {
+            dns_put32(msg + rr.ttl_off, rr.ttl > age ? rr.ttl - age : 0);
+        }
+    }
+}
+
+static uint32_t dnscache_hash(const struct dns_question *q)
+{
+    uint32_t h = 0;
+    int i;
+
+    for (i = 0; i < q->keylen; i++) {
+        h = h * 31 + q->key[i];
+    }
+
+    /* Fibonacci hashing, as for the socket hash */
+    h *= 0x9e3779b1U;
+    return h ^ (h >> 16);
+}
+
+static struct dnscache_entry *dnscache_lookup(struct dnscache *dc,
+                                              const struct dns_question *q,
+                                              uint32_t hash)
+{
+    struct dnscache_entry *e;
+
+    for (e = dc->buckets[hash & (dc->size - 1)]; e; e = e->hnext) {
+        if (e->hash == hash && e->keylen == q->keylen &&
+            !memcmp(e->key, q->key, q->keylen)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void dnscache_lru_unlink(struct dnscache_entry *e)
+{
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void dnscache_touch(struct dnscache *dc, struct dnscache_entry *e)
+{
+    dnscache_lru_unlink(e);
+    e->lru_next = dc->lru.lru_next;
+    e->lru_prev = &dc->lru;
+    dc->lru.lru_next->lru_prev = e;
+    dc->lru.lru_next = e;
+}
+
+static void dnscache_free_waiters(struct dnscache_entry *e)
+{
+    struct dnscache_waiter *w, *next;
+
+    for (w = e->waiters; w; w = next) {
+        next = w->next;
+        g_free(w);
+    }
+    e->waiters = NULL;
+    e->nwaiters = 0;
+}
+
+static void dnscache_remove(struct dnscache *dc, struct dnscache_entry *e)
+{
+    struct dnscache_entry **pe = &dc->buckets[e->hash & (dc->size - 1)];
+
+    while (*pe != e) {
+        pe = &(*pe)->hnext;
+    }
+    *pe = e->hnext;
+    dnscache_lru_unlink(e);
+    dc->count--;
+
+    dnscache_free_waiters(e);
+    g_free(e->resp);
+    g_free(e);
+}
+
+static struct dnscache_entry *dnscache_insert(struct dnscache *dc,
+                                              const struct dns_question *q,
+                                              uint32_t hash)
+{
+    struct dnscache_entry *e, **head;
+
+    if (dc->count >= dc->capacity) {
+        dnscache_remove(dc, dc->lru.lru_prev);
+        dc->stats.evictions++;
+    }
+
+    e = g_new0(struct dnscache_entry, 1);
+    e->hash = hash;
+    e->keylen = q->keylen;
+    memcpy(e->key, q->key, q->keylen);
+
+    head = &dc->buckets[hash & (dc->size - 1)];
+    e->hnext = *head;
+    *head = e;
+    e->lru_next = e->lru_prev = e;
+    dnscache_touch(dc, e);
+    dc->count++;
+    return e;
+}
+
+/*
+ * Send the answer resp to dst as coming from the virtual nameserver, with
+ * the query id and letter case of the question of the query it answers.
+ */
+static void dnscache_send(Slirp *slirp, const struct sockaddr_storage *dst,
+                          const uint8_t *resp, int len, const uint8_t *id,
+                          const uint8_t *question, int qlen, bool edns,
+                          uint32_t age)
+{
+    struct mbuf *m = m_get(slirp);
+    uint8_t *msg;
+
+    if (!m) {
+        return;
+    }
+
+    switch (dst->ss_family) {
+    case AF_INET:
+        m->m_data += IF_MAXLINKHDR + sizeof(struct udpiphdr);
+        break;
+    case AF_INET6:
+        m->m_data += IF_MAXLINKHDR + sizeof(struct ip6) + sizeof(struct udphdr);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    if (M_FREEROOM(m) < len) {
+        m_inc(m, len);
+    }
+
+    msg = mtod(m, uint8_t *);
+    memcpy(msg, resp, len);
+    memcpy(msg, id, 2);
+    memcpy(msg + DNS_HDR_LEN, question, qlen);
+    if (!edns) {
+        len = dns_strip_opt(msg, len, DNS_HDR_LEN + qlen);
+    }
+    if (age) {
+        dns_age(msg, len, DNS_HDR_LEN + qlen, age);
+    }
+    m->m_len = len;
+
+    switch (dst->ss_family) {
+    case AF_INET: {
+        struct sockaddr_in saddr = {
+            .sin_family = AF_INET,
+            .sin_addr = slirp->vnameserver_addr,
+            .sin_port = htons(DNS_PORT),
+        };
+        struct sockaddr_in daddr;
+
+        memcpy(&daddr, dst, sizeof(daddr));
+        udp_output(NULL, m, &saddr, &daddr, IPTOS_LOWDELAY);
+        break;
+    }
+    case AF_INET6: {
+        struct sockaddr_in6 saddr = {
+            .sin6_family = AF_INET6,
+            .sin6_addr = slirp->vnameserver_addr6,
+            .sin6_port = htons(DNS_PORT),
+        };
+        struct sockaddr_in6 daddr;
+
+        memcpy(&daddr, dst, sizeof(daddr));
+        udp6_output(NULL, m, &saddr, &daddr);
+        break;
+    }
+    }
+}
+
+void dnscache_init(Slirp *slirp, unsigned int capacity)
+{
+    struct dnscache *dc = &slirp->dnscache;
+
+    /* Also keeps the power of two below from overflowing */
+    capacity = MIN(capacity, DNSCACHE_SIZE_MAX);
+
+    dc->capacity = capacity;
+    dc->count = 0;
+    dc->lru.lru_next = dc->lru.lru_prev = &dc->lru;
+    dc->size = 1;
+    while (dc->size < capacity) {
+        dc->size <<= 1;
+    }
+    dc->buckets = g_new0(struct dnscache_entry *, dc->size);
+    dc->stats.capacity = capacity;
+}
+
+void dnscache_cleanup(Slirp *slirp)
+{
+    struct dnscache *dc = &slirp->dnscache;
+
+    while (dc->count) {
+        dnscache_remove(dc, dc->lru.lru_next);
+    }
+    g_free(dc->buckets);
+    dc->buckets = NULL;
+}
+
+bool dnscache_query(Slirp *slirp, const struct sockaddr_storage *src,
+                    const uint8_t *msg, int len)
+{
+    struct dnscache *dc = &slirp->dnscache;
+    uint16_t udp_size = DNS_UDP_SIZE_MIN;
+    bool edns = false;
+    struct dnscache_entry *e;
+    struct dnscache_waiter *w;
+    struct dns_question q;
+    struct dns_rr rr;
+    uint64_t now;
+    uint32_t hash;
+
+    if (!dc->capacity || len < DNS_HDR_LEN) {
+        return false;
+    }
+
+    /*
+     * Plain queries only. DNSSEC-aware resolvers, which set CD or DO, are
+     * left to talk to the upstream server directly.
+     */
+    if ((msg[2] & (DNS_FLAG_QR | DNS_OPCODE_MASK)) || (msg[3] & DNS_FLAG_CD) ||
+        dns_get16(msg + 6) || dns_get16(msg + 8) || dns_get16(msg + 10) > 1 ||
+        !dns_parse_question(msg, len, &q)) {
+        return false;
+    }
+    if (dns_get16(msg + 10)) {
+        if (dns_next_rr(msg, len, q.end, &rr) < 0 ||
+            rr.type != DNS_TYPE_OPT || (rr.ttl & DNS_EDNS_DO)) {
+            return false;
+        }
+        udp_size = MAX(rr.class, DNS_UDP_SIZE_MIN);
+        edns = true;
+    }
+
+    hash = dnscache_hash(&q);
+    now = slirp_now_ms(slirp);
+    e = dnscache_lookup(dc, &q, hash);
+
+    if (e && e->resp) {
+        if (now >= e->expires) {
+            dnscache_remove(dc, e);
+            e = NULL;
+        } else if (e->resp_len > udp_size) {
+            /* Has to come over TCP, or with a larger EDNS size */
+            dc->stats.misses++;
+            return false;
+        } else {
+            dnscache_send(slirp, src, e->resp, e->resp_len, msg,
+                          msg + DNS_HDR_LEN, q.end - DNS_HDR_LEN, edns,
+                          (now - e->stored) / 1000);
+            dnscache_touch(dc, e);
+            dc->stats.hits++;
+            if (e->negative) {
+                dc->stats.negative_hits++;
+            }
+            return true;
+        }
+    }
+
+    if (e && now < e->expires) {
+        /* Retransmissions of the query out upstream go out again */
+        if ((sockaddr_equal(&e->origin, src) && !memcmp(e->origin_id, msg, 2)) ||
+            e->nwaiters >= DNSCACHE_WAITERS_MAX) {
+            dc->stats.misses++;
+            return false;
+        }
+
+        w = g_new0(struct dnscache_waiter, 1);
+        memcpy(&w->addr, src, sockaddr_size(src));
+        memcpy(w->id, msg, 2);
+        w->udp_size = udp_size;
+        w->edns = edns;
+        w->qlen = q.end - DNS_HDR_LEN;
+        memcpy(w->question, msg + DNS_HDR_LEN, w->qlen);
+        w->next = e->waiters;
+        e->waiters = w;
+        e->nwaiters++;
+        dc->stats.coalesced++;
+        return true;
+    }
+
+    if (e) {
+        /* No answer came in time, whoever waited has retried by now */
+        dnscache_free_waiters(e);
+        dnscache_touch(dc, e);
+    } else {
+        e = dnscache_insert(dc, &q, hash);
+    }
+    memcpy(&e->origin, src, sockaddr_size(src));
+    memcpy(e->origin_id, msg, 2);
+    e->expires = now + DNSCACHE_PENDING_MS;
+    dc->stats.misses++;
+    return false;
+}
+
+static bool dnscache_from_vnameserver(Slirp *slirp,
+                                      const struct sockaddr_storage *from)
+{
+    switch (from->ss_family) {
+    case AF_INET: {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)from;
+        return sin->sin_port == htons(DNS_PORT) &&
+               sin->sin_addr.s_addr == slirp->vnameserver_addr.s_addr;
+    }
+    case AF_INET6: {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)from;
+        return sin6->sin6_port == htons(DNS_PORT) &&
+               in6_equal(&sin6->sin6_addr, &slirp->vnameserver_addr6);
+    }
+    default:
+        return false;
+    }
+}
+
+void dnscache_response(Slirp *slirp, const struct sockaddr_storage *from,
+                       const uint8_t *msg, int len)
+{
+    struct dnscache *dc = &slirp->dnscache;
+    struct dnscache_entry *e;
+    struct dnscache_waiter *w;
+    struct dns_question q;
+    bool negative = false;
+    uint32_t ttl = 0;
+
+    if (!dc->count || !dnscache_from_vnameserver(slirp, from) ||
+        len < DNS_HDR_LEN ||
+        (msg[2] & (DNS_FLAG_QR | DNS_OPCODE_MASK)) != DNS_FLAG_QR ||
+        !dns_parse_question(msg, len, &q)) {
+        return;
+    }
+
+    /* Only the answer to the query which went out for the entry counts */
+    e = dnscache_lookup(dc, &q, dnscache_hash(&q));
+    if (!e || e->resp || memcmp(e->origin_id, msg, 2)) {
+        return;
+    }
+
+    for (w = e->waiters; w; w = w->next) {
+        if (len <= w->udp_size) {
+            dnscache_send(slirp, &w->addr, msg, len, w->id, w->question,
+                          w->qlen, w->edns, 0);
+        }
+    }
+    dnscache_free_waiters(e);
+
+    if (!(msg[2] & DNS_FLAG_TC) && !(msg[3] & DNS_FLAG_CD) && len <= UINT16_MAX) {
+        ttl = dns_answer_ttl(msg, len, q.end, &negative);
+    }
+    if (!ttl) {
+        dnscache_remove(dc, e);
+        return;
+    }
+
+    e->resp = g_malloc(len);
+    memcpy(e->resp, msg, len);
+    e->resp_len = len;
+    e->negative = negative;
+    e->stored = slirp_now_ms(slirp);
+    e->expires = e->stored + (uint64_t)ttl * 1000;
+}
+
+void slirp_get_dns_cache_stats(Slirp *slirp, SlirpDnsCacheStats *stats)
+{
+    struct dnscache *dc = &slirp->dnscache;
+    struct dnscache_entry *e;
+
+    *stats = dc->stats;
+    stats->entries = 0;
+    stats->pending = 0;
+    for (e = dc->lru.lru_next; e != &dc->lru; e = e->lru_next) {
+        if (e->resp) {
+            stats->entries++;
+        } else {
+            stats->pending++;
+        }
+    }
+}
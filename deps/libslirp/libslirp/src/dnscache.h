@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Caching DNS forwarder at the virtual nameserver address.
+ *
+ * Queries to vnameserver:53 are still forwarded upstream through the usual
+ * UDP sockets; the cache looks at them on their way in, and at the answers
+ * on their way back. Answers are kept for their TTL, NXDOMAIN and NODATA
+ * answers for the TTL of their SOA record (RFC 2308), and served directly
+ * while fresh. Identical queries arriving while one is already out upstream
+ * wait for its answer instead of being forwarded too. The least recently
+ * used entries make room for new ones once the cache is full.
+ */
+
+#ifndef SLIRP_DNSCACHE_H
+#define SLIRP_DNSCACHE_H
+
+#include "libslirp.h"
+
+#define DNS_PORT 53
+
+#define DNS_NAME_MAX 255
+/* Lowercased name in wire format, followed by the type and class */
+#define DNSCACHE_KEY_MAX (DNS_NAME_MAX + 4)
+
+#define DNSCACHE_SIZE_DEFAULT 512
+#define DNSCACHE_SIZE_MAX 65536 /* larger dns_cache_size values are clamped */
+#define DNSCACHE_TTL_MAX (24 * 3600) /* longest time an answer is kept, in s */
+#define DNSCACHE_PENDING_MS 5000 /* how long to wait for the upstream answer */
+#define DNSCACHE_WAITERS_MAX 16 /* coalesced queries per upstream query */
+
+/* A query waiting for the answer to an identical one */
+struct dnscache_waiter {
+    struct dnscache_waiter *next;
+    struct sockaddr_storage addr;
+    uint8_t id[2];
+    uint16_t udp_size; /* largest answer it takes */
+    bool edns;
+    uint16_t qlen;
+    uint8_t question[DNSCACHE_KEY_MAX]; /* as sent, for its letter case */
+};
+
+struct dnscache_entry {
+    struct dnscache_entry *hnext; /* hash chain */
+    struct dnscache_entry *lru_prev, *lru_next;
+    uint32_t hash;
+    uint16_t keylen;
+    uint8_t key[DNSCACHE_KEY_MAX];
+
+    /* Answer, NULL while the query is out upstream */
+    uint8_t *resp;
+    uint16_t resp_len;
+    bool negative;
+    uint64_t stored; /* when the answer came, in ms */
+    uint64_t expires; /* end of its TTL, or of the wait for it */
+
+    /* Upstream query in flight */
+    struct sockaddr_storage origin;
+    uint8_t origin_id[2];
+    struct dnscache_waiter *waiters;
+    unsigned int nwaiters;
+};
+
+struct dnscache {
+    struct dnscache_entry **buckets;
+    unsigned int size; /* Number of buckets, a power of two */
+    unsigned int capacity; /* Most entries kept, 0 when disabled */
+    unsigned int count;
+    struct dnscache_entry lru; /* list head, most recently used first */
+    SlirpDnsCacheStats stats;
+};
+
+void dnscache_init(Slirp *slirp, unsigned int capacity);
+void dnscache_cleanup(Slirp *slirp);
+
+/*
+ * Look at a query sent by the guest from src to the virtual nameserver.
+ * Returns true if it was answered from the cache or will be answered along
+ * with an identical one, false if it has to be forwarded upstream.
+ */
+bool dnscache_query(Slirp *slirp, const struct sockaddr_storage *src,
+                    const uint8_t *msg, int len);
+
+/*
+ * Look at a datagram from the upstream server, before it is passed on to
+ * the guest. from is its source after sotranslate_in.
+ */
+void dnscache_response(Slirp *slirp, const struct sockaddr_storage *from,
+                       const uint8_t *msg, int len);
+
+#endif
@@ -5,46 +5,392 @@
 
 #include "slirp.h"
 
-static void ifs_insque(struct mbuf *ifm, struct mbuf *ifmhead)
+static void if_fq_list_push(struct if_fq_list *list, struct if_fq_flow *flow)
 {
-    ifm->ifs_next = ifmhead->ifs_next;
-    ifmhead->ifs_next = ifm;
-    ifm->ifs_prev = ifmhead;
-    ifm->ifs_next->ifs_prev = ifm;
+    flow->next = NULL;
+    if (list->tail) {
+        list->tail->next = flow;
+    } else {
+        list->head = flow;
+    }
+    list->tail = flow;
 }
 
-static void ifs_remque(struct mbuf *ifm)
+static void if_fq_list_pop(struct if_fq_list *list)
 {
-    ifm->ifs_prev->ifs_next = ifm->ifs_next;
-    ifm->ifs_next->ifs_prev = ifm->ifs_prev;
+    list->head = list->head->next;
+    if (!list->head) {
+        list->tail = NULL;
+    }
 }
 
 void if_init(Slirp *slirp)
 {
-    slirp->if_fastq.qh_link = slirp->if_fastq.qh_rlink = &slirp->if_fastq;
-    slirp->if_batchq.qh_link = slirp->if_batchq.qh_rlink = &slirp->if_batchq;
+    struct if_fq *fq = &slirp->if_fq;
+
+    fq->flows = g_new0(struct if_fq_flow, IF_FQ_FLOWS);
+    fq->perturbation = g_rand_int_range(slirp->grand, 0, INT32_MAX);
+    fq->quantum = slirp->if_mtu + ETH_HLEN;
+    if (fq->limit == 0) {
+        fq->limit = IF_FQ_LIMIT_DEFAULT;
+    }
+    if (fq->target == 0) {
+        fq->target = IF_CODEL_TARGET_DEFAULT;
+    }
+    if (fq->interval == 0) {
+        fq->interval = IF_CODEL_INTERVAL_DEFAULT;
+    }
+}
+
+void if_cleanup(Slirp *slirp)
+{
+    struct if_fq *fq = &slirp->if_fq;
+    struct mbuf *ifm, *next;
+    int i;
+
+    for (i = 0; i < IF_FQ_FLOWS; i++) {
+        for (ifm = fq->flows[i].head; ifm; ifm = next) {
+            next = ifm->ifs_next;
+            m_free(ifm);
+        }
+    }
+    g_free(fq->flows);
+    fq->flows = NULL;
+}
+
+static uint32_t if_fq_mix(uint32_t h, uint32_t v)
+{
+    h ^= v;
+    h *= 0x9e3779b1U;
+    return h ^ (h >> 16);
+}
+
+/*
+ * Packets of a socket all go to the same flow, so that they are sent in
+ * order. Packets without a socket (ICMP errors, DHCP...) are hashed on
+ * their addresses and protocol.
+ */
+static struct if_fq_flow *if_fq_classify(Slirp *slirp, struct socket *so,
+                                         struct mbuf *ifm)
+{
+    struct if_fq *fq = &slirp->if_fq;
+    uint32_t h = fq->perturbation;
+
+    if (so) {
+        uint64_t p = (uintptr_t)so;
+        h = if_fq_mix(h, (uint32_t)p);
+        h = if_fq_mix(h, (uint32_t)(p >> 32));
+    } else if (ifm->m_len >= (int)sizeof(struct ip) &&
+               mtod(ifm, struct ip *)->ip_v == IPVERSION) {
+        struct ip *ip = mtod(ifm, struct ip *);
+        h = if_fq_mix(h, ip->ip_src.s_addr);
+        h = if_fq_mix(h, ip->ip_dst.s_addr);
+        h = if_fq_mix(h, ip->ip_p);
+    } else if (ifm->m_len >= (int)sizeof(struct ip6) &&
+               mtod(ifm, struct ip6 *)->ip_v == IP6VERSION) {
+        struct ip6 *ip = mtod(ifm, struct ip6 *);
+        uint32_t w[8];
+        int i;
+
+        memcpy(w, &ip->ip_src, sizeof(ip->ip_src));
+        memcpy(w + 4, &ip->ip_dst, sizeof(ip->ip_dst));
+        for (i = 0; i < 8; i++) {
+            h = if_fq_mix(h, w[i]);
+        }
+        h = if_fq_mix(h, ip->ip_nh);
+    }
+
+    return &fq->flows[h % IF_FQ_FLOWS];
+}
+
+static void if_fq_append(Slirp *slirp, struct if_fq_flow *flow,
+                         struct mbuf *ifm)
+{
+    ifm->ifs_next = NULL;
+    if (flow->tail) {
+        flow->tail->ifs_next = ifm;
+    } else {
+        flow->head = ifm;
+    }
+    flow->tail = ifm;
+    flow->backlog += ifm->m_len;
+    slirp->if_fq.stats.backlog_packets++;
+    slirp->if_fq.stats.backlog_bytes += ifm->m_len;
+}
+
+static struct mbuf *if_fq_pop(Slirp *slirp, struct if_fq_flow *flow)
+{
+    struct mbuf *ifm = flow->head;
+
+    if (ifm) {
+        flow->head = ifm->ifs_next;
+        if (!flow->head) {
+            flow->tail = NULL;
+        }
+        ifm->ifs_next = NULL;
+        flow->backlog -= ifm->m_len;
+        slirp->if_fq.stats.backlog_packets--;
+        slirp->if_fq.stats.backlog_bytes -= ifm->m_len;
+    }
+    return ifm;
+}
+
+/* Free a packet taken off the queues without sending it */
+static void if_fq_drop(struct mbuf *ifm)
+{
+    if (ifm->ifq_so) {
+        ifm->ifq_so->so_queued--;
+        sopoll_dirty(ifm->ifq_so);
+    }
+    m_free(ifm);
+}
+
+/*
+ * The queues are full: drop the oldest packet of the flow with the most
+ * bytes queued, which is most likely the one that filled them.
+ */
+static void if_fq_drop_fattest(Slirp *slirp)
+{
+    struct if_fq *fq = &slirp->if_fq;
+    struct if_fq_flow *fattest = &fq->flows[0];
+    int i;
+
+    for (i = 1; i < IF_FQ_FLOWS; i++) {
+        if (fq->flows[i].backlog > fattest->backlog) {
+            fattest = &fq->flows[i];
+        }
+    }
+
+    if (fattest->head) {
+        if_fq_drop(if_fq_pop(slirp, fattest));
+        fq->stats.overlimit_drops++;
+    }
+}
+
+/*
+ * Set Congestion Experienced on an ECN-capable packet.
+ * Returns false if the packet is not ECN-capable and has to be dropped.
+ */
+static bool if_codel_mark(struct mbuf *ifm)
+{
+    uint8_t *hdr = mtod(ifm, uint8_t *);
+
+    if (ifm->m_len >= (int)sizeof(struct ip) && (hdr[0] >> 4) == IPVERSION) {
+        struct ip *ip = mtod(ifm, struct ip *);
+        uint16_t old_word, new_word;
+
+        if ((ip->ip_tos & IPTOS_ECN_MASK) == 0) {
+            return false;
+        }
+        if ((ip->ip_tos & IPTOS_ECN_MASK) == IPTOS_ECN_CE) {
+            return true;
+        }
+
+        /* Update the checksum for the version/tos word */
+        memcpy(&old_word, hdr, sizeof(old_word));
+        ip->ip_tos |= IPTOS_ECN_CE;
+        memcpy(&new_word, hdr, sizeof(new_word));
+        ip->ip_sum = cksum_update16(ip->ip_sum, old_word, new_word);
+        return true;
+    }
+
+    if (ifm->m_len >= (int)sizeof(struct ip6) && (hdr[0] >> 4) == IP6VERSION) {
+        /* The ECN field is in the low bits of the traffic class */
+        if ((hdr[1] & 0x30) == 0) {
+            return false;
+        }
+        hdr[1] |= 0x30;
+        return true;
+    }
+
+    return false;
+}
+
+/* CoDel decided to signal congestion with this packet: mark or drop it */
+static bool if_codel_signal(Slirp *slirp, struct mbuf *ifm)
+{
+    struct if_fq *fq = &slirp->if_fq;
+
+    if (fq->ecn && if_codel_mark(ifm)) {
+        fq->stats.ecn_marks++;
+        return true;
+    }
+
+    if_fq_drop(ifm);
+    fq->stats.codel_drops++;
+    return false;
+}
+
+static uint64_t if_sojourn_time(struct mbuf *ifm, uint64_t now)
+{
+    return now > ifm->enqueue_time ? now - ifm->enqueue_time : 0;
+}
+
+static uint64_t if_isqrt(uint64_t x)
+{
+    uint64_t r = 0, bit = 1ULL << 62;
+
+    while (bit > x) {
+        bit >>= 2;
+    }
+    while (bit) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return r;
+}
+
+/* Next drop time: t + interval / sqrt(count) */
+static uint64_t if_codel_control_law(Slirp *slirp, uint64_t t, uint32_t count)
+{
+    return t + slirp->if_fq.interval * 65536 / if_isqrt((uint64_t)count << 32);
+}
+
+static struct mbuf *if_codel_dodequeue(Slirp *slirp, struct if_fq_flow *flow,
+                                       uint64_t now, bool *ok_to_drop)
+{
+    struct if_fq *fq = &slirp->if_fq;
+    struct mbuf *ifm = if_fq_pop(slirp, flow);
+
+    *ok_to_drop = false;
+    if (!ifm) {
+        flow->first_above_time = 0;
+        return NULL;
+    }
+
+    if (if_sojourn_time(ifm, now) < fq->target ||
+        flow->backlog <= (uint32_t)slirp->if_mtu) {
+        /* Went below the target, or too little queued to matter */
+        flow->first_above_time = 0;
+    } else if (flow->first_above_time == 0) {
+        flow->first_above_time = now + fq->interval;
+    } else if (now >= flow->first_above_time) {
+        *ok_to_drop = true;
+    }
+    return ifm;
+}
+
+/*
+ * CoDel dequeue (RFC 8289): once packets have stayed above the target for
+ * a whole interval, drop (or mark) them at an increasing rate until the
+ * standing queue is gone.
+ */
+static struct mbuf *if_codel_dequeue(Slirp *slirp, struct if_fq_flow *flow,
+                                     uint64_t now)
+{
+    struct if_fq *fq = &slirp->if_fq;
+    bool ok_to_drop;
+    struct mbuf *ifm = if_codel_dodequeue(slirp, flow, now, &ok_to_drop);
+
+    if (flow->dropping) {
+        if (!ok_to_drop) {
+            flow->dropping = false;
+        }
+        while (flow->dropping && now >= flow->drop_next) {
+            flow->count++;
+            if (if_codel_signal(slirp, ifm)) {
+                flow->drop_next =
+                    if_codel_control_law(slirp, flow->drop_next, flow->count);
+                break;
+            }
+            ifm = if_codel_dodequeue(slirp, flow, now, &ok_to_drop);
+            if (!ok_to_drop) {
+                flow->dropping = false;
+            } else {
+                flow->drop_next =
+                    if_codel_control_law(slirp, flow->drop_next, flow->count);
+            }
+        }
+    } else if (ok_to_drop) {
+        uint32_t delta = flow->count - flow->lastcount;
+
+        flow->dropping = true;
+        /* Start from the previous drop rate if we left it recently */
+        if (delta > 1 && now - flow->drop_next < 16 * fq->interval) {
+            flow->count = delta;
+        } else {
+            flow->count = 1;
+        }
+        flow->lastcount = flow->count;
+        flow->drop_next = if_codel_control_law(slirp, now, flow->count);
+        if (!if_codel_signal(slirp, ifm)) {
+            ifm = if_codel_dodequeue(slirp, flow, now, &ok_to_drop);
+        }
+    }
+
+    return ifm;
+}
+
+/*
+ * Deficit round robin over the flows, new flows first (RFC 8290).
+ * *plist is set to the list the returned packet's flow is at the head of.
+ */
+static struct mbuf *if_fq_dequeue(Slirp *slirp, uint64_t now,
+                                  struct if_fq_flow **pflow,
+                                  struct if_fq_list **plist)
+{
+    struct if_fq *fq = &slirp->if_fq;
+
+    for (;;) {
+        struct if_fq_list *list;
+        struct if_fq_flow *flow;
+        struct mbuf *ifm;
+
+        list = fq->new_flows.head ? &fq->new_flows : &fq->old_flows;
+        flow = list->head;
+        if (!flow) {
+            return NULL;
+        }
+
+        if (flow->deficit <= 0) {
+            flow->deficit += fq->quantum;
+            if_fq_list_pop(list);
+            if_fq_list_push(&fq->old_flows, flow);
+            continue;
+        }
+
+        ifm = if_codel_dequeue(slirp, flow, now);
+        if (!ifm) {
+            if_fq_list_pop(list);
+            if (list == &fq->new_flows && fq->old_flows.head) {
+                /* Keep it around so it can't come back as a new flow at once */
+                if_fq_list_push(&fq->old_flows, flow);
+            } else {
+                flow->active = false;
+                fq->stats.active_flows--;
+            }
+            continue;
+        }
+
+        flow->deficit -= ifm->m_len;
+        *pflow = flow;
+        *plist = list;
+        return ifm;
+    }
 }
 
 /*
- * if_output: Queue packet into an output queue.
- * There are 2 output queue's, if_fastq and if_batchq.
- * Each output queue is a doubly linked list of double linked lists
- * of mbufs, each list belonging to one "session" (socket).  This
- * way, we can output packets fairly by sending one packet from each
- * session, instead of all the packets from one session, then all packets
- * from the next session, etc.  Packets on the if_fastq get absolute
- * priority, but if one session hogs the link, it gets "downgraded"
- * to the batchq until it runs out of packets, then it'll return
- * to the fastq (eg. if the user does an ls -alR in a telnet session,
- * it'll temporarily get downgraded to the batchq)
+ * if_output: Queue packet into the guest-bound scheduler.
+ * Packets are hashed into per-flow queues (one per socket), which are
+ * served in deficit round robin so that one bulk transfer can't starve an
+ * interactive session. Flows that just started having packets queued get
+ * served first, which gives the same priority to sparse interactive traffic
+ * as the old fastq did, without relying on the IPTOS_LOWDELAY heuristic.
+ * CoDel then keeps the time packets spend queued under control when the
+ * guest link is the bottleneck.
  */
 void if_output(struct socket *so, struct mbuf *ifm)
 {
     Slirp *slirp = ifm->slirp;
     M_DUP_DEBUG(slirp, ifm, 0, 0);
 
-    struct mbuf *ifq;
-    int on_fastq = 1;
+    struct if_fq *fq = &slirp->if_fq;
+    struct if_fq_flow *flow;
 
     DEBUG_CALL("if_output");
     DEBUG_ARG("so = %p", so);
@@ -60,91 +406,48 @@ void if_output(struct socket *so, struct mbuf *ifm)
         ifm->m_flags &= ~M_USEDLIST;
     }
 
-    /*
-     * See if there's already a batchq list for this session.
-     * This can include an interactive session, which should go on fastq,
-     * but gets too greedy... hence it'll be downgraded from fastq to batchq.
-     * We mustn't put this packet back on the fastq (or we'll send it out of
-     * order)
-     * XXX add cache here?
-     */
+    flow = if_fq_classify(slirp, so, ifm);
+    ifm->ifq_so = so;
+    ifm->enqueue_time = slirp->cb->clock_get_ns(slirp->opaque);
+    if_fq_append(slirp, flow, ifm);
     if (so) {
-        for (ifq = (struct mbuf *)slirp->if_batchq.qh_rlink;
-             (struct slirp_quehead *)ifq != &slirp->if_batchq;
-	     ifq = ifq->ifq_prev) {
-            if (so == ifq->ifq_so) {
-                /* A match! */
-                ifm->ifq_so = so;
-                ifs_insque(ifm, ifq->ifs_prev);
-                goto diddit;
-            }
-        }
+        so->so_queued++;
     }
 
-    /* No match, check which queue to put it on */
-    if (so && (so->so_iptos & IPTOS_LOWDELAY)) {
-        ifq = (struct mbuf *)slirp->if_fastq.qh_rlink;
-        on_fastq = 1;
-        /*
-         * Check if this packet is a part of the last
-         * packet's session
-         */
-        if (ifq->ifq_so == so) {
-            ifm->ifq_so = so;
-            ifs_insque(ifm, ifq->ifs_prev);
-            goto diddit;
-        }
-    } else {
-        ifq = (struct mbuf *)slirp->if_batchq.qh_rlink;
+    if (!flow->active) {
+        flow->active = true;
+        flow->deficit = fq->quantum;
+        if_fq_list_push(&fq->new_flows, flow);
+        fq->stats.active_flows++;
     }
 
-    /* Create a new doubly linked list for this session */
-    ifm->ifq_so = so;
-    ifs_init(ifm);
-    slirp_insque(ifm, ifq);
-
-diddit:
-    if (so) {
-        /* Update *_queued */
-        so->so_queued++;
-        so->so_nqueued++;
-        /*
-         * Check if the interactive session should be downgraded to
-         * the batchq.  A session is downgraded if it has queued 6
-         * packets without pausing, and at least 3 of those packets
-         * have been sent over the link
-         * (XXX These are arbitrary numbers, probably not optimal..)
-         */
-        if (on_fastq &&
-            ((so->so_nqueued >= 6) && (so->so_nqueued - so->so_queued) >= 3)) {
-            /* Remove from current queue... */
-            slirp_remque(ifm->ifs_next);
-
-            /* ...And insert in the new.  That'll teach ya! */
-            slirp_insque(ifm->ifs_next, &slirp->if_batchq);
-        }
+    if (fq->stats.backlog_packets > fq->limit) {
+        if_fq_drop_fattest(slirp);
     }
 
     /*
-     * This prevents us from malloc()ing too many mbufs
+     * This prevents us from malloc()ing too many mbufs. In a batch of guest
+     * packets, what they bring about goes out together at its end.
      */
-    if_start(ifm->slirp);
+    if (!slirp->input_batch) {
+        if_start(ifm->slirp);
+    }
 }
 
 /*
- * Send one packet from each session.
- * If there are packets on the fastq, they are sent FIFO, before
- * everything else.  Then we choose the first packet from each
- * batchq session (socket) and send it.
- * For example, if there are 3 ftp sessions fighting for bandwidth,
- * one packet will be sent from the first session, then one packet
- * from the second session, then one packet from the third.
+ * Send packets to the guest, in the order the scheduler picks them, until
+ * the queues are empty, output gets paused, or all flows with packets
+ * queued are waiting for ARP or NDP resolution.
  */
 void if_start(Slirp *slirp)
 {
+    struct if_fq *fq = &slirp->if_fq;
     uint64_t now = slirp->cb->clock_get_ns(slirp->opaque);
-    bool from_batchq = false;
-    struct mbuf *ifm, *ifm_next, *ifqt;
+    struct if_fq_flow *flow;
+    struct if_fq_list *list;
+    struct mbuf *ifm;
+    uint64_t sojourn;
+    uint32_t blocked = 0;
 
     DEBUG_VERBOSE_CALL("if_start");
 
@@ -153,64 +456,81 @@ void if_start(Slirp *slirp)
     }
     slirp->if_start_busy = true;
 
-    struct mbuf *batch_head = NULL;
-    if (slirp->if_batchq.qh_link != &slirp->if_batchq) {
-        batch_head = (struct mbuf *)slirp->if_batchq.qh_link;
-    }
-
-    if (slirp->if_fastq.qh_link != &slirp->if_fastq) {
-        ifm_next = (struct mbuf *)slirp->if_fastq.qh_link;
-    } else if (batch_head) {
-        /* Nothing on fastq, pick up from batchq */
-        ifm_next = batch_head;
-        from_batchq = true;
-    } else {
-        ifm_next = NULL;
-    }
+    while (!fq->paused && (ifm = if_fq_dequeue(slirp, now, &flow, &list))) {
+        if (ifm->expiration_date < now) {
+            /* ARP or NDP resolution never completed */
+            if_fq_drop(ifm);
+            fq->stats.expired_drops++;
+            continue;
+        }
 
-    while (ifm_next) {
-        ifm = ifm_next;
+        if (!if_encap(slirp, ifm)) {
+            /*
+             * Packet is delayed due to pending ARP or NDP resolution: put it
+             * back and give the other flows a chance.
+             */
+            ifm->ifs_next = flow->head;
+            flow->head = ifm;
+            if (!flow->tail) {
+                flow->tail = ifm;
+            }
+            flow->backlog += ifm->m_len;
+            flow->deficit += ifm->m_len;
+            fq->stats.backlog_packets++;
+            fq->stats.backlog_bytes += ifm->m_len;
+            if_fq_list_pop(list);
+            if_fq_list_push(&fq->old_flows, flow);
 
-        ifm_next = ifm->ifq_next;
-        if ((struct slirp_quehead *)ifm_next == &slirp->if_fastq) {
-            /* No more packets in fastq, switch to batchq */
-            ifm_next = batch_head;
-            from_batchq = true;
+            if (++blocked >= fq->stats.active_flows) {
+                break;
+            }
+            continue;
         }
-        if ((struct slirp_quehead *)ifm_next == &slirp->if_batchq) {
-            /* end of batchq */
-            ifm_next = NULL;
+        blocked = 0;
+
+        sojourn = if_sojourn_time(ifm, now);
+        fq->stats.sent_packets++;
+        fq->stats.sojourn_total_ns += sojourn;
+        if (sojourn > fq->stats.sojourn_max_ns) {
+            fq->stats.sojourn_max_ns = sojourn;
         }
 
-        /* Try to send packet unless it already expired */
-        if (ifm->expiration_date >= now && !if_encap(slirp, ifm)) {
-            /* Packet is delayed due to pending ARP or NDP resolution */
-            continue;
+        /* Update so_queued, UDP sockets are only polled when it is low */
+        if (ifm->ifq_so) {
+            ifm->ifq_so->so_queued--;
+            sopoll_dirty(ifm->ifq_so);
         }
 
-        /* Remove it from the queue */
-        ifqt = ifm->ifq_prev;
-        slirp_remque(ifm);
+        m_free(ifm);
+    }
 
-        /* If there are more packets for this session, re-queue them */
-        if (ifm->ifs_next != ifm) {
-            struct mbuf *next = ifm->ifs_next;
+    slirp->if_start_busy = false;
+}
 
-            slirp_insque(next, ifqt);
-            ifs_remque(ifm);
-            if (!from_batchq) {
-                ifm_next = next;
-            }
-        }
+/*
+ * Remove references to so from the queued packets.
+ */
+void if_sofree(struct socket *so)
+{
+    struct if_fq_flow *flow = if_fq_classify(so->slirp, so, NULL);
+    struct mbuf *ifm;
 
-        /* Update so_queued */
-        if (ifm->ifq_so && --ifm->ifq_so->so_queued == 0) {
-            /* If there's no more queued, reset nqueued */
-            ifm->ifq_so->so_nqueued = 0;
+    for (ifm = flow->head; ifm; ifm = ifm->ifs_next) {
+        if (ifm->ifq_so == so) {
+            ifm->ifq_so = NULL;
         }
+    }
+}
 
-        m_free(ifm);
+void slirp_set_output_paused(Slirp *slirp, bool paused)
+{
+    slirp->if_fq.paused = paused;
+    if (!paused) {
+        if_start(slirp);
     }
+}
 
-    slirp->if_start_busy = false;
+void slirp_get_if_stats(Slirp *slirp, SlirpIfStats *stats)
+{
+    *stats = slirp->if_fq.stats;
 }
@@ -22,4 +22,47 @@
 /* 2 for alignment, 14 for ethernet */
 #define IF_MAXLINKHDR (2 + ETH_HLEN)
 
+/*
+ * Guest-bound FQ-CoDel scheduler (RFC 8290): packets are hashed into
+ * IF_FQ_FLOWS queues, served by deficit round robin, and each queue runs
+ * its own CoDel (RFC 8289) instance on the time packets spent queued.
+ */
+#define IF_FQ_FLOWS 1024
+#define IF_FQ_LIMIT_DEFAULT 10240
+#define IF_CODEL_TARGET_DEFAULT 5000000 /* ns */
+#define IF_CODEL_INTERVAL_DEFAULT 100000000 /* ns */
+
+struct if_fq_flow {
+    struct mbuf *head, *tail; /* Queued packets, linked through ifs_next */
+    struct if_fq_flow *next; /* Next flow in new_flows or old_flows */
+    bool active; /* Whether in new_flows or old_flows */
+    int deficit; /* Bytes that can still be sent in this round */
+    uint32_t backlog; /* Bytes queued */
+
+    /* CoDel state */
+    bool dropping;
+    uint32_t count; /* Packets dropped since entering the dropping state */
+    uint32_t lastcount;
+    uint64_t first_above_time;
+    uint64_t drop_next;
+};
+
+struct if_fq_list {
+    struct if_fq_flow *head, *tail;
+};
+
+struct if_fq {
+    struct if_fq_flow *flows;
+    struct if_fq_list new_flows;
+    struct if_fq_list old_flows;
+    uint32_t perturbation; /* Flow hash seed */
+    int quantum; /* Bytes a flow may send per round */
+    uint32_t limit; /* Packets queued, all flows */
+    uint64_t target; /* ns */
+    uint64_t interval; /* ns */
+    bool ecn; /* Mark ECN-capable packets instead of dropping them */
+    bool paused; /* The guest link can't take more packets for now */
+    SlirpIfStats stats;
+};
+
 #endif
@@ -101,6 +101,8 @@ struct ip {
 #define IPTOS_LOWDELAY 0x10
 #define IPTOS_THROUGHPUT 0x08
 #define IPTOS_RELIABILITY 0x04
+#define IPTOS_ECN_MASK 0x03 /* ECN field (RFC 3168) */
+#define IPTOS_ECN_CE 0x03 /* Congestion Experienced */
 
 /*
  * Definitions for options.
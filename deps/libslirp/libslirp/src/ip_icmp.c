@@ -134,6 +134,8 @@ static int icmp_send(struct socket *so, struct mbuf *m, int hlen)
     so->so_iptos = ip->ip_tos;
     so->so_state = SS_ISFCONNECTED;
     so->so_expire = curtime + SO_EXPIRE;
+    soexpire_arm(so);
+    sopoll_dirty(so);
 
     addr.sin_family = AF_INET;
     addr.sin_addr = so->so_faddr;
@@ -153,7 +155,7 @@ static int icmp_send(struct socket *so, struct mbuf *m, int hlen)
 
 void icmp_detach(struct socket *so)
 {
-    so->slirp->cb->unregister_poll_fd(so->s, so->slirp->opaque);
+    sopoll_unregister(so);
     closesocket(so->s);
     sofree(so);
 }
@@ -446,6 +448,7 @@ void icmp_reflect(struct mbuf *m)
     int hlen = ip->ip_hl << 2;
     int optlen = hlen - sizeof(struct ip);
     register struct icmp *icp;
+    uint16_t old_word, new_word;
 
     /*
      * Send an icmp packet back to the ip level,
@@ -455,9 +458,14 @@ void icmp_reflect(struct mbuf *m)
     m->m_len -= hlen;
     icp = mtod(m, struct icmp *);
 
+    /*
+     * The checksum of the request was checked on input, or that of the reply
+     * kept valid when it was received from the host.
+     */
+    memcpy(&old_word, icp, sizeof(old_word));
     icp->icmp_type = ICMP_ECHOREPLY;
-    icp->icmp_cksum = 0;
-    icp->icmp_cksum = cksum(m, ip->ip_len - hlen);
+    memcpy(&new_word, icp, sizeof(new_word));
+    icp->icmp_cksum = cksum_update16(icp->icmp_cksum, old_word, new_word);
 
     m->m_data -= hlen;
     m->m_len += hlen;
@@ -520,6 +528,8 @@ void icmp_receive(struct socket *so)
         }
     }
 
+    /* Put back the identifier of the guest, which the host may have changed */
+    icp->icmp_cksum = cksum_update16(icp->icmp_cksum, icp->icmp_id, id);
     icp->icmp_id = id;
 
     m->m_data -= hlen;
@@ -534,6 +544,9 @@ void icmp_receive(struct socket *so)
         DEBUG_MISC(" udp icmp rx errno = %d-%s", errno, strerror(errno));
         icmp_send_error(so->so_m, ICMP_UNREACH, error_code, 0, strerror(errno));
     } else {
+        /* Send back what the host replied, which its checksum covers */
+        m->m_len = hlen + len;
+        ip->ip_len = m->m_len;
         icmp_reflect(so->so_m);
         so->so_m = NULL; /* Don't m_free() it again! */
     }
@@ -43,6 +43,7 @@ static struct ip *ip_reass(Slirp *slirp, struct ip *ip, struct ipq *fp);
 static void ip_freef(Slirp *slirp, struct ipq *fp);
 static void ip_enq(register struct ipasfrag *p, register struct ipasfrag *prev);
 static void ip_deq(register struct ipasfrag *p);
+static void ip_slowtimo(struct twheel_entry *entry);
 
 /*
  * IP initialization: fill in IP protocol switch table.
@@ -51,6 +52,7 @@ static void ip_deq(register struct ipasfrag *p);
 void ip_init(Slirp *slirp)
 {
     slirp->ipq.ip_link.next = slirp->ipq.ip_link.prev = &slirp->ipq.ip_link;
+    twheel_entry_init(&slirp->ip_frag_timer, ip_slowtimo, slirp);
     udp_init(slirp);
     tcp_init(slirp);
     icmp_init(slirp);
@@ -254,6 +256,10 @@ static struct ip *ip_reass(Slirp *slirp, struct ip *ip, struct ipq *fp)
         fp = mtod(t, struct ipq *);
         slirp_insque(&fp->ip_link, &slirp->ipq.ip_link);
         fp->ipq_ttl = IPFRAGTTL;
+        if (!twheel_pending(&slirp->ip_frag_timer)) {
+            slirp_timer_arm(slirp, &slirp->ip_frag_timer,
+                            1000 / PR_SLOWHZ);
+        }
         fp->ipq_p = ip->ip_p;
         fp->ipq_id = ip->ip_id;
         fp->frag_link.next = fp->frag_link.prev = &fp->frag_link;
@@ -418,9 +424,11 @@ static void ip_deq(register struct ipasfrag *p)
  * IP timer processing;
  * if a timer expires on a reassembly
  * queue, discard it.
+ * Runs PR_SLOWHZ times a second while there are reassembly queues.
  */
-void ip_slowtimo(Slirp *slirp)
+static void ip_slowtimo(struct twheel_entry *entry)
 {
+    Slirp *slirp = entry->opaque;
     struct qlink *l;
 
     DEBUG_CALL("ip_slowtimo");
@@ -437,6 +445,10 @@ void ip_slowtimo(Slirp *slirp)
             ip_freef(slirp, fp);
         }
     }
+
+    if (slirp->ipq.ip_link.next != &slirp->ipq.ip_link) {
+        slirp_timer_arm(slirp, &slirp->ip_frag_timer, 1000 / PR_SLOWHZ);
+    }
 }
 
 /*
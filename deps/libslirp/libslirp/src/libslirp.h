@@ -55,6 +55,17 @@ typedef enum SlirpTimerId {
     SLIRP_TIMER_NUM,
 } SlirpTimerId;
 
+/*
+ * A part of a frame given to send_packet_iov, laid out like struct iovec.
+ * The frame is the concatenation of the parts, the first of which always
+ * holds at least the 14 bytes of the ethernet header, so that it can be
+ * looked at or stripped without gathering the parts.
+ */
+typedef struct SlirpIoVec {
+    const void *iov_base;
+    size_t iov_len;
+} SlirpIoVec;
+
 /*
  * Callbacks from slirp, to be set by the application.
  *
@@ -67,7 +78,7 @@ typedef struct SlirpCb {
      * one given to slirp_init(). If the guest is not ready to receive a frame,
      * the function can just drop the data. TCP will then handle retransmissions
      * at a lower pace.
-     * <0 reports an IO error.
+     * <0 reports an IO error. Not needed if send_packet_iov is provided.
      */
     SlirpWriteCb send_packet;
     /* Print a message for an error due to guest misbehavior.  */
@@ -98,10 +109,33 @@ typedef struct SlirpCb {
     /* Create a new timer.  When the timer fires, the application passes
      * the SlirpTimerId and cb_opaque to slirp_handle_timer.  */
     void *(*timer_new_opaque)(SlirpTimerId id, void *cb_opaque, void *opaque);
+
+    /*
+     * Fields introduced in SlirpConfig version 7 begin
+     */
+
+    /* Called from slirp_pollfds_update when the SLIRP_POLL_* events to poll
+     * fd for have changed, 0 meaning none for now. The application keeps
+     * polling fd for these events until the next change, or until
+     * unregister_poll_fd is called before fd gets closed. Only needed for
+     * slirp_pollfds_update / slirp_pollfd_ready. */
+    void (*update_poll)(int fd, int events, void *opaque);
+
+    /*
+     * Fields introduced in SlirpConfig version 8 begin
+     */
+
+    /* Alternative to send_packet, used for all frames when provided: the
+     * ethernet frame is given as the iovcnt parts in iov, see SlirpIoVec
+     * for their layout. This saves
+     * slirp copying the packet after the header it builds. Returns the
+     * number of bytes sent like send_packet. */
+    slirp_ssize_t (*send_packet_iov)(const SlirpIoVec *iov, int iovcnt,
+                                     void *opaque);
 } SlirpCb;
 
 #define SLIRP_CONFIG_VERSION_MIN 1
-#define SLIRP_CONFIG_VERSION_MAX 5
+#define SLIRP_CONFIG_VERSION_MAX 8
 
 typedef struct SlirpConfig {
     /* Version must be provided */
@@ -160,8 +194,93 @@ typedef struct SlirpConfig {
      * retrieved through NC-SI.
      */
     uint8_t oob_eth_addr[6];
+    /*
+     * Fields introduced in SlirpConfig version 6 begin
+     */
+    /*
+     * Guest-bound FQ-CoDel scheduler. Zero selects the defaults: at most
+     * 10240 queued packets, 5 ms target and 100 ms interval.
+     */
+    uint32_t if_queue_limit; /* Packets queued for the guest, all flows */
+    uint32_t if_codel_target_us; /* Acceptable standing queue delay */
+    uint32_t if_codel_interval_us; /* Window to get below the target */
+    bool if_codel_disable_ecn; /* Drop ECN-capable packets too */
+    /*
+     * Fields introduced in SlirpConfig version 8 begin
+     */
+    /*
+     * Lower bound of the TCP retransmission timeout, which is otherwise
+     * computed from the measured round trip times as in RFC 6298. Zero
+     * selects the default of 200 ms.
+     */
+    uint32_t tcp_rto_min_ms;
+    /*
+     * Number of packet buffers kept preallocated for reuse; more are
+     * malloced and freed on demand when they run out. Zero selects the
+     * default of 1024.
+     */
+    uint32_t mbuf_pool_size;
+    /*
+     * Ceiling of each TCP socket buffer. The buffers start at 128 KiB,
+     * are only allocated when data has to be buffered, grow with the
+     * measured bandwidth-delay product of the connection and shrink back
+     * once it goes idle. Zero selects the default of 4 MiB.
+     */
+    uint32_t tcp_sbuf_max;
+    /*
+     * Number of DNS answers cached at the virtual nameserver, each for its
+     * TTL. Zero selects the default of 512, values above 65536 are clamped;
+     * disable_dns_cache turns the cache off and forwards every query.
+     */
+    uint32_t dns_cache_size;
+    bool disable_dns_cache;
+    /*
+     * UDP NAT mode: number of host sockets per address family shared by
+     * the guest UDP flows, instead of one socket per guest source address
+     * and port. Replies are mapped back through a flow table, each flow
+     * expiring on its own. At most 64; zero keeps NAT mode off.
+     */
+    uint32_t udp_nat_sockets;
 } SlirpConfig;
 
+/* Statistics of the guest-bound packet scheduler */
+typedef struct SlirpIfStats {
+    uint32_t backlog_packets; /* Packets currently queued */
+    uint32_t backlog_bytes;
+    uint32_t active_flows; /* Flows being scheduled */
+    uint64_t sent_packets;
+    uint64_t overlimit_drops; /* Dropped because the queue was full */
+    uint64_t codel_drops; /* Dropped to get rid of a standing queue */
+    uint64_t ecn_marks; /* Marked with CE instead of being dropped */
+    uint64_t expired_drops; /* Dropped after ARP/NDP resolution timed out */
+    uint64_t sojourn_total_ns; /* Time spent queued by the sent packets */
+    uint64_t sojourn_max_ns;
+} SlirpIfStats;
+
+/* Statistics of the packet buffer allocator */
+typedef struct SlirpMbufStats {
+    uint32_t pool_capacity; /* Buffers the pool may hold */
+    uint32_t pool_allocated; /* Buffers the pool holds so far */
+    uint32_t in_use; /* Buffers currently handed out */
+    uint32_t in_use_max;
+    uint64_t allocs;
+    uint64_t pool_misses; /* Malloced because the pool was exhausted */
+    uint64_t ext_allocs; /* Buffers grown beyond the MTU */
+    uint64_t ext_pool_misses; /* Of which needed a malloc */
+} SlirpMbufStats;
+
+/* Statistics of the DNS cache at the virtual nameserver */
+typedef struct SlirpDnsCacheStats {
+    uint32_t capacity; /* Answers the cache may hold */
+    uint32_t entries; /* Answers cached */
+    uint32_t pending; /* Queries out to the upstream server */
+    uint64_t hits; /* Queries answered from the cache */
+    uint64_t negative_hits; /* Of which with NXDOMAIN or no data */
+    uint64_t misses; /* Queries forwarded upstream */
+    uint64_t coalesced; /* Queries answered along with an identical one */
+    uint64_t evictions; /* Entries dropped to make room */
+} SlirpDnsCacheStats;
+
 /* Create a new instance of a slirp stack */
 SLIRP_EXPORT
 Slirp *slirp_new(const SlirpConfig *cfg, const SlirpCb *callbacks,
@@ -186,7 +305,8 @@ void slirp_cleanup(Slirp *slirp);
  * *timeout is set to the amount of virtual time (in ms) that the application intends to
  * wait (UINT32_MAX if infinite). slirp_pollfds_fill updates it according to
  * e.g. TCP timers, so the application knows it should sleep a smaller amount of
- * time. slirp_pollfds_fill calls add_poll for each file descriptor
+ * time. It is left untouched when no timer is pending, so an idle application
+ * does not need to wake up periodically. slirp_pollfds_fill calls add_poll for each file descriptor
  * that should be monitored along the sleep. The opaque pointer is passed as
  * such to add_poll, and add_poll returns an index. */
 SLIRP_EXPORT
@@ -203,17 +323,97 @@ SLIRP_EXPORT
 void slirp_pollfds_poll(Slirp *slirp, int select_error,
                         SlirpGetREventsCb get_revents, void *opaque);
 
+/* Incremental alternative to slirp_pollfds_fill, for applications which
+ * provide the update_poll callback and keep their file descriptors polled
+ * between calls. This is called by the application when it is about to sleep.
+ * It runs the expired timers, reports through update_poll the file descriptors
+ * whose events changed since the last call, and updates *timeout like
+ * slirp_pollfds_fill does. */
+SLIRP_EXPORT
+void slirp_pollfds_update(Slirp *slirp, uint32_t *timeout);
+
+/* Incremental alternative to slirp_pollfds_poll: this is called by the
+ * application when fd, which slirp asked for through update_poll, has the
+ * SLIRP_POLL_* revents. */
+SLIRP_EXPORT
+void slirp_pollfd_ready(Slirp *slirp, int fd, int revents);
+
 /* This is called by the application when the guest emits a packet on the
  * guest network, to be interpreted by slirp. */
 SLIRP_EXPORT
 void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len);
 
+/* A packet emitted by the guest, for slirp_input_batch */
+typedef struct SlirpPacket {
+    const uint8_t *pkt;
+    int pkt_len;
+} SlirpPacket;
+
+/* Like calling slirp_input for each of the count packets in turn, for
+ * packets the guest emitted back to back. What slirp sends in response, the
+ * TCP acknowledgements in particular, is only produced once all of them have
+ * been processed, so that one acknowledgement covers several segments. */
+SLIRP_EXPORT
+void slirp_input_batch(Slirp *slirp, const SlirpPacket *pkts, int count);
+
+/* The same for packets given to slirp between these two calls, by
+ * slirp_input or slirp_input_buf_commit. */
+SLIRP_EXPORT
+void slirp_input_batch_begin(Slirp *slirp);
+SLIRP_EXPORT
+void slirp_input_batch_end(Slirp *slirp);
+
+/* Buffer lent by slirp to receive a packet emitted by the guest */
+typedef struct SlirpInputBuf SlirpInputBuf;
+
+/* Alternative to slirp_input which saves slirp a copy of the packet: this is
+ * called by the application to get a buffer of at least size bytes, in which
+ * it writes the packet, starting with its ethernet header. The buffer is
+ * then handed back with slirp_input_buf_commit, or slirp_input_buf_free if
+ * the application drops the packet, and always before slirp_cleanup.
+ * Returns the start of the buffer and sets *buf. */
+SLIRP_EXPORT
+uint8_t *slirp_input_buf_get(Slirp *slirp, int size, SlirpInputBuf **buf);
+
+/* Make buf at least size bytes large, keeping its content. Returns its new
+ * start. */
+SLIRP_EXPORT
+uint8_t *slirp_input_buf_grow(SlirpInputBuf *buf, int size);
+
+/* Like slirp_input for the pkt_len bytes written in buf, which goes back to
+ * slirp. */
+SLIRP_EXPORT
+void slirp_input_buf_commit(SlirpInputBuf *buf, int pkt_len);
+
+/* Give back buf without processing its content */
+SLIRP_EXPORT
+void slirp_input_buf_free(SlirpInputBuf *buf);
+
 /* This is called by the application when a timer expires, if it provides
  * the timer_new_opaque callback.  It is not needed if the application only
  * uses timer_new. */
 SLIRP_EXPORT
 void slirp_handle_timer(Slirp *slirp, SlirpTimerId id, void *cb_opaque);
 
+/* This is called by the application when the guest network can't take more
+ * packets for the time being, and again when it can. While output is paused,
+ * packets stay in the guest-bound queues, where the scheduler keeps their
+ * delay under control. */
+SLIRP_EXPORT
+void slirp_set_output_paused(Slirp *slirp, bool paused);
+
+/* Fill *stats with the current state of the guest-bound packet scheduler */
+SLIRP_EXPORT
+void slirp_get_if_stats(Slirp *slirp, SlirpIfStats *stats);
+
+/* Fill *stats with the current state of the packet buffer allocator */
+SLIRP_EXPORT
+void slirp_get_mbuf_stats(Slirp *slirp, SlirpMbufStats *stats);
+
+/* Fill *stats with the current state of the DNS cache */
+SLIRP_EXPORT
+void slirp_get_dns_cache_stats(Slirp *slirp, SlirpDnsCacheStats *stats);
+
 /* These set up / remove port forwarding between a host port in the real world
  * and the guest network. */
 SLIRP_EXPORT
@@ -7,8 +7,9 @@
 #define SLIRP_MAIN_H
 
 #include "libslirp.h"
+#include "util.h"
 
-extern unsigned curtime;
+extern SLIRP_THREAD_LOCAL unsigned curtime;
 extern struct in_addr loopback_addr;
 extern unsigned long loopback_mask;
 
@@ -8,25 +8,51 @@
  * FreeBSD.  They are fixed size, determined by the MTU,
  * so that one whole packet can fit.  Mbuf's cannot be
  * chained together.  If there's more data than the mbuf
- * could hold, an external g_malloced buffer is pointed to
- * by m_ext (and the data pointers) and M_EXT is set in
- * the flags
+ * could hold, an external buffer, from the size class
+ * caches or g_malloced, is pointed to by m_ext (and the
+ * data pointers) and M_EXT is set in the flags
  */
 
 #include "slirp.h"
 
-#define MBUF_THRESH 30
-
 /*
  * Find a nice value for msize
  */
 #define SLIRP_MSIZE(mtu) \
     (offsetof(struct mbuf, m_dat) + IF_MAXLINKHDR + TCPIPHDR_DELTA + (mtu))
 
+/* Slab mbufs are laid out at this alignment, which suits struct mbuf */
+#define MBUF_ALIGN 16
+#define MBUF_ALIGN_UP(n) (((n) + MBUF_ALIGN - 1) & ~(size_t)(MBUF_ALIGN - 1))
+
+/*
+ * m_ext size classes: a few pages, a TCP segment of the default 16 KiB
+ * sbuf, and a whole reassembled IP datagram with its link headers.
+ */
+static const int m_ext_class_size[MBUF_EXT_CLASSES] = { 4096, 16384, 66560 };
+
 void m_init(Slirp *slirp)
 {
     slirp->m_freelist.qh_link = slirp->m_freelist.qh_rlink = &slirp->m_freelist;
     slirp->m_usedlist.qh_link = slirp->m_usedlist.qh_rlink = &slirp->m_usedlist;
+    m_set_pool_size(slirp, MBUF_POOL_DEFAULT);
+}
+
+/*
+ * Set how many mbufs may be carved from slabs. The bigger m_ext classes
+ * keep proportionally fewer buffers, so that the cache stays within a few
+ * MiB per class.
+ */
+void m_set_pool_size(Slirp *slirp, uint32_t capacity)
+{
+    struct mbuf_pool *pool = &slirp->mbuf_pool;
+    int i;
+
+    pool->capacity = capacity;
+    pool->stats.pool_capacity = capacity;
+    for (i = 0; i < MBUF_EXT_CLASSES; i++) {
+        pool->ext[i].limit = MAX(capacity >> (2 * (i + 1)), 1);
+    }
 }
 
 static void m_cleanup_list(struct slirp_quehead *list_head)
@@ -39,7 +65,10 @@ static void m_cleanup_list(struct slirp_quehead *list_head)
         if (m->m_flags & M_EXT) {
             g_free(m->m_ext);
         }
-        g_free(m);
+        /* The others belong to a slab */
+        if (m->m_flags & M_DOFREE) {
+            g_free(m);
+        }
         m = next;
     }
     list_head->qh_link = list_head;
@@ -48,33 +77,85 @@ static void m_cleanup_list(struct slirp_quehead *list_head)
 
 void m_cleanup(Slirp *slirp)
 {
+    struct mbuf_pool *pool = &slirp->mbuf_pool;
+    struct mbuf_slab *slab, *next;
+    int i;
+
     m_cleanup_list(&slirp->m_usedlist);
     m_cleanup_list(&slirp->m_freelist);
-    m_cleanup_list(&slirp->if_batchq);
-    m_cleanup_list(&slirp->if_fastq);
+
+    for (i = 0; i < MBUF_EXT_CLASSES; i++) {
+        while (pool->ext[i].free) {
+            void *buf = pool->ext[i].free;
+
+            pool->ext[i].free = *(void **)buf;
+            g_free(buf);
+        }
+        pool->ext[i].count = 0;
+    }
+
+    for (slab = pool->slabs; slab; slab = next) {
+        next = slab->next;
+        g_free(slab);
+    }
+    pool->slabs = NULL;
+    pool->carved = 0;
 }
 
 /*
- * Get an mbuf from the free list, if there are none
- * allocate one
- *
- * Because fragmentation can occur if we alloc new mbufs and
- * free old mbufs, we mark all mbufs above mbuf_thresh as M_DOFREE,
- * which tells m_free to actually g_free() it
+ * Carve a new slab into the free list, returns false when the pool is
+ * already at capacity
+ */
+static bool m_slab_grow(Slirp *slirp)
+{
+    struct mbuf_pool *pool = &slirp->mbuf_pool;
+    size_t stride = MBUF_ALIGN_UP(SLIRP_MSIZE(slirp->if_mtu));
+    size_t hdr = MBUF_ALIGN_UP(sizeof(struct mbuf_slab));
+    uint32_t n = MIN(pool->capacity - pool->carved, MBUF_SLAB_MBUFS);
+    struct mbuf_slab *slab;
+    uint32_t i;
+
+    if (pool->carved >= pool->capacity) {
+        return false;
+    }
+
+    slab = g_malloc(hdr + n * stride);
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    for (i = 0; i < n; i++) {
+        struct mbuf *m = (struct mbuf *)((char *)slab + hdr + i * stride);
+
+        m->slirp = slirp;
+        m->m_flags = M_FREELIST;
+        slirp_insque(m, &slirp->m_freelist);
+    }
+    pool->carved += n;
+    pool->stats.pool_allocated = pool->carved;
+
+    return true;
+}
+
+/*
+ * Get an mbuf from the free list, carving a new slab into it when it is
+ * empty. Once the pool is at capacity, mbufs are allocated one by one and
+ * marked M_DOFREE, which tells m_free to actually g_free() them.
  */
 struct mbuf *m_get(Slirp *slirp)
 {
     register struct mbuf *m;
+    struct mbuf_pool *pool = &slirp->mbuf_pool;
     int flags = 0;
 
     DEBUG_CALL("m_get");
 
-    if (MBUF_DEBUG || slirp->m_freelist.qh_link == &slirp->m_freelist) {
+    if (MBUF_DEBUG || (slirp->m_freelist.qh_link == &slirp->m_freelist &&
+                       !m_slab_grow(slirp))) {
         m = g_malloc(SLIRP_MSIZE(slirp->if_mtu));
-        slirp->mbuf_alloced++;
-        if (MBUF_DEBUG || slirp->mbuf_alloced > MBUF_THRESH)
-            flags = M_DOFREE;
+        flags = M_DOFREE;
         m->slirp = slirp;
+        pool->malloced++;
+        pool->stats.pool_misses++;
     } else {
         m = (struct mbuf *)slirp->m_freelist.qh_link;
         slirp_remque(m);
@@ -84,6 +165,12 @@ struct mbuf *m_get(Slirp *slirp)
     slirp_insque(m, &slirp->m_usedlist);
     m->m_flags = (flags | M_USEDLIST);
 
+    pool->stats.allocs++;
+    pool->stats.in_use++;
+    if (pool->stats.in_use > pool->stats.in_use_max) {
+        pool->stats.in_use_max = pool->stats.in_use;
+    }
+
     /* Initialise it */
     m->m_size = SLIRP_MSIZE(slirp->if_mtu) - offsetof(struct mbuf, m_dat);
     m->m_data = m->m_dat;
@@ -96,34 +183,93 @@ struct mbuf *m_get(Slirp *slirp)
     return m;
 }
 
+/* Get an m_ext buffer of at least size bytes, and the class it belongs to */
+static char *m_ext_get(Slirp *slirp, int size, int *ext_class)
+{
+    struct mbuf_pool *pool = &slirp->mbuf_pool;
+    int i;
+
+    pool->stats.ext_allocs++;
+
+    for (i = 0; i < MBUF_EXT_CLASSES; i++) {
+        if (size <= m_ext_class_size[i]) {
+            break;
+        }
+    }
+    if (MBUF_DEBUG || i == MBUF_EXT_CLASSES) {
+        *ext_class = MBUF_EXT_MALLOC;
+        pool->stats.ext_pool_misses++;
+        return g_malloc(size);
+    }
+
+    *ext_class = i;
+    if (pool->ext[i].free) {
+        char *buf = pool->ext[i].free;
+
+        pool->ext[i].free = *(void **)buf;
+        pool->ext[i].count--;
+        return buf;
+    }
+    pool->stats.ext_pool_misses++;
+    return g_malloc(m_ext_class_size[i]);
+}
+
+static void m_ext_put(Slirp *slirp, char *buf, int ext_class)
+{
+    struct mbuf_ext_cache *cache;
+
+    if (ext_class == MBUF_EXT_MALLOC) {
+        g_free(buf);
+        return;
+    }
+
+    cache = &slirp->mbuf_pool.ext[ext_class];
+    if (cache->count >= cache->limit) {
+        g_free(buf);
+        return;
+    }
+    *(void **)buf = cache->free;
+    cache->free = buf;
+    cache->count++;
+}
+
 void m_free(struct mbuf *m)
 {
     DEBUG_CALL("m_free");
     DEBUG_ARG("m = %p", m);
 
     if (m) {
+        Slirp *slirp = m->slirp;
+
         /* Remove from m_usedlist */
         if (m->m_flags & M_USEDLIST)
             slirp_remque(m);
 
-        /* If it's M_EXT, free() it */
+        /* If it's M_EXT, give the buffer back */
         if (m->m_flags & M_EXT) {
-            g_free(m->m_ext);
+            m_ext_put(slirp, m->m_ext, m->m_ext_class);
             m->m_flags &= ~M_EXT;
         }
         /*
          * Either free() it or put it on the free list
          */
         if (m->m_flags & M_DOFREE) {
-            m->slirp->mbuf_alloced--;
+            slirp->mbuf_pool.malloced--;
+            slirp->mbuf_pool.stats.in_use--;
             g_free(m);
         } else if ((m->m_flags & M_FREELIST) == 0) {
-            slirp_insque(m, &m->slirp->m_freelist);
+            slirp_insque(m, &slirp->m_freelist);
             m->m_flags = M_FREELIST; /* Clobber other flags */
+            slirp->mbuf_pool.stats.in_use--;
         }
     } /* if(m) */
 }
 
+void slirp_get_mbuf_stats(Slirp *slirp, SlirpMbufStats *stats)
+{
+    *stats = slirp->mbuf_pool.stats;
+}
+
 /*
  * Copy data from one mbuf to the end of
  * the other.. if result is too big for one mbuf, allocate
@@ -147,6 +293,7 @@ void m_cat(struct mbuf *m, struct mbuf *n)
 /* make m 'size' bytes large from m_data */
 void m_inc(struct mbuf *m, int size)
 {
+    char *ext;
     int gapsize;
 
     /* some compilers throw up on gotos.  This one we can fake. */
@@ -154,18 +301,29 @@ void m_inc(struct mbuf *m, int size)
         return;
     }
 
-    if (m->m_flags & M_EXT) {
+    if ((m->m_flags & M_EXT) && m->m_ext_class == MBUF_EXT_MALLOC) {
         gapsize = m->m_data - m->m_ext;
         m->m_ext = g_realloc(m->m_ext, size + gapsize);
+        m->m_size = size + gapsize;
     } else {
-        gapsize = m->m_data - m->m_dat;
-        m->m_ext = g_malloc(size + gapsize);
-        memcpy(m->m_ext, m->m_dat, m->m_size);
+        char *old = (m->m_flags & M_EXT) ? m->m_ext : m->m_dat;
+        int ext_class;
+
+        gapsize = m->m_data - old;
+        ext = m_ext_get(m->slirp, size + gapsize, &ext_class);
+        memcpy(ext, old, m->m_size);
+        if (m->m_flags & M_EXT) {
+            m_ext_put(m->slirp, m->m_ext, m->m_ext_class);
+        }
+        m->m_ext = ext;
+        m->m_ext_class = ext_class;
         m->m_flags |= M_EXT;
+        /* Grow within the size class before reallocating again */
+        m->m_size = ext_class == MBUF_EXT_MALLOC ? size + gapsize :
+                                                   m_ext_class_size[ext_class];
     }
 
     m->m_data = m->m_ext + gapsize;
-    m->m_size = size + gapsize;
 }
 
 
@@ -98,7 +98,9 @@ struct mbuf {
     Slirp *slirp;
     bool resolution_requested;
     uint64_t expiration_date;
+    uint64_t enqueue_time; /* When queued for the guest, for CoDel */
     char *m_ext;
+    int m_ext_class; /* Size class of m_ext, MBUF_EXT_MALLOC if outside */
     /* start of dynamic buffer area, must be last element */
     char m_dat[];
 };
@@ -116,7 +118,39 @@ struct mbuf {
     0x08 /* when m_free is called on the mbuf, free() \
           * it rather than putting it on the free list */
 
+/*
+ * Mbufs are carved from slabs of MBUF_SLAB_MBUFS, up to the pool capacity;
+ * beyond it they are malloced and freed one by one. Freed m_ext buffers are
+ * kept per size class for reuse, so that packets bigger than the MTU do not
+ * cost a malloc each either.
+ */
+#define MBUF_POOL_DEFAULT 1024
+#define MBUF_SLAB_MBUFS 64
+#define MBUF_EXT_CLASSES 3
+#define MBUF_EXT_MALLOC (-1)
+
+struct mbuf_slab {
+    struct mbuf_slab *next;
+    /* MBUF_SLAB_MBUFS mbufs of SLIRP_MSIZE(if_mtu) bytes follow */
+};
+
+struct mbuf_ext_cache {
+    void *free; /* Free buffers, linked through their first word */
+    uint32_t count;
+    uint32_t limit;
+};
+
+struct mbuf_pool {
+    uint32_t capacity; /* Mbufs that may be carved from slabs */
+    uint32_t carved;
+    uint32_t malloced; /* Mbufs allocated outside the slabs */
+    struct mbuf_slab *slabs;
+    struct mbuf_ext_cache ext[MBUF_EXT_CLASSES];
+    SlirpMbufStats stats;
+};
+
 void m_init(Slirp *);
+void m_set_pool_size(Slirp *slirp, uint32_t capacity);
 void m_cleanup(Slirp *slirp);
 struct mbuf *m_get(Slirp *);
 void m_free(struct mbuf *);
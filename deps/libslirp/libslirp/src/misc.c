@@ -219,10 +219,11 @@ char *slirp_connection_info(Slirp *slirp)
     const char *state;
     char addr[INET_ADDRSTRLEN];
     char buf[20];
+    size_t sbuf_total = 0;
 
     g_string_append_printf(str,
                            "  Protocol[State]    FD  Source Address  Port   "
-                           "Dest. Address  Port RecvQ SendQ\n");
+                           "Dest. Address  Port RecvQ SendQ RecvBuf SendBuf\n");
 
     /* TODO: IPv6 */
 
@@ -250,10 +251,13 @@ char *slirp_connection_info(Slirp *slirp)
                                src.sin_addr.s_addr ?
                                inet_ntop(AF_INET, &src.sin_addr, addr, sizeof(addr)) : "*",
                                ntohs(src.sin_port));
-        g_string_append_printf(str, "%15s %5d %5d %5d\n",
+        g_string_append_printf(str, "%15s %5d %5d %5d",
                                inet_ntop(AF_INET, &dst_addr, addr, sizeof(addr)),
                                ntohs(dst_port), so->so_rcv.sb_cc,
                                so->so_snd.sb_cc);
+        g_string_append_printf(str, " %7u %7u\n", so->so_rcv.sb_datalen,
+                               so->so_snd.sb_datalen);
+        sbuf_total += so->so_rcv.sb_datalen + so->so_snd.sb_datalen;
     }
 
     for (so = slirp->udb.so_next; so != &slirp->udb; so = so->so_next) {
@@ -263,6 +267,15 @@ char *slirp_connection_info(Slirp *slirp)
             getsockname(so->s, (struct sockaddr *)&src, &src_len);
             dst_addr = so->so_laddr;
             dst_port = so->so_lport;
+        } else if (so->so_state & SS_UDPNAT) {
+            if (so->so_ffamily != AF_INET) {
+                continue;
+            }
+            slirp_fmt0(buf, sizeof(buf), "  UDP[NAT]");
+            src_len = sizeof(src);
+            getsockname(so->s, (struct sockaddr *)&src, &src_len);
+            dst_addr = so->so_faddr;
+            dst_port = so->so_fport;
         } else {
             slirp_fmt0(buf, sizeof(buf), "  UDP[%d sec]",
                        (so->so_expire - curtime) / 1000);
@@ -275,10 +288,13 @@ char *slirp_connection_info(Slirp *slirp)
                                src.sin_addr.s_addr ?
                                inet_ntop(AF_INET, &src.sin_addr, addr, sizeof(addr)) : "*",
                                ntohs(src.sin_port));
-        g_string_append_printf(str, "%15s %5d %5d %5d\n",
+        g_string_append_printf(str, "%15s %5d %5d %5d",
                                inet_ntop(AF_INET, &dst_addr, addr, sizeof(addr)),
                                ntohs(dst_port), so->so_rcv.sb_cc,
                                so->so_snd.sb_cc);
+        g_string_append_printf(str, " %7u %7u\n", so->so_rcv.sb_datalen,
+                               so->so_snd.sb_datalen);
+        sbuf_total += so->so_rcv.sb_datalen + so->so_snd.sb_datalen;
     }
 
     for (so = slirp->icmp.so_next; so != &slirp->icmp; so = so->so_next) {
@@ -294,6 +310,13 @@ char *slirp_connection_info(Slirp *slirp)
                                so->so_rcv.sb_cc, so->so_snd.sb_cc);
     }
 
+    g_string_append_printf(str, "Socket buffers: %zu bytes allocated\n",
+                           sbuf_total);
+    if (slirp->udp_nat.nsockets) {
+        g_string_append_printf(str, "UDP NAT flows: %u\n",
+                               slirp->udp_nat.count);
+    }
+
     return g_string_free(str, FALSE);
 }
 
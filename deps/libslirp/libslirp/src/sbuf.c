@@ -14,7 +14,7 @@ void sbfree(struct sbuf *sb)
 
 bool sbdrop(struct sbuf *sb, size_t num)
 {
-    int limit = sb->sb_datalen / 2;
+    int limit = sb->sb_hiwat / 2;
 
     g_warn_if_fail(num <= sb->sb_cc);
     if (num > sb->sb_cc)
@@ -32,11 +32,72 @@ bool sbdrop(struct sbuf *sb, size_t num)
     return false;
 }
 
+/*
+ * Let sb hold up to size bytes. Nothing is allocated until data has to be
+ * buffered.
+ */
 void sbreserve(struct sbuf *sb, size_t size)
+{
+    sb->sb_hiwat = size;
+}
+
+/*
+ * Allocate exactly size bytes for the data, dropping what was buffered
+ */
+void sballoc(struct sbuf *sb, size_t size)
 {
     sb->sb_wptr = sb->sb_rptr = sb->sb_data = g_realloc(sb->sb_data, size);
     sb->sb_cc = 0;
     sb->sb_datalen = size;
+    sb->sb_hiwat = MAX(sb->sb_hiwat, size);
+}
+
+/*
+ * Make room for len more bytes of data, within sb_hiwat. The data area
+ * is at least doubled, and the buffered data moved to its start.
+ */
+void sbgrow(struct sbuf *sb, size_t len)
+{
+    size_t want = MIN(sb->sb_cc + len, sb->sb_hiwat);
+    size_t size;
+    char *data;
+
+    if (want <= sb->sb_datalen) {
+        return;
+    }
+
+    size = MAX(sb->sb_datalen * 2, SB_MIN_ALLOC);
+    while (size < want) {
+        size *= 2;
+    }
+    size = MIN(size, sb->sb_hiwat);
+
+    data = g_malloc(size);
+    if (sb->sb_cc) {
+        sbcopy(sb, 0, sb->sb_cc, data);
+    }
+    g_free(sb->sb_data);
+
+    sb->sb_data = sb->sb_rptr = data;
+    sb->sb_wptr = data + sb->sb_cc;
+    if (sb->sb_wptr >= sb->sb_data + size) {
+        sb->sb_wptr -= size;
+    }
+    sb->sb_datalen = size;
+}
+
+/*
+ * Give the data area back if nothing is buffered
+ */
+void sbtrim(struct sbuf *sb)
+{
+    if (sb->sb_cc) {
+        return;
+    }
+
+    g_free(sb->sb_data);
+    sb->sb_data = sb->sb_rptr = sb->sb_wptr = NULL;
+    sb->sb_datalen = 0;
 }
 
 /*
@@ -60,6 +121,10 @@ void sbappend(struct socket *so, struct mbuf *m)
         return;
     }
 
+    if (so->so_tcpcb) {
+        tcp_sbuf_update(so->so_tcpcb, 0, m->m_len);
+    }
+
     /*
      * If there is urgent data, call sosendoob
      * if not all was sent, sowrite will take care of the rest
@@ -108,6 +173,11 @@ static void sbappendsb(struct sbuf *sb, struct mbuf *m)
 {
     int len, n, nn;
 
+    sbgrow(sb, m->m_len);
+    if (!sb->sb_datalen) {
+        return;
+    }
+
     len = m->m_len;
 
     if (sb->sb_wptr < sb->sb_rptr) {
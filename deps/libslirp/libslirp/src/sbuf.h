@@ -6,11 +6,20 @@
 #ifndef SBUF_H
 #define SBUF_H
 
-#define sbspace(sb) ((sb)->sb_datalen - (sb)->sb_cc)
+/*
+ * The data area is only allocated when something has to be buffered, and
+ * grown as needed up to sb_hiwat, which is what sbspace counts from.
+ */
+#define sbspace(sb) \
+    ((sb)->sb_cc < (sb)->sb_hiwat ? (sb)->sb_hiwat - (sb)->sb_cc : 0)
+
+/* First allocation of the data area */
+#define SB_MIN_ALLOC 8192
 
 struct sbuf {
     uint32_t sb_cc; /* actual chars in buffer */
-    uint32_t sb_datalen; /* Length of data  */
+    uint32_t sb_datalen; /* Length of data allocated */
+    uint32_t sb_hiwat; /* Length the data may grow to */
     char *sb_wptr; /* write pointer. points to where the next
                     * bytes should be written in the sbuf */
     char *sb_rptr; /* read pointer. points to where the next
@@ -21,6 +30,9 @@ struct sbuf {
 void sbfree(struct sbuf *sb);
 bool sbdrop(struct sbuf *sb, size_t len);
 void sbreserve(struct sbuf *sb, size_t size);
+void sballoc(struct sbuf *sb, size_t size);
+void sbgrow(struct sbuf *sb, size_t len);
+void sbtrim(struct sbuf *sb);
 void sbappend(struct socket *sb, struct mbuf *mb);
 void sbcopy(struct sbuf *sb, size_t off, size_t len, char *p);
 
@@ -79,16 +79,14 @@ unsigned long loopback_mask;
 static const uint8_t special_ethaddr[ETH_ALEN] = { 0x52, 0x55, 0x00,
                                                    0x00, 0x00, 0x00 };
 
-unsigned curtime;
+SLIRP_THREAD_LOCAL unsigned curtime;
 
-static struct in_addr dns_addr;
-static struct in6_addr dns6_addr;
-static uint32_t dns6_scope_id;
-static unsigned dns_addr_time;
-static unsigned dns6_addr_time;
+static SLIRP_THREAD_LOCAL struct in_addr dns_addr;
+static SLIRP_THREAD_LOCAL struct in6_addr dns6_addr;
+static SLIRP_THREAD_LOCAL uint32_t dns6_scope_id;
+static SLIRP_THREAD_LOCAL unsigned dns_addr_time;
+static SLIRP_THREAD_LOCAL unsigned dns6_addr_time;
 
-#define TIMEOUT_FAST 2 /* milliseconds */
-#define TIMEOUT_SLOW 499 /* milliseconds */
 /* for the aging of certain requests like DNS */
 #define TIMEOUT_DEFAULT 1000 /* milliseconds */
 
@@ -457,7 +455,7 @@ static int get_dns_addr_resolv_conf(int af, void *pdns_addr, void *cached_addr,
 
 int get_dns_addr(struct in_addr *pdns_addr)
 {
-    static struct stat dns_addr_stat;
+    static SLIRP_THREAD_LOCAL struct stat dns_addr_stat;
 
     if (dns_addr.s_addr != 0) {
         int ret;
@@ -474,7 +472,7 @@ int get_dns_addr(struct in_addr *pdns_addr)
 
 int get_dns6_addr(struct in6_addr *pdns6_addr, uint32_t *scope_id)
 {
-    static struct stat dns6_addr_stat;
+    static SLIRP_THREAD_LOCAL struct stat dns6_addr_stat;
 
     if (!in6_zero(&dns6_addr)) {
         int ret;
@@ -515,6 +513,8 @@ static void slirp_init_once(void)
     loopback_addr.s_addr = htonl(INADDR_LOOPBACK);
     loopback_mask = htonl(IN_CLASSA_NET);
 
+    cksum_init();
+
     debug = g_getenv("SLIRP_DEBUG");
     if (debug) {
         const GDebugKey keys[] = {
@@ -566,6 +566,28 @@ void *slirp_timer_new(Slirp *slirp, SlirpTimerId id, void *cb_opaque)
     }
 }
 
+uint64_t slirp_now_ms(Slirp *slirp)
+{
+    return slirp->cb->clock_get_ns(slirp->opaque) / SCALE_MS;
+}
+
+/*
+ * Arm a protocol timer to go off in delay_ms milliseconds, from the loop
+ * through slirp_pollfds_poll() or slirp_pollfds_update(), which only wake
+ * up when a timer is due.
+ */
+void slirp_timer_arm(Slirp *slirp, struct twheel_entry *entry,
+                     uint64_t delay_ms)
+{
+    uint64_t now = slirp_now_ms(slirp);
+
+    /* An empty wheel can just be moved to the present */
+    if (!slirp->timers.count) {
+        twheel_run(&slirp->timers, now);
+    }
+    twheel_mod(&slirp->timers, entry, now + delay_ms);
+}
+
 Slirp *slirp_new(const SlirpConfig *cfg, const SlirpCb *callbacks, void *opaque)
 {
     Slirp *slirp;
@@ -594,7 +616,11 @@ Slirp *slirp_new(const SlirpConfig *cfg, const SlirpCb *callbacks, void *opaque)
     slirp->in_enabled = cfg->in_enabled;
     slirp->in6_enabled = cfg->in6_enabled;
 
-    if_init(slirp);
+    /*
+     * The clock is not read before the first timer is armed, the wheel
+     * being empty until then it is moved to the present at that point
+     */
+    twheel_init(&slirp->timers, 0);
     ip_init(slirp);
 
     m_init(slirp);
@@ -645,10 +671,6 @@ Slirp *slirp_new(const SlirpConfig *cfg, const SlirpCb *callbacks, void *opaque)
         slirp->disable_dhcp = false;
     }
 
-    if (slirp->cfg_version >= 4 && slirp->cb->init_completed) {
-        slirp->cb->init_completed(slirp, slirp->opaque);
-    }
-
     if (cfg->version >= 5) {
         slirp->mfr_id = cfg->mfr_id;
         memcpy(slirp->oob_eth_addr, cfg->oob_eth_addr, ETH_ALEN);
@@ -657,6 +679,51 @@ Slirp *slirp_new(const SlirpConfig *cfg, const SlirpCb *callbacks, void *opaque)
         memset(slirp->oob_eth_addr, 0, ETH_ALEN);
     }
 
+    if (cfg->version >= 6) {
+        slirp->if_fq.limit = cfg->if_queue_limit;
+        slirp->if_fq.target = (uint64_t)cfg->if_codel_target_us * 1000;
+        slirp->if_fq.interval = (uint64_t)cfg->if_codel_interval_us * 1000;
+        slirp->if_fq.ecn = !cfg->if_codel_disable_ecn;
+    } else {
+        slirp->if_fq.ecn = true;
+    }
+    if_init(slirp);
+
+    if (cfg->version >= 8 && cfg->tcp_rto_min_ms) {
+        slirp->tcp_rto_min = MIN(cfg->tcp_rto_min_ms, TCPTV_REXMTMAX);
+    } else {
+        slirp->tcp_rto_min = TCPTV_MIN;
+    }
+
+    if (cfg->version >= 8 && cfg->tcp_sbuf_max) {
+        slirp->tcp_sbuf_max = MAX(cfg->tcp_sbuf_max, SB_MIN_ALLOC);
+    } else {
+        slirp->tcp_sbuf_max = TCP_SBUF_MAX_DEFAULT;
+    }
+
+    if (cfg->version >= 8 && cfg->disable_dns_cache) {
+        dnscache_init(slirp, 0);
+    } else if (cfg->version >= 8 && cfg->dns_cache_size) {
+        dnscache_init(slirp, cfg->dns_cache_size);
+    } else {
+        dnscache_init(slirp, DNSCACHE_SIZE_DEFAULT);
+    }
+
+    udp_nat_init(slirp, cfg->version >= 8 ? cfg->udp_nat_sockets : 0);
+
+    if (cfg->version >= 8 && cfg->mbuf_pool_size) {
+        m_set_pool_size(slirp, cfg->mbuf_pool_size);
+    }
+
+    slirp->poll_incremental = cfg->version >= 7 && callbacks->update_poll;
+    slirp->send_iov = cfg->version >= 8 && callbacks->send_packet_iov;
+    sofdindex_init(&slirp->poll_fds);
+
+    /* Everything is set up for the hostfwds and sockets it may create */
+    if (slirp->cfg_version >= 4 && slirp->cb->init_completed) {
+        slirp->cb->init_completed(slirp, slirp->opaque);
+    }
+
     ip6_post_init(slirp);
     return slirp;
 }
@@ -709,7 +776,11 @@ void slirp_cleanup(Slirp *slirp)
 
     ip_cleanup(slirp);
     ip6_cleanup(slirp);
+    if_cleanup(slirp);
+    so_mmsg_cleanup(slirp);
     m_cleanup(slirp);
+    dnscache_cleanup(slirp);
+    sofdindex_cleanup(&slirp->poll_fds);
 
     g_rand_free(slirp->grand);
 
@@ -725,83 +796,56 @@ void slirp_cleanup(Slirp *slirp)
 #define CONN_CANFRCV(so) \
     (((so)->so_state & (SS_FCANTRCVMORE | SS_ISFCONNECTED)) == SS_ISFCONNECTED)
 
+/*
+ * Lower @timeout to when the next protocol timer is due. It is left alone
+ * when no timer is armed, so that the loop can sleep until something
+ * happens.
+ */
 static void slirp_update_timeout(Slirp *slirp, uint32_t *timeout)
 {
-    uint32_t t;
+    uint64_t next = twheel_next(&slirp->timers);
+    uint64_t now;
 
-    if (*timeout <= TIMEOUT_FAST) {
+    if (next == UINT64_MAX) {
         return;
     }
 
-    t = MIN(1000, *timeout);
-
-    /* If we have tcp timeout with slirp, then we will fill @timeout with
-     * more precise value.
-     */
-    if (slirp->time_fasttimo) {
-        *timeout = TIMEOUT_FAST;
-        return;
+    now = slirp_now_ms(slirp);
+    if (next <= now) {
+        *timeout = 0;
+    } else if (next - now < *timeout) {
+        *timeout = next - now;
     }
-    if (slirp->do_slowtimo) {
-        t = MIN(TIMEOUT_SLOW, t);
-    }
-    *timeout = t;
 }
 
-void slirp_pollfds_fill(Slirp *slirp, uint32_t *timeout,
-                        SlirpAddPollCb add_poll, void *opaque)
+/*
+ * Events so has to be polled for, 0 if none for now.
+ */
+static int slirp_socket_poll_events(struct socket *so)
 {
-    struct socket *so, *so_next;
-
-    /*
-     * First, TCP sockets
-     */
-
-    /*
-     * *_slowtimo needs calling if there are IP fragments
-     * in the fragment queue, or there are TCP connections active
-     */
-    slirp->do_slowtimo = ((slirp->tcb.so_next != &slirp->tcb) ||
-                          (&slirp->ipq.ip_link != slirp->ipq.ip_link.next));
-
-    for (so = slirp->tcb.so_next; so != &slirp->tcb; so = so_next) {
-        int events = 0;
-
-        so_next = so->so_next;
-
-        so->pollfds_idx = -1;
-
-        /*
-         * See if we need a tcp_fasttimo
-         */
-        if (slirp->time_fasttimo == 0 && so->so_tcpcb->t_flags & TF_DELACK) {
-            slirp->time_fasttimo = curtime; /* Flag when want a fasttimo */
-        }
+    int events = 0;
 
+    if (so->so_tcpcb) {
         /*
          * NOFDREF can include still connecting to local-host,
          * newly socreated() sockets etc. Don't want to select these.
          */
         if (so->so_state & SS_NOFDREF || so->s == -1) {
-            continue;
+            return 0;
         }
 
         /*
          * Set for reading sockets which are accepting
          */
         if (so->so_state & SS_FACCEPTCONN) {
-            so->pollfds_idx = add_poll(
-                so->s, SLIRP_POLL_IN | SLIRP_POLL_HUP | SLIRP_POLL_ERR, opaque);
-            continue;
+            return SLIRP_POLL_IN | SLIRP_POLL_HUP | SLIRP_POLL_ERR;
         }
 
         /*
          * Set for writing sockets which are connecting
          */
         if (so->so_state & SS_ISFCONNECTING) {
-            so->pollfds_idx =
-                add_poll(so->s, SLIRP_POLL_OUT | SLIRP_POLL_ERR, opaque);
-            continue;
+            return SLIRP_POLL_OUT | SLIRP_POLL_ERR;
         }
 
         /*
@@ -820,11 +864,54 @@ void slirp_pollfds_fill(Slirp *slirp, uint32_t *timeout,
          * and notify again in sbdrop() when the sb becomes less than half full.
          */
         if (CONN_CANFRCV(so) &&
-            (so->so_snd.sb_cc < (so->so_snd.sb_datalen / 2))) {
+            (so->so_snd.sb_cc < (so->so_snd.sb_hiwat / 2))) {
             events |= SLIRP_POLL_IN | SLIRP_POLL_HUP | SLIRP_POLL_ERR |
                       SLIRP_POLL_PRI;
         }
 
+        return events;
+    }
+
+    if (so->so_type == IPPROTO_UDP) {
+        /*
+         * When UDP packets are received from over the
+         * link, they're sendto()'d straight away, so
+         * no need for setting for writing
+         * Limit the number of packets queued by this session
+         * to 4.  Note that even though we try and limit this
+         * to 4 packets, the session could have more queued
+         * if the packets needed to be fragmented
+         * (XXX <= 4 ?)
+         */
+        if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
+            return SLIRP_POLL_IN | SLIRP_POLL_HUP | SLIRP_POLL_ERR;
+        }
+        return 0;
+    }
+
+    /* ICMP */
+    if (so->so_state & SS_ISFCONNECTED) {
+        return SLIRP_POLL_IN | SLIRP_POLL_HUP | SLIRP_POLL_ERR;
+    }
+    return 0;
+}
+
+void slirp_pollfds_fill(Slirp *slirp, uint32_t *timeout,
+                        SlirpAddPollCb add_poll, void *opaque)
+{
+    struct socket *so, *so_next;
+
+    /*
+     * First, TCP sockets
+     */
+    for (so = slirp->tcb.so_next; so != &slirp->tcb; so = so_next) {
+        int events;
+
+        so_next = so->so_next;
+
+        so->pollfds_idx = -1;
+
+        events = slirp_socket_poll_events(so);
         if (events) {
             so->pollfds_idx = add_poll(so->s, events, opaque);
         }
@@ -834,6 +921,8 @@ void slirp_pollfds_fill(Slirp *slirp, uint32_t *timeout,
      * UDP sockets
      */
     for (so = slirp->udb.so_next; so != &slirp->udb; so = so_next) {
+        int events;
+
         so_next = so->so_next;
 
         so->pollfds_idx = -1;
@@ -841,28 +930,14 @@ void slirp_pollfds_fill(Slirp *slirp, uint32_t *timeout,
         /*
          * See if it's timed out
          */
-        if (so->so_expire) {
-            if (so->so_expire <= curtime) {
-                udp_detach(so);
-                continue;
-            } else {
-                slirp->do_slowtimo = true; /* Let socket expire */
-            }
+        if (so->so_expire && so->so_expire <= curtime) {
+            udp_detach(so);
+            continue;
         }
 
-        /*
-         * When UDP packets are received from over the
-         * link, they're sendto()'d straight away, so
-         * no need for setting for writing
-         * Limit the number of packets queued by this session
-         * to 4.  Note that even though we try and limit this
-         * to 4 packets, the session could have more queued
-         * if the packets needed to be fragmented
-         * (XXX <= 4 ?)
-         */
-        if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
-            so->pollfds_idx = add_poll(
-                so->s, SLIRP_POLL_IN | SLIRP_POLL_HUP | SLIRP_POLL_ERR, opaque);
+        events = slirp_socket_poll_events(so);
+        if (events) {
+            so->pollfds_idx = add_poll(so->s, events, opaque);
         }
     }
 
@@ -870,6 +945,8 @@ void slirp_pollfds_fill(Slirp *slirp, uint32_t *timeout,
      * ICMP sockets
      */
     for (so = slirp->icmp.so_next; so != &slirp->icmp; so = so_next) {
+        int events;
+
         so_next = so->so_next;
 
         so->pollfds_idx = -1;
@@ -877,46 +954,157 @@ void slirp_pollfds_fill(Slirp *slirp, uint32_t *timeout,
         /*
          * See if it's timed out
          */
-        if (so->so_expire) {
-            if (so->so_expire <= curtime) {
-                icmp_detach(so);
-                continue;
-            } else {
-                slirp->do_slowtimo = true; /* Let socket expire */
-            }
+        if (so->so_expire && so->so_expire <= curtime) {
+            icmp_detach(so);
+            continue;
         }
 
-        if (so->so_state & SS_ISFCONNECTED) {
-            so->pollfds_idx = add_poll(
-                so->s, SLIRP_POLL_IN | SLIRP_POLL_HUP | SLIRP_POLL_ERR, opaque);
+        events = slirp_socket_poll_events(so);
+        if (events) {
+            so->pollfds_idx = add_poll(so->s, events, opaque);
         }
     }
 
     slirp_update_timeout(slirp, timeout);
 }
 
+/*
+ * Run the protocol timers which are due.
+ */
+static void slirp_check_timers(Slirp *slirp)
+{
+    twheel_run(&slirp->timers, slirp_now_ms(slirp));
+}
+
+static void slirp_tcp_ready(struct socket *so, int revents)
+{
+    int ret;
+
+    if (so->so_state & SS_NOFDREF || so->s == -1) {
+        return;
+    }
+
+#ifndef __APPLE__
+    /*
+     * Check for URG data
+     * This will soread as well, so no need to
+     * test for SLIRP_POLL_IN below if this succeeds.
+     *
+     * This is however disabled on MacOS, which apparently always
+     * reports data as PRI when it is the last data of the
+     * connection. We would then report it out of band, which the guest
+     * would most probably not be ready for.
+     */
+    if (revents & SLIRP_POLL_PRI) {
+        ret = sorecvoob(so);
+        if (ret < 0) {
+            /* Socket error might have resulted in the socket being
+             * removed, do not try to do anything more with it. */
+            return;
+        }
+    }
+    /*
+     * Check sockets for reading
+     */
+    else
+#endif
+        if (revents &
+             (SLIRP_POLL_IN | SLIRP_POLL_HUP | SLIRP_POLL_ERR | SLIRP_POLL_PRI)) {
+        /*
+         * Check for incoming connections
+         */
+        if (so->so_state & SS_FACCEPTCONN) {
+            tcp_connect(so);
+            return;
+        } /* else */
+        ret = soread(so);
+
+        /* Output it if we read something */
+        if (ret > 0) {
+            tcp_output(sototcpcb(so));
+        }
+        if (ret < 0) {
+            /* Socket error might have resulted in the socket being
+             * removed, do not try to do anything more with it. */
+            return;
+        }
+    }
+
+    /*
+     * Check sockets for writing
+     */
+    if (!(so->so_state & SS_NOFDREF) &&
+        (revents & (SLIRP_POLL_OUT | SLIRP_POLL_ERR))) {
+        /*
+         * Check for non-blocking, still-connecting sockets
+         */
+        if (so->so_state & SS_ISFCONNECTING) {
+            /* Connected */
+            so->so_state &= ~SS_ISFCONNECTING;
+
+            ret = send(so->s, (const void *)&ret, 0, 0);
+            if (ret < 0) {
+                /* XXXXX Must fix, zero bytes is a NOP */
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINPROGRESS || errno == ENOTCONN) {
+                    return;
+                }
+
+                /* else failed */
+                so->so_state &= SS_PERSISTENT_MASK;
+                so->so_state |= SS_NOFDREF;
+            }
+            /* else so->so_state &= ~SS_ISFCONNECTING; */
+
+            /*
+             * Continue tcp_input
+             */
+            tcp_input((struct mbuf *)NULL, sizeof(struct ip), so,
+                      so->so_ffamily);
+            /* continue; */
+        } else {
+            ret = sowrite(so);
+            if (ret > 0) {
+                /* Call tcp_output in case we need to send a window
+                 * update to the guest, otherwise it will be stuck
+                 * until it sends a window probe. */
+                tcp_output(sototcpcb(so));
+            }
+        }
+    }
+}
+
+/*
+ * Incoming UDP packets are sent straight away, they're not buffered.
+ * Incoming UDP data isn't buffered either.
+ */
+static void slirp_udp_ready(struct socket *so, int revents)
+{
+    if (so->s != -1 &&
+        (revents & (SLIRP_POLL_IN | SLIRP_POLL_HUP | SLIRP_POLL_ERR))) {
+        sorecvfrom(so);
+    }
+}
+
+static void slirp_icmp_ready(struct socket *so, int revents)
+{
+    if (so->s != -1 &&
+        (revents & (SLIRP_POLL_IN | SLIRP_POLL_HUP | SLIRP_POLL_ERR))) {
+        icmp_receive(so);
+    }
+}
+
 void slirp_pollfds_poll(Slirp *slirp, int select_error,
                         SlirpGetREventsCb get_revents, void *opaque)
 {
     struct socket *so, *so_next;
-    int ret;
 
     curtime = slirp->cb->clock_get_ns(slirp->opaque) / SCALE_MS;
 
     /*
      * See if anything has timed out
      */
-    if (slirp->time_fasttimo &&
-        ((curtime - slirp->time_fasttimo) >= TIMEOUT_FAST)) {
-        tcp_fasttimo(slirp);
-        slirp->time_fasttimo = 0;
-    }
-    if (slirp->do_slowtimo &&
-        ((curtime - slirp->last_slowtimo) >= TIMEOUT_SLOW)) {
-        ip_slowtimo(slirp);
-        tcp_slowtimo(slirp);
-        slirp->last_slowtimo = curtime;
-    }
+    slirp_check_timers(slirp);
 
     /*
      * Check sockets
@@ -935,104 +1123,11 @@ void slirp_pollfds_poll(Slirp *slirp, int select_error,
                 revents = get_revents(so->pollfds_idx, opaque);
             }
 
-            if (so->so_state & SS_NOFDREF || so->s == -1) {
-                continue;
-            }
-
-#ifndef __APPLE__
-            /*
-             * Check for URG data
-             * This will soread as well, so no need to
-             * test for SLIRP_POLL_IN below if this succeeds.
-             *
-             * This is however disabled on MacOS, which apparently always
-             * reports data as PRI when it is the last data of the
-             * connection. We would then report it out of band, which the guest
-             * would most probably not be ready for.
-             */
-            if (revents & SLIRP_POLL_PRI) {
-                ret = sorecvoob(so);
-                if (ret < 0) {
-                    /* Socket error might have resulted in the socket being
-                     * removed, do not try to do anything more with it. */
-                    continue;
-                }
-            }
-            /*
-             * Check sockets for reading
-             */
-            else
-#endif
-                if (revents &
-                     (SLIRP_POLL_IN | SLIRP_POLL_HUP | SLIRP_POLL_ERR | SLIRP_POLL_PRI)) {
-                /*
-                 * Check for incoming connections
-                 */
-                if (so->so_state & SS_FACCEPTCONN) {
-                    tcp_connect(so);
-                    continue;
-                } /* else */
-                ret = soread(so);
-
-                /* Output it if we read something */
-                if (ret > 0) {
-                    tcp_output(sototcpcb(so));
-                }
-                if (ret < 0) {
-                    /* Socket error might have resulted in the socket being
-                     * removed, do not try to do anything more with it. */
-                    continue;
-                }
-            }
-
-            /*
-             * Check sockets for writing
-             */
-            if (!(so->so_state & SS_NOFDREF) &&
-                (revents & (SLIRP_POLL_OUT | SLIRP_POLL_ERR))) {
-                /*
-                 * Check for non-blocking, still-connecting sockets
-                 */
-                if (so->so_state & SS_ISFCONNECTING) {
-                    /* Connected */
-                    so->so_state &= ~SS_ISFCONNECTING;
-
-                    ret = send(so->s, (const void *)&ret, 0, 0);
-                    if (ret < 0) {
-                        /* XXXXX Must fix, zero bytes is a NOP */
-                        if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                            errno == EINPROGRESS || errno == ENOTCONN) {
-                            continue;
-                        }
-
-                        /* else failed */
-                        so->so_state &= SS_PERSISTENT_MASK;
-                        so->so_state |= SS_NOFDREF;
-                    }
-                    /* else so->so_state &= ~SS_ISFCONNECTING; */
-
-                    /*
-                     * Continue tcp_input
-                     */
-                    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so,
-                              so->so_ffamily);
-                    /* continue; */
-                } else {
-                    ret = sowrite(so);
-                    if (ret > 0) {
-                        /* Call tcp_output in case we need to send a window
-                         * update to the guest, otherwise it will be stuck
-                         * until it sends a window probe. */
-                        tcp_output(sototcpcb(so));
-                    }
-                }
-            }
+            slirp_tcp_ready(so, revents);
         }
 
         /*
          * Now UDP sockets.
-         * Incoming packets are sent straight away, they're not buffered.
-         * Incoming UDP data isn't buffered either.
          */
         for (so = slirp->udb.so_next; so != &slirp->udb; so = so_next) {
             int revents;
@@ -1044,10 +1139,7 @@ void slirp_pollfds_poll(Slirp *slirp, int select_error,
                 revents = get_revents(so->pollfds_idx, opaque);
             }
 
-            if (so->s != -1 &&
-                (revents & (SLIRP_POLL_IN | SLIRP_POLL_HUP | SLIRP_POLL_ERR))) {
-                sorecvfrom(so);
-            }
+            slirp_udp_ready(so, revents);
         }
 
         /*
@@ -1063,16 +1155,57 @@ void slirp_pollfds_poll(Slirp *slirp, int select_error,
                 revents = get_revents(so->pollfds_idx, opaque);
             }
 
-            if (so->s != -1 &&
-                (revents & (SLIRP_POLL_IN | SLIRP_POLL_HUP | SLIRP_POLL_ERR))) {
-                icmp_receive(so);
-            }
+            slirp_icmp_ready(so, revents);
         }
     }
 
     if_start(slirp);
 }
 
+void slirp_pollfds_update(Slirp *slirp, uint32_t *timeout)
+{
+    struct socket *so;
+
+    g_return_if_fail(slirp->poll_incremental);
+
+    curtime = slirp->cb->clock_get_ns(slirp->opaque) / SCALE_MS;
+
+    slirp_check_timers(slirp);
+
+    /*
+     * Only the sockets something happened to can need other events.
+     */
+    while ((so = slirp->poll_dirty) != NULL) {
+        sopoll_update(so, slirp_socket_poll_events(so));
+    }
+
+    slirp_update_timeout(slirp, timeout);
+}
+
+void slirp_pollfd_ready(Slirp *slirp, int fd, int revents)
+{
+    struct socket *so = sofdindex_lookup(&slirp->poll_fds, fd);
+
+    if (!so) {
+        return;
+    }
+
+    curtime = slirp->cb->clock_get_ns(slirp->opaque) / SCALE_MS;
+
+    /* Before handling it, which may free it */
+    sopoll_dirty(so);
+
+    if (so->so_tcpcb) {
+        slirp_tcp_ready(so, revents);
+    } else if (so->so_type == IPPROTO_UDP) {
+        slirp_udp_ready(so, revents);
+    } else {
+        slirp_icmp_ready(so, revents);
+    }
+
+    if_start(slirp);
+}
+
 static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
 {
     const struct slirp_arphdr *ah =
@@ -1143,49 +1276,152 @@ static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     }
 }
 
-void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+/* Room left before the ethernet header of guest packets. We add 2 to align
+ * the IP header on 8 bytes despite the ethernet header, and the margin for
+ * the tcpiphdr overhead. */
+#define SLIRP_INPUT_HEADROOM (TCPIPHDR_DELTA + 2)
+
+static struct mbuf *slirp_input_get(Slirp *slirp, int size)
 {
-    struct mbuf *m;
+    struct mbuf *m = m_get(slirp);
+
+    if (!m)
+        return NULL;
+    m->m_data += SLIRP_INPUT_HEADROOM;
+    if (M_ROOM(m) < size) {
+        m_inc(m, size);
+    }
+    return m;
+}
+
+/* Process the ethernet frame held by m, which was set up by slirp_input_get */
+static void slirp_input_mbuf(Slirp *slirp, struct mbuf *m)
+{
+    const uint8_t *pkt = mtod(m, const uint8_t *);
     int proto;
 
-    if (pkt_len < ETH_HLEN)
+    if (m->m_len < ETH_HLEN) {
+        m_free(m);
         return;
+    }
 
     proto = (((uint16_t)pkt[12]) << 8) + pkt[13];
     switch (proto) {
     case ETH_P_ARP:
-        arp_input(slirp, pkt, pkt_len);
+        arp_input(slirp, pkt, m->m_len);
         break;
     case ETH_P_IP:
     case ETH_P_IPV6:
-        m = m_get(slirp);
-        if (!m)
-            return;
-        /* Note: we add 2 to align the IP header on 8 bytes despite the ethernet
-         * header, and add the margin for the tcpiphdr overhead  */
-        if (M_FREEROOM(m) < pkt_len + TCPIPHDR_DELTA + 2) {
-            m_inc(m, pkt_len + TCPIPHDR_DELTA + 2);
-        }
-        m->m_len = pkt_len + TCPIPHDR_DELTA + 2;
-        memcpy(m->m_data + TCPIPHDR_DELTA + 2, pkt, pkt_len);
-
-        m->m_data += TCPIPHDR_DELTA + 2 + ETH_HLEN;
-        m->m_len -= TCPIPHDR_DELTA + 2 + ETH_HLEN;
+        m->m_data += ETH_HLEN;
+        m->m_len -= ETH_HLEN;
 
         if (proto == ETH_P_IP) {
             ip_input(m);
         } else if (proto == ETH_P_IPV6) {
             ip6_input(m);
         }
-        break;
+        return;
 
     case ETH_P_NCSI:
-        ncsi_input(slirp, pkt, pkt_len);
+        ncsi_input(slirp, pkt, m->m_len);
         break;
 
     default:
         break;
     }
+
+    m_free(m);
+}
+
+static void slirp_input_packet(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+{
+    struct mbuf *m;
+
+    if (pkt_len < ETH_HLEN)
+        return;
+
+    m = slirp_input_get(slirp, pkt_len);
+    if (!m)
+        return;
+    memcpy(m->m_data, pkt, pkt_len);
+    m->m_len = pkt_len;
+
+    slirp_input_mbuf(slirp, m);
+}
+
+void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+{
+    slirp_input_packet(slirp, pkt, pkt_len);
+    if (!slirp->input_batch) {
+        sosendto_flush(slirp);
+    }
+}
+
+uint8_t *slirp_input_buf_get(Slirp *slirp, int size, SlirpInputBuf **buf)
+{
+    struct mbuf *m = slirp_input_get(slirp, size);
+
+    *buf = (SlirpInputBuf *)m;
+    return m ? mtod(m, uint8_t *) : NULL;
+}
+
+uint8_t *slirp_input_buf_grow(SlirpInputBuf *buf, int size)
+{
+    struct mbuf *m = (struct mbuf *)buf;
+
+    if (M_ROOM(m) < size) {
+        m_inc(m, size);
+    }
+    return mtod(m, uint8_t *);
+}
+
+void slirp_input_buf_commit(SlirpInputBuf *buf, int pkt_len)
+{
+    struct mbuf *m = (struct mbuf *)buf;
+    Slirp *slirp = m->slirp;
+
+    m->m_len = pkt_len;
+    slirp_input_mbuf(slirp, m);
+    if (!slirp->input_batch) {
+        sosendto_flush(slirp);
+    }
+}
+
+void slirp_input_buf_free(SlirpInputBuf *buf)
+{
+    m_free((struct mbuf *)buf);
+}
+
+void slirp_input_batch_begin(Slirp *slirp)
+{
+    slirp->input_batch++;
+}
+
+void slirp_input_batch_end(Slirp *slirp)
+{
+    sosendto_flush(slirp);
+    if (slirp->input_batch > 1) {
+        /* Nested in a callback, the outer batch finishes the job */
+        slirp->input_batch--;
+        return;
+    }
+
+    /* Still batched, so that the segments queue up for if_start */
+    tcp_output_flush(slirp);
+    slirp->input_batch = 0;
+
+    if_start(slirp);
+}
+
+void slirp_input_batch(Slirp *slirp, const SlirpPacket *pkts, int count)
+{
+    int i;
+
+    slirp_input_batch_begin(slirp);
+    for (i = 0; i < count; i++) {
+        slirp_input_packet(slirp, pkts[i].pkt, pkts[i].pkt_len);
+    }
+    slirp_input_batch_end(slirp);
 }
 
 /* Prepare the IPv4 packet to be sent to the ethernet device. Returns 1 if no
@@ -1311,6 +1547,15 @@ int if_encap(Slirp *slirp, struct mbuf *ifm)
                                            sizeof(ethaddr_str)));
     DEBUG_ARG("dst = %s", slirp_ether_ntoa(eh->h_dest, ethaddr_str,
                                            sizeof(ethaddr_str)));
+    if (slirp->send_iov) {
+        /* The packet goes out from the mbuf, after the header */
+        SlirpIoVec iov[2] = {
+            { eh, ETH_HLEN },
+            { ifm->m_data, ifm->m_len },
+        };
+        slirp_send_packet_iov(slirp, iov, 2);
+        return 1;
+    }
     memcpy(buf + 2 + sizeof(struct ethhdr), ifm->m_data, ifm->m_len);
     slirp_send_packet_all(slirp, buf + 2, ifm->m_len + ETH_HLEN);
     return 1;
@@ -1334,7 +1579,7 @@ int slirp_remove_hostfwd(Slirp *slirp, int is_udp, struct in_addr host_addr,
             addr.sin_family == AF_INET &&
             addr.sin_addr.s_addr == host_addr.s_addr &&
             addr.sin_port == port) {
-            so->slirp->cb->unregister_poll_fd(so->s, so->slirp->opaque);
+            sopoll_unregister(so);
             closesocket(so->s);
             sofree(so);
             return 0;
@@ -1376,7 +1621,7 @@ int slirp_remove_hostxfwd(Slirp *slirp,
         if ((so->so_state & SS_HOSTFWD) &&
             getsockname(so->s, (struct sockaddr *)&addr, &addr_len) == 0 &&
             sockaddr_equal(&addr, (const struct sockaddr_storage *) haddr)) {
-            so->slirp->cb->unregister_poll_fd(so->s, so->slirp->opaque);
+            sopoll_unregister(so);
             closesocket(so->s);
             sofree(so);
             return 0;
@@ -1562,7 +1807,7 @@ size_t slirp_socket_can_recv(Slirp *slirp, struct in_addr guest_addr,
         return 0;
     }
 
-    if (!CONN_CANFRCV(so) || so->so_snd.sb_cc >= (so->so_snd.sb_datalen / 2)) {
+    if (!CONN_CANFRCV(so) || so->so_snd.sb_cc >= (so->so_snd.sb_hiwat / 2)) {
         /* If the sb is already half full, we will wait for the guest to consume it,
          * and notify again in sbdrop() when the sb becomes less than half full. */
         return 0;
@@ -1586,10 +1831,8 @@ void slirp_socket_recv(Slirp *slirp, struct in_addr guest_addr, int guest_port,
         tcp_output(sototcpcb(so));
 }
 
-void slirp_send_packet_all(Slirp *slirp, const void *buf, size_t len)
+static void slirp_send_packet_check(slirp_ssize_t ret, size_t len)
 {
-    slirp_ssize_t ret = slirp->cb->send_packet(buf, len, slirp->opaque);
-
     if (ret < 0) {
         g_critical("Failed to send packet, ret: %ld", (long)ret);
     } else if (ret < len) {
@@ -1597,3 +1840,29 @@ void slirp_send_packet_all(Slirp *slirp, const void *buf, size_t len)
                     (unsigned long)len);
     }
 }
+
+void slirp_send_packet_all(Slirp *slirp, const void *buf, size_t len)
+{
+    if (slirp->send_iov) {
+        SlirpIoVec iov = { buf, len };
+        slirp_send_packet_iov(slirp, &iov, 1);
+        return;
+    }
+
+    slirp_send_packet_check(slirp->cb->send_packet(buf, len, slirp->opaque),
+                            len);
+}
+
+/* Only when the application provides send_packet_iov, see slirp->send_iov */
+void slirp_send_packet_iov(Slirp *slirp, const SlirpIoVec *iov, int iovcnt)
+{
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    slirp_send_packet_check(
+        slirp->cb->send_packet_iov(iov, iovcnt, slirp->opaque), len);
+}
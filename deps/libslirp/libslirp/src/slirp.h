@@ -42,6 +42,7 @@
 #include "ip.h"
 #include "ip6.h"
 #include "tcp.h"
+#include "twheel.h"
 #include "tcp_timer.h"
 #include "tcp_var.h"
 #include "tcpip.h"
@@ -57,6 +58,7 @@
 
 #include "bootp.h"
 #include "tftp.h"
+#include "dnscache.h"
 
 #define ARPOP_REQUEST 1 /* ARP request */
 #define ARPOP_REPLY 2 /* ARP reply   */
@@ -123,9 +125,18 @@ bool ndp_table_search(Slirp *slirp, struct in6_addr ip_addr,
 struct Slirp {
     int cfg_version;
 
-    unsigned time_fasttimo;
-    unsigned last_slowtimo;
-    bool do_slowtimo;
+    /* Protocol timers, see slirp_timer_arm() */
+    struct twheel timers;
+    struct twheel_entry ip_frag_timer;
+
+    /* Incremental poll registration, see slirp_pollfds_update() */
+    bool poll_incremental;
+
+    bool send_iov; /* frames go out through send_packet_iov */
+    struct socket *poll_dirty; /* Sockets whose poll events may have changed */
+    struct sofdindex poll_fds;
+
+    struct so_mmsg so_mmsg; /* batched UDP I/O, see sorecvfrom/sosendto */
 
     bool in_enabled, in6_enabled;
 
@@ -158,13 +169,16 @@ struct Slirp {
     /* mbuf states */
     struct slirp_quehead m_freelist;
     struct slirp_quehead m_usedlist;
-    int mbuf_alloced;
+    struct mbuf_pool mbuf_pool;
 
     /* if states */
-    struct slirp_quehead if_fastq; /* fast queue (for interactive data) */
-    struct slirp_quehead if_batchq; /* queue for non-interactive data */
+    struct if_fq if_fq; /* guest-bound packet scheduler */
     bool if_start_busy; /* avoid if_start recursion */
 
+    /* Processing a batch of guest packets, see slirp_input_batch_begin() */
+    int input_batch; /* nesting depth */
+    struct tcpcb *tcp_output_pending; /* see tcp_output_batched() */
+
     /* ip states */
     struct ipq ipq; /* ip reass. queue */
     uint16_t ip_id; /* ip packet ctr, for ids */
@@ -178,13 +192,18 @@ struct Slirp {
 
     /* tcp states */
     struct socket tcb;
+    struct sohash tcb_hash;
     struct socket *tcp_last_so;
     tcp_seq tcp_iss; /* tcp initial send seq # */
-    uint32_t tcp_now; /* for RFC 1323 timestamps */
+    uint64_t tcp_iss_time; /* when tcp_iss was last advanced, in ms */
+    uint32_t tcp_rto_min; /* retransmit timeout floor, in ms */
+    uint32_t tcp_sbuf_max; /* socket buffer autotuning ceiling */
 
     /* udp states */
     struct socket udb;
+    struct sohash udb_hash;
     struct socket *udp_last_so;
+    struct udp_nat udp_nat;
 
     /* icmp states */
     struct socket icmp;
@@ -195,6 +214,8 @@ struct Slirp {
     struct tftp_session tftp_sessions[TFTP_SESSIONS_MAX];
     char *tftp_server_name;
 
+    struct dnscache dnscache;
+
     ArpTable arp_table;
     NdpTable ndp_table;
 
@@ -234,16 +255,49 @@ int translate_dnssearch(Slirp *s, const char **names);
 /* cksum.c */
 int cksum(struct mbuf *m, int len);
 int ip6_cksum(struct mbuf *m);
+/* Pick the cksum_add kernel for this CPU, called once from slirp_init_once */
+void cksum_init(void);
+/*
+ * Add the 16-bit words of buf to the running sum, for data checksummed in
+ * pieces. Only the last piece may have an odd length.
+ */
+uint64_t cksum_add(const void *buf, size_t len, uint64_t sum);
+/* Fold sum to 16 bits, the checksum is its complement */
+uint16_t cksum_fold(uint64_t sum);
+
+/*
+ * Update checksum sum for a 16-bit field of the data going from old_val to
+ * new_val, without summing the whole data again (RFC 1624, eqn. 3). The
+ * values are in the byte order they have in the data.
+ */
+static inline uint16_t cksum_update16(uint16_t sum, uint16_t old_val,
+                                      uint16_t new_val)
+{
+    uint32_t s = (uint16_t)~sum + (uint16_t)~old_val + new_val;
+
+    s = (s & 0xffff) + (s >> 16);
+    s = (s & 0xffff) + (s >> 16);
+    return ~s;
+}
+
+/* Same for a 32-bit field, such as an IPv4 address */
+static inline uint16_t cksum_update32(uint16_t sum, uint32_t old_val,
+                                      uint32_t new_val)
+{
+    sum = cksum_update16(sum, old_val >> 16, new_val >> 16);
+    return cksum_update16(sum, old_val & 0xffff, new_val & 0xffff);
+}
 
 /* if.c */
 void if_init(Slirp *);
+void if_cleanup(Slirp *);
 void if_output(struct socket *, struct mbuf *);
+void if_sofree(struct socket *);
 
 /* ip_input.c */
 void ip_init(Slirp *);
 void ip_cleanup(Slirp *);
 void ip_input(struct mbuf *);
-void ip_slowtimo(Slirp *);
 void ip_stripoptions(register struct mbuf *, struct mbuf *);
 
 /* ip_output.c */
@@ -263,11 +317,15 @@ int tcp_mss(register struct tcpcb *, unsigned);
 
 /* tcp_output.c */
 int tcp_output(register struct tcpcb *);
+void tcp_output_batched(struct tcpcb *);
+void tcp_output_cancel(struct tcpcb *);
+void tcp_output_flush(Slirp *);
 void tcp_setpersist(register struct tcpcb *);
 
 /* tcp_subr.c */
 void tcp_init(Slirp *);
 void tcp_cleanup(Slirp *);
+void tcp_iss_advance(Slirp *);
 void tcp_template(struct tcpcb *);
 void tcp_respond(struct tcpcb *, register struct tcpiphdr *,
                  register struct mbuf *, tcp_seq, tcp_seq, int, unsigned short);
@@ -278,6 +336,9 @@ int tcp_fconnect(struct socket *, unsigned short af);
 void tcp_connect(struct socket *);
 void tcp_attach(struct socket *);
 uint8_t tcp_tos(struct socket *);
+uint32_t tcp_sbuf_initial(Slirp *slirp, uint32_t space, int mss);
+void tcp_sbuf_update(struct tcpcb *tp, uint32_t acked, uint32_t rcvd);
+void tcp_sbuf_idle(struct tcpcb *tp);
 int tcp_emu(struct socket *, struct mbuf *);
 int tcp_ctl(struct socket *);
 struct tcpcb *tcp_drop(struct tcpcb *tp, int err);
@@ -286,6 +347,11 @@ struct socket *slirp_find_ctl_socket(Slirp *slirp, struct in_addr guest_addr,
                                      int guest_port);
 
 void slirp_send_packet_all(Slirp *slirp, const void *buf, size_t len);
+void slirp_send_packet_iov(Slirp *slirp, const SlirpIoVec *iov, int iovcnt);
 void *slirp_timer_new(Slirp *slirp, SlirpTimerId id, void *cb_opaque);
 
+uint64_t slirp_now_ms(Slirp *slirp);
+void slirp_timer_arm(Slirp *slirp, struct twheel_entry *entry,
+                     uint64_t delay_ms);
+
 #endif
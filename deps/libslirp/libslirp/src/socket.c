@@ -3,6 +3,13 @@
  * Copyright (c) 1995 Danny Gasparovski.
  */
 
+#ifdef __linux__
+/* recvmmsg and sendmmsg */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
 #include "slirp.h"
 #include "ip_icmp.h"
 #ifdef __sun__
@@ -15,8 +22,158 @@
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
 
+#define SOHASH_INITIAL_SIZE 64
+
+uint32_t sohash_addr(const struct sockaddr_storage *ss)
+{
+    uint32_t h = ss->ss_family;
+    size_t i;
+
+    switch (ss->ss_family) {
+    case AF_INET: {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+        h = h * 31 + sin->sin_addr.s_addr;
+        h = h * 31 + sin->sin_port;
+        break;
+    }
+    case AF_INET6: {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ss;
+        uint32_t word;
+        for (i = 0; i < sizeof(sin6->sin6_addr); i += sizeof(word)) {
+            memcpy(&word, &sin6->sin6_addr.s6_addr[i], sizeof(word));
+            h = h * 31 + word;
+        }
+        h = h * 31 + sin6->sin6_port;
+        break;
+    }
+#ifndef _WIN32
+    case AF_UNIX: {
+        const struct sockaddr_un *sa_un = (const struct sockaddr_un *)ss;
+        for (i = 0; i < sizeof(sa_un->sun_path) && sa_un->sun_path[i]; i++) {
+            h = h * 31 + (uint8_t)sa_un->sun_path[i];
+        }
+        break;
+    }
+#endif
+    default:
+        /* Not set yet, sockets are only indexed once their address is */
+        break;
+    }
+
+    return h;
+}
+
+static unsigned int sohash_bucket(struct sohash *hash,
+                                  const struct sockaddr_storage *lhost,
+                                  const struct sockaddr_storage *fhost)
+{
+    uint32_t h = sohash_addr(lhost);
+
+    if (hash->match_fhost) {
+        h = h * 31 + sohash_addr(fhost);
+    }
+
+    /* Fibonacci hashing spreads close addresses and ports */
+    h *= 0x9e3779b1U;
+    return (h ^ (h >> 16)) & (hash->size - 1);
+}
+
+void sohash_init(struct sohash *hash, bool match_fhost)
+{
+    hash->size = SOHASH_INITIAL_SIZE;
+    hash->count = 0;
+    hash->buckets = g_new0(struct socket *, hash->size);
+    hash->match_fhost = match_fhost;
+}
+
+void sohash_cleanup(struct sohash *hash)
+{
+    g_free(hash->buckets);
+    hash->buckets = NULL;
+    hash->size = 0;
+    hash->count = 0;
+}
+
+static void sohash_link(struct sohash *hash, struct socket *so)
+{
+    unsigned int bucket =
+        sohash_bucket(hash, &so->lhost.ss, &so->fhost.ss);
+
+    so->so_hash_next = hash->buckets[bucket];
+    hash->buckets[bucket] = so;
+    so->so_hash = hash;
+}
+
+static void sohash_grow(struct sohash *hash)
+{
+    struct socket **old_buckets = hash->buckets;
+    unsigned int old_size = hash->size;
+    unsigned int i;
+
+    hash->size *= 2;
+    hash->buckets = g_new0(struct socket *, hash->size);
+
+    for (i = 0; i < old_size; i++) {
+        struct socket *so = old_buckets[i];
+        while (so) {
+            struct socket *next = so->so_hash_next;
+            sohash_link(hash, so);
+            so = next;
+        }
+    }
+
+    g_free(old_buckets);
+}
+
+/*
+ * Index so by its current address, moving it if it was indexed with an
+ * older one. Must be called again whenever a key field of so changes.
+ */
+void sohash_insert(struct sohash *hash, struct socket *so)
+{
+    sohash_remove(so);
+
+    if (hash->count >= hash->size) {
+        sohash_grow(hash);
+    }
+
+    sohash_link(hash, so);
+    hash->count++;
+}
+
+void sohash_remove(struct socket *so)
+{
+    struct sohash *hash = so->so_hash;
+    struct socket **link;
+
+    if (!hash) {
+        return;
+    }
+
+    /* The key may have changed since so was linked, look in all buckets */
+    link = &hash->buckets[sohash_bucket(hash, &so->lhost.ss, &so->fhost.ss)];
+    while (*link && *link != so) {
+        link = &(*link)->so_hash_next;
+    }
+    if (!*link) {
+        unsigned int i;
+        for (i = 0; i < hash->size && !*link; i++) {
+            link = &hash->buckets[i];
+            while (*link && *link != so) {
+                link = &(*link)->so_hash_next;
+            }
+        }
+    }
+
+    g_assert(*link == so);
+    *link = so->so_hash_next;
+    so->so_hash_next = NULL;
+    so->so_hash = NULL;
+    hash->count--;
+}
+
 struct socket *solookup(struct socket **last, struct socket *head,
-                        struct sockaddr_storage *lhost,
+                        struct sohash *hash, struct sockaddr_storage *lhost,
                         struct sockaddr_storage *fhost)
 {
     struct socket *so = *last;
@@ -27,7 +184,10 @@ struct socket *solookup(struct socket **last, struct socket *head,
         return so;
     }
 
-    for (so = head->so_next; so != head; so = so->so_next) {
+    g_assert(!hash->match_fhost || fhost);
+
+    for (so = hash->buckets[sohash_bucket(hash, lhost, fhost)]; so;
+         so = so->so_hash_next) {
         if (sockaddr_equal(&(so->lhost.ss), lhost) &&
             (!fhost || sockaddr_equal(&so->fhost.ss, fhost))) {
             *last = so;
@@ -38,6 +198,191 @@ struct socket *solookup(struct socket **last, struct socket *head,
     return (struct socket *)NULL;
 }
 
+#define SOFDINDEX_INITIAL_SIZE 64
+
+static unsigned int sofdindex_bucket(struct sofdindex *index, int fd)
+{
+    uint32_t h = (uint32_t)fd * 0x9e3779b1U;
+    return (h ^ (h >> 16)) & (index->size - 1);
+}
+
+void sofdindex_init(struct sofdindex *index)
+{
+    index->size = SOFDINDEX_INITIAL_SIZE;
+    index->count = 0;
+    index->buckets = g_new0(struct socket *, index->size);
+}
+
+void sofdindex_cleanup(struct sofdindex *index)
+{
+    g_free(index->buckets);
+    index->buckets = NULL;
+    index->size = 0;
+    index->count = 0;
+}
+
+static void sofdindex_link(struct sofdindex *index, struct socket *so)
+{
+    unsigned int bucket = sofdindex_bucket(index, so->so_poll_fd);
+
+    so->so_poll_fd_next = index->buckets[bucket];
+    index->buckets[bucket] = so;
+}
+
+static void sofdindex_insert(struct sofdindex *index, struct socket *so)
+{
+    if (index->count >= index->size) {
+        struct socket **old_buckets = index->buckets;
+        unsigned int old_size = index->size;
+        unsigned int i;
+
+        index->size *= 2;
+        index->buckets = g_new0(struct socket *, index->size);
+        for (i = 0; i < old_size; i++) {
+            struct socket *next, *cur;
+            for (cur = old_buckets[i]; cur; cur = next) {
+                next = cur->so_poll_fd_next;
+                sofdindex_link(index, cur);
+            }
+        }
+        g_free(old_buckets);
+    }
+
+    sofdindex_link(index, so);
+    index->count++;
+}
+
+static void sofdindex_remove(struct sofdindex *index, struct socket *so)
+{
+    struct socket **link =
+        &index->buckets[sofdindex_bucket(index, so->so_poll_fd)];
+
+    while (*link != so) {
+        link = &(*link)->so_poll_fd_next;
+    }
+    *link = so->so_poll_fd_next;
+    so->so_poll_fd_next = NULL;
+    index->count--;
+}
+
+struct socket *sofdindex_lookup(struct sofdindex *index, int fd)
+{
+    struct socket *so;
+
+    for (so = index->buckets[sofdindex_bucket(index, fd)]; so;
+         so = so->so_poll_fd_next) {
+        if (so->so_poll_fd == fd) {
+            return so;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Queue so for slirp_pollfds_update(): something that decides which events
+ * it should be polled for may have changed.
+ */
+void sopoll_dirty(struct socket *so)
+{
+    Slirp *slirp = so->slirp;
+
+    if (so->so_poll_dirty_pprev || !slirp->poll_incremental) {
+        return;
+    }
+
+    so->so_poll_dirty_next = slirp->poll_dirty;
+    if (so->so_poll_dirty_next) {
+        so->so_poll_dirty_next->so_poll_dirty_pprev = &so->so_poll_dirty_next;
+    }
+    slirp->poll_dirty = so;
+    so->so_poll_dirty_pprev = &slirp->poll_dirty;
+}
+
+static void sopoll_clean(struct socket *so)
+{
+    if (!so->so_poll_dirty_pprev) {
+        return;
+    }
+
+    *so->so_poll_dirty_pprev = so->so_poll_dirty_next;
+    if (so->so_poll_dirty_next) {
+        so->so_poll_dirty_next->so_poll_dirty_pprev = so->so_poll_dirty_pprev;
+    }
+    so->so_poll_dirty_next = NULL;
+    so->so_poll_dirty_pprev = NULL;
+}
+
+/*
+ * Take so off the dirty list, and tell the application if the events it
+ * should be polled for are not the ones last reported.
+ */
+void sopoll_update(struct socket *so, int events)
+{
+    Slirp *slirp = so->slirp;
+
+    sopoll_clean(so);
+
+    if (so->so_poll_fd == -1) {
+        if (so->s == -1 || !events) {
+            return;
+        }
+        so->so_poll_fd = so->s;
+        so->so_poll_events = 0;
+        sofdindex_insert(&slirp->poll_fds, so);
+    }
+
+    if (events != so->so_poll_events) {
+        so->so_poll_events = events;
+        slirp->cb->update_poll(so->so_poll_fd, events, slirp->opaque);
+    }
+}
+
+/*
+ * Stop polling so->s, which is about to be closed.
+ */
+void sopoll_unregister(struct socket *so)
+{
+    Slirp *slirp = so->slirp;
+
+    if (so->so_poll_fd != -1) {
+        sofdindex_remove(&slirp->poll_fds, so);
+        so->so_poll_fd = -1;
+        so->so_poll_events = 0;
+    }
+    slirp->cb->unregister_poll_fd(so->s, slirp->opaque);
+}
+
+/*
+ * Idle UDP and ICMP sockets go away at so_expire. The timer is armed once;
+ * when so_expire has been pushed back meanwhile, it is just armed again.
+ */
+static void soexpire_timer(struct twheel_entry *entry)
+{
+    struct socket *so = entry->opaque;
+
+    if (!so->so_expire) {
+        return;
+    }
+
+    if (so->so_expire > curtime) {
+        slirp_timer_arm(so->slirp, &so->so_expire_timer,
+                        so->so_expire - curtime);
+    } else if (so->so_type == IPPROTO_UDP) {
+        udp_detach(so);
+    } else {
+        icmp_detach(so);
+    }
+}
+
+void soexpire_arm(struct socket *so)
+{
+    if (so->so_expire && !twheel_pending(&so->so_expire_timer)) {
+        slirp_timer_arm(so->slirp, &so->so_expire_timer,
+                        so->so_expire - curtime);
+    }
+}
+
 /*
  * Create a new socket, initialise the fields
  * It is the responsibility of the caller to
@@ -54,29 +399,12 @@ struct socket *socreate(Slirp *slirp, int type)
     so->s_aux = -1;
     so->slirp = slirp;
     so->pollfds_idx = -1;
+    so->so_poll_fd = -1;
+    twheel_entry_init(&so->so_expire_timer, soexpire_timer, so);
 
     return so;
 }
 
-/*
- * Remove references to so from the given message queue.
- */
-static void soqfree(struct socket *so, struct slirp_quehead *qh)
-{
-    struct mbuf *ifq;
-
-    for (ifq = (struct mbuf *)qh->qh_link; (struct slirp_quehead *)ifq != qh;
-         ifq = ifq->ifq_next) {
-        if (ifq->ifq_so == so) {
-            struct mbuf *ifm;
-            ifq->ifq_so = NULL;
-            for (ifm = ifq->ifs_next; ifm != ifq; ifm = ifm->ifs_next) {
-                ifm->ifq_so = NULL;
-            }
-        }
-    }
-}
-
 /*
  * slirp_remque and free a socket, clobber cache
  */
@@ -88,8 +416,11 @@ void sofree(struct socket *so)
         closesocket(so->s_aux);
     }
 
-    soqfree(so, &slirp->if_fastq);
-    soqfree(so, &slirp->if_batchq);
+    if_sofree(so);
+    sopoll_clean(so);
+    if (so->so_poll_fd != -1) {
+        sofdindex_remove(&slirp->poll_fds, so);
+    }
 
     if (so == slirp->tcp_last_so) {
         slirp->tcp_last_so = &slirp->tcb;
@@ -99,11 +430,20 @@ void sofree(struct socket *so)
         slirp->icmp_last_so = &slirp->icmp;
     }
     m_free(so->so_m);
+    if (slirp->so_mmsg.tx_so == so) {
+        /* udp_detach flushed them, unless the socket was already closed */
+        slirp->so_mmsg.tx_count = 0;
+        slirp->so_mmsg.tx_so = NULL;
+    }
+
+    sohash_remove(so);
+    twheel_del(&slirp->timers, &so->so_expire_timer);
 
     if (so->so_next && so->so_prev)
         slirp_remque(so); /* crashes if so is not in a queue */
 
     if (so->so_tcpcb) {
+        tcp_timer_cleanup(so->so_tcpcb);
         g_free(so->so_tcpcb);
     }
     g_free(so);
@@ -113,12 +453,16 @@ size_t sopreprbuf(struct socket *so, struct iovec *iov, int *np)
 {
     int n, lss, total;
     struct sbuf *sb = &so->so_snd;
-    int len = sb->sb_datalen - sb->sb_cc;
     int mss = so->so_tcpcb->t_maxseg;
+    int len;
 
     DEBUG_CALL("sopreprbuf");
     DEBUG_ARG("so = %p", so);
 
+    /* Keep at least as much room as there is data, as long as it may grow */
+    sbgrow(sb, MAX(sb->sb_cc, SB_MIN_ALLOC));
+    len = MIN(sb->sb_datalen - sb->sb_cc, sbspace(sb));
+
     if (len <= 0)
         return 0;
 
@@ -250,6 +594,11 @@ int soread(struct socket *so)
     sb->sb_wptr += nn;
     if (sb->sb_wptr >= (sb->sb_data + sb->sb_datalen))
         sb->sb_wptr -= sb->sb_datalen;
+
+    /* The host may have had more, make room for it next time */
+    if (nn == buf_len) {
+        sbgrow(sb, sb->sb_datalen);
+    }
     return nn;
 }
 
@@ -267,6 +616,7 @@ int soreadbuf(struct socket *so, const char *buf, int size)
      * soread wouldn't have been called if there weren't
      */
     assert(size > 0);
+    sbgrow(sb, size);
     if (sopreprbuf(so, iov, &n) < size)
         goto err;
 
@@ -495,13 +845,242 @@ err_disconnected:
     return -1;
 }
 
+/*
+ * Leave room in m for the headers udp_output/udp6_output prepend
+ */
+static void sorecvfrom_reserve(struct socket *so, struct mbuf *m)
+{
+    switch (so->so_ffamily) {
+    case AF_INET:
+        m->m_data += IF_MAXLINKHDR + sizeof(struct udpiphdr);
+        break;
+    case AF_INET6:
+        m->m_data +=
+            IF_MAXLINKHDR + sizeof(struct ip6) + sizeof(struct udphdr);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/*
+ * Report the receive error in errno to the guest as ICMP
+ */
+static void sorecvfrom_error(struct socket *so)
+{
+    /* Nothing was sent to answer, or the socket is shared by NAT flows */
+    if (!so->so_m) {
+        return;
+    }
+
+    switch (so->so_lfamily) {
+        uint8_t code;
+    case AF_INET:
+        code = ICMP_UNREACH_PORT;
+
+        if (errno == EHOSTUNREACH) {
+            code = ICMP_UNREACH_HOST;
+        } else if (errno == ENETUNREACH) {
+            code = ICMP_UNREACH_NET;
+        }
+
+        DEBUG_MISC(" rx error, tx icmp ICMP_UNREACH:%i", code);
+        icmp_send_error(so->so_m, ICMP_UNREACH, code, 0, strerror(errno));
+        break;
+    case AF_INET6:
+        code = ICMP6_UNREACH_PORT;
+
+        if (errno == EHOSTUNREACH) {
+            code = ICMP6_UNREACH_ADDRESS;
+        } else if (errno == ENETUNREACH) {
+            code = ICMP6_UNREACH_NO_ROUTE;
+        }
+
+        DEBUG_MISC(" rx error, tx icmp6 ICMP_UNREACH:%i", code);
+        icmp6_send_error(so->so_m, ICMP6_UNREACH, code);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/*
+ * Pass the datagram m received from addr on to the guest
+ */
+static void sorecvfrom_deliver(struct socket *so, struct mbuf *m,
+                               struct sockaddr_storage *addr)
+{
+    struct socket *out_so = so;
+    struct sockaddr_storage saddr, daddr;
+    uint16_t fport = so->so_fport;
+    uint8_t iptos = so->so_iptos;
+
+    if (so->so_state & SS_UDPNAT) {
+        struct udp_nat_flow *flow = udp_nat_flow_find(so, addr);
+
+        if (!flow) {
+            DEBUG_MISC(" no udp nat flow for this datagram");
+            m_free(m);
+            return;
+        }
+        udp_nat_flow_received(flow);
+
+        saddr = flow->fhost;
+        daddr = flow->lhost;
+        fport = ((struct sockaddr_in *)&flow->fhost)->sin_port;
+        iptos = flow->iptos;
+        /* Let the scheduler tell apart the flows sharing so */
+        out_so = NULL;
+        goto output;
+    }
+
+    /*
+     * Hack: domain name lookup will be used the most for UDP,
+     * and since they'll only be used once there's no need
+     * for the 4 minute (or whatever) timeout... So we time them
+     * out much quicker (10 seconds  for now...)
+     */
+    if (so->so_expire) {
+        if (so->so_fport == htons(53))
+            so->so_expire = curtime + SO_EXPIREFAST;
+        else
+            so->so_expire = curtime + SO_EXPIRE;
+    }
+
+    /*
+     * If this packet was destined for CTL_ADDR,
+     * make it look like that's where it came from
+     */
+    saddr = *addr;
+    sotranslate_in(so, &saddr);
+
+    /* Perform lazy guest IP address resolution if needed. */
+    if (so->so_state & SS_HOSTFWD) {
+        if (soassign_guest_addr_if_needed(so) < 0) {
+            DEBUG_MISC(" guest address not available yet");
+            switch (so->so_lfamily) {
+            case AF_INET:
+                icmp_send_error(so->so_m, ICMP_UNREACH,
+                                ICMP_UNREACH_HOST, 0,
+                                "guest address not available yet");
+                break;
+            case AF_INET6:
+                icmp6_send_error(so->so_m, ICMP6_UNREACH,
+                                 ICMP6_UNREACH_ADDRESS);
+                break;
+            default:
+                g_assert_not_reached();
+            }
+            m_free(m);
+            return;
+        }
+    }
+    daddr = so->lhost.ss;
+
+output:
+    if (fport == htons(DNS_PORT)) {
+        dnscache_response(so->slirp, &saddr, (uint8_t *)m->m_data,
+                          m->m_len);
+    }
+
+    switch (so->so_ffamily) {
+    case AF_INET:
+        udp_output(out_so, m, (struct sockaddr_in *)&saddr,
+                   (struct sockaddr_in *)&daddr, iptos);
+        break;
+    case AF_INET6:
+        udp6_output(out_so, m, (struct sockaddr_in6 *)&saddr,
+                    (struct sockaddr_in6 *)&daddr);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+#ifdef SLIRP_HAVE_MMSG
+/*
+ * Spill space of sorecvfrom_batch, which is done with it when it returns.
+ * The Slirp instances of a thread share it, the last one cleaned up frees it.
+ */
+static __thread char *so_mmsg_overflow;
+static __thread unsigned int so_mmsg_overflow_users;
+
+/*
+ * Drain up to SO_MMSG_BATCH datagrams from so with a single recvmmsg
+ */
+static void sorecvfrom_batch(struct socket *so)
+{
+    struct so_mmsg *mm = &so->slirp->so_mmsg;
+    struct mmsghdr msgs[SO_MMSG_BATCH];
+    struct iovec iov[SO_MMSG_BATCH][2];
+    struct sockaddr_storage addr[SO_MMSG_BATCH];
+    int i, n;
+
+    if (!mm->rx_overflow) {
+        if (!so_mmsg_overflow_users++) {
+            so_mmsg_overflow = g_malloc(SO_MMSG_BATCH * SO_MMSG_OVERFLOW);
+        }
+        mm->rx_overflow = true;
+    }
+
+    for (i = 0; i < SO_MMSG_BATCH; i++) {
+        struct mbuf *m = mm->rx_m[i];
+
+        if (!m) {
+            m = mm->rx_m[i] = m_get(so->slirp);
+            if (!m) {
+                break;
+            }
+        }
+        m->m_data = m->m_dat;
+        m->m_len = 0;
+        sorecvfrom_reserve(so, m);
+
+        iov[i][0].iov_base = m->m_data;
+        iov[i][0].iov_len = M_FREEROOM(m);
+        iov[i][1].iov_base = so_mmsg_overflow + i * SO_MMSG_OVERFLOW;
+        iov[i][1].iov_len = SO_MMSG_OVERFLOW;
+
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_name = &addr[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+        msgs[i].msg_hdr.msg_iov = iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+    if (!i) {
+        return;
+    }
+
+    n = recvmmsg(so->s, msgs, i, MSG_DONTWAIT, NULL);
+    DEBUG_MISC(" did recvmmsg %d, errno = %d-%s", n, errno, strerror(errno));
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            sorecvfrom_error(so);
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        struct mbuf *m = mm->rx_m[i];
+        size_t room = iov[i][0].iov_len;
+
+        mm->rx_m[i] = NULL;
+        m->m_len = msgs[i].msg_len;
+        if (m->m_len > room) {
+            m_inc(m, m->m_len);
+            memcpy(m->m_data + room, iov[i][1].iov_base, m->m_len - room);
+        }
+        sorecvfrom_deliver(so, m, &addr[i]);
+    }
+}
+#endif
+
 /*
  * recvfrom() a UDP socket
  */
 void sorecvfrom(struct socket *so)
 {
     struct sockaddr_storage addr;
-    struct sockaddr_storage saddr, daddr;
     socklen_t addrlen = sizeof(struct sockaddr_storage);
     char buff[256];
 
@@ -513,8 +1092,8 @@ void sorecvfrom(struct socket *so)
 
     /* First look for errors */
     memset(&msg, 0, sizeof(msg));
-    msg.msg_name = &saddr;
-    msg.msg_namelen = sizeof(saddr);
+    msg.msg_name = &addr;
+    msg.msg_namelen = sizeof(addr);
     msg.msg_control = control;
     msg.msg_controllen = sizeof(control);
     iov.iov_base = buff;
@@ -524,7 +1103,18 @@ void sorecvfrom(struct socket *so)
 
     size = recvmsg(so->s, &msg, MSG_ERRQUEUE);
     if (size >= 0) {
+        struct mbuf *m_err = so->so_m;
         struct cmsghdr *cmsg;
+
+        /* On shared sockets, the flow is told by the offending destination */
+        if (so->so_state & SS_UDPNAT) {
+            struct udp_nat_flow *flow = udp_nat_flow_find(so, &addr);
+            m_err = flow ? flow->m : NULL;
+        }
+        if (!m_err) {
+            return;
+        }
+
         for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
 
             if (cmsg->cmsg_level == IPPROTO_IP &&
@@ -537,7 +1127,7 @@ void sorecvfrom(struct socket *so)
                     struct sockaddr_in *sin;
 
                     sin = (struct sockaddr_in *) SO_EE_OFFENDER(ee);
-                    icmp_forward_error(so->so_m, ee->ee_type, ee->ee_code,
+                    icmp_forward_error(m_err, ee->ee_type, ee->ee_code,
                                        0, NULL, &sin->sin_addr);
                 }
             }
@@ -551,7 +1141,7 @@ void sorecvfrom(struct socket *so)
                     struct sockaddr_in6 *sin6;
 
                     sin6 = (struct sockaddr_in6 *) SO_EE_OFFENDER(ee);
-                    icmp6_forward_error(so->so_m, ee->ee_type, ee->ee_code,
+                    icmp6_forward_error(m_err, ee->ee_type, ee->ee_code,
                                         &sin6->sin6_addr);
                 }
             }
@@ -586,6 +1176,9 @@ void sorecvfrom(struct socket *so)
         /* No need for this socket anymore, udp_detach it */
         udp_detach(so);
     } else { /* A "normal" UDP packet */
+#ifdef SLIRP_HAVE_MMSG
+        sorecvfrom_batch(so);
+#else
         struct mbuf *m;
         int len;
 #ifdef _WIN32
@@ -603,17 +1196,7 @@ void sorecvfrom(struct socket *so)
         if (!m) {
             return;
         }
-        switch (so->so_ffamily) {
-        case AF_INET:
-            m->m_data += IF_MAXLINKHDR + sizeof(struct udpiphdr);
-            break;
-        case AF_INET6:
-            m->m_data +=
-                IF_MAXLINKHDR + sizeof(struct ip6) + sizeof(struct udphdr);
-            break;
-        default:
-            g_assert_not_reached();
-        }
+        sorecvfrom_reserve(so, m);
 
         /*
          * XXX Shouldn't FIONREAD packets destined for port 53,
@@ -636,103 +1219,165 @@ void sorecvfrom(struct socket *so)
         if (m->m_len < 0) {
             if (errno == EAGAIN) {
                 printf("eagain on fd %d\n", so->s);
+                m_free(m);
                 return;
             }
-            /* Report error as ICMP */
-            switch (so->so_lfamily) {
-                uint8_t code;
-            case AF_INET:
-                code = ICMP_UNREACH_PORT;
+            sorecvfrom_error(so);
+            m_free(m);
+        } else {
+            sorecvfrom_deliver(so, m, &addr);
+        } /* rx error */
+#endif
+    } /* if ping packet */
+}
 
-                if (errno == EHOSTUNREACH) {
-                    code = ICMP_UNREACH_HOST;
-                } else if (errno == ENETUNREACH) {
-                    code = ICMP_UNREACH_NET;
-                }
+/*
+ * sendto() a socket
+ */
+#ifdef SLIRP_HAVE_MMSG
+/*
+ * Queue a copy of the datagram m for sosendto_flush. Datagrams from the
+ * guest come in one by one, the queue lets consecutive ones to the same
+ * socket go out with a single sendmmsg.
+ */
+static void sosendto_queue(struct socket *so, struct sockaddr_storage *addr,
+                           struct mbuf *m)
+{
+    struct so_mmsg *mm = &so->slirp->so_mmsg;
 
-                DEBUG_MISC(" rx error, tx icmp ICMP_UNREACH:%i", code);
-                icmp_send_error(so->so_m, ICMP_UNREACH, code, 0,
-                                strerror(errno));
-                break;
-            case AF_INET6:
-                code = ICMP6_UNREACH_PORT;
+    if (mm->tx_count && (mm->tx_so != so || mm->tx_count == SO_MMSG_BATCH)) {
+        sosendto_flush(so->slirp);
+    }
+    if (!mm->tx_buf) {
+        mm->tx_buf = g_malloc(SO_MMSG_BATCH * SO_MMSG_TX_MAX);
+    }
 
-                if (errno == EHOSTUNREACH) {
-                    code = ICMP6_UNREACH_ADDRESS;
-                } else if (errno == ENETUNREACH) {
-                    code = ICMP6_UNREACH_NO_ROUTE;
-                }
+    mm->tx_so = so;
+    memcpy(mm->tx_buf + mm->tx_count * SO_MMSG_TX_MAX, m->m_data, m->m_len);
+    mm->tx_len[mm->tx_count] = m->m_len;
+    mm->tx_addr[mm->tx_count] = *addr;
+    mm->tx_count++;
+}
+#endif
 
-                DEBUG_MISC(" rx error, tx icmp6 ICMP_UNREACH:%i", code);
-                icmp6_send_error(so->so_m, ICMP6_UNREACH, code);
-                break;
-            default:
-                g_assert_not_reached();
-            }
-            m_free(m);
-        } else {
-            /*
-             * Hack: domain name lookup will be used the most for UDP,
-             * and since they'll only be used once there's no need
-             * for the 4 minute (or whatever) timeout... So we time them
-             * out much quicker (10 seconds  for now...)
-             */
-            if (so->so_expire) {
-                if (so->so_fport == htons(53))
-                    so->so_expire = curtime + SO_EXPIREFAST;
-                else
-                    so->so_expire = curtime + SO_EXPIRE;
-            }
+/*
+ * Send the datagrams queued by sosendto. A failure is reported to the guest
+ * like sendto failures are by udp_input, with the last datagram of the
+ * socket standing for it, and drops the rest of the batch: they would most
+ * likely fail the same way and only repeat the same error.
+ */
+void sosendto_flush(Slirp *slirp)
+{
+#ifdef SLIRP_HAVE_MMSG
+    struct so_mmsg *mm = &slirp->so_mmsg;
+    struct socket *so = mm->tx_so;
+    struct mmsghdr msgs[SO_MMSG_BATCH];
+    struct iovec iov[SO_MMSG_BATCH];
+    unsigned int i, done = 0;
+    bool retried = false;
+    int n;
 
-            /*
-             * If this packet was destined for CTL_ADDR,
-             * make it look like that's where it came from
-             */
-            saddr = addr;
-            sotranslate_in(so, &saddr);
-
-            /* Perform lazy guest IP address resolution if needed. */
-            if (so->so_state & SS_HOSTFWD) {
-                if (soassign_guest_addr_if_needed(so) < 0) {
-                    DEBUG_MISC(" guest address not available yet");
-                    switch (so->so_lfamily) {
-                    case AF_INET:
-                        icmp_send_error(so->so_m, ICMP_UNREACH,
-                                        ICMP_UNREACH_HOST, 0,
-                                        "guest address not available yet");
-                        break;
-                    case AF_INET6:
-                        icmp6_send_error(so->so_m, ICMP6_UNREACH,
-                                         ICMP6_UNREACH_ADDRESS);
-                        break;
-                    default:
-                        g_assert_not_reached();
-                    }
-                    m_free(m);
-                    return;
-                }
-            }
-            daddr = so->lhost.ss;
+    if (!mm->tx_count) {
+        return;
+    }
 
+    for (i = 0; i < mm->tx_count; i++) {
+        iov[i].iov_base = mm->tx_buf + i * SO_MMSG_TX_MAX;
+        iov[i].iov_len = mm->tx_len[i];
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_name = &mm->tx_addr[i];
+        msgs[i].msg_hdr.msg_namelen = sockaddr_size(&mm->tx_addr[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (done < mm->tx_count) {
+        n = sendmmsg(so->s, msgs + done, mm->tx_count - done, MSG_DONTWAIT);
+        if (n > 0) {
+            done += n;
+            retried = false;
+            continue;
+        }
+
+        /*
+         * An ICMP error about an earlier datagram fails the next send
+         * without sending it, on shared sockets that may be another flow's
+         */
+        if ((so->so_state & SS_UDPNAT) && !retried) {
+            retried = true;
+            continue;
+        }
+
+        DEBUG_MISC("udp tx errno = %d-%s, dropping %u datagrams", errno,
+                   strerror(errno), mm->tx_count - done);
+        if (so->so_m) {
             switch (so->so_ffamily) {
             case AF_INET:
-                udp_output(so, m, (struct sockaddr_in *)&saddr,
-                           (struct sockaddr_in *)&daddr, so->so_iptos);
+                icmp_send_error(so->so_m, ICMP_UNREACH, ICMP_UNREACH_NET, 0,
+                                strerror(errno));
                 break;
             case AF_INET6:
-                udp6_output(so, m, (struct sockaddr_in6 *)&saddr,
-                            (struct sockaddr_in6 *)&daddr);
+                icmp6_send_error(so->so_m, ICMP6_UNREACH,
+                                 ICMP6_UNREACH_NO_ROUTE);
                 break;
             default:
                 g_assert_not_reached();
             }
-        } /* rx error */
-    } /* if ping packet */
+        }
+        break;
+    }
+
+    mm->tx_count = 0;
+    mm->tx_so = NULL;
+#endif
 }
 
 /*
- * sendto() a socket
+ * Set the TTL, or hop limit, of the datagrams so sends to the host
  */
+void sosetttl(struct socket *so, int ttl)
+{
+    if (so->so_ttl == ttl) {
+        return;
+    }
+
+    /* What was queued goes out with the TTL it came with */
+    if (so->slirp->so_mmsg.tx_so == so) {
+        sosendto_flush(so->slirp);
+    }
+
+    switch (so->so_ffamily) {
+    case AF_INET:
+        setsockopt(so->s, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
+        break;
+    case AF_INET6:
+        setsockopt(so->s, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &ttl, sizeof(ttl));
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    so->so_ttl = ttl;
+}
+
+void so_mmsg_cleanup(Slirp *slirp)
+{
+    struct so_mmsg *mm = &slirp->so_mmsg;
+    int i;
+
+    sosendto_flush(slirp);
+    for (i = 0; i < SO_MMSG_BATCH; i++) {
+        m_free(mm->rx_m[i]);
+        mm->rx_m[i] = NULL;
+    }
+#ifdef SLIRP_HAVE_MMSG
+    if (mm->rx_overflow && !--so_mmsg_overflow_users) {
+        g_free(so_mmsg_overflow);
+        so_mmsg_overflow = NULL;
+    }
+#endif
+    g_free(mm->tx_buf);
+}
+
 int sosendto(struct socket *so, struct mbuf *m)
 {
     int ret;
@@ -748,11 +1393,23 @@ int sosendto(struct socket *so, struct mbuf *m)
         return -1;
     }
 
-    /* Don't care what port we get */
-    ret = sendto(so->s, m->m_data, m->m_len, 0, (struct sockaddr *)&addr,
-                 sockaddr_size(&addr));
-    if (ret < 0)
-        return -1;
+#ifdef SLIRP_HAVE_MMSG
+    if (m->m_len <= SO_MMSG_TX_MAX) {
+        sosendto_queue(so, &addr, m);
+    } else
+#endif
+    {
+        /* Datagrams of the socket still queued go first */
+        if (so->slirp->so_mmsg.tx_so == so) {
+            sosendto_flush(so->slirp);
+        }
+
+        /* Don't care what port we get */
+        ret = sendto(so->s, m->m_data, m->m_len, 0, (struct sockaddr *)&addr,
+                     sockaddr_size(&addr));
+        if (ret < 0)
+            return -1;
+    }
 
     /*
      * Kill the socket if there's no reply in 4 minutes,
@@ -833,7 +1490,7 @@ struct socket *tcpx_listen(Slirp *slirp,
      * SS_FACCEPTONCE sockets must time out.
      */
     if (flags & SS_FACCEPTONCE)
-        so->so_tcpcb->t_timer[TCPT_KEEP] = TCPTV_KEEP_INIT * 2;
+        tcp_timer_set(so->so_tcpcb, TCPT_KEEP, TCPTV_KEEP_INIT * 2);
 
     so->so_state &= SS_PERSISTENT_MASK;
     so->so_state |= (SS_FACCEPTCONN | flags);
@@ -865,8 +1522,10 @@ struct socket *tcpx_listen(Slirp *slirp,
     addrlen = sizeof(so->fhost);
     getsockname(s, &so->fhost.sa, &addrlen);
     sotranslate_accept(so);
+    sohash_insert(&slirp->tcb_hash, so);
 
     so->s = s;
+    sopoll_dirty(so);
     return so;
 }
 
@@ -1181,6 +1840,7 @@ unix2inet6_cont:
 
 void sodrop(struct socket *s, int num)
 {
+    tcp_sbuf_update(s->so_tcpcb, num, 0);
     if (sbdrop(&s->so_snd, num)) {
         s->slirp->cb->notify(s->slirp->opaque);
     }
@@ -1220,6 +1880,9 @@ int soassign_guest_addr_if_needed(struct socket *so)
                 return -1;
             }
             so->so_laddr6 = slirp->ndp_table.guest_in6_addr;
+            if (so->so_hash) {
+                sohash_insert(so->so_hash, so);
+            }
             ret = getnameinfo((const struct sockaddr *) &so->lhost.ss,
                               sizeof(so->lhost.ss), addrstr, sizeof(addrstr),
                               portstr, sizeof(portstr),
@@ -14,10 +14,37 @@
 
 #include "misc.h"
 #include "sbuf.h"
+#include "twheel.h"
 
 #define SO_EXPIRE 240000
 #define SO_EXPIREFAST 10000
 
+#ifdef __linux__
+#define SLIRP_HAVE_MMSG 1
+#endif
+
+/*
+ * UDP datagrams moved per recvmmsg/sendmmsg call. Datagrams from the host
+ * are received straight into mbufs, with the tails of those larger than
+ * an mbuf landing in SO_MMSG_OVERFLOW bytes of spill space per slot, shared
+ * by the Slirp instances of a thread; guest datagrams up to SO_MMSG_TX_MAX
+ * bytes are copied and queued.
+ */
+#define SO_MMSG_BATCH 16
+#define SO_MMSG_OVERFLOW 65536
+#define SO_MMSG_TX_MAX 2048
+
+struct so_mmsg {
+    struct mbuf *rx_m[SO_MMSG_BATCH]; /* receive mbufs kept for reuse */
+    bool rx_overflow; /* holds a reference on the thread's spill space */
+
+    struct socket *tx_so; /* socket the queued datagrams go out of */
+    unsigned int tx_count;
+    uint16_t tx_len[SO_MMSG_BATCH];
+    struct sockaddr_storage tx_addr[SO_MMSG_BATCH];
+    char *tx_buf; /* SO_MMSG_TX_MAX bytes per datagram */
+};
+
 /* Helps unify some in/in6 routines. */
 union in4or6_addr {
     struct in_addr addr4;
@@ -36,8 +63,31 @@ union slirp_sockaddr {
     struct sockaddr_in6 sin6;
 };
 
+/*
+ * Hash index of a socket list for solookup(), keyed by lhost, and fhost
+ * too when match_fhost is set. The list is still used for iteration.
+ */
+struct sohash {
+    struct socket **buckets;
+    unsigned int size; /* Number of buckets, a power of two */
+    unsigned int count; /* Number of indexed sockets */
+    bool match_fhost;
+};
+
+/*
+ * Index of the sockets reported to the application through update_poll,
+ * keyed by fd, for slirp_pollfd_ready().
+ */
+struct sofdindex {
+    struct socket **buckets;
+    unsigned int size; /* Number of buckets, a power of two */
+    unsigned int count;
+};
+
 struct socket {
     struct socket *so_next, *so_prev; /* For a linked list of sockets */
+    struct socket *so_hash_next; /* Next socket in the same hash bucket */
+    struct sohash *so_hash; /* Hash index so is in, NULL if none */
 
     int s; /* The actual socket */
     int s_aux; /* An auxiliary socket for miscellaneous use. Currently used to
@@ -46,6 +96,13 @@ struct socket {
 
     int pollfds_idx; /* GPollFD GArray index */
 
+    /* Incremental poll registration, see slirp_pollfds_update() */
+    int so_poll_fd; /* fd reported through update_poll, -1 if none */
+    int so_poll_events; /* SLIRP_POLL_* last reported for so_poll_fd */
+    struct socket *so_poll_fd_next; /* Next socket in the same fd bucket */
+    struct socket *so_poll_dirty_next; /* Poll events may have changed */
+    struct socket **so_poll_dirty_pprev; /* NULL if not on the dirty list */
+
     Slirp *slirp; /* managing slirp instance */
 
     /* XXX union these with not-yet-used sbuf params */
@@ -78,11 +135,10 @@ struct socket {
 
     struct tcpcb *so_tcpcb; /* pointer to TCP protocol control block */
     unsigned so_expire; /* When the socket will expire */
+    struct twheel_entry so_expire_timer; /* see soexpire_arm() */
 
     int so_queued; /* Number of packets queued from this socket */
-    int so_nqueued; /* Number of packets queued in a row
-                     * Used to determine when to "downgrade" a session
-                     * from fastq to batchq */
+    int so_ttl; /* TTL or hop limit set on the UDP socket, 0 if default */
 
     struct sbuf so_rcv; /* Receive buffer */
     struct sbuf so_snd; /* Send buffer */
@@ -116,6 +172,7 @@ struct socket {
 #define SS_INCOMING \
     0x2000 /* Connection was initiated by a host on the internet */
 #define SS_HOSTFWD_V6ONLY 0x4000 /* Only bind on v6 addresses */
+#define SS_UDPNAT 0x8000 /* UDP socket shared by NAT flows, see udp_nat.c */
 
 static inline int sockaddr_equal(const struct sockaddr_storage *a,
                                  const struct sockaddr_storage *b)
@@ -175,7 +232,19 @@ static inline void sockaddr_copy(struct sockaddr *dst, socklen_t dstlen, const s
     memcpy(dst, src, len);
 }
 
-struct socket *solookup(struct socket **, struct socket *,
+uint32_t sohash_addr(const struct sockaddr_storage *);
+void sohash_init(struct sohash *, bool match_fhost);
+void sohash_cleanup(struct sohash *);
+void sohash_insert(struct sohash *, struct socket *);
+void sohash_remove(struct socket *);
+void sofdindex_init(struct sofdindex *);
+void sofdindex_cleanup(struct sofdindex *);
+struct socket *sofdindex_lookup(struct sofdindex *, int fd);
+void soexpire_arm(struct socket *);
+void sopoll_dirty(struct socket *);
+void sopoll_unregister(struct socket *);
+void sopoll_update(struct socket *, int events);
+struct socket *solookup(struct socket **, struct socket *, struct sohash *,
                         struct sockaddr_storage *, struct sockaddr_storage *);
 struct socket *socreate(Slirp *, int);
 void sofree(struct socket *);
@@ -185,6 +254,9 @@ int sosendoob(struct socket *);
 int sowrite(struct socket *);
 void sorecvfrom(struct socket *);
 int sosendto(struct socket *, struct mbuf *);
+void sosendto_flush(Slirp *);
+void sosetttl(struct socket *, int ttl);
+void so_mmsg_cleanup(Slirp *);
 struct socket *tcp_listen(Slirp *, uint32_t, unsigned, uint32_t, unsigned, int);
 struct socket *tcpx_listen(Slirp *slirp,
                            const struct sockaddr *haddr, socklen_t haddrlen,
@@ -28,22 +28,123 @@
 
 #ifdef HAVE_VMSTATE
 
+/*
+ * The timers are migrated as the slow ticks they have left, and the idle
+ * and round trip times as the slow ticks they have lasted.
+ */
+static int slirp_tcp_pre_save(void *opaque)
+{
+    struct tcpcb *tp = opaque;
+    int i;
+
+    for (i = 0; i < TCPT_NTIMERS; i++) {
+        tp->t_timer[i] = tcp_timer_remaining(tp, i);
+    }
+    tp->t_idle = MIN(tcp_idle(tp) / TCPTV_TICK_MS, INT16_MAX);
+    if (tp->t_rtt) {
+        tp->t_rtt = MIN(tcp_rtt(tp) / TCPTV_TICK_MS + 1, INT16_MAX);
+    }
+
+    return 0;
+}
+
 static int slirp_tcp_post_load(void *opaque, int version)
 {
-    tcp_template((struct tcpcb *)opaque);
+    struct tcpcb *tp = opaque;
+    Slirp *slirp = tp->t_socket->slirp;
+    uint64_t now = slirp_now_ms(slirp);
+    int i;
+
+    tcp_template(tp);
+
+    for (i = 0; i < TCPT_NTIMERS; i++) {
+        tcp_timer_set(tp, i, MAX(tp->t_timer[i], 0) * TCPTV_TICK_MS);
+    }
+    tp->t_rcvtime = now - (uint64_t)MAX(tp->t_idle, 0) * TCPTV_TICK_MS;
+    if (tp->t_rtt) {
+        tp->t_rtstart = now - (uint64_t)MAX(tp->t_rtt - 1, 0) * TCPTV_TICK_MS;
+    }
 
     return 0;
 }
 
+/*
+ * The retransmit timeout and the round trip time estimates are kept in
+ * milliseconds, and migrated in slow ticks. The floor comes from the
+ * configuration of the destination.
+ */
+struct tcpcb_rtt_tmp {
+    struct tcpcb *parent;
+    int16_t rxtcur, srtt, rttvar;
+    uint16_t rttmin;
+};
+
+static int tcpcb_rtt_tmp_pre_save(void *opaque)
+{
+    struct tcpcb_rtt_tmp *tmp = opaque;
+    struct tcpcb *tp = tmp->parent;
+
+    tmp->rxtcur = MIN(DIV_ROUND_UP(tp->t_rxtcur, TCPTV_TICK_MS), INT16_MAX);
+    tmp->srtt = MIN(tp->t_srtt / TCPTV_TICK_MS, INT16_MAX);
+    tmp->rttvar = MIN(tp->t_rttvar / TCPTV_TICK_MS, INT16_MAX);
+    tmp->rttmin = DIV_ROUND_UP(tp->t_rttmin, TCPTV_TICK_MS);
+
+    return 0;
+}
+
+static int tcpcb_rxtcur_tmp_post_load(void *opaque, int version)
+{
+    struct tcpcb_rtt_tmp *tmp = opaque;
+
+    tmp->parent->t_rxtcur = MAX(tmp->rxtcur, 0) * TCPTV_TICK_MS;
+
+    return 0;
+}
+
+static int tcpcb_rtt_tmp_post_load(void *opaque, int version)
+{
+    struct tcpcb_rtt_tmp *tmp = opaque;
+    struct tcpcb *tp = tmp->parent;
+
+    tp->t_srtt = MAX(tmp->srtt, 0) * TCPTV_TICK_MS;
+    tp->t_rttvar = MAX(tmp->rttvar, 0) * TCPTV_TICK_MS;
+    tp->t_rttmin = tp->t_socket->slirp->tcp_rto_min;
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_slirp_tcp_rxtcur_tmp = {
+    .name = "slirp-tcp-rxtcur-tmp",
+    .version_id = 0,
+    .pre_save = tcpcb_rtt_tmp_pre_save,
+    .post_load = tcpcb_rxtcur_tmp_post_load,
+    .fields = (VMStateField[]){ VMSTATE_INT16(rxtcur, struct tcpcb_rtt_tmp),
+                                VMSTATE_END_OF_LIST() }
+};
+
+static const VMStateDescription vmstate_slirp_tcp_rtt_tmp = {
+    .name = "slirp-tcp-rtt-tmp",
+    .version_id = 0,
+    .pre_save = tcpcb_rtt_tmp_pre_save,
+    .post_load = tcpcb_rtt_tmp_post_load,
+    .fields = (VMStateField[]){ VMSTATE_INT16(srtt, struct tcpcb_rtt_tmp),
+                                VMSTATE_INT16(rttvar, struct tcpcb_rtt_tmp),
+                                VMSTATE_UINT16(rttmin, struct tcpcb_rtt_tmp),
+                                VMSTATE_END_OF_LIST() }
+};
+
 static const VMStateDescription vmstate_slirp_tcp = {
     .name = "slirp-tcp",
     .version_id = 0,
+    .pre_save = slirp_tcp_pre_save,
     .post_load = slirp_tcp_post_load,
     .fields = (VMStateField[]){ VMSTATE_INT16(t_state, struct tcpcb),
                                 VMSTATE_INT16_ARRAY(t_timer, struct tcpcb,
                                                     TCPT_NTIMERS),
                                 VMSTATE_INT16(t_rxtshift, struct tcpcb),
-                                VMSTATE_INT16(t_rxtcur, struct tcpcb),
+                                VMSTATE_WITH_TMP(struct tcpcb,
+                                                 struct tcpcb_rtt_tmp,
+                                                 vmstate_slirp_tcp_rxtcur_tmp),
                                 VMSTATE_INT16(t_dupacks, struct tcpcb),
                                 VMSTATE_UINT16(t_maxseg, struct tcpcb),
                                 VMSTATE_UINT8(t_force, struct tcpcb),
@@ -66,9 +167,9 @@ static const VMStateDescription vmstate_slirp_tcp = {
                                 VMSTATE_INT16(t_idle, struct tcpcb),
                                 VMSTATE_INT16(t_rtt, struct tcpcb),
                                 VMSTATE_UINT32(t_rtseq, struct tcpcb),
-                                VMSTATE_INT16(t_srtt, struct tcpcb),
-                                VMSTATE_INT16(t_rttvar, struct tcpcb),
-                                VMSTATE_UINT16(t_rttmin, struct tcpcb),
+                                VMSTATE_WITH_TMP(struct tcpcb,
+                                                 struct tcpcb_rtt_tmp,
+                                                 vmstate_slirp_tcp_rtt_tmp),
                                 VMSTATE_UINT32(max_sndwnd, struct tcpcb),
                                 VMSTATE_UINT8(t_oobflags, struct tcpcb),
                                 VMSTATE_UINT8(t_iobc, struct tcpcb),
@@ -107,8 +208,13 @@ static int sbuf_tmp_post_load(void *opaque, int version)
     uint32_t requested_len = tmp->parent->sb_datalen;
 
     /* Allocate the buffer space used by the field after the tmp */
-    sbreserve(tmp->parent, tmp->parent->sb_datalen);
+    sballoc(tmp->parent, requested_len);
+    /* The limit is not migrated, start over from the initial one */
+    sbreserve(tmp->parent, MAX(requested_len, TCP_SNDSPACE));
 
+    if (!requested_len && !tmp->woff && !tmp->roff) {
+        return 0;
+    }
     if (tmp->woff >= requested_len || tmp->roff >= requested_len) {
         g_critical("invalid sbuf offsets r/w=%u/%u len=%u", tmp->roff,
                    tmp->woff, requested_len);
@@ -355,6 +461,7 @@ int slirp_state_load(Slirp *slirp, int version_id, SlirpReadCb read_cb,
         if (ret < 0) {
             return ret;
         }
+        sohash_insert(&slirp->tcb_hash, so);
 
         if ((so->so_faddr.s_addr & slirp->vnetwork_mask.s_addr) !=
             slirp->vnetwork_addr.s_addr) {
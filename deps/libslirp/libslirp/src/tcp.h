@@ -43,6 +43,9 @@ typedef uint32_t tcp_seq;
 
 #define TCP_SNDSPACE 1024 * 128
 #define TCP_RCVSPACE 1024 * 128
+#define TCP_SBUF_MAX_DEFAULT (4 * 1024 * 1024) /* autotuning ceiling */
+#define TCP_SBUF_TUNE_MIN_MS 5 /* shortest autotuning interval */
+#define TCP_SBUF_IDLE_MS 1000 /* idle time before shrinking the buffers */
 #define TCP_MAXSEG_MAX 32768
 
 /*
@@ -41,7 +41,7 @@
 
 #define TCPREXMTTHRESH 3
 
-#define TCP_PAWS_IDLE (24 * 24 * 60 * 60 * PR_SLOWHZ)
+#define TCP_PAWS_IDLE (24 * 24 * 60 * 60 * 1000)
 
 /* for modulo comparisons of timestamps */
 #define TSTMP_LT(a, b) ((int)((a) - (b)) < 0)
@@ -61,7 +61,7 @@
     {                                                                  \
         if ((ti)->ti_seq == (tp)->rcv_nxt && tcpfrag_list_empty(tp) && \
             (tp)->t_state == TCPS_ESTABLISHED) {                       \
-            tp->t_flags |= TF_DELACK;                                  \
+            tcp_delack(tp);                                            \
             (tp)->rcv_nxt += (ti)->ti_len;                             \
             flags = (ti)->ti_flags & TH_FIN;                           \
             if (so->so_emu) {                                          \
@@ -383,7 +383,8 @@ findso:
         g_assert_not_reached();
     }
 
-    so = solookup(&slirp->tcp_last_so, &slirp->tcb, &lhost, &fhost);
+    so = solookup(&slirp->tcp_last_so, &slirp->tcb, &slirp->tcb_hash, &lhost,
+                  &fhost);
 
     /*
      * If the state is CLOSED (i.e., TCB does not exist) then
@@ -428,6 +429,7 @@ findso:
 
         so->lhost.ss = lhost;
         so->fhost.ss = fhost;
+        sohash_insert(&slirp->tcb_hash, so);
 
         so->so_iptos = tcp_tos(so);
         if (so->so_iptos == 0) {
@@ -454,6 +456,9 @@ findso:
     if (so->so_state & SS_ISFCONNECTING)
         goto drop;
 
+    /* The segment may change what so has to be polled for */
+    sopoll_dirty(so);
+
     tp = sototcpcb(so);
 
     /* XXX Should never fail */
@@ -468,11 +473,11 @@ findso:
      * Segment received on connection.
      * Reset idle time and keep-alive timer.
      */
-    tp->t_idle = 0;
+    tp->t_rcvtime = slirp_now_ms(slirp);
     if (slirp_do_keepalive)
-        tp->t_timer[TCPT_KEEP] = TCPTV_KEEPINTVL;
+        tcp_timer_set(tp, TCPT_KEEP, TCPTV_KEEPINTVL);
     else
-        tp->t_timer[TCPT_KEEP] = TCPTV_KEEP_IDLE;
+        tcp_timer_set(tp, TCPT_KEEP, TCPTV_KEEP_IDLE);
 
     /*
      * Process options if not in LISTEN state,
@@ -511,7 +516,7 @@ findso:
                  * this is a pure ack for outstanding data.
                  */
                 if (tp->t_rtt && SEQ_GT(ti->ti_ack, tp->t_rtseq))
-                    tcp_xmit_timer(tp, tp->t_rtt);
+                    tcp_xmit_timer(tp, tcp_rtt(tp));
                 acked = ti->ti_ack - tp->snd_una;
                 sodrop(so, acked);
                 tp->snd_una = ti->ti_ack;
@@ -527,9 +532,9 @@ findso:
                  * decide between more output or persist.
                  */
                 if (tp->snd_una == tp->snd_max)
-                    tp->t_timer[TCPT_REXMT] = 0;
+                    tcp_timer_set(tp, TCPT_REXMT, 0);
                 else if (tp->t_timer[TCPT_PERSIST] == 0)
-                    tp->t_timer[TCPT_REXMT] = tp->t_rxtcur;
+                    tcp_timer_set(tp, TCPT_REXMT, tp->t_rxtcur);
 
                 /*
                  * This is called because sowwakeup might have
@@ -537,7 +542,7 @@ findso:
                  * we don't need this.. XXX???
                  */
                 if (so->so_snd.sb_cc)
-                    tcp_output(tp);
+                    tcp_output_batched(tp);
 
                 return;
             }
@@ -567,7 +572,7 @@ findso:
              * TCP throughput.  See RFC 2581.
              */
             tp->t_flags |= TF_ACKNOW;
-            tcp_output(tp);
+            tcp_output_batched(tp);
             return;
         }
     } /* header prediction */
@@ -708,7 +713,7 @@ findso:
              */
             so->so_m = m;
             so->so_ti = ti;
-            tp->t_timer[TCPT_KEEP] = TCPTV_KEEP_INIT;
+            tcp_timer_set(tp, TCPT_KEEP, TCPTV_KEEP_INIT);
             tp->t_state = TCPS_SYN_RECEIVED;
             /*
              * Initialize receive sequence numbers now so that we can send a
@@ -734,6 +739,7 @@ findso:
         if (optp)
             tcp_dooptions(tp, (uint8_t *)optp, optlen, ti);
 
+        tcp_iss_advance(slirp);
         if (iss)
             tp->iss = iss;
         else
@@ -744,7 +750,7 @@ findso:
         tcp_rcvseqinit(tp);
         tp->t_flags |= TF_ACKNOW;
         tp->t_state = TCPS_SYN_RECEIVED;
-        tp->t_timer[TCPT_KEEP] = TCPTV_KEEP_INIT;
+        tcp_timer_set(tp, TCPT_KEEP, TCPTV_KEEP_INIT);
         goto trimthenstep6;
     } /* case TCPS_LISTEN */
 
@@ -780,7 +786,7 @@ findso:
                 tp->snd_nxt = tp->snd_una;
         }
 
-        tp->t_timer[TCPT_REXMT] = 0;
+        tcp_timer_set(tp, TCPT_REXMT, 0);
         tp->irs = ti->ti_seq;
         tcp_rcvseqinit(tp);
         tp->t_flags |= TF_ACKNOW;
@@ -794,7 +800,7 @@ findso:
              * use its rtt as our initial srtt & rtt var.
              */
             if (tp->t_rtt)
-                tcp_xmit_timer(tp, tp->t_rtt);
+                tcp_xmit_timer(tp, tcp_rtt(tp));
         } else
             tp->t_state = TCPS_SYN_RECEIVED;
 
@@ -1049,7 +1055,7 @@ findso:
                     if (win < 2)
                         win = 2;
                     tp->snd_ssthresh = win * tp->t_maxseg;
-                    tp->t_timer[TCPT_REXMT] = 0;
+                    tcp_timer_set(tp, TCPT_REXMT, 0);
                     tp->t_rtt = 0;
                     tp->snd_nxt = ti->ti_ack;
                     tp->snd_cwnd = tp->t_maxseg;
@@ -1089,7 +1095,7 @@ findso:
          * Recompute the initial retransmit timer.
          */
         if (tp->t_rtt && SEQ_GT(ti->ti_ack, tp->t_rtseq))
-            tcp_xmit_timer(tp, tp->t_rtt);
+            tcp_xmit_timer(tp, tcp_rtt(tp));
 
         /*
          * If all outstanding data is acked, stop retransmit
@@ -1098,10 +1104,10 @@ findso:
          * timer, using current (possibly backed-off) value.
          */
         if (ti->ti_ack == tp->snd_max) {
-            tp->t_timer[TCPT_REXMT] = 0;
+            tcp_timer_set(tp, TCPT_REXMT, 0);
             needoutput = 1;
         } else if (tp->t_timer[TCPT_PERSIST] == 0)
-            tp->t_timer[TCPT_REXMT] = tp->t_rxtcur;
+            tcp_timer_set(tp, TCPT_REXMT, tp->t_rxtcur);
         /*
          * When new data is acked, open the congestion window.
          * If the window gives us less than ssthresh packets
@@ -1146,7 +1152,7 @@ findso:
                  * we'll hang forever.
                  */
                 if (so->so_state & SS_FCANTRCVMORE) {
-                    tp->t_timer[TCPT_2MSL] = TCP_MAXIDLE;
+                    tcp_timer_set(tp, TCPT_2MSL, TCP_MAXIDLE);
                 }
                 tp->t_state = TCPS_FIN_WAIT_2;
             }
@@ -1162,7 +1168,7 @@ findso:
             if (ourfinisacked) {
                 tp->t_state = TCPS_TIME_WAIT;
                 tcp_canceltimers(tp);
-                tp->t_timer[TCPT_2MSL] = 2 * TCPTV_MSL;
+                tcp_timer_set(tp, TCPT_2MSL, 2 * TCPTV_MSL);
             }
             break;
 
@@ -1185,7 +1191,7 @@ findso:
          * it and restart the finack timer.
          */
         case TCPS_TIME_WAIT:
-            tp->t_timer[TCPT_2MSL] = 2 * TCPTV_MSL;
+            tcp_timer_set(tp, TCPT_2MSL, 2 * TCPTV_MSL);
             goto dropafterack;
         }
     } /* switch(tp->t_state) */
@@ -1219,7 +1225,7 @@ step6:
          * soreceive.  It's hard to imagine someone
          * actually wanting to send this much urgent data.
          */
-        if (ti->ti_urp + so->so_rcv.sb_cc > so->so_rcv.sb_datalen) {
+        if (ti->ti_urp + so->so_rcv.sb_cc > so->so_rcv.sb_hiwat) {
             ti->ti_urp = 0;
             tiflags &= ~TH_URG;
             goto dodata;
@@ -1329,14 +1335,14 @@ dodata:
         case TCPS_FIN_WAIT_2:
             tp->t_state = TCPS_TIME_WAIT;
             tcp_canceltimers(tp);
-            tp->t_timer[TCPT_2MSL] = 2 * TCPTV_MSL;
+            tcp_timer_set(tp, TCPT_2MSL, 2 * TCPTV_MSL);
             break;
 
         /*
          * In TIME_WAIT state restart the 2 MSL time_wait timer.
          */
         case TCPS_TIME_WAIT:
-            tp->t_timer[TCPT_2MSL] = 2 * TCPTV_MSL;
+            tcp_timer_set(tp, TCPT_2MSL, 2 * TCPTV_MSL);
             break;
         }
     }
@@ -1345,7 +1351,7 @@ dodata:
      * Return any desired output.
      */
     if (needoutput || (tp->t_flags & TF_ACKNOW)) {
-        tcp_output(tp);
+        tcp_output_batched(tp);
     }
     return;
 
@@ -1358,7 +1364,7 @@ dropafterack:
         goto drop;
     m_free(m);
     tp->t_flags |= TF_ACKNOW;
-    tcp_output(tp);
+    tcp_output_batched(tp);
     return;
 
 dropwithreset:
@@ -1425,7 +1431,7 @@ static void tcp_dooptions(struct tcpcb *tp, uint8_t *cp, int cnt,
 
 static void tcp_xmit_timer(register struct tcpcb *tp, int rtt)
 {
-    register short delta;
+    register int delta;
 
     DEBUG_CALL("tcp_xmit_timer");
     DEBUG_ARG("tp = %p", tp);
@@ -1437,9 +1443,9 @@ static void tcp_xmit_timer(register struct tcpcb *tp, int rtt)
          * binary point (i.e., scaled by 8).  The following magic
          * is equivalent to the smoothing algorithm in rfc793 with
          * an alpha of .875 (srtt = rtt/8 + srtt*7/8 in fixed
-         * point).  Adjust rtt to origin 0.
+         * point).
          */
-        delta = rtt - 1 - (tp->t_srtt >> TCP_RTT_SHIFT);
+        delta = rtt - (tp->t_srtt >> TCP_RTT_SHIFT);
         if ((tp->t_srtt += delta) <= 0)
             tp->t_srtt = 1;
         /*
@@ -1470,18 +1476,11 @@ static void tcp_xmit_timer(register struct tcpcb *tp, int rtt)
     tp->t_rxtshift = 0;
 
     /*
-     * the retransmit should happen at rtt + 4 * rttvar.
-     * Because of the way we do the smoothing, srtt and rttvar
-     * will each average +1/2 tick of bias.  When we compute
-     * the retransmit timer, we want 1/2 tick of rounding and
-     * 1 extra tick because of +-1/2 tick uncertainty in the
-     * firing of the timer.  The bias will give us exactly the
-     * 1.5 tick we need.  But, because the bias is
-     * statistical, we have to test that we don't drop below
-     * the minimum feasible timer (which is 2 ticks).
+     * the retransmit should happen at rtt + 4 * rttvar,
+     * but no sooner than the configured floor.
      */
-    TCPT_RANGESET(tp->t_rxtcur, TCP_REXMTVAL(tp), (short)tp->t_rttmin,
-                  TCPTV_REXMTMAX); /* XXX */
+    TCPT_RANGESET(tp->t_rxtcur, TCP_REXMTVAL(tp), (int)tp->t_rttmin,
+                  TCPTV_REXMTMAX);
 
     /*
      * We received an ack for a packet that wasn't retransmitted;
@@ -1539,12 +1538,8 @@ int tcp_mss(struct tcpcb *tp, unsigned offer)
 
     tp->snd_cwnd = mss;
 
-    sbreserve(&so->so_snd,
-              TCP_SNDSPACE +
-                  ((TCP_SNDSPACE % mss) ? (mss - (TCP_SNDSPACE % mss)) : 0));
-    sbreserve(&so->so_rcv,
-              TCP_RCVSPACE +
-                  ((TCP_RCVSPACE % mss) ? (mss - (TCP_RCVSPACE % mss)) : 0));
+    sbreserve(&so->so_snd, tcp_sbuf_initial(so->slirp, TCP_SNDSPACE, mss));
+    sbreserve(&so->so_rcv, tcp_sbuf_initial(so->slirp, TCP_RCVSPACE, mss));
 
     DEBUG_MISC(" returning mss = %d", mss);
 
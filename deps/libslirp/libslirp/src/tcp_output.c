@@ -74,7 +74,7 @@ int tcp_output(struct tcpcb *tp)
      * to send, then transmit; otherwise, investigate further.
      */
     idle = (tp->snd_max == tp->snd_una);
-    if (idle && tp->t_idle >= tp->t_rxtcur)
+    if (idle && tcp_idle(tp) >= (uint32_t)tp->t_rxtcur)
         /*
          * We have been idle for "a while" and no acks are
          * expected to clock out any data we send --
@@ -118,7 +118,7 @@ again:
                 flags &= ~TH_FIN;
             win = 1;
         } else {
-            tp->t_timer[TCPT_PERSIST] = 0;
+            tcp_timer_set(tp, TCPT_PERSIST, 0);
             tp->t_rxtshift = 0;
         }
     }
@@ -138,7 +138,7 @@ again:
          */
         len = 0;
         if (win == 0) {
-            tp->t_timer[TCPT_REXMT] = 0;
+            tcp_timer_set(tp, TCPT_REXMT, 0);
             tp->snd_nxt = tp->snd_una;
         }
     }
@@ -194,7 +194,7 @@ again:
 
         if (adv >= (long)(2 * tp->t_maxseg))
             goto send;
-        if (2 * adv >= (long)so->so_rcv.sb_datalen)
+        if (2 * adv >= (long)so->so_rcv.sb_hiwat)
             goto send;
     }
 
@@ -358,7 +358,7 @@ send:
      * Calculate receive window.  Don't shrink window,
      * but avoid silly window syndrome.
      */
-    if (win < (long)(so->so_rcv.sb_datalen / 4) && win < (long)tp->t_maxseg)
+    if (win < (long)(so->so_rcv.sb_hiwat / 4) && win < (long)tp->t_maxseg)
         win = 0;
     if (win > (long)TCP_MAXWIN << tp->rcv_scale)
         win = (long)TCP_MAXWIN << tp->rcv_scale;
@@ -413,6 +413,7 @@ send:
              */
             if (tp->t_rtt == 0) {
                 tp->t_rtt = 1;
+                tp->t_rtstart = slirp_now_ms(so->slirp);
                 tp->t_rtseq = startseq;
             }
         }
@@ -426,9 +427,9 @@ send:
          * of retransmit time.
          */
         if (tp->t_timer[TCPT_REXMT] == 0 && tp->snd_nxt != tp->snd_una) {
-            tp->t_timer[TCPT_REXMT] = tp->t_rxtcur;
+            tcp_timer_set(tp, TCPT_REXMT, tp->t_rxtcur);
             if (tp->t_timer[TCPT_PERSIST]) {
-                tp->t_timer[TCPT_PERSIST] = 0;
+                tcp_timer_set(tp, TCPT_PERSIST, 0);
                 tp->t_rxtshift = 0;
             }
         }
@@ -502,15 +503,71 @@ send:
     return (0);
 }
 
+/*
+ * tcp_output() for segments received from the guest. While a batch of them
+ * is being processed, see slirp_input_batch_begin(), the output is only noted, and
+ * done once for the whole batch by tcp_output_flush(): the guest gets one ACK
+ * for all of its segments, along with any data they opened the window for.
+ */
+void tcp_output_batched(struct tcpcb *tp)
+{
+    Slirp *slirp = tp->t_socket->slirp;
+
+    if (!slirp->input_batch) {
+        tcp_output(tp);
+        return;
+    }
+
+    if (tp->t_output_pprev) {
+        return;
+    }
+
+    tp->t_output_next = slirp->tcp_output_pending;
+    if (tp->t_output_next) {
+        tp->t_output_next->t_output_pprev = &tp->t_output_next;
+    }
+    slirp->tcp_output_pending = tp;
+    tp->t_output_pprev = &slirp->tcp_output_pending;
+}
+
+/*
+ * Forget the output pending for tp, which is going away
+ */
+void tcp_output_cancel(struct tcpcb *tp)
+{
+    if (!tp->t_output_pprev) {
+        return;
+    }
+
+    *tp->t_output_pprev = tp->t_output_next;
+    if (tp->t_output_next) {
+        tp->t_output_next->t_output_pprev = tp->t_output_pprev;
+    }
+    tp->t_output_next = NULL;
+    tp->t_output_pprev = NULL;
+}
+
+void tcp_output_flush(Slirp *slirp)
+{
+    struct tcpcb *tp;
+
+    while ((tp = slirp->tcp_output_pending) != NULL) {
+        tcp_output_cancel(tp);
+        tcp_output(tp);
+    }
+}
+
 void tcp_setpersist(struct tcpcb *tp)
 {
     int t = ((tp->t_srtt >> 2) + tp->t_rttvar) >> 1;
+    int persist;
 
     /*
      * Start/restart persistence timer.
      */
-    TCPT_RANGESET(tp->t_timer[TCPT_PERSIST], t * tcp_backoff[tp->t_rxtshift],
-                  TCPTV_PERSMIN, TCPTV_PERSMAX);
+    TCPT_RANGESET(persist, t * tcp_backoff[tp->t_rxtshift], TCPTV_PERSMIN,
+                  TCPTV_PERSMAX);
+    tcp_timer_set(tp, TCPT_PERSIST, persist);
     if (tp->t_rxtshift < TCP_MAXRXTSHIFT)
         tp->t_rxtshift++;
 }
@@ -48,7 +48,9 @@
 void tcp_init(Slirp *slirp)
 {
     slirp->tcp_iss = 1; /* wrong */
+    slirp->tcp_iss_time = 0; /* set on first use */
     slirp->tcb.so_next = slirp->tcb.so_prev = &slirp->tcb;
+    sohash_init(&slirp->tcb_hash, true);
     slirp->tcp_last_so = &slirp->tcb;
 }
 
@@ -57,6 +59,20 @@ void tcp_cleanup(Slirp *slirp)
     while (slirp->tcb.so_next != &slirp->tcb) {
         tcp_close(sototcpcb(slirp->tcb.so_next));
     }
+    sohash_cleanup(&slirp->tcb_hash);
+}
+
+/*
+ * Move tcp_iss along by TCP_ISSINCR a second since it was last used.
+ */
+void tcp_iss_advance(Slirp *slirp)
+{
+    uint64_t now = slirp_now_ms(slirp);
+
+    if (slirp->tcp_iss_time) {
+        slirp->tcp_iss += (now - slirp->tcp_iss_time) * TCP_ISSINCR / 1000;
+    }
+    slirp->tcp_iss_time = now;
 }
 
 /*
@@ -267,19 +283,19 @@ struct tcpcb *tcp_newtcpcb(struct socket *so)
 
     tp->t_flags = TCP_DO_RFC1323 ? (TF_REQ_SCALE | TF_REQ_TSTMP) : 0;
     tp->t_socket = so;
+    tcp_timer_init(tp);
 
     /*
      * Init srtt to TCPTV_SRTTBASE (0), so we can tell that we have no
-     * rtt estimate.  Set rttvar so that srtt + 2 * rttvar gives
-     * reasonable initial retransmit time.
+     * rtt estimate.  Set rttvar so that the retransmit timeout is
+     * TCPTV_RTOINIT until the first measurement.
      */
     tp->t_srtt = TCPTV_SRTTBASE;
-    tp->t_rttvar = TCPTV_SRTTDFLT << 2;
-    tp->t_rttmin = TCPTV_MIN;
+    tp->t_rttvar = TCPTV_RTOINIT;
+    tp->t_rttmin = so->slirp->tcp_rto_min;
 
-    TCPT_RANGESET(tp->t_rxtcur,
-                  ((TCPTV_SRTTBASE >> 2) + (TCPTV_SRTTDFLT << 2)) >> 1,
-                  TCPTV_MIN, TCPTV_REXMTMAX);
+    TCPT_RANGESET(tp->t_rxtcur, TCP_REXMTVAL(tp), (int)tp->t_rttmin,
+                  TCPTV_REXMTMAX);
 
     tp->snd_cwnd = TCP_MAXWIN << TCP_MAX_WINSHIFT;
     tp->snd_ssthresh = TCP_MAXWIN << TCP_MAX_WINSHIFT;
@@ -332,12 +348,14 @@ struct tcpcb *tcp_close(struct tcpcb *tp)
         slirp_remque(tcpiphdr2qlink(tcpiphdr_prev(t)));
         m_free(m);
     }
+    tcp_timer_cleanup(tp);
+    tcp_output_cancel(tp);
     g_free(tp);
     so->so_tcpcb = NULL;
     /* clobber input socket cache if we're closing the cached connection */
     if (so == slirp->tcp_last_so)
         slirp->tcp_last_so = &slirp->tcb;
-    so->slirp->cb->unregister_poll_fd(so->s, so->slirp->opaque);
+    sopoll_unregister(so);
     closesocket(so->s);
     sbfree(&so->so_rcv);
     sbfree(&so->so_snd);
@@ -544,11 +562,12 @@ void tcp_connect(struct socket *inso)
 
     so->fhost.ss = addr;
     sotranslate_accept(so);
+    sohash_insert(&slirp->tcb_hash, so);
 
     /* Close the accept() socket, set right state */
     if (inso->so_state & SS_FACCEPTONCE) {
         /* If we only accept once, close the accept() socket */
-        so->slirp->cb->unregister_poll_fd(so->s, so->slirp->opaque);
+        sopoll_unregister(so);
         closesocket(so->s);
 
         /* Don't select it yet, even though we have an FD */
@@ -564,11 +583,13 @@ void tcp_connect(struct socket *inso)
     tcp_template(tp);
 
     tp->t_state = TCPS_SYN_SENT;
-    tp->t_timer[TCPT_KEEP] = TCPTV_KEEP_INIT;
+    tcp_timer_set(tp, TCPT_KEEP, TCPTV_KEEP_INIT);
+    tcp_iss_advance(slirp);
     tp->iss = slirp->tcp_iss;
     slirp->tcp_iss += TCP_ISSINCR / 2;
     tcp_sendseqinit(tp);
     tcp_output(tp);
+    sopoll_dirty(so);
 }
 
 /*
@@ -580,6 +601,89 @@ void tcp_attach(struct socket *so)
     slirp_insque(so, &so->slirp->tcb);
 }
 
+/*
+ * Initial size of a socket buffer, rounded up to whole segments
+ */
+uint32_t tcp_sbuf_initial(Slirp *slirp, uint32_t space, int mss)
+{
+    space = MIN(space, slirp->tcp_sbuf_max);
+    if (space % mss) {
+        space += mss - space % mss;
+    }
+    return space;
+}
+
+static bool tcp_sbuf_tune(struct sbuf *sb, uint32_t bytes, uint32_t max)
+{
+    uint32_t want = MIN((uint64_t)bytes * 2, max);
+
+    if (want <= sb->sb_hiwat) {
+        return false;
+    }
+    sbreserve(sb, want);
+    return true;
+}
+
+/*
+ * Socket buffer autotuning. The buffers start at TCP_SNDSPACE/TCP_RCVSPACE
+ * and are allocated lazily; over every round trip, each is allowed to hold
+ * twice what went through it, up to slirp->tcp_sbuf_max, so that a large
+ * bandwidth-delay product does not get throttled by the buffering. acked
+ * is what the guest acknowledged out of so_snd, rcvd what it sent into
+ * so_rcv. After TCP_SBUF_IDLE_MS without traffic, tcp_sbuf_idle shrinks
+ * them back.
+ */
+void tcp_sbuf_update(struct tcpcb *tp, uint32_t acked, uint32_t rcvd)
+{
+    struct socket *so = tp->t_socket;
+    Slirp *slirp = so->slirp;
+    uint64_t now = slirp_now_ms(slirp);
+    uint32_t interval = MAX(tp->t_srtt >> TCP_RTT_SHIFT, TCP_SBUF_TUNE_MIN_MS);
+    bool changed;
+
+    tp->t_sbuf_acked += acked;
+    tp->t_sbuf_rcvd += rcvd;
+    if (now - tp->t_sbuf_start < interval) {
+        return;
+    }
+
+    changed = tcp_sbuf_tune(&so->so_snd, tp->t_sbuf_acked, slirp->tcp_sbuf_max);
+    changed |= tcp_sbuf_tune(&so->so_rcv, tp->t_sbuf_rcvd, slirp->tcp_sbuf_max);
+    if (changed) {
+        sopoll_dirty(so);
+    }
+
+    tp->t_sbuf_start = now;
+    tp->t_sbuf_acked = 0;
+    tp->t_sbuf_rcvd = 0;
+    slirp_timer_arm(slirp, &tp->t_sbuf_idle_entry, TCP_SBUF_IDLE_MS);
+}
+
+/*
+ * The connection went idle: take the buffers back to their initial size,
+ * and free them if they are empty. Data still buffered, e.g. for a host
+ * which does not read, keeps them around until the next try.
+ */
+void tcp_sbuf_idle(struct tcpcb *tp)
+{
+    struct socket *so = tp->t_socket;
+    Slirp *slirp = so->slirp;
+
+    sbreserve(&so->so_snd,
+              MIN(so->so_snd.sb_hiwat,
+                  tcp_sbuf_initial(slirp, TCP_SNDSPACE, tp->t_maxseg)));
+    sbreserve(&so->so_rcv,
+              MIN(so->so_rcv.sb_hiwat,
+                  tcp_sbuf_initial(slirp, TCP_RCVSPACE, tp->t_maxseg)));
+    sbtrim(&so->so_snd);
+    sbtrim(&so->so_rcv);
+    sopoll_dirty(so);
+
+    if (so->so_snd.sb_datalen || so->so_rcv.sb_datalen) {
+        slirp_timer_arm(slirp, &tp->t_sbuf_idle_entry, TCP_SBUF_IDLE_MS);
+    }
+}
+
 /*
  * Set the socket's type of service field
  */
@@ -1016,6 +1120,7 @@ int tcp_ctl(struct socket *so)
             }
         }
     }
+    sbgrow(sb, SB_MIN_ALLOC);
     sb->sb_cc = slirp_fmt(sb->sb_wptr, sb->sb_datalen - (sb->sb_wptr - sb->sb_data),
                           "Error: No application configured.\r\n");
     sb->sb_wptr += sb->sb_cc;
@@ -36,66 +36,131 @@
 static struct tcpcb *tcp_timers(register struct tcpcb *tp, int timer);
 
 /*
- * Fast timeout routine for processing delayed acks
+ * Each timer of a tcpcb has an entry in the timing wheel of the Slirp
+ * instance, so only the timers which are due get processed.
+ * t_timer[] keeps the interval a timer was armed with, in slow ticks
+ * rounded up, 0 when it is off.
  */
-void tcp_fasttimo(Slirp *slirp)
+static void tcp_timer_expired(struct twheel_entry *entry)
 {
-    register struct socket *so;
-    register struct tcpcb *tp;
-
-    DEBUG_CALL("tcp_fasttimo");
-
-    so = slirp->tcb.so_next;
-    if (so)
-        for (; so != &slirp->tcb; so = so->so_next)
-            if ((tp = (struct tcpcb *)so->so_tcpcb) &&
-                (tp->t_flags & TF_DELACK)) {
-                tp->t_flags &= ~TF_DELACK;
-                tp->t_flags |= TF_ACKNOW;
-                tcp_output(tp);
-            }
+    struct tcpcb *tp = entry->opaque;
+    int timer = entry - tp->t_timer_entry;
+
+    tp->t_timer[timer] = 0;
+    tcp_timers(tp, timer);
 }
 
 /*
- * Tcp protocol timeout routine called every 500 ms.
- * Updates the timers in all active tcb's and
- * causes finite state machine actions if timers expire.
+ * Delayed ack timer went off.
  */
-void tcp_slowtimo(Slirp *slirp)
+static void tcp_delack_expired(struct twheel_entry *entry)
 {
-    register struct socket *ip, *ipnxt;
-    register struct tcpcb *tp;
-    register int i;
+    struct tcpcb *tp = entry->opaque;
 
-    DEBUG_CALL("tcp_slowtimo");
+    DEBUG_CALL("tcp_delack_expired");
 
-    /*
-     * Search through tcb's and update active timers.
-     */
-    ip = slirp->tcb.so_next;
-    if (ip == NULL) {
-        return;
+    if (tp->t_flags & TF_DELACK) {
+        tp->t_flags &= ~TF_DELACK;
+        tp->t_flags |= TF_ACKNOW;
+        tcp_output(tp);
     }
-    for (; ip != &slirp->tcb; ip = ipnxt) {
-        ipnxt = ip->so_next;
-        tp = sototcpcb(ip);
-        if (tp == NULL) {
-            continue;
-        }
-        for (i = 0; i < TCPT_NTIMERS; i++) {
-            if (tp->t_timer[i] && --tp->t_timer[i] == 0) {
-                tcp_timers(tp, i);
-                if (ipnxt->so_prev != ip)
-                    goto tpgone;
-            }
-        }
-        tp->t_idle++;
-        if (tp->t_rtt)
-            tp->t_rtt++;
-    tpgone:;
+}
+
+/*
+ * The connection has been idle for a while, shrink its socket buffers.
+ */
+static void tcp_sbuf_idle_expired(struct twheel_entry *entry)
+{
+    tcp_sbuf_idle(entry->opaque);
+}
+
+void tcp_timer_init(struct tcpcb *tp)
+{
+    int i;
+
+    for (i = 0; i < TCPT_NTIMERS; i++) {
+        twheel_entry_init(&tp->t_timer_entry[i], tcp_timer_expired, tp);
     }
-    slirp->tcp_iss += TCP_ISSINCR / PR_SLOWHZ; /* increment iss */
-    slirp->tcp_now++; /* for timestamps */
+    twheel_entry_init(&tp->t_delack_entry, tcp_delack_expired, tp);
+    twheel_entry_init(&tp->t_sbuf_idle_entry, tcp_sbuf_idle_expired, tp);
+    tp->t_rcvtime = slirp_now_ms(tp->t_socket->slirp);
+    tp->t_sbuf_start = tp->t_rcvtime;
+}
+
+void tcp_timer_cleanup(struct tcpcb *tp)
+{
+    Slirp *slirp = tp->t_socket->slirp;
+
+    tcp_canceltimers(tp);
+    twheel_del(&slirp->timers, &tp->t_delack_entry);
+    twheel_del(&slirp->timers, &tp->t_sbuf_idle_entry);
+}
+
+/*
+ * Arm timer to go off in ms milliseconds, or stop it if ms is 0.
+ */
+void tcp_timer_set(struct tcpcb *tp, int timer, uint32_t ms)
+{
+    Slirp *slirp = tp->t_socket->slirp;
+
+    tp->t_timer[timer] = MIN(DIV_ROUND_UP(ms, TCPTV_TICK_MS), INT16_MAX);
+    if (ms) {
+        slirp_timer_arm(slirp, &tp->t_timer_entry[timer], ms);
+    } else {
+        twheel_del(&slirp->timers, &tp->t_timer_entry[timer]);
+    }
+}
+
+/*
+ * Slow ticks left before timer goes off, 0 if it is off.
+ */
+int tcp_timer_remaining(struct tcpcb *tp, int timer)
+{
+    struct twheel_entry *entry = &tp->t_timer_entry[timer];
+    uint64_t now = slirp_now_ms(tp->t_socket->slirp);
+
+    if (!twheel_pending(entry)) {
+        return 0;
+    }
+    if (entry->expires <= now) {
+        return 1;
+    }
+    return DIV_ROUND_UP(entry->expires - now, TCPTV_TICK_MS);
+}
+
+/*
+ * Ack the data received in order after TCP_DELACK_MS, unless something
+ * gets sent before.
+ */
+void tcp_delack(struct tcpcb *tp)
+{
+    tp->t_flags |= TF_DELACK;
+    if (!twheel_pending(&tp->t_delack_entry)) {
+        slirp_timer_arm(tp->t_socket->slirp, &tp->t_delack_entry,
+                        TCP_DELACK_MS);
+    }
+}
+
+/*
+ * Milliseconds since the last segment was received.
+ */
+uint32_t tcp_idle(struct tcpcb *tp)
+{
+    uint64_t idle = slirp_now_ms(tp->t_socket->slirp) - tp->t_rcvtime;
+
+    return MIN(idle, UINT32_MAX);
+}
+
+/*
+ * Round trip time of the segment being timed, in milliseconds. It is at
+ * least the 1 ms granularity of the clock: faster round trips, usual on the
+ * local link, would otherwise give an srtt of 0, which means no estimate.
+ */
+uint32_t tcp_rtt(struct tcpcb *tp)
+{
+    uint64_t rtt = slirp_now_ms(tp->t_socket->slirp) - tp->t_rtstart;
+
+    return MAX(MIN(rtt, TCPTV_REXMTMAX), 1);
 }
 
 /*
@@ -106,7 +171,7 @@ void tcp_canceltimers(struct tcpcb *tp)
     register int i;
 
     for (i = 0; i < TCPT_NTIMERS; i++)
-        tp->t_timer[i] = 0;
+        tcp_timer_set(tp, i, 0);
 }
 
 const int tcp_backoff[TCP_MAXRXTSHIFT + 1] = { 1,  2,  4,  8,  16, 32, 64,
@@ -129,8 +194,8 @@ static struct tcpcb *tcp_timers(register struct tcpcb *tp, int timer)
      * control block.  Otherwise, check again in a bit.
      */
     case TCPT_2MSL:
-        if (tp->t_state != TCPS_TIME_WAIT && tp->t_idle <= TCP_MAXIDLE)
-            tp->t_timer[TCPT_2MSL] = TCPTV_KEEPINTVL;
+        if (tp->t_state != TCPS_TIME_WAIT && tcp_idle(tp) <= TCP_MAXIDLE)
+            tcp_timer_set(tp, TCPT_2MSL, TCPTV_KEEPINTVL);
         else
             tp = tcp_close(tp);
         break;
@@ -180,10 +245,12 @@ static struct tcpcb *tcp_timers(register struct tcpcb *tp, int timer)
              */
             tp->t_rxtshift = 6;
         }
-        rexmt = TCP_REXMTVAL(tp) * tcp_backoff[tp->t_rxtshift];
-        TCPT_RANGESET(tp->t_rxtcur, rexmt, (short)tp->t_rttmin,
+        /* Back off from the floored timeout, as in RFC 6298 5.5 */
+        rexmt = MAX(TCP_REXMTVAL(tp), (int)tp->t_rttmin) *
+                tcp_backoff[tp->t_rxtshift];
+        TCPT_RANGESET(tp->t_rxtcur, rexmt, (int)tp->t_rttmin,
                       TCPTV_REXMTMAX); /* XXX */
-        tp->t_timer[TCPT_REXMT] = tp->t_rxtcur;
+        tcp_timer_set(tp, TCPT_REXMT, tp->t_rxtcur);
         /*
          * If losing, let the lower level know and try for
          * a better route.  Also, if we backed off this far,
@@ -256,7 +323,7 @@ static struct tcpcb *tcp_timers(register struct tcpcb *tp, int timer)
             goto dropit;
 
         if (slirp_do_keepalive && tp->t_state <= TCPS_CLOSE_WAIT) {
-            if (tp->t_idle >= TCPTV_KEEP_IDLE + TCP_MAXIDLE)
+            if (tcp_idle(tp) >= TCPTV_KEEP_IDLE + TCP_MAXIDLE)
                 goto dropit;
             /*
              * Send a packet designed to force a response
@@ -272,9 +339,9 @@ static struct tcpcb *tcp_timers(register struct tcpcb *tp, int timer)
              */
             tcp_respond(tp, &tp->t_template, (struct mbuf *)NULL, tp->rcv_nxt,
                         tp->snd_una - 1, 0, tp->t_socket->so_ffamily);
-            tp->t_timer[TCPT_KEEP] = TCPTV_KEEPINTVL;
+            tcp_timer_set(tp, TCPT_KEEP, TCPTV_KEEPINTVL);
         } else
-            tp->t_timer[TCPT_KEEP] = TCPTV_KEEP_IDLE;
+            tcp_timer_set(tp, TCPT_KEEP, TCPTV_KEEP_IDLE);
         break;
 
     dropit:
@@ -35,8 +35,9 @@
 #define TCP_TIMER_H
 
 /*
- * Definitions of the TCP timers.  These timers are counted
- * down PR_SLOWHZ times a second.
+ * Definitions of the TCP timers.  These timers are set in
+ * milliseconds, and go off from the timing wheel of the
+ * Slirp instance.
  */
 #define TCPT_NTIMERS 4
 
@@ -82,25 +83,29 @@
  */
 
 /*
- * Time constants.
+ * Time constants, in milliseconds.
  */
-#define TCPTV_MSL (5 * PR_SLOWHZ) /* max seg lifetime (hah!) */
+#define TCPTV_MSL (5 * 1000) /* max seg lifetime (hah!) */
 
 #define TCPTV_SRTTBASE        \
     0 /* base roundtrip time; \
          if 0, no idea yet */
-#define TCPTV_SRTTDFLT (3 * PR_SLOWHZ) /* assumed RTT if no info */
+#define TCPTV_RTOINIT (1 * 1000) /* RTO before any RTT sample (RFC 6298) */
 
-#define TCPTV_PERSMIN (5 * PR_SLOWHZ) /* retransmit persistence */
-#define TCPTV_PERSMAX (60 * PR_SLOWHZ) /* maximum persist interval */
+#define TCPTV_PERSMIN (5 * 1000) /* retransmit persistence */
+#define TCPTV_PERSMAX (60 * 1000) /* maximum persist interval */
 
-#define TCPTV_KEEP_INIT (75 * PR_SLOWHZ) /* initial connect keep alive */
-#define TCPTV_KEEP_IDLE (120 * 60 * PR_SLOWHZ) /* dflt time before probing */
-#define TCPTV_KEEPINTVL (75 * PR_SLOWHZ) /* default probe interval */
+#define TCPTV_KEEP_INIT (75 * 1000) /* initial connect keep alive */
+#define TCPTV_KEEP_IDLE (120 * 60 * 1000) /* dflt time before probing */
+#define TCPTV_KEEPINTVL (75 * 1000) /* default probe interval */
 #define TCPTV_KEEPCNT 8 /* max probes before drop */
 
-#define TCPTV_MIN (1 * PR_SLOWHZ) /* minimum allowable value */
-#define TCPTV_REXMTMAX (12 * PR_SLOWHZ) /* max allowable REXMT value */
+#define TCPTV_MIN 200 /* default minimum RTO, see tcp_rto_min_ms */
+#define TCPTV_REXMTMAX (60 * 1000) /* max allowable REXMT value */
+#define TCPTV_GRANULARITY 1 /* clock granularity G of RFC 6298 */
+
+#define TCPTV_TICK_MS (1000 / PR_SLOWHZ) /* slow tick, for migration */
+#define TCP_DELACK_MS 2 /* delay of delayed acks */
 
 #define TCP_LINGERTIME 120 /* linger at most 2 minutes */
 
@@ -123,8 +128,13 @@ extern const int tcp_backoff[];
 
 struct tcpcb;
 
-void tcp_fasttimo(Slirp *);
-void tcp_slowtimo(Slirp *);
+void tcp_timer_init(struct tcpcb *);
+void tcp_timer_cleanup(struct tcpcb *);
+void tcp_timer_set(struct tcpcb *, int timer, uint32_t ms);
+int tcp_timer_remaining(struct tcpcb *, int timer);
+void tcp_delack(struct tcpcb *);
+uint32_t tcp_idle(struct tcpcb *);
+uint32_t tcp_rtt(struct tcpcb *);
 void tcp_canceltimers(struct tcpcb *);
 
 #endif
@@ -36,6 +36,7 @@
 
 #include "tcpip.h"
 #include "tcp_timer.h"
+#include "twheel.h"
 
 /*
  * Tcp control block, one per tcp; fields:
@@ -44,9 +45,9 @@ struct tcpcb {
     struct tcpiphdr *seg_next; /* sequencing queue */
     struct tcpiphdr *seg_prev;
     short t_state; /* state of this connection */
-    short t_timer[TCPT_NTIMERS]; /* tcp timers */
+    short t_timer[TCPT_NTIMERS]; /* tcp timers, see tcp_timer_set() */
     short t_rxtshift; /* log(2) of rexmt exp. backoff */
-    short t_rxtcur; /* current retransmit value */
+    int t_rxtcur; /* current retransmit value, in ms */
     short t_dupacks; /* consecutive dup acks recd */
     uint16_t t_maxseg; /* maximum segment size */
     uint8_t t_force; /* 1 if forcing out a byte */
@@ -102,12 +103,12 @@ struct tcpcb {
      * transmit timing stuff.  See below for scale of srtt and rttvar.
      * "Variance" is actually smoothed difference.
      */
-    short t_idle; /* inactivity time */
-    short t_rtt; /* round trip time */
+    short t_idle; /* inactivity time, only for migration, see tcp_idle() */
+    short t_rtt; /* round trip time, nonzero while timing, see tcp_rtt() */
     tcp_seq t_rtseq; /* sequence number being timed */
-    short t_srtt; /* smoothed round-trip time */
-    short t_rttvar; /* variance in round-trip time */
-    uint16_t t_rttmin; /* minimum rtt allowed */
+    int t_srtt; /* smoothed round-trip time, in ms */
+    int t_rttvar; /* variance in round-trip time, in ms */
+    uint32_t t_rttmin; /* minimum retransmit timeout allowed, in ms */
     uint32_t max_sndwnd; /* largest window peer has offered */
 
     /* out-of-band data */
@@ -125,6 +126,21 @@ struct tcpcb {
     uint32_t ts_recent; /* timestamp echo data */
     uint32_t ts_recent_age; /* when last updated */
     tcp_seq last_ack_sent;
+
+    struct twheel_entry t_timer_entry[TCPT_NTIMERS];
+    struct twheel_entry t_delack_entry;
+    uint64_t t_rcvtime; /* when the last segment was received, in ms */
+    uint64_t t_rtstart; /* when the timed segment was sent, in ms */
+
+    /* Socket buffer autotuning, see tcp_sbuf_update */
+    struct twheel_entry t_sbuf_idle_entry;
+    uint64_t t_sbuf_start; /* start of the measurement, in ms */
+    uint32_t t_sbuf_acked; /* bytes acked by the guest since then */
+    uint32_t t_sbuf_rcvd; /* bytes received from the guest since then */
+
+    /* Output held back until the end of a batch, see tcp_output_batched */
+    struct tcpcb *t_output_next;
+    struct tcpcb **t_output_pprev; /* NULL if no output is pending */
 };
 
 #define sototcpcb(so) ((so)->so_tcpcb)
@@ -144,18 +160,13 @@ struct tcpcb {
 #define TCP_RTTVAR_SHIFT 2 /* multiplier for rttvar; 2 bits */
 
 /*
- * The initial retransmission should happen at rtt + 4 * rttvar.
- * Because of the way we do the smoothing, srtt and rttvar
- * will each average +1/2 tick of bias.  When we compute
- * the retransmit timer, we want 1/2 tick of rounding and
- * 1 extra tick because of +-1/2 tick uncertainty in the
- * firing of the timer.  The bias will give us exactly the
- * 1.5 tick we need.  But, because the bias is
- * statistical, we have to test that we don't drop below
- * the minimum feasible timer (which is 2 ticks).
+ * The retransmission should happen at srtt + max(G, 4 * rttvar)
+ * (RFC 6298), G being the granularity of the clock.
  * This macro assumes that the value of TCP_RTTVAR_SCALE
  * is the same as the multiplier for rttvar.
  */
-#define TCP_REXMTVAL(tp) (((tp)->t_srtt >> TCP_RTT_SHIFT) + (tp)->t_rttvar)
+#define TCP_REXMTVAL(tp)                   \
+    (((tp)->t_srtt >> TCP_RTT_SHIFT) + \
+     MAX((tp)->t_rttvar, TCPTV_GRANULARITY))
 
 #endif
@@ -0,0 +1,200 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Hierarchical timing wheel, see twheel.h.
+ */
+
+#include <stddef.h>
+
+#include "twheel.h"
+
+#define TWHEEL_MASK (TWHEEL_SLOTS - 1)
+
+static inline int twheel_ctz(uint64_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+static inline uint64_t twheel_rotr(uint64_t x, unsigned r)
+{
+    return (x >> r) | (x << ((64 - r) & 63));
+}
+
+void twheel_init(struct twheel *wheel, uint64_t now)
+{
+    int level, i;
+
+    wheel->now = now;
+    wheel->count = 0;
+    for (level = 0; level < TWHEEL_LEVELS; level++) {
+        wheel->occupied[level] = 0;
+        for (i = 0; i < TWHEEL_SLOTS; i++) {
+            wheel->slots[level][i] = NULL;
+        }
+    }
+}
+
+void twheel_entry_init(struct twheel_entry *entry, TWheelCb cb, void *opaque)
+{
+    entry->next = NULL;
+    entry->pprev = NULL;
+    entry->expires = 0;
+    entry->slot = 0;
+    entry->cb = cb;
+    entry->opaque = opaque;
+}
+
+/*
+ * Put entry in the lowest level whose slots still cover its deadline from
+ * wheel->now. Deadlines beyond the last level are parked in its farthest
+ * slot, and placed again from there.
+ */
+static void twheel_link(struct twheel *wheel, struct twheel_entry *entry)
+{
+    struct twheel_entry **head;
+    uint64_t distance = 0;
+    unsigned shift = 0, idx;
+    int level;
+
+    for (level = 0; level < TWHEEL_LEVELS; level++) {
+        shift = level * TWHEEL_BITS;
+        distance = (entry->expires >> shift) - (wheel->now >> shift);
+        if (distance < TWHEEL_SLOTS) {
+            break;
+        }
+    }
+
+    if (level == TWHEEL_LEVELS) {
+        level = TWHEEL_LEVELS - 1;
+        idx = ((wheel->now >> shift) + TWHEEL_MASK) & TWHEEL_MASK;
+    } else {
+        idx = (entry->expires >> shift) & TWHEEL_MASK;
+    }
+
+    head = &wheel->slots[level][idx];
+    entry->next = *head;
+    if (entry->next) {
+        entry->next->pprev = &entry->next;
+    }
+    *head = entry;
+    entry->pprev = head;
+    entry->slot = level * TWHEEL_SLOTS + idx;
+
+    wheel->occupied[level] |= UINT64_C(1) << idx;
+    wheel->count++;
+}
+
+static void twheel_unlink(struct twheel *wheel, struct twheel_entry *entry)
+{
+    unsigned level = entry->slot / TWHEEL_SLOTS;
+    unsigned idx = entry->slot % TWHEEL_SLOTS;
+
+    *entry->pprev = entry->next;
+    if (entry->next) {
+        entry->next->pprev = entry->pprev;
+    }
+    entry->next = NULL;
+    entry->pprev = NULL;
+
+    if (!wheel->slots[level][idx]) {
+        wheel->occupied[level] &= ~(UINT64_C(1) << idx);
+    }
+    wheel->count--;
+}
+
+void twheel_mod(struct twheel *wheel, struct twheel_entry *entry,
+                uint64_t expires)
+{
+    if (twheel_pending(entry)) {
+        twheel_unlink(wheel, entry);
+    }
+
+    /* The slot of wheel->now has already been run */
+    entry->expires = expires > wheel->now ? expires : wheel->now + 1;
+    twheel_link(wheel, entry);
+}
+
+void twheel_del(struct twheel *wheel, struct twheel_entry *entry)
+{
+    if (twheel_pending(entry)) {
+        twheel_unlink(wheel, entry);
+    }
+}
+
+uint64_t twheel_next(const struct twheel *wheel)
+{
+    uint64_t next = UINT64_MAX;
+    int level;
+
+    for (level = 0; level < TWHEEL_LEVELS; level++) {
+        unsigned shift = level * TWHEEL_BITS;
+        uint64_t base = wheel->now >> shift;
+        uint64_t occupied = wheel->occupied[level];
+        uint64_t when;
+
+        if (!occupied) {
+            continue;
+        }
+
+        /* The slot of wheel->now is behind, look from the one after it */
+        occupied = twheel_rotr(occupied, (base + 1) & TWHEEL_MASK);
+        when = (base + 1 + twheel_ctz(occupied)) << shift;
+        if (when < next) {
+            next = when;
+        }
+    }
+
+    return next;
+}
+
+void twheel_run(struct twheel *wheel, uint64_t now)
+{
+    while (wheel->count) {
+        struct twheel_entry **head, *entry;
+        uint64_t next = twheel_next(wheel);
+        int level;
+
+        if (next > now) {
+            break;
+        }
+        wheel->now = next;
+
+        /*
+         * The upper level slots starting at this time go down to the lower
+         * levels, or straight into the level 0 slot which is run below.
+         */
+        for (level = TWHEEL_LEVELS - 1; level > 0; level--) {
+            unsigned shift = level * TWHEEL_BITS;
+
+            if (next & ((UINT64_C(1) << shift) - 1)) {
+                continue;
+            }
+
+            head = &wheel->slots[level][(next >> shift) & TWHEEL_MASK];
+            while ((entry = *head) != NULL) {
+                twheel_unlink(wheel, entry);
+                twheel_link(wheel, entry);
+            }
+        }
+
+        /* Everything left in this slot expires now */
+        head = &wheel->slots[0][next & TWHEEL_MASK];
+        while ((entry = *head) != NULL) {
+            twheel_unlink(wheel, entry);
+            entry->cb(entry);
+        }
+    }
+
+    if (now > wheel->now) {
+        wheel->now = now;
+    }
+}
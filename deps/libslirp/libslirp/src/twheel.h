@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Hierarchical timing wheel.
+ *
+ * Entries are kept in 4 levels of 64 slots each, level n having a
+ * granularity of 64^n milliseconds, which covers about 4.6 hours; later
+ * deadlines are parked in the last level until they come close enough.
+ * Arming and cancelling are O(1). Entries of the upper levels are cascaded
+ * down when their slot comes due, so that every entry fires at its exact
+ * deadline, and twheel_run only visits the slots which have entries.
+ */
+
+#ifndef TWHEEL_H
+#define TWHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TWHEEL_LEVELS 4
+#define TWHEEL_BITS 6
+#define TWHEEL_SLOTS (1 << TWHEEL_BITS)
+
+struct twheel_entry;
+
+typedef void (*TWheelCb)(struct twheel_entry *entry);
+
+struct twheel_entry {
+    struct twheel_entry *next;
+    struct twheel_entry **pprev; /* NULL when not armed */
+    uint64_t expires; /* deadline, in milliseconds */
+    uint16_t slot; /* level * TWHEEL_SLOTS + slot index */
+    TWheelCb cb;
+    void *opaque;
+};
+
+struct twheel {
+    uint64_t now; /* every entry up to this time has been run */
+    unsigned count; /* armed entries */
+    uint64_t occupied[TWHEEL_LEVELS]; /* bitmaps of the non-empty slots */
+    struct twheel_entry *slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+};
+
+void twheel_init(struct twheel *wheel, uint64_t now);
+void twheel_entry_init(struct twheel_entry *entry, TWheelCb cb, void *opaque);
+
+/*
+ * (Re)arm entry to fire at expires. Deadlines which are already due fire on
+ * the next twheel_run.
+ */
+void twheel_mod(struct twheel *wheel, struct twheel_entry *entry,
+                uint64_t expires);
+void twheel_del(struct twheel *wheel, struct twheel_entry *entry);
+
+static inline bool twheel_pending(const struct twheel_entry *entry)
+{
+    return entry->pprev != NULL;
+}
+
+/*
+ * Fire the entries due up to now, in deadline order. The callbacks may arm
+ * and cancel entries, including themselves.
+ */
+void twheel_run(struct twheel *wheel, uint64_t now);
+
+/*
+ * Time at which twheel_run next has something to do, UINT64_MAX if nothing
+ * is armed. This may be earlier than the next deadline when entries need to
+ * be cascaded down first.
+ */
+uint64_t twheel_next(const struct twheel *wheel);
+
+#endif
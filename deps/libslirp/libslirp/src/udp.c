@@ -47,6 +47,7 @@ static uint8_t udp_tos(struct socket *so);
 void udp_init(Slirp *slirp)
 {
     slirp->udb.so_next = slirp->udb.so_prev = &slirp->udb;
+    sohash_init(&slirp->udb_hash, false);
     slirp->udp_last_so = &slirp->udb;
 }
 
@@ -58,6 +59,8 @@ void udp_cleanup(Slirp *slirp)
         so_next = so->so_next;
         udp_detach(slirp->udb.so_next);
     }
+    udp_nat_cleanup(slirp);
+    sohash_cleanup(&slirp->udb_hash);
 }
 
 /* m->m_data  points at ip packet header
@@ -74,8 +77,9 @@ void udp_input(register struct mbuf *m, int iphlen)
     int len;
     struct ip save_ip;
     struct socket *so;
-    struct sockaddr_storage lhost;
-    struct sockaddr_in *lhost4;
+    struct sockaddr_storage lhost, fhost;
+    struct sockaddr_in *lhost4, *fhost4;
+    struct udp_nat_flow *flow = NULL;
     int ttl;
 
     DEBUG_CALL("udp_input");
@@ -167,10 +171,36 @@ void udp_input(register struct mbuf *m, int iphlen)
         goto bad;
     }
 
+    /*
+     *  answer DNS queries from the cache
+     */
+    if (ntohs(uh->uh_dport) == DNS_PORT && !slirp->disable_dns &&
+        ip->ip_dst.s_addr == slirp->vnameserver_addr.s_addr &&
+        dnscache_query(slirp, &lhost, (uint8_t *)(uh + 1),
+                       len - sizeof(struct udphdr))) {
+        goto bad;
+    }
+
     /*
      * Locate pcb for datagram.
      */
-    so = solookup(&slirp->udp_last_so, &slirp->udb, &lhost, NULL);
+    so = solookup(&slirp->udp_last_so, &slirp->udb, &slirp->udb_hash, &lhost,
+                  NULL);
+
+    if (so == NULL) {
+        /*
+         * In NAT mode, send it through a shared socket
+         */
+        memset(&fhost, 0, sizeof(fhost));
+        fhost.ss_family = AF_INET;
+        fhost4 = (struct sockaddr_in *)&fhost;
+        fhost4->sin_addr = ip->ip_dst;
+        fhost4->sin_port = uh->uh_dport;
+        flow = udp_nat_flow_out(slirp, &lhost, &fhost, ip->ip_tos);
+        if (flow) {
+            so = flow->so;
+        }
+    }
 
     if (so == NULL) {
         /*
@@ -190,6 +220,7 @@ void udp_input(register struct mbuf *m, int iphlen)
         so->so_lfamily = AF_INET;
         so->so_laddr = ip->ip_src;
         so->so_lport = uh->uh_sport;
+        sohash_insert(&slirp->udb_hash, so);
 
         if ((so->so_iptos = udp_tos(so)) == 0)
             so->so_iptos = ip->ip_tos;
@@ -199,6 +230,7 @@ void udp_input(register struct mbuf *m, int iphlen)
          * and if it is, do the fork_exec() etc.
          */
     }
+    sopoll_dirty(so);
 
     so->so_ffamily = AF_INET;
     so->so_faddr = ip->ip_dst; /* XXX */
@@ -220,7 +252,7 @@ void udp_input(register struct mbuf *m, int iphlen)
         icmp_send_error(m, ICMP_TIMXCEED, ICMP_TIMXCEED_INTRANS, 0, NULL);
         goto bad;
     }
-    setsockopt(so->s, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
+    sosetttl(so, ttl);
 
     /*
      * Now we sendto() the packet.
@@ -234,13 +266,18 @@ void udp_input(register struct mbuf *m, int iphlen)
         goto bad;
     }
 
-    m_free(so->so_m); /* used for ICMP if error on sorecvfrom */
-
     /* restore the orig mbuf packet */
     m->m_len += iphlen;
     m->m_data -= iphlen;
     *ip = save_ip;
-    so->so_m = m; /* ICMP backup */
+
+    /* used for ICMP if error on sorecvfrom */
+    if (flow) {
+        udp_nat_flow_sent(flow, m);
+    } else {
+        m_free(so->so_m);
+        so->so_m = m; /* ICMP backup */
+    }
 
     return;
 bad:
@@ -331,6 +368,7 @@ int udp_attach(struct socket *so, unsigned short af)
 #endif
 
         so->so_expire = curtime + SO_EXPIRE;
+        soexpire_arm(so);
         slirp_insque(so, &so->slirp->udb);
     }
     so->slirp->cb->register_poll_fd(so->s, so->slirp->opaque);
@@ -339,7 +377,13 @@ int udp_attach(struct socket *so, unsigned short af)
 
 void udp_detach(struct socket *so)
 {
-    so->slirp->cb->unregister_poll_fd(so->s, so->slirp->opaque);
+    if (so->so_state & SS_UDPNAT) {
+        udp_nat_detach(so);
+    }
+    if (so->slirp->so_mmsg.tx_so == so) {
+        sosendto_flush(so->slirp);
+    }
+    sopoll_unregister(so);
     closesocket(so->s);
     sofree(so);
 }
@@ -399,11 +443,15 @@ struct socket *udpx_listen(Slirp *slirp,
     sotranslate_accept(so);
 
     sockaddr_copy(&so->lhost.sa, sizeof(so->lhost), laddr, laddrlen);
+    sohash_insert(&slirp->udb_hash, so);
 
     if (flags != SS_FACCEPTONCE)
         so->so_expire = 0;
+    else
+        soexpire_arm(so);
     so->so_state &= SS_PERSISTENT_MASK;
     so->so_state |= SS_ISFCONNECTED | flags;
+    sopoll_dirty(so);
 
     return so;
 }
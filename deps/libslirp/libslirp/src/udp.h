@@ -74,6 +74,34 @@ struct udpiphdr {
 #define UDPCTL_CHECKSUM 1 /* checksum UDP packets */
 #define UDPCTL_MAXID 2
 
+/*
+ * NAT mode, see udp_nat.c
+ */
+#define UDP_NAT_SOCKETS_MAX 64 /* pool sockets per address family */
+#define UDP_NAT_FLOWS_MAX 65536
+
+struct udp_nat_flow {
+    struct udp_nat_flow *fwd_next; /* chain by guest and destination */
+    struct udp_nat_flow *rev_next; /* chain by pool socket and host address */
+    struct sockaddr_storage lhost; /* guest address and port */
+    struct sockaddr_storage fhost; /* destination, as the guest sees it */
+    struct sockaddr_storage haddr; /* destination, as the host sends to it */
+    struct socket *so; /* pool socket the flow goes through */
+    struct mbuf *m; /* last datagram sent, for ICMP errors */
+    uint8_t iptos;
+    unsigned expire; /* like so_expire */
+    struct twheel_entry expire_timer;
+};
+
+struct udp_nat {
+    unsigned int nsockets; /* per address family, 0 when NAT mode is off */
+    struct socket *pool[2][UDP_NAT_SOCKETS_MAX]; /* AF_INET, AF_INET6 */
+    struct udp_nat_flow **fwd; /* flows by guest and destination */
+    struct udp_nat_flow **rev; /* flows by pool socket and host address */
+    unsigned int size; /* buckets of each index, a power of two */
+    unsigned int count;
+};
+
 struct mbuf;
 
 void udp_init(Slirp *);
@@ -89,6 +117,18 @@ struct socket *udpx_listen(Slirp *,
 int udp_output(struct socket *so, struct mbuf *m, struct sockaddr_in *saddr,
                struct sockaddr_in *daddr, int iptos);
 
+void udp_nat_init(Slirp *, unsigned int nsockets);
+void udp_nat_cleanup(Slirp *);
+struct udp_nat_flow *udp_nat_flow_out(Slirp *,
+                                      const struct sockaddr_storage *lhost,
+                                      const struct sockaddr_storage *fhost,
+                                      uint8_t iptos);
+void udp_nat_flow_sent(struct udp_nat_flow *, struct mbuf *m);
+struct udp_nat_flow *udp_nat_flow_find(struct socket *,
+                                       const struct sockaddr_storage *haddr);
+void udp_nat_flow_received(struct udp_nat_flow *);
+void udp_nat_detach(struct socket *);
+
 void udp6_input(register struct mbuf *);
 int udp6_output(struct socket *so, struct mbuf *m, struct sockaddr_in6 *saddr,
                 struct sockaddr_in6 *daddr);
@@ -19,6 +19,7 @@ void udp6_input(struct mbuf *m)
     int len;
     struct socket *so;
     struct sockaddr_in6 lhost;
+    struct udp_nat_flow *flow = NULL;
     int hop_limit;
 
     DEBUG_CALL("udp6_input");
@@ -63,6 +64,7 @@ void udp6_input(struct mbuf *m)
     save_ip = *ip;
 
     /* Locate pcb for datagram. */
+    memset(&lhost, 0, sizeof(lhost));
     lhost.sin6_family = AF_INET6;
     lhost.sin6_addr = ip->ip_src;
     lhost.sin6_port = uh->uh_sport;
@@ -90,9 +92,38 @@ void udp6_input(struct mbuf *m)
         goto bad;
     }
 
-    so = solookup(&slirp->udp_last_so, &slirp->udb,
+    /* answer DNS queries from the cache */
+    if (ntohs(uh->uh_dport) == DNS_PORT && !slirp->disable_dns &&
+        in6_equal(&ip->ip_dst, &slirp->vnameserver_addr6)) {
+        struct sockaddr_storage src;
+
+        memcpy(&src, &lhost, sizeof(lhost));
+        if (dnscache_query(slirp, &src, (uint8_t *)(uh + 1),
+                           len - sizeof(struct udphdr))) {
+            goto bad;
+        }
+    }
+
+    so = solookup(&slirp->udp_last_so, &slirp->udb, &slirp->udb_hash,
                   (struct sockaddr_storage *)&lhost, NULL);
 
+    if (so == NULL) {
+        /* In NAT mode, send it through a shared socket */
+        struct sockaddr_storage src, dst;
+        struct sockaddr_in6 *dst6 = (struct sockaddr_in6 *)&dst;
+
+        memset(&src, 0, sizeof(src));
+        memcpy(&src, &lhost, sizeof(lhost));
+        memset(&dst, 0, sizeof(dst));
+        dst6->sin6_family = AF_INET6;
+        dst6->sin6_addr = ip->ip_dst;
+        dst6->sin6_port = uh->uh_dport;
+        flow = udp_nat_flow_out(slirp, &src, &dst, 0);
+        if (flow) {
+            so = flow->so;
+        }
+    }
+
     if (so == NULL) {
         /* If there's no socket for this packet, create one. */
         so = socreate(slirp, IPPROTO_UDP);
@@ -106,7 +137,9 @@ void udp6_input(struct mbuf *m)
         so->so_lfamily = AF_INET6;
         so->so_laddr6 = ip->ip_src;
         so->so_lport6 = uh->uh_sport;
+        sohash_insert(&slirp->udb_hash, so);
     }
+    sopoll_dirty(so);
 
     so->so_ffamily = AF_INET6;
     so->so_faddr6 = ip->ip_dst; /* XXX */
@@ -128,7 +161,7 @@ void udp6_input(struct mbuf *m)
         icmp6_send_error(m, ICMP6_TIMXCEED, ICMP6_TIMXCEED_INTRANS);
         goto bad;
     }
-    setsockopt(so->s, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &hop_limit, sizeof(hop_limit));
+    sosetttl(so, hop_limit);
 
     /*
      * Now we sendto() the packet.
@@ -142,13 +175,18 @@ void udp6_input(struct mbuf *m)
         goto bad;
     }
 
-    m_free(so->so_m); /* used for ICMP if error on sorecvfrom */
-
     /* restore the orig mbuf packet */
     m->m_len += iphlen;
     m->m_data -= iphlen;
     *ip = save_ip;
-    so->so_m = m;
+
+    /* used for ICMP if error on sorecvfrom */
+    if (flow) {
+        udp_nat_flow_sent(flow, m);
+    } else {
+        m_free(so->so_m);
+        so->so_m = m;
+    }
 
     return;
 bad:
@@ -0,0 +1,344 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * UDP NAT mode.
+ *
+ * Otherwise every guest UDP source address and port gets a host socket of
+ * its own, kept until SO_EXPIRE after its last datagram, so that a guest
+ * scanning from random source ports ties up one fd per query. In NAT mode,
+ * datagrams of guest flows which have no such socket go out through a small
+ * pool of unconnected host sockets per address family instead. A flow is a
+ * guest address and port talking to one destination; the flow table maps
+ * the replies arriving on a pool socket from that destination back to it,
+ * and each flow expires on its own like a socket would.
+ *
+ * A guest port sticks to one pool socket as long as it doesn't talk to a
+ * destination another flow already reaches through that socket, so most
+ * flows keep a stable host port. Only replies from the exact destination a
+ * flow sent to are passed on.
+ */
+
+#include "slirp.h"
+
+#define UDP_NAT_INITIAL_SIZE 64
+
+static unsigned int udp_nat_fwd_bucket(struct udp_nat *nat,
+                                       const struct sockaddr_storage *lhost,
+                                       const struct sockaddr_storage *fhost)
+{
+    uint32_t h = sohash_addr(lhost) * 31 + sohash_addr(fhost);
+
+    h *= 0x9e3779b1U;
+    return (h ^ (h >> 16)) & (nat->size - 1);
+}
+
+static unsigned int udp_nat_rev_bucket(struct udp_nat *nat,
+                                       const struct socket *so,
+                                       const struct sockaddr_storage *haddr)
+{
+    uint32_t h = (uint32_t)((uintptr_t)so >> 4) * 31 + sohash_addr(haddr);
+
+    h *= 0x9e3779b1U;
+    return (h ^ (h >> 16)) & (nat->size - 1);
+}
+
+static void udp_nat_link(struct udp_nat *nat, struct udp_nat_flow *flow)
+{
+    unsigned int bucket;
+
+    bucket = udp_nat_fwd_bucket(nat, &flow->lhost, &flow->fhost);
+    flow->fwd_next = nat->fwd[bucket];
+    nat->fwd[bucket] = flow;
+
+    bucket = udp_nat_rev_bucket(nat, flow->so, &flow->haddr);
+    flow->rev_next = nat->rev[bucket];
+    nat->rev[bucket] = flow;
+}
+
+static void udp_nat_unlink(struct udp_nat *nat, struct udp_nat_flow *flow)
+{
+    struct udp_nat_flow **link;
+
+    link = &nat->fwd[udp_nat_fwd_bucket(nat, &flow->lhost, &flow->fhost)];
+    while (*link != flow) {
+        link = &(*link)->fwd_next;
+    }
+    *link = flow->fwd_next;
+
+    link = &nat->rev[udp_nat_rev_bucket(nat, flow->so, &flow->haddr)];
+    while (*link != flow) {
+        link = &(*link)->rev_next;
+    }
+    *link = flow->rev_next;
+}
+
+static void udp_nat_grow(struct udp_nat *nat)
+{
+    struct udp_nat_flow **old_fwd = nat->fwd;
+    unsigned int old_size = nat->size;
+    unsigned int i;
+
+    nat->size *= 2;
+    nat->fwd = g_new0(struct udp_nat_flow *, nat->size);
+    g_free(nat->rev);
+    nat->rev = g_new0(struct udp_nat_flow *, nat->size);
+
+    /* Every flow is on exactly one forward chain */
+    for (i = 0; i < old_size; i++) {
+        struct udp_nat_flow *flow = old_fwd[i];
+        while (flow) {
+            struct udp_nat_flow *next = flow->fwd_next;
+            udp_nat_link(nat, flow);
+            flow = next;
+        }
+    }
+
+    g_free(old_fwd);
+}
+
+static void udp_nat_flow_free(Slirp *slirp, struct udp_nat_flow *flow)
+{
+    udp_nat_unlink(&slirp->udp_nat, flow);
+    slirp->udp_nat.count--;
+    twheel_del(&slirp->timers, &flow->expire_timer);
+    m_free(flow->m);
+    g_free(flow);
+}
+
+/*
+ * Idle flows go away at their expire time, see soexpire_timer
+ */
+static void udp_nat_flow_timer(struct twheel_entry *entry)
+{
+    struct udp_nat_flow *flow = entry->opaque;
+    Slirp *slirp = flow->so->slirp;
+
+    if (flow->expire > curtime) {
+        slirp_timer_arm(slirp, &flow->expire_timer, flow->expire - curtime);
+    } else {
+        udp_nat_flow_free(slirp, flow);
+    }
+}
+
+/*
+ * Where the host really sends datagrams for fhost to, or false if it
+ * doesn't. sotranslate_out only looks at the destination of the socket.
+ */
+static bool udp_nat_translate(Slirp *slirp,
+                              const struct sockaddr_storage *fhost,
+                              struct sockaddr_storage *haddr)
+{
+    struct socket so;
+
+    memset(&so, 0, sizeof(so));
+    so.slirp = slirp;
+    so.fhost.ss = *fhost;
+    *haddr = *fhost;
+    return sotranslate_out(&so, haddr) == 0;
+}
+
+/*
+ * Pool socket slot of family af, opened on first use. Pool sockets don't
+ * expire, their flows do.
+ */
+static struct socket *udp_nat_socket(Slirp *slirp, unsigned short af,
+                                     unsigned int slot)
+{
+    struct socket **pool = &slirp->udp_nat.pool[af == AF_INET6][slot];
+    struct socket *so = *pool;
+
+    if (so) {
+        return so;
+    }
+
+    so = socreate(slirp, IPPROTO_UDP);
+    if (udp_attach(so, af) == -1) {
+        DEBUG_MISC(" udp_nat attach errno = %d-%s", errno, strerror(errno));
+        sofree(so);
+        return NULL;
+    }
+    so->so_expire = 0;
+    twheel_del(&slirp->timers, &so->so_expire_timer);
+    so->so_lfamily = af;
+    so->so_ffamily = af;
+    so->so_state |= SS_UDPNAT;
+
+    *pool = so;
+    return so;
+}
+
+void udp_nat_init(Slirp *slirp, unsigned int nsockets)
+{
+    struct udp_nat *nat = &slirp->udp_nat;
+
+    memset(nat, 0, sizeof(*nat));
+    nat->nsockets = MIN(nsockets, UDP_NAT_SOCKETS_MAX);
+    if (nat->nsockets) {
+        nat->size = UDP_NAT_INITIAL_SIZE;
+        nat->fwd = g_new0(struct udp_nat_flow *, nat->size);
+        nat->rev = g_new0(struct udp_nat_flow *, nat->size);
+    }
+}
+
+/*
+ * Called once the pool sockets have been detached, which took their flows
+ */
+void udp_nat_cleanup(Slirp *slirp)
+{
+    struct udp_nat *nat = &slirp->udp_nat;
+
+    g_free(nat->fwd);
+    g_free(nat->rev);
+    nat->fwd = nat->rev = NULL;
+    nat->size = 0;
+    nat->nsockets = 0;
+}
+
+/*
+ * Flow for a datagram from lhost to fhost, created if needed. NULL when
+ * NAT mode is off or the flow can't be set up, in which case the datagram
+ * gets a socket of its own as usual.
+ */
+struct udp_nat_flow *udp_nat_flow_out(Slirp *slirp,
+                                      const struct sockaddr_storage *lhost,
+                                      const struct sockaddr_storage *fhost,
+                                      uint8_t iptos)
+{
+    struct udp_nat *nat = &slirp->udp_nat;
+    struct sockaddr_storage haddr;
+    struct udp_nat_flow *flow;
+    struct socket *so = NULL;
+    unsigned int start, i;
+
+    if (!nat->nsockets || !udp_nat_translate(slirp, fhost, &haddr)) {
+        return NULL;
+    }
+
+    for (flow = nat->fwd[udp_nat_fwd_bucket(nat, lhost, fhost)]; flow;
+         flow = flow->fwd_next) {
+        if (sockaddr_equal(&flow->lhost, lhost) &&
+            sockaddr_equal(&flow->fhost, fhost)) {
+            break;
+        }
+    }
+    if (flow) {
+        if (sockaddr_equal(&flow->haddr, &haddr)) {
+            return flow;
+        }
+        /* The translation changed, e.g. to another DNS server */
+        udp_nat_flow_free(slirp, flow);
+    }
+
+    if (nat->count >= UDP_NAT_FLOWS_MAX) {
+        return NULL;
+    }
+
+    /*
+     * Replies are told apart by the socket they arrive on and their
+     * source, so two flows to the same destination can't share a socket.
+     */
+    start = sohash_addr(lhost) % nat->nsockets;
+    for (i = 0; i < nat->nsockets; i++) {
+        so = udp_nat_socket(slirp, fhost->ss_family,
+                            (start + i) % nat->nsockets);
+        if (!so) {
+            return NULL;
+        }
+        if (!udp_nat_flow_find(so, &haddr)) {
+            break;
+        }
+    }
+    if (i == nat->nsockets) {
+        return NULL;
+    }
+
+    if (nat->count >= nat->size) {
+        udp_nat_grow(nat);
+    }
+
+    flow = g_new0(struct udp_nat_flow, 1);
+    flow->lhost = *lhost;
+    flow->fhost = *fhost;
+    flow->haddr = haddr;
+    flow->so = so;
+    flow->iptos = iptos;
+    flow->expire = curtime + SO_EXPIRE;
+    twheel_entry_init(&flow->expire_timer, udp_nat_flow_timer, flow);
+    slirp_timer_arm(slirp, &flow->expire_timer, SO_EXPIRE);
+
+    udp_nat_link(nat, flow);
+    nat->count++;
+    return flow;
+}
+
+/*
+ * The datagram m of flow went out; keep it for ICMP errors about it
+ */
+void udp_nat_flow_sent(struct udp_nat_flow *flow, struct mbuf *m)
+{
+    m_free(flow->m);
+    flow->m = m;
+    flow->expire = curtime + SO_EXPIRE;
+}
+
+/*
+ * Flow which sent to haddr through so, NULL if none did
+ */
+struct udp_nat_flow *udp_nat_flow_find(struct socket *so,
+                                       const struct sockaddr_storage *haddr)
+{
+    struct udp_nat *nat = &so->slirp->udp_nat;
+    struct udp_nat_flow *flow;
+
+    for (flow = nat->rev[udp_nat_rev_bucket(nat, so, haddr)]; flow;
+         flow = flow->rev_next) {
+        if (flow->so == so && sockaddr_equal(&flow->haddr, haddr)) {
+            return flow;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * A reply came for flow. Like sockets, DNS flows are done with quickly.
+ */
+void udp_nat_flow_received(struct udp_nat_flow *flow)
+{
+    if (((struct sockaddr_in *)&flow->fhost)->sin_port == htons(DNS_PORT)) {
+        flow->expire = curtime + SO_EXPIREFAST;
+        /* Sooner than the timer was armed for */
+        slirp_timer_arm(flow->so->slirp, &flow->expire_timer, SO_EXPIREFAST);
+    } else {
+        flow->expire = curtime + SO_EXPIRE;
+    }
+}
+
+/*
+ * The pool socket so is going away, and its flows with it
+ */
+void udp_nat_detach(struct socket *so)
+{
+    Slirp *slirp = so->slirp;
+    struct udp_nat *nat = &slirp->udp_nat;
+    unsigned int i;
+
+    for (i = 0; i < nat->size; i++) {
+        struct udp_nat_flow *flow = nat->fwd[i];
+        while (flow) {
+            struct udp_nat_flow *next = flow->fwd_next;
+            if (flow->so == so) {
+                udp_nat_flow_free(slirp, flow);
+            }
+            flow = next;
+        }
+    }
+
+    for (i = 0; i < UDP_NAT_SOCKETS_MAX; i++) {
+        if (nat->pool[0][i] == so) {
+            nat->pool[0][i] = NULL;
+        }
+        if (nat->pool[1][i] == so) {
+            nat->pool[1][i] = NULL;
+        }
+    }
+}
@@ -59,6 +59,16 @@
 #define SLIRP_PACKED_END __pragma(pack(pop))
 #endif
 
+/*
+ * Process wide state that is updated while processing packets, kept per
+ * thread so Slirp instances can run on different threads.
+ */
+#ifdef _MSC_VER
+#define SLIRP_THREAD_LOCAL __declspec(thread)
+#else
+#define SLIRP_THREAD_LOCAL __thread
+#endif
+
 #ifndef DIV_ROUND_UP
 #define DIV_ROUND_UP(n, d) (((n) + (d)-1) / (d))
 #endif
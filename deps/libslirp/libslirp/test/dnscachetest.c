@@ -0,0 +1,629 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * DNS cache at the virtual nameserver: queries and upstream answers are fed
+ * straight to dnscache_query and dnscache_response, and the answers the
+ * cache sends are picked up from the frames going to the guest.
+ *
+ * Upstream answers are untrusted, so besides caching, expiry, coalescing
+ * and eviction, this checks that truncated answers, bad compression
+ * pointers and negative answers without a usable SOA record are never
+ * cached.
+ */
+
+#include <stdio.h>
+
+#include "slirp.h"
+
+#define GUEST_ADDR 0x0a00020f
+#define NAMESERVER_ADDR 0x0a000203
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_RCODE_NXDOMAIN 3
+
+#define CHECK(cond)                                                      \
+    do {                                                                 \
+        if (!(cond)) {                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,       \
+                    __LINE__, #cond);                                    \
+            failures++;                                                  \
+        }                                                                \
+    } while (0)
+
+struct dns_msg {
+    uint8_t b[512];
+    int len;
+};
+
+/* DNS payloads of the UDP datagrams sent to the guest */
+struct sent_answer {
+    uint16_t dport;
+    struct dns_msg msg;
+};
+
+static int failures;
+static int64_t now_ns;
+static struct sent_answer sent[32];
+static int nsent;
+
+static slirp_ssize_t send_packet(const void *buf, size_t len, void *opaque)
+{
+    const uint8_t *p = buf;
+    struct sent_answer *a;
+    int ihl;
+
+    /* Ethernet, IPv4 and UDP, anything else is not an answer */
+    if (len < ETH_HLEN + 20 + 8 || p[12] != 0x08 || p[13] != 0x00) {
+        return len;
+    }
+    p += ETH_HLEN;
+    len -= ETH_HLEN;
+    ihl = (p[0] & 0x0f) * 4;
+    if (p[9] != IPPROTO_UDP || len < ihl + 8) {
+        return len;
+    }
+    p += ihl;
+    len -= ihl;
+
+    g_assert(nsent < G_N_ELEMENTS(sent));
+    a = &sent[nsent++];
+    a->dport = (p[2] << 8) | p[3];
+    a->msg.len = MIN(len - 8, sizeof(a->msg.b));
+    memcpy(a->msg.b, p + 8, a->msg.len);
+    return len;
+}
+
+static void guest_error(const char *msg, void *opaque)
+{
+    fprintf(stderr, "guest error: %s\n", msg);
+}
+
+static int64_t clock_get_ns(void *opaque)
+{
+    return now_ns;
+}
+
+static void *timer_new_opaque(SlirpTimerId id, void *cb_opaque, void *opaque)
+{
+    return NULL;
+}
+
+static void timer_free(void *timer, void *opaque)
+{
+}
+
+static void timer_mod(void *timer, int64_t expire_time, void *opaque)
+{
+}
+
+static void register_poll_fd(int fd, void *opaque)
+{
+}
+
+static void unregister_poll_fd(int fd, void *opaque)
+{
+}
+
+static void notify(void *opaque)
+{
+}
+
+static struct SlirpCb callbacks = {
+    .send_packet = send_packet,
+    .guest_error = guest_error,
+    .clock_get_ns = clock_get_ns,
+    .timer_new_opaque = timer_new_opaque,
+    .timer_free = timer_free,
+    .timer_mod = timer_mod,
+    .register_poll_fd = register_poll_fd,
+    .unregister_poll_fd = unregister_poll_fd,
+    .notify = notify,
+};
+
+static Slirp *new_slirp(uint32_t dns_cache_size)
+{
+    static const uint8_t guest_ethaddr[ETH_ALEN] = { 0x52, 0x54, 0, 0x12,
+                                                     0x34, 0x56 };
+    SlirpConfig config = {
+        .version = 8,
+        .in_enabled = true,
+        .vnetwork.s_addr = htonl(0x0a000200),
+        .vnetmask.s_addr = htonl(0xffffff00),
+        .vhost.s_addr = htonl(0x0a000202),
+        .vdhcp_start.s_addr = htonl(GUEST_ADDR),
+        .vnameserver.s_addr = htonl(NAMESERVER_ADDR),
+        .dns_cache_size = dns_cache_size,
+    };
+    Slirp *slirp = slirp_new(&config, &callbacks, NULL);
+
+    /* So that the answers go out without an ARP request first */
+    arp_table_add(slirp, htonl(GUEST_ADDR), guest_ethaddr);
+    nsent = 0;
+    return slirp;
+}
+
+static void put8(struct dns_msg *m, uint8_t v)
+{
+    g_assert(m->len < sizeof(m->b));
+    m->b[m->len++] = v;
+}
+
+static void put16(struct dns_msg *m, uint16_t v)
+{
+    put8(m, v >> 8);
+    put8(m, v);
+}
+
+static void put32(struct dns_msg *m, uint32_t v)
+{
+    put16(m, v >> 16);
+    put16(m, v);
+}
+
+static void set16(struct dns_msg *m, int off, uint16_t v)
+{
+    m->b[off] = v >> 8;
+    m->b[off + 1] = v;
+}
+
+static uint16_t get16(const struct dns_msg *m, int off)
+{
+    return (m->b[off] << 8) | m->b[off + 1];
+}
+
+static uint32_t get32(const struct dns_msg *m, int off)
+{
+    return ((uint32_t)get16(m, off) << 16) | get16(m, off + 2);
+}
+
+/* name in dotted form, without compression */
+static void put_name(struct dns_msg *m, const char *name)
+{
+    while (*name) {
+        const char *dot = strchr(name, '.');
+        int l = dot ? dot - name : strlen(name);
+
+        put8(m, l);
+        while (l--) {
+            put8(m, *name++);
+        }
+        if (*name == '.') {
+            name++;
+        }
+    }
+    put8(m, 0);
+}
+
+static void make_query(struct dns_msg *m, uint16_t id, const char *name,
+                       uint16_t type)
+{
+    m->len = 0;
+    put16(m, id);
+    put16(m, 0x0100); /* RD */
+    put16(m, 1);
+    put16(m, 0);
+    put16(m, 0);
+    put16(m, 0);
+    put_name(m, name);
+    put16(m, type);
+    put16(m, 1); /* IN */
+}
+
+/* Answer header and question for query q, records are put after it */
+static void make_answer(struct dns_msg *m, const struct dns_msg *q,
+                        uint8_t rcode, uint16_t ancount, uint16_t nscount)
+{
+    *m = *q;
+    m->b[2] |= 0x80; /* QR */
+    m->b[3] = 0x80 | rcode; /* RA */
+    set16(m, 6, ancount);
+    set16(m, 8, nscount);
+}
+
+/* A record for the name of the question, through a compression pointer */
+static void put_a(struct dns_msg *m, uint32_t ttl)
+{
+    put16(m, 0xc000 | 12);
+    put16(m, DNS_TYPE_A);
+    put16(m, 1);
+    put32(m, ttl);
+    put16(m, 4);
+    put32(m, 0x5db8d822);
+}
+
+/* SOA record of the zone of the question, with rdlen bytes of RDATA */
+static void put_soa(struct dns_msg *m, uint32_t ttl, uint32_t minimum,
+                    uint16_t rdlen)
+{
+    int i;
+
+    put16(m, 0xc000 | 12);
+    put16(m, DNS_TYPE_SOA);
+    put16(m, 1);
+    put32(m, ttl);
+    put16(m, rdlen);
+    if (rdlen < 24) {
+        for (i = 0; i < rdlen; i++) {
+            put8(m, 0);
+        }
+        return;
+    }
+    put16(m, 0xc000 | 12); /* MNAME */
+    put16(m, 0xc000 | 12); /* RNAME */
+    put32(m, 2024010101); /* SERIAL */
+    put32(m, 7200); /* REFRESH */
+    put32(m, 3600); /* RETRY */
+    put32(m, 1209600); /* EXPIRE */
+    put32(m, minimum);
+}
+
+static bool query_from(Slirp *slirp, uint16_t port, const struct dns_msg *q)
+{
+    struct sockaddr_storage src = { 0 };
+    struct sockaddr_in *sin = (struct sockaddr_in *)&src;
+
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(GUEST_ADDR);
+    sin->sin_port = htons(port);
+    return dnscache_query(slirp, &src, q->b, q->len);
+}
+
+static void answer_from_upstream(Slirp *slirp, const struct dns_msg *r,
+                                 int len)
+{
+    struct sockaddr_storage from = { 0 };
+    struct sockaddr_in *sin = (struct sockaddr_in *)&from;
+
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(NAMESERVER_ADDR);
+    sin->sin_port = htons(53);
+    dnscache_response(slirp, &from, r->b, len);
+}
+
+static SlirpDnsCacheStats stats(Slirp *slirp)
+{
+    SlirpDnsCacheStats s;
+
+    slirp_get_dns_cache_stats(slirp, &s);
+    return s;
+}
+
+static void advance_ms(uint64_t ms)
+{
+    now_ns += ms * 1000000LL;
+}
+
+/*
+ * Answers are served with the id and letter case of the query, and the TTLs
+ * aged by their time in the cache, until they expire.
+ */
+static void test_positive(void)
+{
+    Slirp *slirp = new_slirp(0);
+    struct dns_msg q, r;
+    int ttl_off;
+
+    make_query(&q, 0x1111, "www.example.com", DNS_TYPE_A);
+    CHECK(!query_from(slirp, 1000, &q));
+    make_answer(&r, &q, 0, 1, 0);
+    put_a(&r, 60);
+    answer_from_upstream(slirp, &r, r.len);
+    CHECK(stats(slirp).entries == 1);
+
+    advance_ms(10000);
+    make_query(&q, 0x2222, "WWW.Example.COM", DNS_TYPE_A);
+    CHECK(query_from(slirp, 1001, &q));
+    CHECK(nsent == 1);
+    if (nsent == 1) {
+        const struct dns_msg *a = &sent[0].msg;
+
+        ttl_off = q.len + 6;
+        CHECK(sent[0].dport == 1001);
+        CHECK(a->len == r.len);
+        CHECK(get16(a, 0) == 0x2222);
+        CHECK(!memcmp(a->b + 12, q.b + 12, q.len - 12));
+        CHECK(get32(a, ttl_off) == 50);
+    }
+    CHECK(stats(slirp).hits == 1);
+
+    /* An AAAA query is another entry */
+    make_query(&q, 0x3333, "www.example.com", 28);
+    CHECK(!query_from(slirp, 1002, &q));
+
+    advance_ms(51000);
+    make_query(&q, 0x4444, "www.example.com", DNS_TYPE_A);
+    CHECK(!query_from(slirp, 1003, &q));
+    CHECK(stats(slirp).hits == 1);
+
+    slirp_cleanup(slirp);
+}
+
+/*
+ * Feed every truncation of r to a pending query for q, none of them may be
+ * cached. The whole answer is, unless it has TC set.
+ */
+static void check_truncations(Slirp *slirp, struct dns_msg *q,
+                              struct dns_msg *r)
+{
+    uint16_t id = 0x100;
+    int len;
+
+    for (len = 0; len < r->len; len++) {
+        /* Let the previous query time out, so that this one goes out */
+        advance_ms(DNSCACHE_PENDING_MS + 1);
+        set16(q, 0, id);
+        set16(r, 0, id);
+        id++;
+        CHECK(!query_from(slirp, 2000, q));
+        answer_from_upstream(slirp, r, len);
+        CHECK(stats(slirp).entries == 0);
+    }
+
+    advance_ms(DNSCACHE_PENDING_MS + 1);
+    r->b[2] |= 0x02; /* TC */
+    CHECK(!query_from(slirp, 2000, q));
+    answer_from_upstream(slirp, r, r->len);
+    CHECK(stats(slirp).entries == 0);
+
+    r->b[2] &= ~0x02;
+    CHECK(!query_from(slirp, 2000, q));
+    answer_from_upstream(slirp, r, r->len);
+    CHECK(stats(slirp).entries == 1);
+    CHECK(nsent == 0);
+}
+
+static void test_truncated(void)
+{
+    Slirp *slirp = new_slirp(0);
+    struct dns_msg q, r;
+
+    make_query(&q, 0, "truncated.example.com", DNS_TYPE_A);
+    make_answer(&r, &q, 0, 2, 0);
+    put_a(&r, 300);
+    put_a(&r, 300);
+    check_truncations(slirp, &q, &r);
+    slirp_cleanup(slirp);
+
+    slirp = new_slirp(0);
+    make_query(&q, 0, "nx.example.com", DNS_TYPE_A);
+    make_answer(&r, &q, DNS_RCODE_NXDOMAIN, 0, 1);
+    put_soa(&r, 300, 60, 24);
+    check_truncations(slirp, &q, &r);
+    slirp_cleanup(slirp);
+}
+
+/*
+ * Compression pointers are skipped in records, never followed, and not
+ * accepted in the question.
+ */
+static void test_compression(void)
+{
+    Slirp *slirp = new_slirp(0);
+    struct dns_msg q, r;
+    int i;
+
+    make_query(&q, 0x10, "pointer.example.com", DNS_TYPE_A);
+
+    /* Question pointing back into the header: the answer is ignored */
+    CHECK(!query_from(slirp, 3000, &q));
+    r.len = 0;
+    put16(&r, 0x10);
+    put16(&r, 0x8180);
+    put16(&r, 1);
+    put16(&r, 1);
+    put16(&r, 0);
+    put16(&r, 0);
+    put16(&r, 0xc000 | 4);
+    put16(&r, DNS_TYPE_A);
+    put16(&r, 1);
+    put_a(&r, 300);
+    answer_from_upstream(slirp, &r, r.len);
+    CHECK(stats(slirp).entries == 0);
+    CHECK(stats(slirp).pending == 1);
+
+    /* Labels with the reserved 0x40 and 0x80 types */
+    make_query(&r, 0x11, "reserved.example.com", DNS_TYPE_A);
+    r.b[12] = 0x40 | 8;
+    CHECK(!query_from(slirp, 3000, &r));
+    r.b[12] = 0x80 | 8;
+    CHECK(!query_from(slirp, 3000, &r));
+    CHECK(stats(slirp).pending == 1);
+
+    /* Record name cut in the middle of a pointer */
+    advance_ms(DNSCACHE_PENDING_MS + 1);
+    set16(&q, 0, 0x12);
+    CHECK(!query_from(slirp, 3000, &q));
+    make_answer(&r, &q, 0, 1, 0);
+    put8(&r, 0xc0);
+    answer_from_upstream(slirp, &r, r.len);
+    CHECK(stats(slirp).entries == 0);
+
+    /*
+     * Names pointing to themselves and past the end of the message: the
+     * pointers are only skipped, so the records are fine
+     */
+    CHECK(!query_from(slirp, 3000, &q));
+    make_answer(&r, &q, 0, 2, 0);
+    for (i = 0; i < 2; i++) {
+        put16(&r, 0xc000 | (i ? 0x3fff : r.len));
+        put16(&r, DNS_TYPE_A);
+        put16(&r, 1);
+        put32(&r, 300);
+        put16(&r, 4);
+        put32(&r, 0x01020304);
+    }
+    answer_from_upstream(slirp, &r, r.len);
+    CHECK(stats(slirp).entries == 1);
+
+    slirp_cleanup(slirp);
+}
+
+/*
+ * NXDOMAIN and NODATA answers are cached for the MINIMUM of their SOA
+ * record, and not at all without one.
+ */
+static void test_negative(void)
+{
+    Slirp *slirp = new_slirp(0);
+    struct dns_msg q, r;
+
+    make_query(&q, 0x20, "missing.example.com", DNS_TYPE_A);
+    CHECK(!query_from(slirp, 4000, &q));
+    make_answer(&r, &q, DNS_RCODE_NXDOMAIN, 0, 1);
+    put_soa(&r, 3600, 30, 24);
+    answer_from_upstream(slirp, &r, r.len);
+    CHECK(stats(slirp).entries == 1);
+
+    advance_ms(10000);
+    set16(&q, 0, 0x21);
+    CHECK(query_from(slirp, 4001, &q));
+    CHECK(nsent == 1 && (sent[0].msg.b[3] & 0x0f) == DNS_RCODE_NXDOMAIN);
+    CHECK(stats(slirp).negative_hits == 1);
+
+    advance_ms(20001);
+    set16(&q, 0, 0x22);
+    CHECK(!query_from(slirp, 4002, &q));
+
+    /* NODATA */
+    make_query(&q, 0x23, "nodata.example.com", 28);
+    CHECK(!query_from(slirp, 4003, &q));
+    make_answer(&r, &q, 0, 0, 1);
+    put_soa(&r, 600, 900, 24);
+    answer_from_upstream(slirp, &r, r.len);
+    CHECK(stats(slirp).entries == 1);
+    advance_ms(599000);
+    set16(&q, 0, 0x24);
+    CHECK(query_from(slirp, 4004, &q));
+    advance_ms(2000);
+    set16(&q, 0, 0x25);
+    CHECK(!query_from(slirp, 4005, &q));
+    CHECK(stats(slirp).negative_hits == 2);
+
+    /* No SOA record */
+    make_query(&q, 0x26, "nosoa.example.com", DNS_TYPE_A);
+    CHECK(!query_from(slirp, 4006, &q));
+    make_answer(&r, &q, DNS_RCODE_NXDOMAIN, 0, 0);
+    answer_from_upstream(slirp, &r, r.len);
+    CHECK(stats(slirp).entries == 0);
+
+    /* SOA record too short for its MINIMUM field */
+    make_query(&q, 0x27, "shortsoa.example.com", DNS_TYPE_A);
+    CHECK(!query_from(slirp, 4007, &q));
+    make_answer(&r, &q, DNS_RCODE_NXDOMAIN, 0, 1);
+    put_soa(&r, 300, 0, 8);
+    answer_from_upstream(slirp, &r, r.len);
+    CHECK(stats(slirp).entries == 0);
+
+    /* SOA record in the answer section */
+    make_query(&q, 0x28, "answersoa.example.com", DNS_TYPE_A);
+    CHECK(!query_from(slirp, 4008, &q));
+    make_answer(&r, &q, DNS_RCODE_NXDOMAIN, 1, 0);
+    put_soa(&r, 300, 60, 24);
+    answer_from_upstream(slirp, &r, r.len);
+    CHECK(stats(slirp).entries == 0);
+
+    slirp_cleanup(slirp);
+}
+
+/*
+ * Identical queries wait for the one out upstream, up to
+ * DNSCACHE_WAITERS_MAX of them, and all get the answer.
+ */
+static void test_waiters(void)
+{
+    Slirp *slirp = new_slirp(0);
+    bool answered[DNSCACHE_WAITERS_MAX] = { false };
+    struct dns_msg q, r;
+    int i;
+
+    make_query(&q, 0x30, "busy.example.com", DNS_TYPE_A);
+    CHECK(!query_from(slirp, 5000, &q));
+
+    /* A retransmission goes out again */
+    CHECK(!query_from(slirp, 5000, &q));
+
+    for (i = 0; i < DNSCACHE_WAITERS_MAX; i++) {
+        set16(&q, 0, 0x100 + i);
+        CHECK(query_from(slirp, 6000 + i, &q));
+    }
+    set16(&q, 0, 0x200);
+    CHECK(!query_from(slirp, 7000, &q));
+    CHECK(stats(slirp).coalesced == DNSCACHE_WAITERS_MAX);
+    CHECK(nsent == 0);
+
+    set16(&q, 0, 0x30);
+    make_answer(&r, &q, 0, 1, 0);
+    put_a(&r, 300);
+    answer_from_upstream(slirp, &r, r.len);
+
+    CHECK(nsent == DNSCACHE_WAITERS_MAX);
+    for (i = 0; i < nsent; i++) {
+        int waiter = sent[i].dport - 6000;
+
+        CHECK(waiter >= 0 && waiter < DNSCACHE_WAITERS_MAX);
+        if (waiter >= 0 && waiter < DNSCACHE_WAITERS_MAX) {
+            CHECK(!answered[waiter]);
+            CHECK(get16(&sent[i].msg, 0) == 0x100 + waiter);
+            answered[waiter] = true;
+        }
+    }
+    CHECK(stats(slirp).entries == 1);
+
+    /* A late answer to a query which went out again changes nothing */
+    set16(&r, 0, 0x200);
+    answer_from_upstream(slirp, &r, r.len);
+    CHECK(stats(slirp).entries == 1);
+
+    slirp_cleanup(slirp);
+}
+
+/* The least recently used entry makes room once the cache is full */
+static void test_lru(void)
+{
+    Slirp *slirp = new_slirp(4);
+    struct dns_msg q, r;
+    char name[32];
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        snprintf(name, sizeof(name), "host%d.example.com", i);
+        make_query(&q, 0x40 + i, name, DNS_TYPE_A);
+        CHECK(!query_from(slirp, 8000, &q));
+        make_answer(&r, &q, 0, 1, 0);
+        put_a(&r, 300);
+        answer_from_upstream(slirp, &r, r.len);
+
+        /* host0 stays in use */
+        if (i == 3) {
+            make_query(&q, 0x50, "host0.example.com", DNS_TYPE_A);
+            CHECK(query_from(slirp, 8001, &q));
+        }
+    }
+
+    CHECK(stats(slirp).entries == 4);
+    CHECK(stats(slirp).evictions == 1);
+    make_query(&q, 0x51, "host0.example.com", DNS_TYPE_A);
+    CHECK(query_from(slirp, 8002, &q));
+    make_query(&q, 0x52, "host1.example.com", DNS_TYPE_A);
+    CHECK(!query_from(slirp, 8003, &q));
+
+    slirp_cleanup(slirp);
+}
+
+int main(int argc, char *argv[])
+{
+    test_positive();
+    test_truncated();
+    test_compression();
+    test_negative();
+    test_waiters();
+    test_lru();
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("dnscache passed\n");
+    return 0;
+}
@@ -0,0 +1,184 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+/*
+ * Socket buffer autotuning: a bulk transfer in one direction has to grow the
+ * buffer its data goes through, so_snd for host to guest and so_rcv for guest
+ * to host, and leave the other one alone.
+ *
+ * The connections have no host socket, so what the guest sends stays in
+ * so_rcv until the test drops it, and the clock only moves between rounds.
+ */
+
+#include <stdio.h>
+
+#include "slirp.h"
+
+#define SEGMENT 1460
+#define ROUNDS 32
+#define ROUND_MS 10
+#define BURSTS 4
+
+static int64_t now_ns;
+
+static slirp_ssize_t send_packet(const void *buf, size_t len, void *opaque)
+{
+    return len;
+}
+
+static void guest_error(const char *msg, void *opaque)
+{
+    fprintf(stderr, "guest error: %s\n", msg);
+}
+
+static int64_t clock_get_ns(void *opaque)
+{
+    return now_ns;
+}
+
+static void *timer_new_opaque(SlirpTimerId id, void *cb_opaque, void *opaque)
+{
+    return NULL;
+}
+
+static void timer_free(void *timer, void *opaque)
+{
+}
+
+static void timer_mod(void *timer, int64_t expire_time, void *opaque)
+{
+}
+
+static void register_poll_fd(int fd, void *opaque)
+{
+}
+
+static void unregister_poll_fd(int fd, void *opaque)
+{
+}
+
+static void notify(void *opaque)
+{
+}
+
+static struct SlirpCb callbacks = {
+    .send_packet = send_packet,
+    .guest_error = guest_error,
+    .clock_get_ns = clock_get_ns,
+    .timer_new_opaque = timer_new_opaque,
+    .timer_free = timer_free,
+    .timer_mod = timer_mod,
+    .register_poll_fd = register_poll_fd,
+    .unregister_poll_fd = unregister_poll_fd,
+    .notify = notify,
+};
+
+static struct socket *make_connection(Slirp *slirp)
+{
+    struct socket *so = socreate(slirp, IPPROTO_TCP);
+
+    tcp_attach(so);
+    so->so_ffamily = AF_INET;
+    tcp_mss(sototcpcb(so), 0);
+    return so;
+}
+
+/* The guest fills so_rcv a few times a round, and the host takes it all */
+static void upload(struct socket *so)
+{
+    int round, burst;
+
+    for (round = 0; round < ROUNDS; round++) {
+        now_ns += ROUND_MS * 1000000LL;
+        for (burst = 0; burst < BURSTS; burst++) {
+            while (sbspace(&so->so_rcv) >= SEGMENT) {
+                struct mbuf *m = m_get(so->slirp);
+
+                memset(m->m_data, 'u', SEGMENT);
+                m->m_len = SEGMENT;
+                sbappend(so, m);
+            }
+            sbdrop(&so->so_rcv, so->so_rcv.sb_cc);
+        }
+    }
+}
+
+/*
+ * The host writes what slirp_socket_can_recv would let it, a few times a
+ * round, and the guest acks it all
+ */
+static void download(struct socket *so)
+{
+    static char buf[TCP_SBUF_MAX_DEFAULT];
+    struct iovec iov[2];
+    int round, burst;
+    size_t len;
+
+    memset(buf, 'd', sizeof(buf));
+    for (round = 0; round < ROUNDS; round++) {
+        now_ns += ROUND_MS * 1000000LL;
+        for (burst = 0; burst < BURSTS; burst++) {
+            while (so->so_snd.sb_cc < so->so_snd.sb_hiwat / 2 &&
+                   (len = sopreprbuf(so, iov, NULL)) > 0) {
+                soreadbuf(so, buf, MIN(len, sizeof(buf)));
+            }
+            sodrop(so, so->so_snd.sb_cc);
+        }
+    }
+}
+
+static int check(const char *name, const struct sbuf *grown,
+                 const struct sbuf *idle, uint32_t initial, uint32_t max)
+{
+    printf("%s: grown %u/%u bytes, idle %u/%u bytes\n", name,
+           grown->sb_datalen, grown->sb_hiwat, idle->sb_datalen,
+           idle->sb_hiwat);
+
+    if (grown->sb_datalen <= initial || grown->sb_hiwat != max) {
+        fprintf(stderr, "%s: the buffer in use did not grow to %u bytes\n",
+                name, max);
+        return 1;
+    }
+    if (idle->sb_datalen != 0 || idle->sb_hiwat > initial) {
+        fprintf(stderr, "%s: the unused buffer grew\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    SlirpConfig config = {
+        .version = 8,
+        .restricted = false,
+        .in_enabled = true,
+        .vnetwork.s_addr = htonl(0x0a000200),
+        .vnetmask.s_addr = htonl(0xffffff00),
+        .vhost.s_addr = htonl(0x0a000202),
+        .vdhcp_start.s_addr = htonl(0x0a00020f),
+        .vnameserver.s_addr = htonl(0x0a000203),
+    };
+    struct socket *up, *down;
+    uint32_t initial;
+    Slirp *slirp;
+    int failed = 0;
+
+    slirp = slirp_new(&config, &callbacks, NULL);
+
+    up = make_connection(slirp);
+    initial = up->so_rcv.sb_hiwat;
+    upload(up);
+    failed |= check("guest to host", &up->so_rcv, &up->so_snd, initial,
+                    slirp->tcp_sbuf_max);
+
+    down = make_connection(slirp);
+    initial = down->so_snd.sb_hiwat;
+    download(down);
+    failed |= check("host to guest", &down->so_snd, &down->so_rcv, initial,
+                    slirp->tcp_sbuf_max);
+
+    tcp_close(sototcpcb(up));
+    tcp_close(sototcpcb(down));
+    slirp_cleanup(slirp);
+
+    return failed;
+}
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Framing of IP packets on the guest link
+class IFrameCodec {
+public:
+	// Destination of decoded bytes, they are appended at data + length
+	struct FrameBuffer {
+		uint8_t* data = nullptr;
+		size_t capacity = 0;
+		size_t length = 0;
+		// Set when the frame didn't fit in capacity, the bytes past capacity are dropped
+		bool truncated = false;
+		// Optional, called when size bytes don't fit in capacity. It can move the frame to a larger buffer, updating
+		// data and capacity.
+		void (*grow)(FrameBuffer& frame, size_t size, void* opaque) = nullptr;
+		void* growOpaque = nullptr;
+
+		void reset() {
+			length = 0;
+			truncated = false;
+		}
+
+		void append(const uint8_t* bytes, size_t len) {
+			if(len > capacity - length && grow && !truncated)
+				grow(*this, length + len, growOpaque);
+
+			if(len > capacity - length) {
+				len = capacity - length;
+				truncated = true;
+			}
+
+			memcpy(data + length, bytes, len);
+			length += len;
+		}
+	};
+
+	virtual ~IFrameCodec() {}
+
+	// Decode data into frame until the end of a frame or the end of data.
+	// Returns the number of bytes consumed, frameEnd is set when the frame is complete.
+	// The decoder state is kept between calls so a frame can be split across reads.
+	virtual size_t decode(const uint8_t* data, size_t len, FrameBuffer& frame, bool& frameEnd) = 0;
+
+	// Part of the data of a frame to encode, a frame is the concatenation of its segments
+	struct Segment {
+		const uint8_t* data;
+		size_t len;
+	};
+
+	// Return the size of the data in segments once encoded as a frame.
+	virtual size_t encodedSize(const Segment* segments, size_t count) const = 0;
+
+	// Encode the data in segments as a frame into output which must hold at least encodedSize() bytes.
+	// Returns the number of bytes written.
+	virtual size_t encode(const Segment* segments, size_t count, uint8_t* output) const = 0;
+};
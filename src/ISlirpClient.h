@@ -2,9 +2,13 @@
 
 #pragma once
 
+#include <libslirp.h>
+#include <stddef.h>
+
 class ISlirpClient {
 public:
 	virtual ~ISlirpClient() {}
 	virtual void close() = 0;
-	virtual void sendSlirpPacketToGuest(const void* data, size_t len) = 0;
+	// Send the ethernet frame made of the iovcnt parts in iov, the first one holds the whole ethernet header
+	virtual void sendSlirpPacketToGuest(const SlirpIoVec* iov, int iovcnt) = 0;
 };
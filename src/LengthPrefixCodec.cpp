@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: MIT
+
+#include "LengthPrefixCodec.h"
+#include <algorithm>
+#include <string.h>
+
+LengthPrefixCodec::LengthPrefixCodec(size_t prefixSize) : prefixSize(prefixSize) {}
+
+size_t LengthPrefixCodec::decode(const uint8_t* data, size_t len, FrameBuffer& frame, bool& frameEnd) {
+	size_t i = 0;
+
+	frameEnd = false;
+
+	while(prefixBytesReceived < prefixSize) {
+		if(i >= len)
+			return i;
+
+		frameRemainingBytes = (frameRemainingBytes << 8) | data[i];
+		prefixBytesReceived++;
+		i++;
+	}
+
+	size_t runLength = std::min<size_t>(len - i, frameRemainingBytes);
+	frame.append(data + i, runLength);
+	i += runLength;
+	frameRemainingBytes -= (uint32_t) runLength;
+
+	if(frameRemainingBytes == 0) {
+		prefixBytesReceived = 0;
+		frameEnd = true;
+	}
+
+	return i;
+}
+
+size_t LengthPrefixCodec::encodedSize(const Segment* segments, size_t count) const {
+	size_t size = prefixSize;
+
+	for(size_t i = 0; i < count; i++) {
+		size += segments[i].len;
+	}
+
+	return size;
+}
+
+size_t LengthPrefixCodec::encode(const Segment* segments, size_t count, uint8_t* output) const {
+	size_t len = encodedSize(segments, count) - prefixSize;
+
+	for(size_t i = 0; i < prefixSize; i++) {
+		output[i] = (uint8_t) (len >> (8 * (prefixSize - 1 - i)));
+	}
+
+	uint8_t* data = output + prefixSize;
+	for(size_t i = 0; i < count; i++) {
+		memcpy(data, segments[i].data, segments[i].len);
+		data += segments[i].len;
+	}
+
+	return prefixSize + len;
+}
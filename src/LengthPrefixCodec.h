@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "IFrameCodec.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Frames made of a big endian length prefix of 2 or 4 bytes followed by the packet as is.
+// Meant for peers that are not real serial lines, there is no escaping and no resynchronization.
+class LengthPrefixCodec : public IFrameCodec {
+public:
+	explicit LengthPrefixCodec(size_t prefixSize);
+
+	virtual size_t decode(const uint8_t* data, size_t len, FrameBuffer& frame, bool& frameEnd) override;
+	virtual size_t encodedSize(const Segment* segments, size_t count) const override;
+	virtual size_t encode(const Segment* segments, size_t count, uint8_t* output) const override;
+
+private:
+	size_t prefixSize;
+
+	// Decoder state, the prefix can be split across reads
+	size_t prefixBytesReceived = 0;
+	uint32_t frameRemainingBytes = 0;
+};
@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Free list of reusable objects.
+// Released objects are kept for reuse as long as the memory they hold stays below maxPooledBytes,
+// T must provide a memorySize() method returning the memory held by one object.
+template<typename T> class ObjectPool {
+public:
+	struct Stats {
+		uint64_t heapAllocations = 0;
+		uint64_t heapFrees = 0;
+		uint64_t reuses = 0;
+	};
+
+	ObjectPool(size_t maxPooledBytes) : maxPooledBytes(maxPooledBytes) {}
+	ObjectPool(const ObjectPool&) = delete;
+	ObjectPool& operator=(const ObjectPool&) = delete;
+	~ObjectPool() {
+		for(T* object : freeObjects) {
+			delete object;
+		}
+	}
+
+	T* acquire() {
+		if(freeObjects.empty()) {
+			stats.heapAllocations++;
+			return new T;
+		}
+
+		T* object = freeObjects.back();
+		freeObjects.pop_back();
+		pooledBytes -= object->memorySize();
+		stats.reuses++;
+		return object;
+	}
+
+	void release(T* object) {
+		size_t objectSize = object->memorySize();
+
+		if(pooledBytes + objectSize > maxPooledBytes) {
+			stats.heapFrees++;
+			delete object;
+			return;
+		}
+
+		pooledBytes += objectSize;
+		freeObjects.push_back(object);
+	}
+
+	// Account for a heap allocation done to grow a pooled object
+	void countHeapAllocation() { stats.heapAllocations++; }
+
+	const Stats& getStats() const { return stats; }
+
+private:
+	std::vector<T*> freeObjects;
+	size_t pooledBytes = 0;
+	size_t maxPooledBytes;
+	Stats stats;
+};
@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: MIT
 
 #include "PipeConnection.h"
+#include "LengthPrefixCodec.h"
+#include "SlipCodec.h"
 #include "SlirpServer.h"
 #include <algorithm>
 #include <libslirp.h>
@@ -8,28 +10,108 @@
 #include <spdlog/spdlog.h>
 #include <uv.h>
 
-PipeConnection::PipeConnection(SlirpServer* slirpServer) : slirpServer(slirpServer) {
-	uv_pipe_init(uv_default_loop(), &pipeHandle, 0);
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+PipeConnection::PipeConnection(SlirpServer* slirpServer, const Config& config)
+    : slirpServer(slirpServer), config(config) {
+	uv_loop_t* loop = slirpServer->getLoop();
+
+	uv_pipe_init(loop, &pipeHandle, 0);
 	pipeHandle.data = this;
 
+	uv_check_init(loop, &writeBatchCheckHandle);
+	writeBatchCheckHandle.data = this;
+
+	uv_idle_init(loop, &writeBatchIdleHandle);
+	writeBatchIdleHandle.data = this;
+
+	uv_timer_init(loop, &writeBatchTimerHandle);
+	writeBatchTimerHandle.data = this;
+
 	connectReq = {};
 	connectReq.data = this;
 
-	resetInputBuffer();
+	switch(config.framing) {
+	case Framing::SLIP:
+		frameCodec.reset(new SlipCodec);
+		break;
+	case Framing::LENGTH16:
+		frameCodec.reset(new LengthPrefixCodec(2));
+		break;
+	case Framing::LENGTH32:
+		frameCodec.reset(new LengthPrefixCodec(4));
+		break;
+	}
+
+	inputFrame.grow = &PipeConnection::growInputFrameStatic;
+	inputFrame.growOpaque = this;
 }
 
 PipeConnection::~PipeConnection() {
+	releaseInputFrame();
 	slirpServer->detachClient(this);
 }
 
 void PipeConnection::connectPipe(const char* pipePath) {
 	this->pipePath = pipePath;
 
+#ifndef _WIN32
+	struct stat pathStat;
+	if(stat(pipePath, &pathStat) == 0 && S_ISCHR(pathStat.st_mode)) {
+		openTty(pipePath);
+		return;
+	}
+#endif
+
 	SPDLOG_INFO("Connecting to SLIP pipe {}", pipePath);
 
 	uv_pipe_connect(&connectReq, &pipeHandle, pipePath, &PipeConnection::onConnectedStatic);
 }
 
+#ifndef _WIN32
+void PipeConnection::openTty(const char* ttyPath) {
+	SPDLOG_INFO("Opening SLIP tty {}", ttyPath);
+
+	int fd = open(ttyPath, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if(fd < 0) {
+		int result = uv_translate_sys_error(errno);
+		SPDLOG_ERROR("failed to open {}: {} ({})", ttyPath, uv_strerror(result), result);
+		return;
+	}
+
+	if(setTtyRawMode(fd) < 0) {
+		SPDLOG_WARN("failed to set raw mode on {}: {}", ttyPath, strerror(errno));
+	}
+
+	int result = uv_pipe_open(&pipeHandle, fd);
+	if(result < 0) {
+		SPDLOG_ERROR("failed to open {}: {} ({})", ttyPath, uv_strerror(result), result);
+		::close(fd);
+		return;
+	}
+
+	SPDLOG_INFO("Opened {}", ttyPath);
+
+	startRead();
+}
+
+int PipeConnection::setTtyRawMode(int fd) {
+	struct termios attributes;
+
+	if(tcgetattr(fd, &attributes) < 0)
+		return -1;
+
+	cfmakeraw(&attributes);
+	return tcsetattr(fd, TCSANOW, &attributes);
+}
+#endif
+
 void PipeConnection::startRead() {
 	slirpServer->attachClient(this);
 
@@ -37,14 +119,22 @@ void PipeConnection::startRead() {
 }
 
 void PipeConnection::close() {
+	if(uv_is_closing((uv_handle_t*) &pipeHandle))
+		return;
+
 	uv_read_stop((uv_stream_t*) &pipeHandle);
-	uv_close((uv_handle_t*) &pipeHandle, &PipeConnection::onCloseStatic);
-}
+	releaseInputFrame();
 
-void PipeConnection::resetInputBuffer() {
-	inputBuffer.clear();
-	inputBuffer.assign(SlirpServer::SLIRP_ETHER_HEADER,
-	                   SlirpServer::SLIRP_ETHER_HEADER + sizeof(SlirpServer::SLIRP_ETHER_HEADER));
+	if(pendingWriteBatch) {
+		releaseWriteBatch(pendingWriteBatch);
+		pendingWriteBatch = nullptr;
+	}
+
+	handlesToClose = 4;
+	uv_close((uv_handle_t*) &writeBatchCheckHandle, &PipeConnection::onCloseStatic);
+	uv_close((uv_handle_t*) &writeBatchIdleHandle, &PipeConnection::onCloseStatic);
+	uv_close((uv_handle_t*) &writeBatchTimerHandle, &PipeConnection::onCloseStatic);
+	uv_close((uv_handle_t*) &pipeHandle, &PipeConnection::onCloseStatic);
 }
 
 void PipeConnection::onConnected(uv_connect_t* req, int status) {
@@ -62,102 +152,279 @@ void PipeConnection::onConnected(uv_connect_t* req, int status) {
 
 void PipeConnection::onAlloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
 	(void) handle;
+	(void) suggested_size;
+
+	ReadBuffer* readBuffer = readBufferPool.acquire();
 
-	buf->base = (char*) malloc(suggested_size);
-	buf->len = (unsigned int) suggested_size;
+	buf->base = (char*) readBuffer->data;
+	buf->len = (unsigned int) sizeof(readBuffer->data);
 }
 
 void PipeConnection::onRead(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
 	if(nread < 0) {
 		if(nread == UV_EOF) {
 			SPDLOG_DEBUG("client disconnected");
+		} else if(nread == UV_EIO) {
+			// Reading a tty whose other side was closed
+			SPDLOG_DEBUG("tty hung up");
 		} else {
 			int status = (int) nread;
 			SPDLOG_ERROR("failed to read data, uv error: {} ({})", uv_strerror(status), status);
 		}
-		free(buf->base);
+		releaseReadBuffer(buf);
 		close();
 		return;
 	}
 
 	SPDLOG_TRACE("Received {} bytes from pipe: {:a}", nread, spdlog::to_hex(buf->base, buf->base + nread, 16));
 
-	for(ssize_t i = 0; i < nread; i++) {
-		uint8_t byte = buf->base[i];
+	const uint8_t* data = (const uint8_t*) buf->base;
+	size_t remaining = (size_t) nread;
 
-		if(escapeNext) {
-			if(byte == ESC_END) {
-				byte = END;
-			} else if(byte == ESC_ESC) {
-				byte = ESC;
-			}
-			escapeNext = false;
-		} else {
-			if(byte == ESC) {
-				escapeNext = true;
-				continue;
-			} else if(byte == END) {
-				if(inputBuffer.size() > SlirpServer::SLIRP_ETHER_HEADER_SIZE) {
-					slirpServer->receivePacketFromGuest(&inputBuffer[0], inputBuffer.size());
-					resetInputBuffer();
-				}
+	// Frames found in a read are processed together
+	slirpServer->beginGuestPackets();
+
+	while(remaining > 0) {
+		if(!inputPacket)
+			startInputFrame();
+
+		bool frameEnd;
+		size_t consumed = frameCodec->decode(data, remaining, inputFrame, frameEnd);
+
+		data += consumed;
+		remaining -= consumed;
+
+		if(!frameEnd)
+			continue;
+
+		if(inputFrame.truncated) {
+			SPDLOG_WARN("Dropping frame larger than {} bytes", MAX_INPUT_FRAME_SIZE);
+			if(config.headerCompression)
+				vjCompression.setInputError();
+		} else if(inputFrame.length > 0) {
+			size_t packetLength = inputFrame.length;
+			if(config.headerCompression)
+				packetLength = vjCompression.uncompress(inputFrame);
+
+			if(packetLength > 0) {
+				slirpServer->receivePacketFromGuest(inputPacket,
+				                                    inputPacketData,
+				                                    SlirpServer::SLIRP_ETHER_HEADER_SIZE + packetLength);
+				inputPacket = nullptr;
 				continue;
 			}
 		}
-		inputBuffer.push_back(byte);
+		// The buffer is kept for the next frame
+		inputFrame.reset();
 	}
 
-	free(buf->base);
+	slirpServer->endGuestPackets();
+
+	releaseReadBuffer(buf);
+}
+
+void PipeConnection::startInputFrame() {
+	inputPacketData = slirpServer->getGuestPacketBuffer(SlirpServer::SLIRP_ETHER_HEADER_SIZE + INPUT_FRAME_INITIAL_SIZE,
+	                                                    &inputPacket);
+
+	inputFrame.data = inputPacketData + SlirpServer::SLIRP_ETHER_HEADER_SIZE;
+	inputFrame.capacity = INPUT_FRAME_INITIAL_SIZE;
+	inputFrame.reset();
+}
+
+void PipeConnection::releaseInputFrame() {
+	if(!inputPacket)
+		return;
+
+	slirpServer->releaseGuestPacketBuffer(inputPacket);
+	inputPacket = nullptr;
+}
+
+void PipeConnection::growInputFrame(size_t size) {
+	// Double the size to not grow again for each part of a large frame
+	size = std::min(std::max(size, 2 * inputFrame.capacity), MAX_INPUT_FRAME_SIZE);
+	if(size <= inputFrame.capacity)
+		return;
+
+	inputPacketData = slirpServer->growGuestPacketBuffer(inputPacket, SlirpServer::SLIRP_ETHER_HEADER_SIZE + size);
+
+	inputFrame.data = inputPacketData + SlirpServer::SLIRP_ETHER_HEADER_SIZE;
+	inputFrame.capacity = size;
+}
+
+void PipeConnection::releaseReadBuffer(const uv_buf_t* buf) {
+	// libuv gives back a null buffer on UV_ENOBUFS
+	if(buf->base != nullptr)
+		readBufferPool.release((ReadBuffer*) buf->base);
+}
+
+void PipeConnection::flushWriteBatch() {
+	WriteBatch* writeBatch = pendingWriteBatch;
+
+	uv_check_stop(&writeBatchCheckHandle);
+	uv_idle_stop(&writeBatchIdleHandle);
+	uv_timer_stop(&writeBatchTimerHandle);
+
+	if(writeBatch == nullptr)
+		return;
+	pendingWriteBatch = nullptr;
+
+	writeBatch->bufs.clear();
+	for(size_t i = 0; i < writeBatch->frameCount; i++) {
+		std::vector<uint8_t>& frame = writeBatch->frames[i];
+		writeBatch->bufs.push_back(uv_buf_init((char*) &frame[0], (unsigned int) frame.size()));
+	}
+
+	SPDLOG_TRACE("Writing {} frames ({} bytes) to pipe", writeBatch->frameCount, writeBatch->byteCount);
+
+	int result = uv_write(&writeBatch->writeReq,
+	                      (uv_stream_t*) &pipeHandle,
+	                      &writeBatch->bufs[0],
+	                      (unsigned int) writeBatch->bufs.size(),
+	                      &PipeConnection::onWriteStatic);
+	if(result < 0) {
+		SPDLOG_ERROR("failed to write data, uv error: {} ({})", uv_strerror(result), result);
+		releaseWriteBatch(writeBatch);
+	}
+}
+
+void PipeConnection::releaseWriteBatch(WriteBatch* writeBatch) {
+	writeBatch->frameCount = 0;
+	writeBatch->byteCount = 0;
+	writeBatchPool.release(writeBatch);
+}
+
+void PipeConnection::updateWriteQueueCongestion() {
+	// The server is not ours anymore once closed
+	if(uv_is_closing((uv_handle_t*) &pipeHandle))
+		return;
+
+	size_t queuedBytes = uv_stream_get_write_queue_size((uv_stream_t*) &pipeHandle);
+	if(pendingWriteBatch)
+		queuedBytes += pendingWriteBatch->byteCount;
+
+	if(!writeQueueCongested && queuedBytes >= config.writeQueueHighWatermark) {
+		writeQueueCongested = true;
+		slirpServer->setGuestLinkCongested(true);
+	} else if(writeQueueCongested && queuedBytes <= config.writeQueueLowWatermark) {
+		writeQueueCongested = false;
+		slirpServer->setGuestLinkCongested(false);
+	}
+}
+
+void PipeConnection::onWriteBatchCheck(uv_check_t* handle) {
+	if(pendingWriteBatch == nullptr)
+		return;
+
+	if(uv_now(handle->loop) - pendingWriteBatch->startTime >= config.writeBatchMaxDelayMs)
+		flushWriteBatch();
 }
 
 void PipeConnection::onWrite(uv_write_t* req, int status) {
-	WriteBuffer* writeBuffer = (WriteBuffer*) req->data;
+	// writeReq is the first member of WriteBatch
+	WriteBatch* writeBatch = (WriteBatch*) req;
 
 	if(status < 0) {
 		SPDLOG_ERROR("failed to write data, uv error: {} ({})", uv_strerror(status), status);
 	}
 
-	delete writeBuffer;
+	releaseWriteBatch(writeBatch);
+	updateWriteQueueCongestion();
 }
 
 void PipeConnection::onClose(uv_handle_t* handle) {
+	(void) handle;
+
+	// Wait for all handles to be closed
+	handlesToClose--;
+	if(handlesToClose > 0)
+		return;
+
+	const auto& readStats = readBufferPool.getStats();
+	const auto& writeStats = writeBatchPool.getStats();
+	SPDLOG_DEBUG("Read buffers: {} heap allocations, {} reuses, write batches: {} heap allocations, {} reuses",
+	             readStats.heapAllocations,
+	             readStats.reuses,
+	             writeStats.heapAllocations,
+	             writeStats.reuses);
+
 	slirpServer->detachClient(this);
 	if(onCloseFunction)
 		onCloseFunction();
 }
 
-void PipeConnection::sendSlirpPacketToGuest(const void* buf, size_t len) {
-	const uint8_t* bufToSend = ((const uint8_t*) buf);
+void PipeConnection::sendSlirpPacketToGuest(const SlirpIoVec* iov, int iovcnt) {
+	const uint8_t* header = (const uint8_t*) iov[0].iov_base;
+
+	if(uv_is_closing((uv_handle_t*) &pipeHandle))
+		return;
 
-	if(bufToSend[12] != 0x08 || bufToSend[13] != 0x00) {
-		SPDLOG_ERROR("SLiRP try to send a non-IPv4 packet with EtherType {:x}", (bufToSend[12] << 8) | bufToSend[13]);
+	if(header[12] != 0x08 || header[13] != 0x00) {
+		SPDLOG_ERROR("SLiRP try to send a non-IPv4 packet with EtherType {:x}", (header[12] << 8) | header[13]);
 		return;
 	}
 
 	// Send without ethernet header
-	bufToSend += SlirpServer::SLIRP_ETHER_HEADER_SIZE;
-	len -= SlirpServer::SLIRP_ETHER_HEADER_SIZE;
-
-	WriteBuffer* writeBuffer = new WriteBuffer;
-	writeBuffer->writeReq.data = writeBuffer;
-
-	writeBuffer->data.reserve(len + 10);
-	writeBuffer->data.push_back(END);
-	for(size_t i = 0; i < len; i++) {
-		uint8_t byte = bufToSend[i];
-		if(byte == END) {
-			writeBuffer->data.push_back(ESC);
-			writeBuffer->data.push_back(ESC_END);
-		} else if(byte == ESC) {
-			writeBuffer->data.push_back(ESC);
-			writeBuffer->data.push_back(ESC_ESC);
+	outputSegments.clear();
+	for(int i = 0; i < iovcnt; i++) {
+		const uint8_t* data = (const uint8_t*) iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+		if(i == 0) {
+			data += SlirpServer::SLIRP_ETHER_HEADER_SIZE;
+			len -= SlirpServer::SLIRP_ETHER_HEADER_SIZE;
+		}
+		if(len > 0)
+			outputSegments.push_back({data, len});
+	}
+
+	if(config.headerCompression) {
+		// Only the bytes that can hold the headers are copied to be compressed in place, the rest of the packet is
+		// encoded from the segments
+		size_t len = 0;
+		size_t copiedLength = 0;
+		size_t copiedSegments = 0;
+		for(IFrameCodec::Segment& segment : outputSegments) {
+			len += segment.len;
+			if(copiedLength == sizeof(compressionHeader))
+				continue;
+
+			size_t copied = std::min(segment.len, sizeof(compressionHeader) - copiedLength);
+			memcpy(compressionHeader + copiedLength, segment.data, copied);
+			copiedLength += copied;
+			segment.data += copied;
+			segment.len -= copied;
+			if(segment.len == 0)
+				copiedSegments++;
+		}
+
+		const uint8_t* packet = vjCompression.compress(compressionHeader, len);
+		outputSegments.erase(outputSegments.begin(), outputSegments.begin() + copiedSegments);
+		outputSegments.insert(outputSegments.begin(), {packet, (size_t) (compressionHeader + copiedLength - packet)});
+	}
+
+	if(pendingWriteBatch == nullptr) {
+		pendingWriteBatch = writeBatchPool.acquire();
+		pendingWriteBatch->writeReq.data = this;
+		pendingWriteBatch->startTime = uv_now(pipeHandle.loop);
+
+		uv_check_start(&writeBatchCheckHandle, &PipeConnection::onWriteBatchCheckStatic);
+		if(config.writeBatchMaxDelayMs == 0) {
+			uv_idle_start(&writeBatchIdleHandle, &PipeConnection::onWriteBatchIdle);
 		} else {
-			writeBuffer->data.push_back(byte);
+			uv_timer_start(&writeBatchTimerHandle, &PipeConnection::onWriteBatchTimer, config.writeBatchMaxDelayMs, 0);
 		}
 	}
-	writeBuffer->data.push_back(END);
 
-	writeBuffer->buf = uv_buf_init((char*) &writeBuffer->data[0], (unsigned int) writeBuffer->data.size());
+	std::vector<uint8_t>& frame = pendingWriteBatch->addFrame();
+	size_t encodedSize = frameCodec->encodedSize(outputSegments.data(), outputSegments.size());
+	if(encodedSize > frame.capacity())
+		writeBatchPool.countHeapAllocation();
+	frame.resize(encodedSize);
+	frameCodec->encode(outputSegments.data(), outputSegments.size(), &frame[0]);
+
+	pendingWriteBatch->byteCount += encodedSize;
+	if(pendingWriteBatch->byteCount >= config.writeBatchMaxBytes)
+		flushWriteBatch();
 
-	uv_write(&writeBuffer->writeReq, (uv_stream_t*) &pipeHandle, &writeBuffer->buf, 1, &PipeConnection::onWriteStatic);
+	updateWriteQueueCongestion();
 }
@@ -2,7 +2,10 @@
 
 #pragma once
 
+#include "IFrameCodec.h"
 #include "ISlirpClient.h"
+#include "ObjectPool.h"
+#include "VjCompression.h"
 #include <functional>
 #include <libslirp.h>
 #include <memory>
@@ -17,20 +20,57 @@ class SlirpServer;
 
 class PipeConnection : public ISlirpClient {
 public:
-	PipeConnection(SlirpServer* slirpServer);
+	enum class Framing { SLIP, LENGTH16, LENGTH32 };
+
+	struct Config {
+		Framing framing = Framing::SLIP;
+		// Frames sent to the guest are written together once they reach this size
+		size_t writeBatchMaxBytes = 65536;
+		// Maximum time a frame waits for following frames, 0 to write at the end of the loop iteration
+		uint64_t writeBatchMaxDelayMs = 0;
+		// Reading from host sockets is paused when the data queued for the guest goes above writeQueueHighWatermark
+		// and resumed once it is below writeQueueLowWatermark
+		size_t writeQueueHighWatermark = 1024 * 1024;
+		size_t writeQueueLowWatermark = 256 * 1024;
+		// CSLIP: compress TCP/IP headers with Van Jacobson compression (RFC 1144)
+		bool headerCompression = false;
+	};
+
+	PipeConnection(SlirpServer* slirpServer, const Config& config);
 	virtual ~PipeConnection();
+	// Connect to a named pipe or unix socket, or open a tty device like a PTY slave created by QEMU
 	void connectPipe(const char* pipePath);
 	void startRead();
 	void close();
 	void setOnCloseCallback(std::function<void()> onCloseFunction) { this->onCloseFunction = onCloseFunction; }
 
-	virtual void sendSlirpPacketToGuest(const void* data, size_t len) override;
+	virtual void sendSlirpPacketToGuest(const SlirpIoVec* iov, int iovcnt) override;
 
 	uv_pipe_t* getHandle() { return &pipeHandle; }
 
+#ifndef _WIN32
+	// Disable echo and line processing so frames go through the tty unchanged
+	static int setTtyRawMode(int fd);
+#endif
+
 private:
+	struct WriteBatch;
+
 	// functions
-	void resetInputBuffer();
+#ifndef _WIN32
+	void openTty(const char* ttyPath);
+#endif
+	void releaseReadBuffer(const uv_buf_t* buf);
+	void startInputFrame();
+	void releaseInputFrame();
+	static void growInputFrameStatic(IFrameCodec::FrameBuffer& frame, size_t size, void* opaque) {
+		(void) frame;
+		((PipeConnection*) opaque)->growInputFrame(size);
+	}
+	void growInputFrame(size_t size);
+	void flushWriteBatch();
+	void releaseWriteBatch(WriteBatch* writeBatch);
+	void updateWriteQueueCongestion();
 
 private:
 	// callbacks
@@ -53,27 +93,92 @@ private:
 	static void onWriteStatic(uv_write_t* req, int status) { ((PipeConnection*) req->data)->onWrite(req, status); }
 	void onWrite(uv_write_t* req, int status);
 
+	static void onWriteBatchCheckStatic(uv_check_t* handle) {
+		((PipeConnection*) handle->data)->onWriteBatchCheck(handle);
+	}
+	void onWriteBatchCheck(uv_check_t* handle);
+
+	static void onWriteBatchIdle(uv_idle_t* handle) { (void) handle; }
+	static void onWriteBatchTimer(uv_timer_t* handle) { (void) handle; }
+
 	static void onCloseStatic(uv_handle_t* handle) { ((PipeConnection*) handle->data)->onClose(handle); }
 	void onClose(uv_handle_t* handle);
 
 private:
-	struct WriteBuffer {
+	struct ReadBuffer {
+		// Read size used by libuv for pipes
+		constexpr static size_t SIZE = 65536;
+		uint8_t data[SIZE];
+
+		size_t memorySize() const { return sizeof(*this); }
+	};
+
+	// Encoded frames written to the pipe with a single uv_write
+	struct WriteBatch {
 		uv_write_t writeReq;
-		uv_buf_t buf;
-		std::vector<uint8_t> data;
+		std::vector<uv_buf_t> bufs;
+		// Only the first frameCount frames are used, others are kept to reuse their storage
+		std::vector<std::vector<uint8_t>> frames;
+		size_t frameCount = 0;
+		size_t byteCount = 0;
+		uint64_t startTime = 0;
+
+		std::vector<uint8_t>& addFrame() {
+			if(frameCount == frames.size())
+				frames.emplace_back();
+			return frames[frameCount++];
+		}
+
+		size_t memorySize() const {
+			size_t size = sizeof(*this) + bufs.capacity() * sizeof(uv_buf_t);
+			for(const auto& frame : frames) {
+				size += sizeof(frame) + frame.capacity();
+			}
+			return size;
+		}
 	};
 
+	// Maximum memory kept in pools for reuse
+	constexpr static size_t READ_BUFFER_POOL_MAX_BYTES = 4 * sizeof(ReadBuffer);
+	constexpr static size_t WRITE_BATCH_POOL_MAX_BYTES = 1024 * 1024;
+
 	SlirpServer* slirpServer;
+	Config config;
 	uv_pipe_t pipeHandle;
 	uv_connect_t connectReq;
 	std::string pipePath;
 
-	const static uint8_t END = 0xC0;      // Indicates the end of a packet.
-	const static uint8_t ESC = 0xDB;      // Indicates byte stuffing.
-	const static uint8_t ESC_END = 0xDC;  // ESC ESC_END means END data byte.
-	const static uint8_t ESC_ESC = 0xDD;  // ESC ESC_ESC means ESC data byte.
-	std::vector<uint8_t> inputBuffer;
-	bool escapeNext = false;
+	// Frames are queued in pendingWriteBatch and written from the check handle at the end of the loop iteration.
+	// The idle handle prevents the loop from blocking in poll while a batch is pending, the timer wakes
+	// it up when a maximum delay is configured.
+	WriteBatch* pendingWriteBatch = nullptr;
+	uv_check_t writeBatchCheckHandle;
+	uv_idle_t writeBatchIdleHandle;
+	uv_timer_t writeBatchTimerHandle;
+	int handlesToClose = 0;
+	bool writeQueueCongested = false;
+
+	// Maximum size of an IP packet received from the guest
+	constexpr static size_t MAX_INPUT_FRAME_SIZE = 65535;
+	// Size of the buffers first taken for received frames, the MTU configured on the guest
+	constexpr static size_t INPUT_FRAME_INITIAL_SIZE = 1500;
+
+	std::unique_ptr<IFrameCodec> frameCodec;
+	// Received frames are decoded in a buffer lent by libslirp, after an ethernet header, so they are given to it
+	// without a copy. It is taken when a frame starts and grown for frames larger than INPUT_FRAME_INITIAL_SIZE.
+	SlirpInputBuf* inputPacket = nullptr;
+	uint8_t* inputPacketData = nullptr;
+	IFrameCodec::FrameBuffer inputFrame;
+
+	// Only used with config.headerCompression, the headers of packets sent to the guest are copied in
+	// compressionHeader to be compressed in place, their payload is encoded from where libslirp left it
+	VjCompression vjCompression;
+	uint8_t compressionHeader[VjCompression::MAX_HEADER_SIZE];
+	// Parts of the packet being sent to the guest, without the ethernet header
+	std::vector<IFrameCodec::Segment> outputSegments;
+
+	ObjectPool<ReadBuffer> readBufferPool{READ_BUFFER_POOL_MAX_BYTES};
+	ObjectPool<WriteBatch> writeBatchPool{WRITE_BATCH_POOL_MAX_BYTES};
 
 	std::function<void()> onCloseFunction;
 };
@@ -2,21 +2,54 @@
 
 #include "PipeServer.h"
 #include "PipeConnection.h"
+#include "SlirpWorker.h"
 #include <algorithm>
 #include <libslirp.h>
 #include <spdlog/fmt/bin_to_hex.h>
 #include <spdlog/spdlog.h>
 #include <uv.h>
 
-PipeServer::PipeServer(SlirpServer* slirpServer) : slirpServer(slirpServer) {
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+PipeServer::PipeServer(SlirpServer* slirpServer, const PipeConnection::Config& connectionConfig)
+    : slirpServer(slirpServer), connectionConfig(connectionConfig) {
 	uv_pipe_init(uv_default_loop(), &pipeHandle, 0);
 	pipeHandle.data = this;
 }
 
+PipeServer::~PipeServer() {
+#ifndef _WIN32
+	if(ptySlaveFd >= 0)
+		close(ptySlaveFd);
+	if(!ptyLinkPath.empty())
+		unlink(ptyLinkPath.c_str());
+#endif
+}
+
 void PipeServer::listenPipe(const char* pipePath) {
 	int result;
 	this->pipePath = pipePath;
 
+#ifndef _WIN32
+	if(strcmp(pipePath, "pty") == 0 || strncmp(pipePath, "pty:", 4) == 0) {
+		listenPty(pipePath[3] == ':' ? pipePath + 4 : nullptr);
+		return;
+	}
+
+	// Remove the socket left by a previous run, bind would fail with EADDRINUSE
+	struct stat pathStat;
+	if(stat(pipePath, &pathStat) == 0 && S_ISSOCK(pathStat.st_mode)) {
+		SPDLOG_DEBUG("removing stale socket {}", pipePath);
+		unlink(pipePath);
+	}
+#endif
+
 	SPDLOG_INFO("Listening SLIP on pipe {}", pipePath);
 
 	result = uv_pipe_bind(&pipeHandle, pipePath);
@@ -24,7 +57,7 @@ void PipeServer::listenPipe(const char* pipePath) {
 		SPDLOG_ERROR("failed to bind to path {}: {} ({})", pipePath, uv_strerror(result), result);
 		return;
 	}
-	result = uv_listen((uv_stream_t*) &pipeHandle, 1, &PipeServer::onConnection);
+	result = uv_listen((uv_stream_t*) &pipeHandle, workers.empty() ? 1 : 128, &PipeServer::onConnection);
 	if(result < 0) {
 		SPDLOG_ERROR("failed to listen on path {}: {} ({})", pipePath, uv_strerror(result), result);
 		return;
@@ -39,18 +72,152 @@ void PipeServer::onConnection(uv_stream_t* server, int status) {
 		return;
 	}
 
-	PipeConnection* pipeConnection = new PipeConnection(thisInstance->slirpServer);
+	if(!thisInstance->workers.empty()) {
+		thisInstance->dispatchConnectionToWorker();
+		return;
+	}
+
+	PipeConnection* pipeConnection = new PipeConnection(thisInstance->slirpServer, thisInstance->connectionConfig);
+
+	pipeConnection->setOnCloseCallback([pipeConnection]() {
+		SPDLOG_INFO("SLIP Connection {} closed", (void*) pipeConnection);
+		delete pipeConnection;
+	});
+
 	int result = uv_accept(server, (uv_stream_t*) pipeConnection->getHandle());
 	if(result < 0) {
-		delete pipeConnection;
+		SPDLOG_ERROR("failed to accept connection on path {}: {} ({})",
+		             thisInstance->pipePath,
+		             uv_strerror(result),
+		             result);
+		pipeConnection->close();
+		return;
 	}
 
 	SPDLOG_INFO("Got SLIP connection {} on SLIP pipe", (void*) pipeConnection);
 
+	pipeConnection->startRead();
+}
+
+void PipeServer::dispatchConnectionToWorker() {
+	uv_pipe_t* acceptedPipe = new uv_pipe_t;
+	uv_os_fd_t pipeFd;
+	uv_os_fd_t workerPipeFd;
+	int result;
+
+	uv_pipe_init(pipeHandle.loop, acceptedPipe, 0);
+
+	result = uv_accept((uv_stream_t*) &pipeHandle, (uv_stream_t*) acceptedPipe);
+	if(result == 0)
+		result = uv_fileno((uv_handle_t*) acceptedPipe, &pipeFd);
+
+	if(result < 0) {
+		SPDLOG_ERROR("failed to accept connection on path {}: {} ({})", pipePath, uv_strerror(result), result);
+		uv_close((uv_handle_t*) acceptedPipe, &PipeServer::onAcceptedPipeClose);
+		return;
+	}
+
+	// Handles can't move between loops, give a duplicate of the OS handle to the worker and close this one
+#ifdef _WIN32
+	if(!DuplicateHandle(
+	       GetCurrentProcess(), pipeFd, GetCurrentProcess(), &workerPipeFd, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+		result = uv_translate_sys_error(GetLastError());
+	}
+#else
+	workerPipeFd = dup(pipeFd);
+	if(workerPipeFd < 0) {
+		result = uv_translate_sys_error(errno);
+	}
+#endif
+
+	uv_close((uv_handle_t*) acceptedPipe, &PipeServer::onAcceptedPipeClose);
+
+	if(result < 0) {
+		SPDLOG_ERROR("failed to duplicate connection handle: {} ({})", uv_strerror(result), result);
+		return;
+	}
+
+	getLeastLoadedWorker()->addConnection(workerPipeFd);
+}
+
+SlirpWorker* PipeServer::getLeastLoadedWorker() {
+	return *std::min_element(workers.begin(), workers.end(), [](SlirpWorker* a, SlirpWorker* b) {
+		return a->getGuestCount() < b->getGuestCount();
+	});
+}
+
+#ifndef _WIN32
+void PipeServer::listenPty(const char* linkPath) {
+	int masterFd;
+	const char* slaveName;
+	int result;
+
+	masterFd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(masterFd < 0 || grantpt(masterFd) < 0 || unlockpt(masterFd) < 0 || (slaveName = ptsname(masterFd)) == nullptr) {
+		result = uv_translate_sys_error(errno);
+		SPDLOG_ERROR("failed to create pty: {} ({})", uv_strerror(result), result);
+		if(masterFd >= 0)
+			close(masterFd);
+		return;
+	}
+
+	ptySlaveFd = open(slaveName, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if(ptySlaveFd < 0) {
+		result = uv_translate_sys_error(errno);
+		SPDLOG_ERROR("failed to open pty {}: {} ({})", slaveName, uv_strerror(result), result);
+		close(masterFd);
+		return;
+	}
+	fcntl(masterFd, F_SETFD, FD_CLOEXEC);
+
+	if(PipeConnection::setTtyRawMode(ptySlaveFd) < 0) {
+		SPDLOG_WARN("failed to set raw mode on {}: {}", slaveName, strerror(errno));
+	}
+
+	if(linkPath != nullptr) {
+		struct stat linkStat;
+
+		// Replace the link left by a previous run
+		if(lstat(linkPath, &linkStat) == 0 && S_ISLNK(linkStat.st_mode))
+			unlink(linkPath);
+
+		if(symlink(slaveName, linkPath) < 0) {
+			result = uv_translate_sys_error(errno);
+			SPDLOG_ERROR("failed to link {} to {}: {} ({})", linkPath, slaveName, uv_strerror(result), result);
+		} else {
+			ptyLinkPath = linkPath;
+		}
+	}
+
+	SPDLOG_INFO("Listening SLIP on pty {}", linkPath != nullptr ? linkPath : slaveName);
+	if(linkPath != nullptr)
+		SPDLOG_INFO("{} is a link to {}", linkPath, slaveName);
+
+	// The PTY has only one peer, its master side is the accepted connection
+	if(!workers.empty()) {
+		getLeastLoadedWorker()->addConnection(masterFd);
+		return;
+	}
+
+	PipeConnection* pipeConnection = new PipeConnection(slirpServer, connectionConfig);
+
 	pipeConnection->setOnCloseCallback([pipeConnection]() {
 		SPDLOG_INFO("SLIP Connection {} closed", (void*) pipeConnection);
 		delete pipeConnection;
 	});
 
+	result = uv_pipe_open(pipeConnection->getHandle(), masterFd);
+	if(result < 0) {
+		SPDLOG_ERROR("failed to open pty {}: {} ({})", slaveName, uv_strerror(result), result);
+		close(masterFd);
+		pipeConnection->close();
+		return;
+	}
+
 	pipeConnection->startRead();
 }
+#endif
+
+void PipeServer::onAcceptedPipeClose(uv_handle_t* handle) {
+	delete(uv_pipe_t*) handle;
+}
@@ -2,6 +2,7 @@
 
 #pragma once
 
+#include "PipeConnection.h"
 #include <libslirp.h>
 #include <memory>
 #include <stdint.h>
@@ -12,19 +13,41 @@
 #include <vector>
 
 class SlirpServer;
+class SlirpWorker;
 
 class PipeServer {
 public:
-	PipeServer(SlirpServer* slirpServer);
+	PipeServer(SlirpServer* slirpServer, const PipeConnection::Config& connectionConfig);
+	~PipeServer();
 
+	// Accept multiple guests, each connection is handed to the least loaded worker instead of slirpServer
+	void setWorkers(const std::vector<SlirpWorker*>& workers) { this->workers = workers; }
+
+	// Listen on a named pipe or unix socket. On POSIX systems, "pty" or "pty:<link>" creates a PTY instead and its
+	// slave side is used as the guest serial port, optionally through a symlink at <link>
 	void listenPipe(const char* pipePath);
 
+private:
+	// functions
+	void dispatchConnectionToWorker();
+	SlirpWorker* getLeastLoadedWorker();
+#ifndef _WIN32
+	void listenPty(const char* linkPath);
+#endif
+
 private:
 	// callbacks
 	static void onConnection(uv_stream_t* server, int status);
+	static void onAcceptedPipeClose(uv_handle_t* handle);
 
 private:
 	SlirpServer* slirpServer;
+	std::vector<SlirpWorker*> workers;
+	PipeConnection::Config connectionConfig;
 	uv_pipe_t pipeHandle;
 	std::string pipePath;
+
+	// The PTY slave is kept open so reading the master doesn't fail while the guest has not opened it yet
+	int ptySlaveFd = -1;
+	std::string ptyLinkPath;
 };
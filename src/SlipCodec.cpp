@@ -0,0 +1,236 @@
+// SPDX-License-Identifier: MIT
+
+#include "SlipCodec.h"
+#include <bit>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SLIP_CODEC_SSE2
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SLIP_CODEC_AVX2
+#define SLIP_CODEC_TARGET_AVX2
+#elif defined(__GNUC__)
+#define SLIP_CODEC_AVX2
+#define SLIP_CODEC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+static size_t findSpecialByteScalar(const uint8_t* data, size_t len) {
+	for(size_t i = 0; i < len; i++) {
+		if(data[i] == SlipCodec::END || data[i] == SlipCodec::ESC)
+			return i;
+	}
+	return len;
+}
+
+static size_t countSpecialBytesScalar(const uint8_t* data, size_t len) {
+	size_t count = 0;
+	for(size_t i = 0; i < len; i++) {
+		count += (data[i] == SlipCodec::END) + (data[i] == SlipCodec::ESC);
+	}
+	return count;
+}
+
+#ifdef SLIP_CODEC_SSE2
+static size_t findSpecialByteSse2(const uint8_t* data, size_t len) {
+	const __m128i end = _mm_set1_epi8((char) SlipCodec::END);
+	const __m128i esc = _mm_set1_epi8((char) SlipCodec::ESC);
+	size_t i = 0;
+
+	for(; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*) (data + i));
+		__m128i special = _mm_or_si128(_mm_cmpeq_epi8(chunk, end), _mm_cmpeq_epi8(chunk, esc));
+		unsigned int mask = (unsigned int) _mm_movemask_epi8(special);
+		if(mask)
+			return i + std::countr_zero(mask);
+	}
+
+	return i + findSpecialByteScalar(data + i, len - i);
+}
+
+static size_t countSpecialBytesSse2(const uint8_t* data, size_t len) {
+	const __m128i end = _mm_set1_epi8((char) SlipCodec::END);
+	const __m128i esc = _mm_set1_epi8((char) SlipCodec::ESC);
+	size_t count = 0;
+	size_t i = 0;
+
+	for(; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*) (data + i));
+		__m128i special = _mm_or_si128(_mm_cmpeq_epi8(chunk, end), _mm_cmpeq_epi8(chunk, esc));
+		count += std::popcount((unsigned int) _mm_movemask_epi8(special));
+	}
+
+	return count + countSpecialBytesScalar(data + i, len - i);
+}
+#endif
+
+#ifdef SLIP_CODEC_AVX2
+SLIP_CODEC_TARGET_AVX2 static size_t findSpecialByteAvx2(const uint8_t* data, size_t len) {
+	const __m256i end = _mm256_set1_epi8((char) SlipCodec::END);
+	const __m256i esc = _mm256_set1_epi8((char) SlipCodec::ESC);
+	size_t i = 0;
+
+	for(; i + 32 <= len; i += 32) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i*) (data + i));
+		__m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, end), _mm256_cmpeq_epi8(chunk, esc));
+		unsigned int mask = (unsigned int) _mm256_movemask_epi8(special);
+		if(mask)
+			return i + std::countr_zero(mask);
+	}
+
+	return i + findSpecialByteSse2(data + i, len - i);
+}
+
+SLIP_CODEC_TARGET_AVX2 static size_t countSpecialBytesAvx2(const uint8_t* data, size_t len) {
+	const __m256i end = _mm256_set1_epi8((char) SlipCodec::END);
+	const __m256i esc = _mm256_set1_epi8((char) SlipCodec::ESC);
+	size_t count = 0;
+	size_t i = 0;
+
+	for(; i + 32 <= len; i += 32) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i*) (data + i));
+		__m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, end), _mm256_cmpeq_epi8(chunk, esc));
+		count += std::popcount((unsigned int) _mm256_movemask_epi8(special));
+	}
+
+	return count + countSpecialBytesSse2(data + i, len - i);
+}
+
+static bool cpuHasAvx2() {
+#if defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 0);
+	if(info[0] < 7)
+		return false;
+
+	// AVX2 requires the OS to save YMM registers (OSXSAVE + XCR0 bits 1 and 2)
+	__cpuid(info, 1);
+	if((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+		return false;
+	if((_xgetbv(0) & 0x6) != 0x6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+struct SlipScanFunctions {
+	size_t (*findSpecialByte)(const uint8_t* data, size_t len);
+	size_t (*countSpecialBytes)(const uint8_t* data, size_t len);
+};
+
+static SlipScanFunctions selectScanFunctions() {
+#if defined(SLIP_CODEC_AVX2)
+	if(cpuHasAvx2())
+		return {&findSpecialByteAvx2, &countSpecialBytesAvx2};
+#endif
+#if defined(SLIP_CODEC_SSE2)
+	return {&findSpecialByteSse2, &countSpecialBytesSse2};
+#else
+	return {&findSpecialByteScalar, &countSpecialBytesScalar};
+#endif
+}
+
+static const SlipScanFunctions scanFunctions = selectScanFunctions();
+
+size_t SlipCodec::findSpecialByte(const uint8_t* data, size_t len) {
+	return scanFunctions.findSpecialByte(data, len);
+}
+
+size_t SlipCodec::countSpecialBytes(const uint8_t* data, size_t len) {
+	return scanFunctions.countSpecialBytes(data, len);
+}
+
+size_t SlipCodec::encodedSize(const Segment* segments, size_t count) const {
+	size_t size = 2;
+
+	for(size_t i = 0; i < count; i++) {
+		size += segments[i].len + countSpecialBytes(segments[i].data, segments[i].len);
+	}
+
+	return size;
+}
+
+uint8_t* SlipCodec::escape(const uint8_t* data, size_t len, uint8_t* output) {
+	size_t i = 0;
+
+	while(i < len) {
+		size_t runLength = findSpecialByte(data + i, len - i);
+
+		memcpy(output, data + i, runLength);
+		output += runLength;
+		i += runLength;
+
+		if(i >= len)
+			break;
+
+		*output++ = ESC;
+		*output++ = data[i] == END ? ESC_END : ESC_ESC;
+		i++;
+	}
+
+	return output;
+}
+
+size_t SlipCodec::encode(const Segment* segments, size_t count, uint8_t* output) const {
+	uint8_t* outputStart = output;
+
+	*output++ = END;
+
+	for(size_t i = 0; i < count; i++) {
+		output = escape(segments[i].data, segments[i].len, output);
+	}
+
+	*output++ = END;
+
+	return (size_t) (output - outputStart);
+}
+
+size_t SlipCodec::decode(const uint8_t* data, size_t len, FrameBuffer& frame, bool& frameEnd) {
+	size_t i = 0;
+
+	frameEnd = false;
+
+	// Finish an escape sequence split by the previous read
+	if(escapeNext && len > 0) {
+		uint8_t byte = unescape(data[0]);
+		frame.append(&byte, 1);
+		escapeNext = false;
+		i = 1;
+	}
+
+	while(i < len) {
+		size_t runLength = findSpecialByte(data + i, len - i);
+
+		frame.append(data + i, runLength);
+		i += runLength;
+
+		if(i >= len)
+			break;
+
+		if(data[i] == END) {
+			frameEnd = true;
+			return i + 1;
+		}
+
+		// ESC byte
+		i++;
+		if(i >= len) {
+			escapeNext = true;
+			break;
+		}
+
+		uint8_t byte = unescape(data[i]);
+		frame.append(&byte, 1);
+		i++;
+	}
+
+	return i;
+}
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "IFrameCodec.h"
+#include <stddef.h>
+#include <stdint.h>
+
+class SlipCodec : public IFrameCodec {
+public:
+	static constexpr uint8_t END = 0xC0;      // Indicates the end of a packet.
+	static constexpr uint8_t ESC = 0xDB;      // Indicates byte stuffing.
+	static constexpr uint8_t ESC_END = 0xDC;  // ESC ESC_END means END data byte.
+	static constexpr uint8_t ESC_ESC = 0xDD;  // ESC ESC_ESC means ESC data byte.
+
+	// Decode SLIP data into frame until the end of a frame or the end of data.
+	// Returns the number of bytes consumed, frameEnd is set when an END byte was reached.
+	// The escape state is kept between calls so an escape sequence can be split across reads.
+	virtual size_t decode(const uint8_t* data, size_t len, FrameBuffer& frame, bool& frameEnd) override;
+
+	// Return the size of the data in segments once encoded as a SLIP frame, including both END delimiters.
+	virtual size_t encodedSize(const Segment* segments, size_t count) const override;
+
+	// Encode the data in segments as a SLIP frame into output which must hold at least encodedSize() bytes.
+	// Returns the number of bytes written.
+	virtual size_t encode(const Segment* segments, size_t count, uint8_t* output) const override;
+
+	// Return the offset of the first END or ESC byte in data, or len if there is none.
+	static size_t findSpecialByte(const uint8_t* data, size_t len);
+
+	// Return the number of END and ESC bytes in data.
+	static size_t countSpecialBytes(const uint8_t* data, size_t len);
+
+private:
+	// Escape data into output, returns the end of the written bytes
+	static uint8_t* escape(const uint8_t* data, size_t len, uint8_t* output);
+
+	static uint8_t unescape(uint8_t byte) {
+		if(byte == ESC_END)
+			return END;
+		else if(byte == ESC_ESC)
+			return ESC;
+		return byte;
+	}
+
+private:
+	bool escapeNext = false;
+};
@@ -5,6 +5,7 @@
 #include "SlirpServer.h"
 #include <algorithm>
 #include <libslirp.h>
+#include <mutex>
 #include <spdlog/fmt/bin_to_hex.h>
 #include <spdlog/spdlog.h>
 #include <uv.h>
@@ -29,26 +30,37 @@ const uint8_t SlirpServer::SLIRP_ETHER_HEADER[SLIRP_ETHER_HEADER_SIZE] = {
     0x00,
 };
 
-SlirpServer::SlirpServer() {}
+// slirp_new initializes libslirp globals on first use
+static std::mutex slirpNewMutex;
 
-void SlirpServer::init(bool disableHostAccess, const std::vector<std::pair<uint16_t, uint16_t>>& forwardedPorts) {
+static struct in_addr makeInAddr(const char* address) {
+	struct in_addr addr;
+	addr.s_addr = inet_addr(address);
+	return addr;
+}
+
+SlirpServer::SlirpServer(uv_loop_t* loop) : loop(loop) {}
+
+void SlirpServer::init(bool disableHostAccess,
+                       unsigned int udpNatSockets,
+                       const std::vector<std::pair<uint16_t, uint16_t>>& forwardedPorts) {
 	SlirpConfig config = {
-	    .version = 4,
+	    .version = 8,
 	    .restricted = false,
 	    .in_enabled = true,
-	    .vnetwork = {.S_un = {.S_addr = inet_addr("192.168.10.0")}},
-	    .vnetmask = {.S_un = {.S_addr = inet_addr("255.255.255.0")}},
-	    .vhost = {.S_un = {.S_addr = inet_addr("192.168.10.1")}},
-	    .vdhcp_start = {.S_un = {.S_addr = inet_addr("192.168.10.15")}},
-	    .vnameserver = {.S_un = {.S_addr = inet_addr("192.168.10.2")}},
+	    .vnetwork = makeInAddr("192.168.10.0"),
+	    .vnetmask = makeInAddr("255.255.255.0"),
+	    .vhost = makeInAddr("192.168.10.1"),
+	    .vdhcp_start = makeInAddr("192.168.10.15"),
+	    .vnameserver = makeInAddr("192.168.10.2"),
 	    .disable_host_loopback = disableHostAccess,
 	    .enable_emu = false,
 	    .disable_dns = false,
 	    .disable_dhcp = false,
+	    .udp_nat_sockets = udpNatSockets,
 	};
 
 	static struct SlirpCb callbacks = {
-	    .send_packet = &SlirpServer::onSlirpWrite,
 	    .guest_error = &SlirpServer::onSlirpGuestError,
 	    .clock_get_ns = &SlirpServer::onSlirpClockGetNs,
 	    .timer_free = &SlirpServer::onSlirpTimerFree,
@@ -57,6 +69,8 @@ void SlirpServer::init(bool disableHostAccess, const std::vector<std::pair<uint1
 	    .unregister_poll_fd = &SlirpServer::onSlirpUnregisterFd,
 	    .notify = &SlirpServer::onSlirpNotify,
 	    .timer_new_opaque = &SlirpServer::onSlirpTimerNew,
+	    .update_poll = &SlirpServer::onSlirpUpdatePoll,
+	    .send_packet_iov = &SlirpServer::onSlirpWrite,
 	};
 
 	SPDLOG_INFO("Gateway IP: 192.168.10.1");
@@ -67,10 +81,16 @@ void SlirpServer::init(bool disableHostAccess, const std::vector<std::pair<uint1
 	if(disableHostAccess)
 		SPDLOG_INFO("Access to host ports is disabled");
 
-	slirpHandle = slirp_new(&config, &callbacks, this);
+	if(udpNatSockets > 0)
+		SPDLOG_INFO("UDP NAT mode: {} shared host sockets per address family", udpNatSockets);
 
-	struct in_addr localhost = {.S_un = {.S_addr = inet_addr("127.0.0.1")}};
-	struct in_addr guestAddr = {.S_un = {.S_addr = inet_addr("192.168.10.15")}};
+	{
+		std::lock_guard<std::mutex> lock(slirpNewMutex);
+		slirpHandle = slirp_new(&config, &callbacks, this);
+	}
+
+	struct in_addr localhost = makeInAddr("127.0.0.1");
+	struct in_addr guestAddr = makeInAddr("192.168.10.15");
 
 	for(const auto& portToForward : forwardedPorts) {
 		SPDLOG_INFO("Forwarded port: 127.0.0.1:{} -> 192.168.10.15:{}", portToForward.first, portToForward.second);
@@ -80,16 +100,52 @@ void SlirpServer::init(bool disableHostAccess, const std::vector<std::pair<uint1
 		}
 	}
 
-	uv_prepare_init(uv_default_loop(), &prepareHandle);
+	uv_prepare_init(loop, &prepareHandle);
 	prepareHandle.data = this;
 	uv_prepare_start(&prepareHandle, &SlirpServer::onSlirpPrepareStatic);
 
-	uv_timer_init(uv_default_loop(), &pollTimerHandle);
+	uv_timer_init(loop, &pollTimerHandle);
 	pollTimerHandle.data = this;
 
 	updateArpTable();
 }
 
+void SlirpServer::close(std::function<void()> onClosed) {
+	onClosedFunction = onClosed;
+
+	if(slirpHandle == nullptr) {
+		if(onClosedFunction)
+			onClosedFunction();
+		return;
+	}
+
+	// Stop polling sockets before libslirp closes them
+	handlesToClose = 2 + (int) fdsToPoll.size();
+	for(auto& fdToPoll : fdsToPoll) {
+		uv_close((uv_handle_t*) &fdToPoll.second->pollHandle, &SlirpServer::onSlirpPollCloseOnShutdown);
+		fdToPoll.second.release();  // will be freed by the onSlirpPollCloseOnShutdown function
+	}
+	fdsToPoll.clear();
+
+	uv_close((uv_handle_t*) &prepareHandle, &SlirpServer::onCloseStatic);
+	uv_close((uv_handle_t*) &pollTimerHandle, &SlirpServer::onCloseStatic);
+
+	slirp_cleanup(slirpHandle);
+	slirpHandle = nullptr;
+}
+
+void SlirpServer::onClose(uv_handle_t* handle) {
+	(void) handle;
+
+	// Wait for all handles to be closed
+	handlesToClose--;
+	if(handlesToClose > 0)
+		return;
+
+	if(onClosedFunction)
+		onClosedFunction();
+}
+
 void SlirpServer::attachClient(ISlirpClient* client) {
 	if(this->slirpClient) {
 		this->slirpClient->close();
@@ -98,8 +154,73 @@ void SlirpServer::attachClient(ISlirpClient* client) {
 }
 
 void SlirpServer::detachClient(ISlirpClient* client) {
-	if(this->slirpClient == client)
+	if(this->slirpClient == client) {
 		this->slirpClient = nullptr;
+		setGuestLinkCongested(false);
+		logGuestQueueStats();
+	}
+}
+
+void SlirpServer::setGuestLinkCongested(bool congested) {
+	if(guestLinkCongested == congested)
+		return;
+
+	if(congested)
+		SPDLOG_DEBUG("guest link congested, pausing reads from host sockets");
+	else
+		SPDLOG_DEBUG("guest link drained, resuming reads from host sockets");
+
+	guestLinkCongested = congested;
+	updateSlirpPoll = true;
+
+	for(auto& fdToPoll : fdsToPoll)
+		applyPollEvents(fdToPoll.second.get());
+
+	// Keep the packets in libslirp's FQ-CoDel queues rather than in the pipe write queue
+	if(slirpHandle)
+		slirp_set_output_paused(slirpHandle, congested);
+}
+
+void SlirpServer::logGuestQueueStats() {
+	SlirpIfStats stats;
+	slirp_get_if_stats(slirpHandle, &stats);
+
+	SPDLOG_DEBUG(
+	    "guest queue: {} packets sent, average sojourn {} us, max {} us, {} dropped over limit, {} dropped by CoDel, "
+	    "{} ECN marked, {} expired, {} still queued",
+	    stats.sent_packets,
+	    stats.sent_packets ? stats.sojourn_total_ns / stats.sent_packets / 1000 : 0,
+	    stats.sojourn_max_ns / 1000,
+	    stats.overlimit_drops,
+	    stats.codel_drops,
+	    stats.ecn_marks,
+	    stats.expired_drops,
+	    stats.backlog_packets);
+
+	SlirpMbufStats mbufStats;
+	slirp_get_mbuf_stats(slirpHandle, &mbufStats);
+
+	SPDLOG_DEBUG("packet buffers: {} allocated, {} not from the pool, {} of {} pooled, peak {} in use, "
+	             "{} extended, {} not from the pool",
+	             mbufStats.allocs,
+	             mbufStats.pool_misses,
+	             mbufStats.pool_allocated,
+	             mbufStats.pool_capacity,
+	             mbufStats.in_use_max,
+	             mbufStats.ext_allocs,
+	             mbufStats.ext_pool_misses);
+
+	SlirpDnsCacheStats dnsStats;
+	slirp_get_dns_cache_stats(slirpHandle, &dnsStats);
+
+	SPDLOG_DEBUG("DNS cache: {} of {} entries, {} hits ({} negative), {} misses, {} coalesced, {} evicted",
+	             dnsStats.entries,
+	             dnsStats.capacity,
+	             dnsStats.hits,
+	             dnsStats.negative_hits,
+	             dnsStats.misses,
+	             dnsStats.coalesced,
+	             dnsStats.evictions);
 }
 
 void SlirpServer::updateArpTable() {
@@ -154,92 +275,68 @@ void SlirpServer::updateSlirpPollFds() {
 	if(updateSlirpPoll) {
 		updateSlirpPoll = false;
 
-		slirp_pollfds_poll(slirpHandle, 0, &SlirpServer::getSlirpRevents, this);
-
+		// Only the fds whose events changed are reported, through onSlirpUpdatePoll
 		uint32_t timeout = UINT32_MAX;
-		activeFds.clear();
-		std::for_each(fdsToPoll.begin(), fdsToPoll.end(), [this](const auto& pair) { activeFds.insert(pair.first); });
-		slirp_pollfds_fill(slirpHandle, &timeout, &SlirpServer::addSlirpFdToPoll, this);
-
-		for(auto& removedFd : activeFds) {
-			auto it = fdsToPoll.find(removedFd);
-			if(it != fdsToPoll.end()) {
-				SPDLOG_DEBUG("removing poll on fd {}", removedFd);
-				uv_poll_stop(&it->second->pollHandle);
-				uv_close((uv_handle_t*) &it->second->pollHandle, &SlirpServer::onSlirpPollClose);
-				it->second.release();  // will be freed by the onClosePoll function
-				fdsToPoll.erase(it);
-			} else {
-				SPDLOG_WARN("removed fd not found in fdsToPoll: {}", removedFd);
-			}
-		}
+		slirp_pollfds_update(slirpHandle, &timeout);
 
+		// No timeout means no libslirp timer is pending, so the loop can sleep until an fd or the guest wakes it.
+		// An armed timer is only moved when the deadline comes sooner, a later one just costs an early update.
 		if(timeout != UINT32_MAX) {
-			uv_timer_start(&pollTimerHandle, &SlirpServer::onSlirpPollTimeout, timeout, 0);
-		} else {
+			uint64_t deadline = uv_now(loop) + timeout;
+			if(!uv_is_active((uv_handle_t*) &pollTimerHandle) || deadline < pollTimerDeadline) {
+				uv_timer_start(&pollTimerHandle, &SlirpServer::onSlirpPollTimeout, timeout, 0);
+				pollTimerDeadline = deadline;
+			}
+		} else if(uv_is_active((uv_handle_t*) &pollTimerHandle)) {
 			uv_timer_stop(&pollTimerHandle);
 		}
 	}
 }
 
-int SlirpServer::addSlirpFdToPoll(int fd, int events, void* opaque) {
-	SlirpServer* thisInstance = (SlirpServer*) opaque;
-	FdInfo* fdInfo;
-
-	if(thisInstance->fdsToPoll.contains(fd)) {
-		fdInfo = thisInstance->fdsToPoll[fd].get();
-	} else {
-		SPDLOG_DEBUG("new poll fd {}", fd);
-		thisInstance->fdsToPoll[fd] = std::make_unique<FdInfo>();
-		fdInfo = thisInstance->fdsToPoll[fd].get();
-		uv_poll_init_socket(uv_default_loop(), &fdInfo->pollHandle, fd);
-		fdInfo->fd = fd;
-		fdInfo->events = 0;
-		fdInfo->pollHandle.data = fdInfo;
-		fdInfo->connection = thisInstance;
-		fdInfo->connection = thisInstance;
-		fdInfo->activeUvEvents = 0;
-	}
-
-	thisInstance->activeFds.erase(fd);
-
+void SlirpServer::applyPollEvents(FdInfo* fdInfo) {
 	int uvEvents = 0;
 
-	if(events & SLIRP_POLL_IN)
+	// Host data would only pile up in the guest link write queue
+	if((fdInfo->slirpEvents & SLIRP_POLL_IN) && !guestLinkCongested)
 		uvEvents |= UV_READABLE;
-	if(events & SLIRP_POLL_OUT)
+	if(fdInfo->slirpEvents & SLIRP_POLL_OUT)
 		uvEvents |= UV_WRITABLE;
-	//	if(events & SLIRP_POLL_HUP)
-	//		uvEvents |= UV_DISCONNECT;
 
-	if(fdInfo->activeUvEvents == uvEvents) {
-		SPDLOG_DEBUG("already polling on fd {} with uv events {}", fd, uvEvents);
-		return fd;
-	}
+	if(fdInfo->activeUvEvents == uvEvents)
+		return;
 
 	fdInfo->activeUvEvents = uvEvents;
 
-	SPDLOG_DEBUG("start poll on fd {} with uv events {}", fd, uvEvents);
-	uv_poll_start(&fdInfo->pollHandle, uvEvents, &SlirpServer::onSlirpPoll);
-
-	return fd;
+	if(uvEvents) {
+		SPDLOG_DEBUG("start poll on fd {} with uv events {}", fdInfo->fd, uvEvents);
+		uv_poll_start(&fdInfo->pollHandle, uvEvents, &SlirpServer::onSlirpPoll);
+	} else {
+		SPDLOG_DEBUG("stop poll on fd {}", fdInfo->fd);
+		uv_poll_stop(&fdInfo->pollHandle);
+	}
 }
 
-int SlirpServer::getSlirpRevents(int fd, void* opaque) {
+void SlirpServer::onSlirpUpdatePoll(int fd, int events, void* opaque) {
 	SlirpServer* thisInstance = (SlirpServer*) opaque;
+	FdInfo* fdInfo;
 
 	auto it = thisInstance->fdsToPoll.find(fd);
 	if(it != thisInstance->fdsToPoll.end()) {
-		if(it->second->events) {
-			SPDLOG_DEBUG("poll revents on fd {} = {}", fd, it->second->events);
-		}
-		int events = it->second->events;
-		it->second->events = 0;
-		return events;
+		fdInfo = it->second.get();
 	} else {
-		SPDLOG_DEBUG("poll get revents not found fd {}", fd);
-		return 0;
+		SPDLOG_DEBUG("new poll fd {}", fd);
+		auto newFdInfo = std::make_unique<FdInfo>();
+		fdInfo = newFdInfo.get();
+		uv_poll_init_socket(thisInstance->loop, &fdInfo->pollHandle, fd);
+		fdInfo->fd = fd;
+		fdInfo->activeUvEvents = 0;
+		fdInfo->pollHandle.data = fdInfo;
+		fdInfo->connection = thisInstance;
+		thisInstance->fdsToPoll[fd] = std::move(newFdInfo);
 	}
+
+	fdInfo->slirpEvents = events;
+	thisInstance->applyPollEvents(fdInfo);
 }
 
 void SlirpServer::onSlirpPrepare(uv_prepare_t* handle) {
@@ -249,23 +346,37 @@ void SlirpServer::onSlirpPrepare(uv_prepare_t* handle) {
 
 void SlirpServer::onSlirpPoll(uv_poll_t* handle, int status, int events) {
 	FdInfo* thisInstance = (FdInfo*) handle->data;
-	thisInstance->connection->updateSlirpPoll = true;
+	SlirpServer* slirpServer = thisInstance->connection;
+	int fd = thisInstance->fd;
+	int revents = 0;
 
 	if(status < 0) {
-		SPDLOG_ERROR("poll failed: {}", -status);
+		// libuv reports POLLERR this way and stops the handle, on UDP sockets it only means an ICMP error is queued
+		SPDLOG_DEBUG("poll error on fd {}: {}", fd, uv_strerror(status));
+		revents = SLIRP_POLL_ERR;
+		thisInstance->activeUvEvents = 0;
 	} else {
 		SPDLOG_DEBUG("poll triggerred on {} with uv events {}", thisInstance->fd, events);
 
 		if(events & UV_READABLE)
-			thisInstance->events |= SLIRP_POLL_IN;
+			revents |= SLIRP_POLL_IN;
 		if(events & UV_WRITABLE)
-			thisInstance->events |= SLIRP_POLL_OUT;
+			revents |= SLIRP_POLL_OUT;
 		if(events & UV_DISCONNECT)
-			thisInstance->events |= SLIRP_POLL_HUP;
+			revents |= SLIRP_POLL_HUP;
 	}
 
-	thisInstance->activeUvEvents = 0;
-	uv_poll_stop(handle);
+	// The handle stays armed, libslirp reports any change of interest through onSlirpUpdatePoll.
+	// This may also unregister the fd and close the handle.
+	slirp_pollfd_ready(slirpServer->slirpHandle, fd, revents);
+	slirpServer->updateSlirpPoll = true;
+
+	// Arm the handle libuv stopped again, unless the fd was unregistered meanwhile
+	if(status < 0) {
+		auto it = slirpServer->fdsToPoll.find(fd);
+		if(it != slirpServer->fdsToPoll.end() && it->second.get() == thisInstance)
+			slirpServer->applyPollEvents(thisInstance);
+	}
 }
 
 void SlirpServer::onSlirpPollClose(uv_handle_t* handle) {
@@ -274,26 +385,63 @@ void SlirpServer::onSlirpPollClose(uv_handle_t* handle) {
 	delete thisInstance;
 }
 
+void SlirpServer::onSlirpPollCloseOnShutdown(uv_handle_t* handle) {
+	FdInfo* thisInstance = (FdInfo*) handle->data;
+	SlirpServer* slirpServer = thisInstance->connection;
+
+	delete thisInstance;
+	slirpServer->onClose(handle);
+}
+
 void SlirpServer::onSlirpPollTimeout(uv_timer_t* timer) {
 	SlirpServer* thisInstance = (SlirpServer*) timer->data;
 	thisInstance->updateSlirpPoll = true;
 	SPDLOG_DEBUG("poll timeout");
 }
 
-void SlirpServer::receivePacketFromGuest(const void* data, size_t len) {
-	SPDLOG_DEBUG("Received SLIP packet: {:a}", spdlog::to_hex((uint8_t*) data, (uint8_t*) data + len, 16));
+uint8_t* SlirpServer::getGuestPacketBuffer(size_t size, SlirpInputBuf** buffer) {
+	uint8_t* data = slirp_input_buf_get(slirpHandle, (int) size, buffer);
 
-	slirp_input(slirpHandle, (const uint8_t*) data, (int) len);
+	std::copy_n(SLIRP_ETHER_HEADER, SLIRP_ETHER_HEADER_SIZE, data);
+	return data;
+}
+
+uint8_t* SlirpServer::growGuestPacketBuffer(SlirpInputBuf* buffer, size_t size) {
+	return slirp_input_buf_grow(buffer, (int) size);
+}
+
+void SlirpServer::releaseGuestPacketBuffer(SlirpInputBuf* buffer) {
+	slirp_input_buf_free(buffer);
+}
+
+void SlirpServer::receivePacketFromGuest(SlirpInputBuf* buffer, const uint8_t* data, size_t len) {
+	SPDLOG_DEBUG("Received SLIP packet: {:a}", spdlog::to_hex(data, data + len, 16));
+
+	slirp_input_buf_commit(buffer, (int) len);
 	updateSlirpPoll = true;
 }
 
-slirp_ssize_t SlirpServer::onSlirpWrite(const void* buf, size_t len, void* opaque) {
+void SlirpServer::beginGuestPackets() {
+	slirp_input_batch_begin(slirpHandle);
+}
+
+void SlirpServer::endGuestPackets() {
+	slirp_input_batch_end(slirpHandle);
+}
+
+slirp_ssize_t SlirpServer::onSlirpWrite(const SlirpIoVec* iov, int iovcnt, void* opaque) {
 	SlirpServer* thisInstance = (SlirpServer*) opaque;
-	const uint8_t* bufToSend = ((const uint8_t*) buf);
+	size_t len = 0;
 
-	SPDLOG_DEBUG("Sending {} bytes from pipe: {:a}", len, spdlog::to_hex(bufToSend, bufToSend + len, 16));
+	for(int i = 0; i < iovcnt; i++) {
+		const uint8_t* part = (const uint8_t*) iov[i].iov_base;
+		SPDLOG_DEBUG("Sending {} bytes from pipe: {:a}", iov[i].iov_len, spdlog::to_hex(part, part + iov[i].iov_len, 16));
+		len += iov[i].iov_len;
+	}
 
-	thisInstance->slirpClient->sendSlirpPacketToGuest(bufToSend, len);
+	// Host sockets can still produce packets after the guest disconnected
+	if(thisInstance->slirpClient)
+		thisInstance->slirpClient->sendSlirpPacketToGuest(iov, iovcnt);
 
 	return (slirp_ssize_t) len;
 }
@@ -314,7 +462,7 @@ void* SlirpServer::onSlirpTimerNew(SlirpTimerId id, void* cb_opaque, void* opaqu
 	timer->cb_opaque = cb_opaque;
 	timer->pipeConnection = (SlirpServer*) opaque;
 	timer->timerHandle.data = timer;
-	uv_timer_init(uv_default_loop(), &timer->timerHandle);
+	uv_timer_init(timer->pipeConnection->loop, &timer->timerHandle);
 
 	return timer;
 }
@@ -322,7 +470,12 @@ void* SlirpServer::onSlirpTimerNew(SlirpTimerId id, void* cb_opaque, void* opaqu
 void SlirpServer::onSlirpTimerFree(void* timer, void* opaque) {
 	(void) opaque;
 
-	delete((SlirpTimer*) timer);
+	SlirpTimer* slirpTimer = (SlirpTimer*) timer;
+	uv_close((uv_handle_t*) &slirpTimer->timerHandle, &SlirpServer::onSlirpTimerClose);
+}
+
+void SlirpServer::onSlirpTimerClose(uv_handle_t* handle) {
+	delete((SlirpTimer*) handle->data);
 }
 
 void SlirpServer::onSlirpTimerMod(void* timer, int64_t expire_time, void* opaque) {
@@ -343,8 +496,16 @@ void SlirpServer::onSlirpRegisterFd(int fd, void* opaque) {
 }
 
 void SlirpServer::onSlirpUnregisterFd(int fd, void* opaque) {
-	(void) fd;
-	(void) opaque;
+	SlirpServer* thisInstance = (SlirpServer*) opaque;
+
+	// Called before libslirp closes fd, which may then be reused by a new socket
+	auto it = thisInstance->fdsToPoll.find(fd);
+	if(it != thisInstance->fdsToPoll.end()) {
+		SPDLOG_DEBUG("removing poll on fd {}", fd);
+		uv_close((uv_handle_t*) &it->second->pollHandle, &SlirpServer::onSlirpPollClose);
+		it->second.release();  // will be freed by the onSlirpPollClose function
+		thisInstance->fdsToPoll.erase(it);
+	}
 }
 
 void SlirpServer::onSlirpNotify(void* opaque) {
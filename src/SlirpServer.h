@@ -9,19 +9,37 @@
 #include <stdint.h>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
 #include <uv.h>
 #include <vector>
 
 class SlirpServer {
 public:
-	SlirpServer();
+	SlirpServer(uv_loop_t* loop);
 
-	void init(bool disableHostAccess, const std::vector<std::pair<uint16_t, uint16_t>>& forwardedPorts);
+	// udpNatSockets > 0 multiplexes guest UDP flows over that many host sockets per address family
+	void init(bool disableHostAccess,
+	          unsigned int udpNatSockets,
+	          const std::vector<std::pair<uint16_t, uint16_t>>& forwardedPorts);
+	// Free the Slirp instance and close all handles, onClosed is called once it is done
+	void close(std::function<void()> onClosed);
 	void attachClient(ISlirpClient* client);
 	void detachClient(ISlirpClient* client);
 
-	void receivePacketFromGuest(const void* data, size_t len);
+	// Packets from the guest are written in buffers lent by libslirp, after an ethernet header of
+	// SLIRP_ETHER_HEADER_SIZE bytes. Returns the start of the buffer.
+	uint8_t* getGuestPacketBuffer(size_t size, SlirpInputBuf** buffer);
+	uint8_t* growGuestPacketBuffer(SlirpInputBuf* buffer, size_t size);
+	void releaseGuestPacketBuffer(SlirpInputBuf* buffer);
+	// Give the packet of len bytes in buffer, which starts at data, to libslirp
+	void receivePacketFromGuest(SlirpInputBuf* buffer, const uint8_t* data, size_t len);
+	// Packets received between these calls are answered once libslirp has processed them all
+	void beginGuestPackets();
+	void endGuestPackets();
+
+	uv_loop_t* getLoop() { return loop; }
+
+	// Stop reading host sockets and sending packets while the guest link can't keep up with the data sent to it
+	void setGuestLinkCongested(bool congested);
 
 	constexpr static uint8_t SLIRP_ETHER_HEADER_SIZE = 14;
 	const static uint8_t SLIRP_ETHER_HEADER[SLIRP_ETHER_HEADER_SIZE];
@@ -30,9 +48,10 @@ private:
 	// functions
 	void resetInputBuffer();
 	void updateArpTable();
+	void logGuestQueueStats();
 	void updateSlirpPollFds();
-	static int addSlirpFdToPoll(int fd, int events, void* opaque);
-	static int getSlirpRevents(int idx, void* opaque);
+	struct FdInfo;
+	void applyPollEvents(FdInfo* fdInfo);
 
 private:
 	// callbacks
@@ -41,9 +60,14 @@ private:
 
 	static void onSlirpPoll(uv_poll_t* handle, int status, int events);
 	static void onSlirpPollClose(uv_handle_t* handle);
+	static void onSlirpPollCloseOnShutdown(uv_handle_t* handle);
 	static void onSlirpPollTimeout(uv_timer_t* timer);
+	static void onSlirpTimerClose(uv_handle_t* handle);
 
-	static slirp_ssize_t onSlirpWrite(const void* buf, size_t len, void* opaque);
+	static void onCloseStatic(uv_handle_t* handle) { ((SlirpServer*) handle->data)->onClose(handle); }
+	void onClose(uv_handle_t* handle);
+
+	static slirp_ssize_t onSlirpWrite(const SlirpIoVec* iov, int iovcnt, void* opaque);
 	static void onSlirpGuestError(const char* msg, void* opaque);
 	static int64_t onSlirpClockGetNs(void* opaque);
 	static void* onSlirpTimerNew(SlirpTimerId id, void* cb_opaque, void* opaque);
@@ -52,23 +76,27 @@ private:
 	static void onSlirpTimerExpired(uv_timer_t* timer);
 	static void onSlirpRegisterFd(int fd, void* opaque);
 	static void onSlirpUnregisterFd(int fd, void* opaque);
+	static void onSlirpUpdatePoll(int fd, int events, void* opaque);
 	static void onSlirpNotify(void* opaque);
 
 private:
+	uv_loop_t* loop;
 	Slirp* slirpHandle = nullptr;
 	uv_prepare_t prepareHandle;
 	uv_timer_t pollTimerHandle;
+	uint64_t pollTimerDeadline = 0;
 
+	// Poll handles stay armed for the events libslirp last asked for through update_poll
 	struct FdInfo {
 		int fd;
-		int events;
+		int slirpEvents;
 		int activeUvEvents;
 		uv_poll_t pollHandle;
 		SlirpServer* connection;
 	};
 	std::unordered_map<int, std::unique_ptr<FdInfo>> fdsToPoll;
-	std::unordered_set<int> activeFds;
 	bool updateSlirpPoll = true;
+	bool guestLinkCongested = false;
 
 	struct SlirpTimer {
 		uv_timer_t timerHandle;
@@ -78,4 +106,7 @@ private:
 	};
 
 	ISlirpClient* slirpClient = nullptr;
+
+	int handlesToClose = 0;
+	std::function<void()> onClosedFunction;
 };
@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: MIT
+
+#include "SlirpWorker.h"
+#include "SlirpServer.h"
+#include <spdlog/spdlog.h>
+#include <uv.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+SlirpWorker::SlirpWorker(int index,
+                         bool disableHostAccess,
+                         unsigned int udpNatSockets,
+                         const PipeConnection::Config& connectionConfig)
+    : index(index), disableHostAccess(disableHostAccess), udpNatSockets(udpNatSockets), connectionConfig(connectionConfig) {
+	uv_loop_init(&loop);
+
+	uv_async_init(&loop, &asyncHandle, &SlirpWorker::onAsyncStatic);
+	asyncHandle.data = this;
+}
+
+SlirpWorker::~SlirpWorker() {
+	if(started) {
+		stop();
+	} else if(!stopRequested) {
+		// The thread never ran, close the loop from here
+		uv_close((uv_handle_t*) &asyncHandle, nullptr);
+		uv_run(&loop, UV_RUN_DEFAULT);
+	}
+	closePendingConnections();
+	uv_loop_close(&loop);
+}
+
+void SlirpWorker::start() {
+	int result = uv_thread_create(&thread, &SlirpWorker::threadMain, this);
+	if(result < 0) {
+		SPDLOG_ERROR("failed to start worker {}: {} ({})", index, uv_strerror(result), result);
+		return;
+	}
+
+	started = true;
+}
+
+void SlirpWorker::stop() {
+	if(!started)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopRequested = true;
+	}
+	uv_async_send(&asyncHandle);
+
+	uv_thread_join(&thread);
+	started = false;
+
+	// Connections added while the loop was stopping
+	closePendingConnections();
+}
+
+void SlirpWorker::addConnection(uv_os_fd_t pipeFd) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pendingConnections.push_back(pipeFd);
+	}
+	guestCount++;
+
+	uv_async_send(&asyncHandle);
+}
+
+void SlirpWorker::threadMain(void* arg) {
+	SlirpWorker* thisInstance = (SlirpWorker*) arg;
+
+	SPDLOG_DEBUG("worker {} started", thisInstance->index);
+
+	uv_run(&thisInstance->loop, UV_RUN_DEFAULT);
+
+	SPDLOG_DEBUG("worker {} stopped", thisInstance->index);
+}
+
+void SlirpWorker::startGuest(uv_os_fd_t pipeFd) {
+	SlirpServer* slirpServer = new SlirpServer(&loop);
+	slirpServer->init(disableHostAccess, udpNatSockets, {});
+
+	PipeConnection* pipeConnection = new PipeConnection(slirpServer, connectionConfig);
+	connections.insert(pipeConnection);
+
+	pipeConnection->setOnCloseCallback([this, pipeConnection, slirpServer]() {
+		SPDLOG_INFO("SLIP Connection {} closed on worker {}", (void*) pipeConnection, index);
+
+		slirpServer->close([slirpServer]() { delete slirpServer; });
+		connections.erase(pipeConnection);
+		guestCount--;
+
+		delete pipeConnection;
+	});
+
+#ifdef _WIN32
+	uv_file file = _open_osfhandle((intptr_t) pipeFd, 0);
+#else
+	uv_file file = pipeFd;
+#endif
+
+	int result = uv_pipe_open(pipeConnection->getHandle(), file);
+	if(result < 0) {
+		SPDLOG_ERROR("failed to open SLIP connection on worker {}: {} ({})", index, uv_strerror(result), result);
+#ifdef _WIN32
+		if(file >= 0)
+			_close(file);
+		else
+			CloseHandle(pipeFd);
+#else
+		::close(file);
+#endif
+		pipeConnection->close();
+		return;
+	}
+
+	SPDLOG_INFO("Got SLIP connection {} on worker {}", (void*) pipeConnection, index);
+
+	pipeConnection->startRead();
+}
+
+// Close a connection handle no guest was started for
+void SlirpWorker::closePipeFd(uv_os_fd_t pipeFd) {
+#ifdef _WIN32
+	CloseHandle(pipeFd);
+#else
+	::close(pipeFd);
+#endif
+	guestCount--;
+}
+
+void SlirpWorker::closePendingConnections() {
+	std::vector<uv_os_fd_t> remainingConnections;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		remainingConnections.swap(pendingConnections);
+	}
+
+	for(uv_os_fd_t pipeFd : remainingConnections) {
+		closePipeFd(pipeFd);
+	}
+}
+
+void SlirpWorker::onAsync(uv_async_t* handle) {
+	std::vector<uv_os_fd_t> newConnections;
+	bool stopNow;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		newConnections.swap(pendingConnections);
+		stopNow = stopRequested;
+	}
+
+	for(uv_os_fd_t pipeFd : newConnections) {
+		if(stopNow)
+			closePipeFd(pipeFd);
+		else
+			startGuest(pipeFd);
+	}
+
+	if(stopNow) {
+		// Closing connections removes them from the set
+		std::vector<PipeConnection*> connectionsToClose(connections.begin(), connections.end());
+		for(PipeConnection* pipeConnection : connectionsToClose) {
+			pipeConnection->close();
+		}
+		uv_close((uv_handle_t*) handle, nullptr);
+	}
+}
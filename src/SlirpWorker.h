@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "PipeConnection.h"
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_set>
+#include <uv.h>
+#include <vector>
+
+// Thread with its own event loop, each guest connection given to it gets its own Slirp instance
+class SlirpWorker {
+public:
+	SlirpWorker(int index,
+	            bool disableHostAccess,
+	            unsigned int udpNatSockets,
+	            const PipeConnection::Config& connectionConfig);
+	~SlirpWorker();
+
+	void start();
+	void stop();
+
+	// Can be called from any thread, the worker takes ownership of the connected pipe handle
+	void addConnection(uv_os_fd_t pipeFd);
+	size_t getGuestCount() const { return guestCount; }
+
+private:
+	// functions
+	static void threadMain(void* arg);
+	void startGuest(uv_os_fd_t pipeFd);
+	void closePipeFd(uv_os_fd_t pipeFd);
+	void closePendingConnections();
+
+private:
+	// callbacks
+	static void onAsyncStatic(uv_async_t* handle) { ((SlirpWorker*) handle->data)->onAsync(handle); }
+	void onAsync(uv_async_t* handle);
+
+private:
+	int index;
+	bool disableHostAccess;
+	unsigned int udpNatSockets;
+	PipeConnection::Config connectionConfig;
+
+	uv_loop_t loop;
+	uv_async_t asyncHandle;
+	uv_thread_t thread;
+	bool started = false;
+
+	// Protected by mutex, filled by other threads
+	std::mutex mutex;
+	std::vector<uv_os_fd_t> pendingConnections;
+	bool stopRequested = false;
+
+	std::atomic<size_t> guestCount = 0;
+	std::unordered_set<PipeConnection*> connections;
+};
@@ -0,0 +1,455 @@
+// SPDX-License-Identifier: MIT
+
+#include "VjCompression.h"
+#include <string.h>
+
+// Change mask bits of a compressed packet
+static constexpr uint8_t NEW_C = 0x40;
+static constexpr uint8_t NEW_I = 0x20;
+static constexpr uint8_t TCP_PUSH_BIT = 0x10;
+static constexpr uint8_t NEW_S = 0x08;
+static constexpr uint8_t NEW_A = 0x04;
+static constexpr uint8_t NEW_W = 0x02;
+static constexpr uint8_t NEW_U = 0x01;
+
+// Reserved combinations used for echoed interactive traffic and unidirectional data transfers
+static constexpr uint8_t SPECIAL_I = NEW_S | NEW_W | NEW_U;
+static constexpr uint8_t SPECIAL_D = NEW_S | NEW_A | NEW_W | NEW_U;
+static constexpr uint8_t SPECIALS_MASK = NEW_S | NEW_A | NEW_W | NEW_U;
+
+static constexpr uint8_t IPPROTO_TCP_NUMBER = 6;
+
+static constexpr uint8_t TH_FIN = 0x01;
+static constexpr uint8_t TH_SYN = 0x02;
+static constexpr uint8_t TH_RST = 0x04;
+static constexpr uint8_t TH_PUSH = 0x08;
+static constexpr uint8_t TH_ACK = 0x10;
+static constexpr uint8_t TH_URG = 0x20;
+
+// Field offsets in the IP header
+static constexpr size_t IP_LEN = 2;
+static constexpr size_t IP_ID = 4;
+static constexpr size_t IP_OFF = 6;
+static constexpr size_t IP_PROTO = 9;
+static constexpr size_t IP_SUM = 10;
+static constexpr size_t IP_SRC = 12;
+
+// Field offsets in the TCP header
+static constexpr size_t TH_SEQ = 4;
+static constexpr size_t TH_ACK_NUMBER = 8;
+static constexpr size_t TH_OFF = 12;
+static constexpr size_t TH_FLAGS = 13;
+static constexpr size_t TH_WIN = 14;
+static constexpr size_t TH_SUM = 16;
+static constexpr size_t TH_URP = 18;
+
+static uint16_t get16(const uint8_t* p) {
+	return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static uint32_t get32(const uint8_t* p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void put16(uint8_t* p, uint32_t value) {
+	p[0] = (uint8_t) (value >> 8);
+	p[1] = (uint8_t) value;
+}
+
+static void put32(uint8_t* p, uint32_t value) {
+	p[0] = (uint8_t) (value >> 24);
+	p[1] = (uint8_t) (value >> 16);
+	p[2] = (uint8_t) (value >> 8);
+	p[3] = (uint8_t) value;
+}
+
+static size_t ipHeaderLength(const uint8_t* ip) {
+	return (ip[0] & 0x0F) * 4;
+}
+
+static size_t tcpHeaderLength(const uint8_t* th) {
+	return (th[TH_OFF] >> 4) * 4;
+}
+
+// Deltas are sent as one byte, or as a zero byte followed by 16 bits.
+// encodeDelta is only used for non-zero deltas, encodeDeltaOrZero for fields where zero is valid.
+static uint8_t* encodeDelta(uint8_t* cp, uint32_t delta) {
+	if(delta >= 256) {
+		*cp++ = 0;
+		put16(cp, delta);
+		cp += 2;
+	} else {
+		*cp++ = (uint8_t) delta;
+	}
+	return cp;
+}
+
+static uint8_t* encodeDeltaOrZero(uint8_t* cp, uint32_t delta) {
+	if(delta >= 256 || delta == 0) {
+		*cp++ = 0;
+		put16(cp, delta);
+		cp += 2;
+	} else {
+		*cp++ = (uint8_t) delta;
+	}
+	return cp;
+}
+
+// Returns false if the delta goes past end
+static bool decodeDelta(const uint8_t*& cp, const uint8_t* end, uint32_t& delta) {
+	if(cp >= end)
+		return false;
+
+	if(*cp == 0) {
+		if(end - cp < 3)
+			return false;
+		delta = get16(cp + 1);
+		cp += 3;
+	} else {
+		delta = *cp++;
+	}
+	return true;
+}
+
+VjCompression::VjCompression() {
+	for(size_t i = MAX_STATES - 1; i > 0; i--) {
+		txStates[i].id = (uint8_t) i;
+		txStates[i].next = &txStates[i - 1];
+		txStates[i].headerLength = 0;
+	}
+	txStates[0].id = 0;
+	txStates[0].next = &txStates[MAX_STATES - 1];
+	txStates[0].headerLength = 0;
+	lastTxState = &txStates[0];
+
+	for(size_t i = 0; i < MAX_STATES; i++) {
+		rxStates[i].next = nullptr;
+		rxStates[i].id = (uint8_t) i;
+		rxStates[i].headerLength = 0;
+	}
+}
+
+uint8_t* VjCompression::compress(uint8_t* packet, size_t& len) {
+	uint8_t* ip = packet;
+
+	// Only TCP packets that are not fragments and only have the ACK flag among SYN, FIN, RST and ACK are compressed
+	if(len < 40 || (ip[0] >> 4) != 4 || ip[IP_PROTO] != IPPROTO_TCP_NUMBER || (get16(ip + IP_OFF) & 0x3FFF) != 0)
+		return packet;
+
+	size_t ipLength = ipHeaderLength(ip);
+	if(ipLength < 20 || ipLength + 20 > len)
+		return packet;
+
+	uint8_t* th = ip + ipLength;
+	if((th[TH_FLAGS] & (TH_SYN | TH_FIN | TH_RST | TH_ACK)) != TH_ACK)
+		return packet;
+
+	size_t headerLength = ipLength + tcpHeaderLength(th);
+	if(tcpHeaderLength(th) < 20 || headerLength > len || headerLength > MAX_HEADER_SIZE)
+		return packet;
+
+	auto matches = [ip, th](const ConnectionState* cs) {
+		const uint8_t* csIp = cs->header;
+		// Source and destination addresses, then both ports
+		return cs->headerLength != 0 && memcmp(ip + IP_SRC, csIp + IP_SRC, 8) == 0 &&
+		       memcmp(th, csIp + ipHeaderLength(csIp), 4) == 0;
+	};
+
+	// Find the connection state, moving it to the front of the list
+	ConnectionState* cs = lastTxState->next;
+	bool found = matches(cs);
+	if(!found) {
+		ConnectionState* previous;
+		do {
+			previous = cs;
+			cs = cs->next;
+			if(matches(cs)) {
+				found = true;
+				break;
+			}
+		} while(cs != lastTxState);
+
+		if(found) {
+			if(cs == lastTxState) {
+				lastTxState = previous;
+			} else {
+				previous->next = cs->next;
+				cs->next = lastTxState->next;
+				lastTxState->next = cs;
+			}
+		} else {
+			// Reuse the least recently used state, which becomes the front of the list
+			lastTxState = previous;
+		}
+	}
+
+	if(found) {
+		const uint8_t* oldIp = cs->header;
+		const uint8_t* oldTh = oldIp + ipLength;
+		uint8_t newSeq[16];
+		uint8_t* cp = newSeq;
+		uint8_t changes = 0;
+		uint32_t deltaS;
+		uint32_t deltaA;
+
+		// Fields expected to stay constant: version, header length, TOS, fragment flags, TTL, protocol and options
+		if(memcmp(ip, oldIp, 2) != 0 || memcmp(ip + IP_OFF, oldIp + IP_OFF, 4) != 0 ||
+		   th[TH_OFF] != oldTh[TH_OFF] || memcmp(ip + 20, oldIp + 20, ipLength - 20) != 0 ||
+		   memcmp(th + 20, oldTh + 20, headerLength - ipLength - 20) != 0)
+			goto uncompressed;
+
+		if(th[TH_FLAGS] & TH_URG) {
+			cp = encodeDeltaOrZero(cp, get16(th + TH_URP));
+			changes |= NEW_U;
+		} else if(get16(th + TH_URP) != get16(oldTh + TH_URP)) {
+			goto uncompressed;
+		}
+
+		deltaS = (uint16_t) (get16(th + TH_WIN) - get16(oldTh + TH_WIN));
+		if(deltaS) {
+			cp = encodeDelta(cp, deltaS);
+			changes |= NEW_W;
+		}
+
+		deltaA = get32(th + TH_ACK_NUMBER) - get32(oldTh + TH_ACK_NUMBER);
+		if(deltaA) {
+			if(deltaA > 0xFFFF)
+				goto uncompressed;
+			cp = encodeDelta(cp, deltaA);
+			changes |= NEW_A;
+		}
+
+		deltaS = get32(th + TH_SEQ) - get32(oldTh + TH_SEQ);
+		if(deltaS) {
+			if(deltaS > 0xFFFF)
+				goto uncompressed;
+			cp = encodeDelta(cp, deltaS);
+			changes |= NEW_S;
+		}
+
+		switch(changes) {
+		case 0:
+			// Nothing changed: a data packet following a pure ack is compressed, anything else is probably a
+			// retransmission or a window probe and is sent uncompressed in case the peer missed the previous one
+			if(get16(ip + IP_LEN) != get16(oldIp + IP_LEN) && get16(oldIp + IP_LEN) == headerLength)
+				break;
+			goto uncompressed;
+		case SPECIAL_I:
+		case SPECIAL_D:
+			// The real changes would be decoded as a special case
+			goto uncompressed;
+		case NEW_S | NEW_A:
+			if(deltaS == deltaA && deltaS == get16(oldIp + IP_LEN) - headerLength) {
+				// Echoed terminal traffic
+				changes = SPECIAL_I;
+				cp = newSeq;
+			}
+			break;
+		case NEW_S:
+			if(deltaS == get16(oldIp + IP_LEN) - headerLength) {
+				// Data transfer
+				changes = SPECIAL_D;
+				cp = newSeq;
+			}
+			break;
+		}
+
+		deltaS = (uint16_t) (get16(ip + IP_ID) - get16(oldIp + IP_ID));
+		if(deltaS != 1) {
+			cp = encodeDeltaOrZero(cp, deltaS);
+			changes |= NEW_I;
+		}
+		if(th[TH_FLAGS] & TH_PUSH)
+			changes |= TCP_PUSH_BIT;
+
+		// Grab the checksum before the header is overwritten by the compressed one
+		uint16_t checksum = get16(th + TH_SUM);
+		memcpy(cs->header, ip, headerLength);
+		cs->headerLength = headerLength;
+
+		size_t deltaLength = cp - newSeq;
+		size_t compressedLength = 3 + deltaLength;
+		if(lastTxId != cs->id)
+			compressedLength++;
+
+		uint8_t* output = packet + headerLength - compressedLength;
+		cp = output;
+		if(lastTxId != cs->id) {
+			lastTxId = cs->id;
+			*cp++ = changes | NEW_C;
+			*cp++ = cs->id;
+		} else {
+			*cp++ = changes;
+		}
+		put16(cp, checksum);
+		cp += 2;
+		memcpy(cp, newSeq, deltaLength);
+
+		output[0] |= TYPE_COMPRESSED_TCP;
+		len -= headerLength - compressedLength;
+		return output;
+	}
+
+uncompressed:
+	// Send the full header with the connection id instead of the protocol to (re)synchronize the peer
+	memcpy(cs->header, ip, headerLength);
+	cs->headerLength = headerLength;
+	ip[IP_PROTO] = cs->id;
+	ip[0] |= TYPE_UNCOMPRESSED_TCP;
+	lastTxId = cs->id;
+	return packet;
+}
+
+size_t VjCompression::uncompress(IFrameCodec::FrameBuffer& frame) {
+	uint8_t* packet = frame.data;
+	size_t len = frame.length;
+
+	if(len == 0)
+		return 0;
+
+	if(packet[0] & TYPE_COMPRESSED_TCP)
+		return uncompressTcp(frame);
+
+	if(packet[0] >= TYPE_UNCOMPRESSED_TCP) {
+		uint8_t* ip = packet;
+		ip[0] &= 0x4F;
+
+		if(len < 40 || ip[IP_PROTO] >= MAX_STATES) {
+			tossCompressedInput = true;
+			return 0;
+		}
+
+		size_t ipLength = ipHeaderLength(ip);
+		size_t headerLength = ipLength + 20 <= len ? ipLength + tcpHeaderLength(ip + ipLength) : len + 1;
+		if(ipLength < 20 || headerLength > len || headerLength > MAX_HEADER_SIZE) {
+			tossCompressedInput = true;
+			return 0;
+		}
+
+		ConnectionState* cs = &rxStates[ip[IP_PROTO]];
+		lastRxId = ip[IP_PROTO];
+		tossCompressedInput = false;
+
+		ip[IP_PROTO] = IPPROTO_TCP_NUMBER;
+		memcpy(cs->header, ip, headerLength);
+		put16(cs->header + IP_SUM, 0);
+		cs->headerLength = headerLength;
+		return len;
+	}
+
+	// TYPE_IP
+	return len;
+}
+
+size_t VjCompression::uncompressTcp(IFrameCodec::FrameBuffer& frame) {
+	const uint8_t* cp = frame.data;
+	const uint8_t* end = frame.data + frame.length;
+	uint8_t changes = *cp++ & ~TYPE_COMPRESSED_TCP;
+
+	if(changes & NEW_C) {
+		if(cp >= end || *cp >= MAX_STATES)
+			goto bad;
+		tossCompressedInput = false;
+		lastRxId = *cp++;
+	} else if(tossCompressedInput) {
+		return 0;
+	}
+
+	{
+		if(lastRxId >= MAX_STATES || rxStates[lastRxId].headerLength == 0)
+			goto bad;
+
+		ConnectionState* cs = &rxStates[lastRxId];
+		uint8_t* ip = cs->header;
+		uint8_t* th = ip + ipHeaderLength(ip);
+		uint32_t delta;
+
+		if(end - cp < 2)
+			goto bad;
+		memcpy(th + TH_SUM, cp, 2);
+		cp += 2;
+
+		if(changes & TCP_PUSH_BIT)
+			th[TH_FLAGS] |= TH_PUSH;
+		else
+			th[TH_FLAGS] &= ~TH_PUSH;
+
+		switch(changes & SPECIALS_MASK) {
+		case SPECIAL_I: {
+			uint32_t dataLength = get16(ip + IP_LEN) - (uint32_t) cs->headerLength;
+			put32(th + TH_ACK_NUMBER, get32(th + TH_ACK_NUMBER) + dataLength);
+			put32(th + TH_SEQ, get32(th + TH_SEQ) + dataLength);
+			break;
+		}
+		case SPECIAL_D:
+			put32(th + TH_SEQ, get32(th + TH_SEQ) + get16(ip + IP_LEN) - (uint32_t) cs->headerLength);
+			break;
+		default:
+			if(changes & NEW_U) {
+				th[TH_FLAGS] |= TH_URG;
+				if(!decodeDelta(cp, end, delta))
+					goto bad;
+				put16(th + TH_URP, delta);
+			} else {
+				th[TH_FLAGS] &= ~TH_URG;
+			}
+			if(changes & NEW_W) {
+				if(!decodeDelta(cp, end, delta))
+					goto bad;
+				put16(th + TH_WIN, get16(th + TH_WIN) + delta);
+			}
+			if(changes & NEW_A) {
+				if(!decodeDelta(cp, end, delta))
+					goto bad;
+				put32(th + TH_ACK_NUMBER, get32(th + TH_ACK_NUMBER) + delta);
+			}
+			if(changes & NEW_S) {
+				if(!decodeDelta(cp, end, delta))
+					goto bad;
+				put32(th + TH_SEQ, get32(th + TH_SEQ) + delta);
+			}
+			break;
+		}
+
+		if(changes & NEW_I) {
+			if(!decodeDelta(cp, end, delta))
+				goto bad;
+			put16(ip + IP_ID, get16(ip + IP_ID) + delta);
+		} else {
+			put16(ip + IP_ID, get16(ip + IP_ID) + 1);
+		}
+
+		// cp now points to the data, replace the compressed header with the saved one
+		size_t compressedLength = cp - frame.data;
+		size_t dataLength = frame.length - compressedLength;
+		size_t totalLength = cs->headerLength + dataLength;
+		if(totalLength > frame.capacity && frame.grow)
+			frame.grow(frame, totalLength, frame.growOpaque);
+		if(totalLength > frame.capacity || totalLength > 0xFFFF)
+			goto bad;
+
+		put16(ip + IP_LEN, (uint32_t) totalLength);
+
+		// Recompute the IP header checksum
+		size_t ipLength = ipHeaderLength(ip);
+		uint32_t sum = 0;
+		put16(ip + IP_SUM, 0);
+		for(size_t i = 0; i < ipLength; i += 2) {
+			sum += get16(ip + i);
+		}
+		sum = (sum & 0xFFFF) + (sum >> 16);
+		sum = (sum & 0xFFFF) + (sum >> 16);
+		put16(ip + IP_SUM, ~sum);
+
+		// Growing the frame may have moved it
+		uint8_t* packet = frame.data;
+		memmove(packet + cs->headerLength, packet + compressedLength, dataLength);
+		memcpy(packet, cs->header, cs->headerLength);
+
+		return totalLength;
+	}
+
+bad:
+	tossCompressedInput = true;
+	return 0;
+}
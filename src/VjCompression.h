@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "IFrameCodec.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Van Jacobson TCP/IP header compression (RFC 1144), as used by CSLIP.
+// The packet type is carried in the high bits of the first byte of each packet.
+class VjCompression {
+public:
+	constexpr static uint8_t TYPE_IP = 0x40;
+	constexpr static uint8_t TYPE_UNCOMPRESSED_TCP = 0x70;
+	constexpr static uint8_t TYPE_COMPRESSED_TCP = 0x80;
+
+	// The uncompressed IP + TCP header is at most this size
+	constexpr static size_t MAX_HEADER_SIZE = 128;
+
+	VjCompression();
+
+	// Compress the header of an IP packet of len bytes in place.
+	// Only its first MAX_HEADER_SIZE bytes are read and written, so packet can be a copy of just these bytes with the
+	// payload left where it is. Returns the start of the packet to send, which is inside packet, and updates len.
+	uint8_t* compress(uint8_t* packet, size_t& len);
+
+	// Uncompress a received packet in place, frame is grown if it has no room for the uncompressed header.
+	// Returns the length of the IP packet or 0 if the packet must be dropped.
+	size_t uncompress(IFrameCodec::FrameBuffer& frame);
+
+	// Drop compressed packets until the connection state is resent after a framing error
+	void setInputError() { tossCompressedInput = true; }
+
+private:
+	constexpr static size_t MAX_STATES = 16;
+
+	struct ConnectionState {
+		ConnectionState* next;
+		uint8_t id;
+		size_t headerLength;
+		uint8_t header[MAX_HEADER_SIZE];
+	};
+
+	size_t uncompressTcp(IFrameCodec::FrameBuffer& frame);
+
+	// Transmit connection states, in a circular list from the most recently used (lastTxState->next)
+	// to the least recently used (lastTxState)
+	ConnectionState txStates[MAX_STATES];
+	ConnectionState* lastTxState;
+	uint8_t lastTxId = 0xFF;
+
+	ConnectionState rxStates[MAX_STATES];
+	uint8_t lastRxId = 0xFF;
+	bool tossCompressedInput = true;
+};
@@ -10,8 +10,14 @@
 #include "PipeConnection.h"
 #include "PipeServer.h"
 #include "SlirpServer.h"
+#include "SlirpWorker.h"
+#include <memory>
 #include <uv.h>
 
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
 void initializeSpdLog() {
 	spdlog::init_thread_pool(8192, 1);
 	std::vector<spdlog::sink_ptr> sinks;
@@ -43,6 +49,29 @@ char* checkAndIncrementArgIndex(int argc, char** argv, int& i) {
 	return argv[i];
 }
 
+long parseNumberArgOrExit(const char* option, const char* value, long minValue, long maxValue) {
+	char* numberEnd = nullptr;
+	long number;
+
+	if(value == nullptr) {
+		SPDLOG_CRITICAL("{} requires a number argument", option);
+
+		spdlog::shutdown();
+		exit(1);
+	}
+
+	number = strtol(value, &numberEnd, 10);
+	if(numberEnd == nullptr || *numberEnd != '\0' || number < minValue || number > maxValue) {
+		SPDLOG_CRITICAL("{} requires a number between {} and {}, got {}", option, minValue, maxValue, value);
+
+		spdlog::shutdown();
+		exit(1);
+	}
+
+	return number;
+}
+
+#ifdef _WIN32
 void allocateConsole() {
 	FILE* fDummy;
 	AllocConsole();
@@ -68,24 +97,49 @@ void allocateConsole() {
 	SetStdHandle(STD_ERROR_HANDLE, hConOut);
 	SetStdHandle(STD_INPUT_HANDLE, hConIn);
 }
+#else
+void allocateConsole() {
+	// Not a GUI application, logs already go to the terminal
+}
+#endif
+
+#ifndef _WIN32
+void onTerminateSignal(uv_signal_t* handle, int signum) {
+	SPDLOG_INFO("Received signal {}, exiting", signum);
+	// Return from uv_run so destructors remove the unix socket or PTY link
+	uv_stop(handle->loop);
+}
+#endif
 
+#ifdef _WIN32
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR pCmdLine, int nCmdShow) {
 	int argc = __argc;
 	char** argv = __argv;
+#else
+int main(int argc, char** argv) {
+#endif
 	/**
-	 * --listen <pipe or tcp>
-	 * --connect <pipe or tcp>
+	 * --listen <pipe, unix socket or pty>
+	 * --connect <pipe, unix socket or tty device>
 	 * --network <ip/mask>
 	 * --disable-host-access
+	 * --udp-nat <sockets>
 	 * --forward <port:port>
 	 */
 	enum class GuestMode { SERVER, CLIENT };
 
+#ifdef _WIN32
 	const char* const defaultEndpoint = "\\\\.\\pipe\\serial-port";
+#else
+	const char* const defaultEndpoint = "/tmp/serial-port";
+#endif
 
 	GuestMode guestMode = GuestMode::SERVER;
 	const char* guestEndpoint = nullptr;
 	bool disableHostAccess = false;
+	unsigned int udpNatSockets = 0;
+	PipeConnection::Config connectionConfig;
+	int workerCount = 0;
 	std::vector<std::pair<uint16_t, uint16_t>> forwardedPorts;
 
 	for(int i = 1; i < argc; i++) {
@@ -108,6 +162,9 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR pCmdLine,
 			guestEndpoint = checkAndIncrementArgIndex(argc, argv, i);
 		} else if(strcmp(argv[i], "--disable-host-access") == 0) {
 			disableHostAccess = true;
+		} else if(strcmp(argv[i], "--udp-nat") == 0) {
+			char* value = checkAndIncrementArgIndex(argc, argv, i);
+			udpNatSockets = parseNumberArgOrExit(argv[i], value, 1, 64);
 		} else if(strcmp(argv[i], "--debug") == 0) {
 			spdlog::set_level(spdlog::level::debug);
 		} else if(strcmp(argv[i], "--forward") == 0) {
@@ -154,16 +211,79 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR pCmdLine,
 			}
 
 			forwardedPorts.push_back(std::make_pair(uint16_t(hostPort), uint16_t(guestPort)));
+		} else if(strcmp(argv[i], "--protocol") == 0) {
+			char* value = checkAndIncrementArgIndex(argc, argv, i);
+			if(value != nullptr && strcmp(value, "slip") == 0) {
+				connectionConfig.headerCompression = false;
+			} else if(value != nullptr && strcmp(value, "cslip") == 0) {
+				connectionConfig.headerCompression = true;
+			} else {
+				SPDLOG_CRITICAL("protocol requires slip or cslip argument, got {}", value ? value : "nothing");
+
+				spdlog::shutdown();
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "--framing") == 0) {
+			char* value = checkAndIncrementArgIndex(argc, argv, i);
+			if(value != nullptr && strcmp(value, "slip") == 0) {
+				connectionConfig.framing = PipeConnection::Framing::SLIP;
+			} else if(value != nullptr && strcmp(value, "length16") == 0) {
+				connectionConfig.framing = PipeConnection::Framing::LENGTH16;
+			} else if(value != nullptr && strcmp(value, "length32") == 0) {
+				connectionConfig.framing = PipeConnection::Framing::LENGTH32;
+			} else {
+				SPDLOG_CRITICAL("framing requires slip, length16 or length32 argument, got {}",
+				                value ? value : "nothing");
+
+				spdlog::shutdown();
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "--write-batch-bytes") == 0) {
+			char* value = checkAndIncrementArgIndex(argc, argv, i);
+			connectionConfig.writeBatchMaxBytes = parseNumberArgOrExit(argv[i], value, 1, 16 * 1024 * 1024);
+		} else if(strcmp(argv[i], "--write-batch-delay") == 0) {
+			char* value = checkAndIncrementArgIndex(argc, argv, i);
+			connectionConfig.writeBatchMaxDelayMs = parseNumberArgOrExit(argv[i], value, 0, 1000);
+		} else if(strcmp(argv[i], "--write-queue-limit") == 0) {
+			char* value = checkAndIncrementArgIndex(argc, argv, i);
+			connectionConfig.writeQueueHighWatermark = parseNumberArgOrExit(argv[i], value, 1, 256 * 1024 * 1024);
+			connectionConfig.writeQueueLowWatermark = connectionConfig.writeQueueHighWatermark / 4;
+		} else if(strcmp(argv[i], "--workers") == 0) {
+			char* value = checkAndIncrementArgIndex(argc, argv, i);
+			workerCount = parseNumberArgOrExit(argv[i], value, 1, 256);
 		} else if(strcmp(argv[i], "--help") == 0) {
 			SPDLOG_INFO("\nUsage: {} [options]\n"
 			            "  --help                             Show this help\n"
 			            "  --listen [<pipe>]                  Run in listen mode on given pipe\n"
+			            "                                     (unix socket path on Linux, or pty to\n"
+			            "                                     create a PTY, pty:<link> to also link\n"
+			            "                                     it at <link>)\n"
 			            "  --connect [<pipe>]                 Run in connect mode on given pipe\n"
-			            "                                     (default mode)\n"
+			            "                                     (unix socket or tty device like a QEMU\n"
+			            "                                     -serial pty on Linux) (default mode)\n"
 			            "  --disable-host-access              Disable access to host ports from guest\n"
+			            "  --udp-nat <sockets>                Send guest UDP flows through this many\n"
+			            "                                     shared host sockets instead of one per\n"
+			            "                                     guest port (at most 64)\n"
 			            "  --debug                            Show debug logs\n"
 			            "  --forward <hostport>:<guestport>   Forward host port to guest (can be\n"
 			            "                                     specified multiple times)\n"
+			            "  --protocol <slip|cslip>            Line protocol, cslip adds Van Jacobson\n"
+			            "                                     TCP/IP header compression (default slip)\n"
+			            "  --framing <slip|length16|length32> Frame packets with SLIP or with a 2 or 4\n"
+			            "                                     bytes big endian length prefix, for peers\n"
+			            "                                     that are not serial lines (default slip)\n"
+			            "  --write-batch-bytes <bytes>        Write frames to the guest once this many\n"
+			            "                                     bytes are queued (default 65536)\n"
+			            "  --write-batch-delay <ms>           Maximum time to queue frames before\n"
+			            "                                     writing them to the guest (default 0,\n"
+			            "                                     write at each event loop iteration)\n"
+			            "  --write-queue-limit <bytes>        Pause reading host sockets when more than\n"
+			            "                                     this many bytes are queued to the guest\n"
+			            "                                     (default 1048576)\n"
+			            "  --workers <count>                  Accept multiple guests in listen mode,\n"
+			            "                                     each with its own network, served by\n"
+			            "                                     <count> threads\n"
 			            "  --console                          Run with a console to show logs\n"
 			            "\n"
 			            "Note: default pipe is {}\n",
@@ -179,11 +299,39 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR pCmdLine,
 		guestEndpoint = defaultEndpoint;
 	}
 
-	SlirpServer slirpServer;
-	PipeServer pipeServer(&slirpServer);
-	PipeConnection pipeConnection(&slirpServer);
+	if(workerCount > 0 && guestMode != GuestMode::SERVER) {
+		SPDLOG_CRITICAL("--workers can only be used in listen mode");
+
+		spdlog::shutdown();
+		exit(1);
+	}
+
+	if(workerCount > 0 && !forwardedPorts.empty()) {
+		SPDLOG_CRITICAL("--forward can't be used with --workers as guests would share host ports");
+
+		spdlog::shutdown();
+		exit(1);
+	}
+
+	SlirpServer slirpServer(uv_default_loop());
+	PipeServer pipeServer(&slirpServer, connectionConfig);
+	PipeConnection pipeConnection(&slirpServer, connectionConfig);
+	std::vector<std::unique_ptr<SlirpWorker>> workers;
+
+	if(workerCount > 0) {
+		std::vector<SlirpWorker*> workerPointers;
 
-	slirpServer.init(disableHostAccess, forwardedPorts);
+		SPDLOG_INFO("Serving multiple guests with {} workers", workerCount);
+
+		for(int i = 0; i < workerCount; i++) {
+			workers.push_back(std::make_unique<SlirpWorker>(i, disableHostAccess, udpNatSockets, connectionConfig));
+			workers.back()->start();
+			workerPointers.push_back(workers.back().get());
+		}
+		pipeServer.setWorkers(workerPointers);
+	} else {
+		slirpServer.init(disableHostAccess, udpNatSockets, forwardedPorts);
+	}
 
 	if(guestMode == GuestMode::SERVER) {
 		pipeServer.listenPipe(guestEndpoint);
@@ -191,8 +339,23 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR pCmdLine,
 		pipeConnection.connectPipe(guestEndpoint);
 	}
 
+#ifndef _WIN32
+	// Writing to a disconnected guest or host socket must fail with EPIPE instead of killing the process
+	signal(SIGPIPE, SIG_IGN);
+
+	uv_signal_t sigintHandle;
+	uv_signal_t sigtermHandle;
+	uv_signal_init(uv_default_loop(), &sigintHandle);
+	uv_signal_init(uv_default_loop(), &sigtermHandle);
+	uv_signal_start(&sigintHandle, &onTerminateSignal, SIGINT);
+	uv_signal_start(&sigtermHandle, &onTerminateSignal, SIGTERM);
+#endif
+
 	uv_run(uv_default_loop(), UV_RUN_DEFAULT);
 
+	// Workers log while stopping
+	workers.clear();
+
 	spdlog::shutdown();
 
 	return 0;
@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: MIT
+
+// Randomized round trip of SlipCodec: frames with a varied density of END and ESC bytes are encoded with the
+// vectorized encoder, checked against a byte by byte reference encoder and decoded back, split across reads.
+
+#include "../SlipCodec.h"
+#include <algorithm>
+#include <random>
+#include <stdio.h>
+#include <vector>
+
+static std::mt19937 rng(0x534c4950);
+
+static size_t randomBelow(size_t bound) {
+	return std::uniform_int_distribution<size_t>(0, bound - 1)(rng);
+}
+
+// One byte at a time, as the SLIP RFC 1055 sample code does
+static std::vector<uint8_t> referenceEncode(const std::vector<uint8_t>& frame) {
+	std::vector<uint8_t> output;
+
+	output.push_back(SlipCodec::END);
+	for(uint8_t byte : frame) {
+		if(byte == SlipCodec::END) {
+			output.push_back(SlipCodec::ESC);
+			output.push_back(SlipCodec::ESC_END);
+		} else if(byte == SlipCodec::ESC) {
+			output.push_back(SlipCodec::ESC);
+			output.push_back(SlipCodec::ESC_ESC);
+		} else {
+			output.push_back(byte);
+		}
+	}
+	output.push_back(SlipCodec::END);
+
+	return output;
+}
+
+// Sizes around the 16 and 32 byte vector widths are the interesting ones
+static size_t randomFrameSize() {
+	static const size_t boundaries[] = {0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 1500};
+
+	if(randomBelow(2))
+		return boundaries[randomBelow(std::size(boundaries))];
+	return randomBelow(2048);
+}
+
+// specialPerMille of the bytes are END or ESC
+static std::vector<uint8_t> randomFrame(size_t size, unsigned int specialPerMille) {
+	std::vector<uint8_t> frame(size);
+
+	for(uint8_t& byte : frame) {
+		if(randomBelow(1000) < specialPerMille)
+			byte = randomBelow(2) ? SlipCodec::END : SlipCodec::ESC;
+		else
+			byte = (uint8_t) randomBelow(256);
+	}
+
+	return frame;
+}
+
+// Split frame into up to 4 segments, some of them empty
+static std::vector<IFrameCodec::Segment> randomSegments(const std::vector<uint8_t>& frame) {
+	std::vector<IFrameCodec::Segment> segments;
+	size_t count = 1 + randomBelow(4);
+	size_t offset = 0;
+
+	for(size_t i = 0; i < count; i++) {
+		size_t len = i + 1 == count ? frame.size() - offset : randomBelow(frame.size() - offset + 1);
+		segments.push_back({frame.data() + offset, len});
+		offset += len;
+	}
+
+	return segments;
+}
+
+static bool checkScan(const std::vector<uint8_t>& frame) {
+	size_t offset = frame.empty() ? 0 : randomBelow(frame.size());
+	const uint8_t* data = frame.data() + offset;
+	size_t len = frame.size() - offset;
+	size_t first = std::find_if(data, data + len, [](uint8_t byte) {
+		return byte == SlipCodec::END || byte == SlipCodec::ESC;
+	}) - data;
+	size_t count = std::count(data, data + len, SlipCodec::END) + std::count(data, data + len, SlipCodec::ESC);
+
+	if(SlipCodec::findSpecialByte(data, len) != first || SlipCodec::countSpecialBytes(data, len) != count) {
+		fprintf(stderr, "scan mismatch at offset %zu of a %zu bytes frame\n", offset, frame.size());
+		return false;
+	}
+	return true;
+}
+
+static bool checkEncode(const SlipCodec& codec, const std::vector<uint8_t>& frame, std::vector<uint8_t>& stream) {
+	std::vector<IFrameCodec::Segment> segments = randomSegments(frame);
+	std::vector<uint8_t> reference = referenceEncode(frame);
+	size_t size = codec.encodedSize(segments.data(), segments.size());
+	// Guard bytes past encodedSize catch an encoder writing more than it announced
+	std::vector<uint8_t> output(size + 64, 0xAA);
+	size_t written = codec.encode(segments.data(), segments.size(), output.data());
+
+	if(size != reference.size() || written != size) {
+		fprintf(stderr, "%zu bytes frame: encodedSize %zu, encode %zu, expected %zu\n", frame.size(), size, written,
+		        reference.size());
+		return false;
+	}
+	if(!std::equal(reference.begin(), reference.end(), output.begin()) ||
+	   std::any_of(output.begin() + size, output.end(), [](uint8_t byte) { return byte != 0xAA; })) {
+		fprintf(stderr, "%zu bytes frame: encoded bytes differ from the reference\n", frame.size());
+		return false;
+	}
+
+	stream.insert(stream.end(), output.begin(), output.begin() + written);
+	return true;
+}
+
+// Decode stream in random read sizes, single bytes included so escape sequences get split
+static bool checkDecode(const std::vector<uint8_t>& stream, const std::vector<std::vector<uint8_t>>& frames) {
+	SlipCodec codec;
+	std::vector<uint8_t> buffer(4096);
+	IFrameCodec::FrameBuffer frame;
+	size_t decoded = 0;
+	size_t offset = 0;
+
+	frame.data = buffer.data();
+	frame.capacity = buffer.size();
+
+	while(offset < stream.size()) {
+		size_t readEnd = std::min(stream.size(), offset + 1 + randomBelow(randomBelow(2) ? 3 : 512));
+
+		while(offset < readEnd) {
+			bool frameEnd;
+
+			offset += codec.decode(stream.data() + offset, readEnd - offset, frame, frameEnd);
+			if(!frameEnd)
+				continue;
+
+			// Every frame starts with an END, the empty frame it closes is skipped like PipeConnection does
+			if(frame.length == 0)
+				continue;
+
+			if(decoded >= frames.size()) {
+				fprintf(stderr, "more frames decoded than encoded\n");
+				return false;
+			}
+
+			const std::vector<uint8_t>& expected = frames[decoded];
+			if(frame.truncated || frame.length != expected.size() ||
+			   !std::equal(expected.begin(), expected.end(), frame.data)) {
+				fprintf(stderr, "frame %zu: decoded %zu bytes, expected %zu\n", decoded, frame.length,
+				        expected.size());
+				return false;
+			}
+			decoded++;
+			frame.reset();
+		}
+	}
+
+	if(decoded != frames.size()) {
+		fprintf(stderr, "decoded %zu frames, expected %zu\n", decoded, frames.size());
+		return false;
+	}
+	return true;
+}
+
+int main() {
+	static const unsigned int densities[] = {0, 1, 16, 125, 500, 1000};
+	SlipCodec codec;
+
+	for(int round = 0; round < 200; round++) {
+		std::vector<std::vector<uint8_t>> frames;
+		std::vector<uint8_t> stream;
+
+		for(int i = 0; i < 50; i++) {
+			unsigned int density = densities[randomBelow(std::size(densities))];
+			std::vector<uint8_t> frame = randomFrame(randomFrameSize(), density);
+
+			if(!checkScan(frame) || !checkEncode(codec, frame, stream))
+				return 1;
+			if(!frame.empty())
+				frames.push_back(std::move(frame));
+		}
+
+		if(!checkDecode(stream, frames))
+			return 1;
+	}
+
+	printf("SlipCodec round trip passed\n");
+	return 0;
+}